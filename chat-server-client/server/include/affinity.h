@@ -0,0 +1,62 @@
+#ifndef __AFFINITY_H
+#define __AFFINITY_H
+
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+/*
+ * Thread placement helpers. Linux allocates a page on the NUMA node of the CPU
+ * the page is first touched on (the default local policy), so a thread pinned before
+ * allocating its buffers gets them on its own node without any libnuma calls.
+ */
+namespace concurrent {
+
+
+/*
+ * Represents Affinity exception.
+ */
+class AffinityException: public std::runtime_error {
+public:
+    AffinityException(const std::string& what_arg):
+        std::runtime_error(what_arg)
+    { }
+};
+
+
+typedef std::vector<int> CpuList;
+
+
+/*
+ * Parses a cpu list like "0-3,8,10-11" (see man cpuset).
+ * Every cpu must be available to the process.
+ * returns cpu numbers
+ */
+CpuList parse_cpu_list(const std::string& str);
+
+/*
+ * Returns the cpu list string representation (comma separated cpu numbers).
+ */
+std::string format_cpu_list(const CpuList& cpus);
+
+/*
+ * Pins the calling thread to the cpus. If the list is empty, lets the thread run on
+ * all the cpus the process has been started on (a thread inherits the mask of its creator).
+ * Should be called by a thread before it allocates its buffers (see above).
+ */
+void set_thread_affinity(const CpuList& cpus);
+
+/*
+ * Steers all the interrupts that can be moved to the cpus (see /proc/irq),
+ * keeping the rest of the cpus free for the server threads. Requires root privileges.
+ * returns the number of interrupts moved
+ */
+size_t set_irq_affinity(const CpuList& cpus);
+
+
+} // namespace concurrent
+
+
+#endif // __AFFINITY_H
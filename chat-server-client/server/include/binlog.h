@@ -0,0 +1,336 @@
+#ifndef __BINLOG_H
+#define __BINLOG_H
+
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <istream>
+#include <ostream>
+#include <type_traits>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <boost/format.hpp>
+#include <logger.h>
+#include <affinity.h>
+
+
+namespace logging {
+
+
+/*
+ * Represents BinaryLog exception.
+ */
+class BinaryLogException: public std::runtime_error {
+public:
+    BinaryLogException(const std::string& what_arg):
+        std::runtime_error(what_arg)
+    { }
+};
+
+
+/*
+ * Represents a log message format: a loglevel and a boost::format string like "user %1% connected".
+ * A call site declares its format statically and passes the message arguments to log (see below),
+ * so the binary log records the format id and the raw arguments only. The arguments of a format
+ * should have the same types at every call.
+ */
+class Format {
+public:
+    Format(Loglevel lvl, const char* fmt):
+        level(lvl), fmt(fmt)
+    { }
+
+    Format(const Format&) = delete;
+
+    Format& operator=(const Format&) = delete;
+
+    Loglevel get_level() const
+    {
+        return level;
+    }
+
+    const char* get_format() const
+    {
+        return fmt;
+    }
+
+private:
+    friend class BinaryLog;
+
+    Loglevel level;
+    const char* fmt;
+    std::atomic<uint32_t> id{0};        // binary log format id, assigned on the first record (0 - none)
+};
+
+
+/*
+ * Represents a binary log. Single for the entire application.
+ * A thread records a message (see record) to its own ring buffer: the format id, the time
+ * and the raw arguments, so logging costs an encoding of a few values and a copy, with no
+ * formatting and no lock. A writing thread drains the rings to the log file every flush_interval.
+ * A record not fitting into a full ring is dropped and counted.
+ *
+ * The file is a sequence of entries (integers are varints, strings are prefixed by the size):
+ *      'F' id level format signature  - format definition, written before its first record
+ *      'C' thread size records        - records of the thread
+ *      'D' thread count               - number of records of the thread dropped
+ * A record is: format id, time since the previous record of the thread (ns, the first one
+ * since the epoch), the arguments: signature 'i' - zigzag varint, 'u' - varint, 'd' - 8 bytes
+ * double, 's' - string.
+ * The log is converted to text by BinlogDecode tool (see BinaryLogDecoder).
+ * Thread-safe.
+ */
+class BinaryLog {
+public:
+    static constexpr size_t ring_size = 1 << 20;        // per-thread ring buffer size
+    static constexpr char magic[] = "CHATBLG1";         // file header
+    const std::chrono::milliseconds flush_interval = std::chrono::milliseconds(10);
+
+    BinaryLog(const BinaryLog&) = delete;
+
+    BinaryLog& operator=(const BinaryLog&) = delete;
+
+    /*
+     * Returns the application BinaryLog object pointer.
+     */
+    static BinaryLog* get_instance();
+
+    /*
+     * Creates the log file and starts the writing thread.
+     * params:
+     *      path - log file path
+     *      cpus - cpus the writing thread is pinned to (empty - not pinned)
+     */
+    void open(const std::string& path, const concurrent::CpuList& cpus = concurrent::CpuList());
+
+    /*
+     * Writes the recorded messages and stops the writing thread.
+     * The messages recorded while the log is being closed may be lost.
+     */
+    void close();
+
+    bool is_open() const;
+
+    /*
+     * Records a message to the calling thread ring.
+     * params:
+     *      format - message format
+     *      args   - message arguments: integers, floating point numbers and strings
+     */
+    template<typename... Args>
+    void record(Format& format, const Args&... args);
+
+private:
+    /*
+     * single producer single consumer ring of a thread records
+     */
+    struct ThreadBuffer {
+        std::vector<char> ring;
+        std::atomic<uint64_t> head{0};          // written by the thread
+        std::atomic<uint64_t> tail{0};          // read by the writing thread
+        std::atomic<uint64_t> dropped{0};
+        uint64_t last_time = 0;                 // time of the last record, used by the thread only
+        uint32_t index;                         // thread index in the file
+    };
+
+    static BinaryLog binlog;
+
+    std::atomic<bool> open_flag{false};
+    std::atomic<uint64_t> session{0};          // incremented on open, the thread buffers are per session
+    int fd = -1;
+
+    std::mutex mx;                              // guards the following
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+    std::vector<std::string> formats;           // format definitions by id - 1
+    size_t formats_written = 0;                 // used by the writing thread only
+    bool stop_flag = false;
+    std::condition_variable stop_cv;
+
+    std::thread write_thread;
+
+    BinaryLog()
+    { }
+
+   ~BinaryLog()
+    {
+        close();
+    }
+
+    /*
+     * Returns the format id, registers the format if it has no id.
+     */
+    uint32_t get_format_id(Format& format, const char* signature);
+
+    /*
+     * Returns the calling thread ring, creates one on the first call in the session.
+     */
+    ThreadBuffer* get_thread_buffer();
+
+    /*
+     * Copies the encoded record to the calling thread ring.
+     * returns false if the record is dropped: the ring is full
+     */
+    bool commit(ThreadBuffer* buf_ptr, const std::vector<char>& rec);
+
+    /*
+     * the writing thread body
+     */
+    void write_handler(const concurrent::CpuList& cpus);
+
+    /*
+     * Writes the new format definitions and the recorded messages to the file.
+     */
+    void write_records();
+
+    static void put_varint(std::vector<char>& buf, uint64_t value);
+
+    template<typename T>
+    static void put_arg(std::vector<char>& buf, const T& value);
+
+    template<typename T>
+    static constexpr char arg_type();
+};
+
+
+/*
+ * Converts a binary log to text, a line per message formatted as the Logger sinks do.
+ */
+class BinaryLogDecoder {
+public:
+    /*
+     * params:
+     *      max_level - the messages with a higher loglevel are skipped
+     */
+    BinaryLogDecoder(Loglevel max_level = Loglevel::DEBUG):
+        max_level(max_level)
+    { }
+
+    /*
+     * Decodes the log read from in to out. A truncated last entry (the log of a crashed
+     * process) is ignored.
+     * returns the number of messages decoded
+     */
+    size_t decode(std::istream& in, std::ostream& out);
+
+private:
+    struct Definition {
+        Loglevel level;
+        std::string fmt;
+        std::string signature;
+    };
+
+    Loglevel max_level;
+    std::vector<Definition> formats;
+    std::vector<uint64_t> last_times;           // last record time by thread
+
+    void decode_records(uint32_t thread, const std::string& records, std::ostream& out, size_t& count);
+};
+
+
+/*
+ * Logs the message: records it to the binary log if it is open, otherwise formats it
+ * and logs it with Logger.
+ * params:
+ *      format - message format, declared statically by the call site
+ *      args   - message arguments
+ */
+template<typename... Args>
+void log(Format& format, const Args&... args)
+{
+    BinaryLog* binlog_ptr = BinaryLog::get_instance();
+    if (binlog_ptr->is_open()) {
+        binlog_ptr->record(format, args...);
+        return;
+    }
+
+    boost::format text(format.get_format());
+    (void)(text % ... % args);      // a format without arguments leaves a bare expression
+    Logger::get_instance()->log(format.get_level(), text.str());
+}
+
+
+template<typename T>
+constexpr char BinaryLog::arg_type()
+{
+    if constexpr (std::is_floating_point<T>::value) {
+        return 'd';
+    }
+    else if constexpr (std::is_integral<T>::value && std::is_signed<T>::value) {
+        return 'i';
+    }
+    else if constexpr (std::is_integral<T>::value) {
+        return 'u';
+    }
+    else {
+        static_assert(std::is_convertible<T, std::string>::value, "unsupported binary log argument type");
+        return 's';
+    }
+}
+
+template<typename T>
+void BinaryLog::put_arg(std::vector<char>& buf, const T& value)
+{
+    if constexpr (std::is_floating_point<T>::value) {
+        double d = value;
+        char raw[sizeof(double)];
+        std::memcpy(raw, &d, sizeof(double));
+        buf.insert(buf.end(), raw, raw + sizeof(double));
+    }
+    else if constexpr (std::is_integral<T>::value && std::is_signed<T>::value) {
+        int64_t v = value;
+        put_varint(buf, (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63));
+    }
+    else if constexpr (std::is_integral<T>::value) {
+        put_varint(buf, value);
+    }
+    else if constexpr (std::is_same<T, std::string>::value) {
+        put_varint(buf, value.size());
+        buf.insert(buf.end(), value.begin(), value.end());
+    }
+    else {
+        const char* str = value;
+        size_t size = std::strlen(str);
+        put_varint(buf, size);
+        buf.insert(buf.end(), str, str + size);
+    }
+}
+
+template<typename... Args>
+void BinaryLog::record(Format& format, const Args&... args)
+{
+    static constexpr char signature[] = {arg_type<typename std::decay<Args>::type>()..., '\0'};
+    static thread_local std::vector<char> rec;
+
+    uint32_t id = format.id.load(std::memory_order_acquire);
+    if (id == 0) {
+        id = get_format_id(format, signature);
+    }
+
+    ThreadBuffer* buf_ptr = get_thread_buffer();
+    uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    now = std::max(now, buf_ptr->last_time);      // the times are stored as increments
+
+    rec.clear();
+    put_varint(rec, id);
+    put_varint(rec, now - buf_ptr->last_time);
+    (put_arg(rec, args), ...);
+
+    if (commit(buf_ptr, rec)) {
+        buf_ptr->last_time = now;
+    }
+}
+
+
+} // namespace logging
+
+
+#endif // __BINLOG_H
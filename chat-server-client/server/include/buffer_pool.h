@@ -0,0 +1,49 @@
+#ifndef __BUFFER_POOL_H
+#define __BUFFER_POOL_H
+
+
+#include <vector>
+#include <cstddef>
+
+
+namespace chat {
+
+
+/*
+ * Represents a per-thread pool of the connection buffers storage.
+ * An idle connection gives its empty buffers back to the pool (see release),
+ * so it holds no buffer memory; a connection becoming active again takes a buffer
+ * from the pool (see acquire) instead of allocating and growing a new one.
+ * Buffers larger than max_capacity are freed rather than kept: the pool holds
+ * at most max_buffers * max_capacity bytes per thread.
+ * Static methods only, the pool is thread-local.
+ */
+class BufferPool {
+public:
+    static constexpr size_t initial_capacity = 4096;    // capacity of a buffer allocated by the pool
+    static constexpr size_t max_capacity = 64 << 10;    // maximum capacity of a buffer kept in the pool
+    static constexpr size_t max_buffers = 1024;         // maximum buffers kept in the pool
+
+    BufferPool() = delete;
+
+    /*
+     * Gives the storage to the buffer with no storage. Does nothing if the buffer has one.
+     * params:
+     *      buf - empty buffer
+     */
+    static void acquire(std::vector<char>& buf);
+
+    /*
+     * Takes the storage from the empty buffer, the buffer is left with no storage.
+     * Does nothing if the buffer is not empty.
+     * params:
+     *      buf - buffer to be released
+     */
+    static void release(std::vector<char>& buf);
+};
+
+
+} // namespace chat
+
+
+#endif // __BUFFER_POOL_H
@@ -0,0 +1,128 @@
+#ifndef __BUS_H
+#define __BUS_H
+
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+
+
+namespace chat {
+
+
+/*
+ * Represents Bus exception.
+ */
+class BusException: public std::runtime_error {
+public:
+    BusException(const std::string& what_arg):
+        std::runtime_error(what_arg)
+    { }
+};
+
+
+/*
+ * Represents a broadcast bus between worker processes of a host.
+ * The bus is a shared memory region (see memfd_create) created before the workers are forked:
+ * every worker has its own ring it is the only writer of, the other workers read the ring
+ * with their own cursors, so there are no locks and no writer ever waits for a reader.
+ * A reader too slow to keep up loses the overwritten records (see consume).
+ * A worker is notified of new records through its eventfd.
+ *
+ * Ring record: | uint32 size | event (1 byte) | varint nick size | nick | payload |
+ *
+ * Non-copyable.
+ * Not thread-safe: a worker should publish and consume from a single thread.
+ */
+class Bus {
+public:
+    enum class Event: uint8_t {
+        BROADCAST = 1,      // a message to all the users, nick is the source
+        PRIVATE   = 2,      // a message to the user nick
+        JOIN      = 3,      // the user nick has connected to the worker
+        LEAVE     = 4       // the user nick has disconnected from the worker
+    };
+
+    struct Record {
+        Event event;
+        size_t worker;          // publisher worker
+        std::string nick;
+        std::string payload;
+    };
+
+    /*
+     * Constructor. Should be called before the workers are forked.
+     * params:
+     *      workers   - number of workers
+     *      ring_size - ring size of every worker, bytes
+     */
+    Bus(size_t workers, size_t ring_size = 4 << 20);
+
+   ~Bus();
+
+    Bus(const Bus&) = delete;
+
+    Bus& operator=(const Bus&) = delete;
+
+    /*
+     * Sets the worker the bus is used by. Should be called by a worker after fork.
+     */
+    void attach(size_t worker);
+
+    size_t get_worker() const;
+
+    /*
+     * Appends a record to the worker ring and notifies the other workers.
+     */
+    void publish(Event event, const std::string& nick, const std::string& payload = std::string());
+
+    /*
+     * Reads the records published by the other workers since the last call.
+     * params:
+     *      records - buffer the records are appended to
+     * returns the number of the rings overrun or holding a malformed record since the last call
+     * (some records are lost, the ring is read on from the writer position)
+     */
+    size_t consume(std::vector<Record>& records);
+
+    /*
+     * Returns the worker eventfd to be polled for the new records.
+     */
+    int get_eventfd() const;
+
+private:
+    /*
+     * Ring header, the counters are in separate cache lines: head is read by the readers on
+     * every consume, reserved is checked after a record is read (see consume).
+     */
+    struct RingHeader {
+        alignas(64) std::atomic<uint64_t> head;         // bytes published
+        alignas(64) std::atomic<uint64_t> reserved;     // bytes being published (head + the record being written)
+    };
+
+    size_t workers;
+    size_t ring_size;
+    size_t worker = 0;
+
+    int mem_fd;
+    char* mem;
+    size_t mem_size;
+    std::vector<int> event_fds;         // eventfd of every worker
+    std::vector<uint64_t> cursors;      // read position in every ring
+
+    RingHeader* header(size_t ring) const;
+
+    char* data(size_t ring) const;
+
+    void copy_in(size_t ring, uint64_t pos, const char* src, size_t size);
+
+    void copy_out(size_t ring, uint64_t pos, char* dst, size_t size) const;
+};
+
+
+} // namespace chat
+
+
+#endif // __BUS_H
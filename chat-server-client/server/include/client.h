@@ -4,9 +4,15 @@
 
 #include <stdexcept>
 #include <string>
+#include <vector>
 #include <memory>
 #include <map>
+#include <chrono>
+#include <cstdint>
 #include <socket.h>
+#include <shm.h>
+#include <protocol.h>
+#include <token_bucket.h>
 
 
 namespace chat {
@@ -25,23 +31,73 @@ public:
 
 /*
  * Represents a chat client, contains its status, socket, nick name.
+ * A client is AWAITING_NICK untill the handshake is completed (see connect),
+ * then ONLINE untill disconnected. A client starting with an HTTP upgrade request
+ * speaks the protocol over WebSocket messages (see websocket.h). A co-located client may exchange
+ * the data through a shared memory channel instead of the socket (see set_channel).
+ * The client socket is non-blocking: received data is accumulated in the input buffer
+ * untill an entire frame is received, data that can't be sent at once is kept
+ * in the output buffer untill the socket is writable again.
+ * In the coalescing mode (see set_coalescing) the shared frames are held back for a short while
+ * and sent together with a single system call.
+ * An idle client holds no buffer memory: the buffers are given back to the BufferPool once empty
+ * and taken from it when there is data to be kept again.
  * Non-copyable.
  * Not thread-safe.
  */
 class Client {
 public:
-    enum class Status {
+    enum class Status: uint8_t {
+        AWAITING_NICK,
         ONLINE,
         OFFLINE
     };
 
-    const size_t msg_max_size = 65535;                      // maximum message size to be accepted
+    typedef std::chrono::steady_clock Clock;
+
+    /*
+     * Represents the client session state to be passed to another server process
+     * on hot restart (see handoff.h).
+     */
+    struct State {
+        Status status;
+        protocol::Version version;
+        uint8_t flags;
+        bool websocket;
+        std::string nick;
+        std::vector<char> in_buf;       // received data not processed yet
+        std::vector<char> out_buf;      // data not sent yet
+        std::string ws_fragments;       // WebSocket message fragments received so far
+    };
+
+    static constexpr size_t msg_max_size = protocol::v1_frame_max_size;     // maximum v1 message size to be accepted
+    static constexpr size_t frame_max_size = protocol::v2_frame_max_size;   // maximum v2 frame size to be accepted
+    static constexpr size_t read_max_size = 65536;                          // maximum data size to be read at once
+    static constexpr size_t out_buf_max_size = 4 << 20;     // maximum output buffer size (a single frame may exceed it)
+    static constexpr size_t iov_max_count = 1024;           // maximum buffers sent at once (IOV_MAX)
     static const std::map<Status, std::string> status_str;  // status string representation
 
-    Client(std::unique_ptr<net::Socket> sock_ptr):
-        sock_ptr(std::move(sock_ptr))
+    /*
+     * Constructor.
+     * params:
+     *      sock_ptr  - client socket
+     *      msg_rate  - maximum messages per second to be accepted from the client (0 - unlimited)
+     *      msg_burst - maximum messages to be accepted at once
+     */
+    Client(std::unique_ptr<net::Socket> sock_ptr, double msg_rate = 0, double msg_burst = 0):
+        sock(std::move(*sock_ptr)), rate_limiter(msg_rate, msg_burst)
     { }
 
+    /*
+     * Constructor. Restores a session passed by another server process.
+     * params:
+     *      sock_ptr  - client socket
+     *      state     - client session state
+     *      msg_rate  - maximum messages per second to be accepted from the client (0 - unlimited)
+     *      msg_burst - maximum messages to be accepted at once
+     */
+    Client(std::unique_ptr<net::Socket> sock_ptr, const State& state, double msg_rate = 0, double msg_burst = 0);
+
     /*
      * Calls disconnets.
      */
@@ -52,9 +108,31 @@ public:
     Client& operator=(const Client&) = delete;
 
     /*
-     * Sets user status online. Gets user nick name.
+     * Processes the handshake data read so far: accepts the WebSocket upgrade if requested,
+     * gets user nick name and negotiates the protocol version (see protocol.h).
+     * Sets user status online once the handshake is completed.
+     * returns true if the handshake is completed
      */
-    void connect();
+    bool connect();
+
+    /*
+     * Makes the client exchange the data through the shared memory channel, the socket
+     * (a unix socket the channel has been passed through) is kept to detect the peer disconnect only.
+     * Should be called before any data is exchanged.
+     */
+    void set_channel(std::unique_ptr<net::ShmChannel> channel_ptr);
+
+    /*
+     * Returns the shared memory channel of the client or null pointer if the client uses the socket.
+     */
+    net::ShmChannel* get_channel() const;
+
+    /*
+     * Returns the time the handshake must be completed by.
+     */
+    Clock::time_point get_handshake_deadline() const;
+
+    void set_handshake_deadline(Clock::time_point deadline);
 
     /*
      * Sets user status offline. Closes the socket.
@@ -62,33 +140,191 @@ public:
     void disconnect();
 
     /*
-     * Sends message msg to the user.
+     * Returns the session state. The socket and the state are expected to be passed
+     * to another server process, so the client is marked offline silently.
+     */
+    State detach();
+
+    /*
+     * Reads the data available on the socket to the input buffer.
+     * Reads at most read_max_size bytes at once, so a single client can't hold
+     * the caller for long. The data is read to a per-thread scratch buffer first,
+     * so the input buffer grows by the received data size only.
+     */
+    void read();
+
+    /*
+     * Sends frame to the user using the negotiated wire format.
+     * v1 users get the frame payload only.
      * params:
-     *      msg - message to be sent
+     *      frame - frame to be sent
      */
-    void send_message(const std::string& msg);
+    void send_frame(const protocol::Frame& frame);
+
+    /*
+     * Sends data already encoded with the user wire format (see get_format).
+     * Lets a message sent to many users be encoded (and compressed) only once.
+     * The data not sent at once is buffered (see flush).
+     * params:
+     *      data - encoded frames
+     */
+    void send_data(const std::vector<char>& data);
+
+    /*
+     * Sends data shared by several clients (see send_data above).
+     * In the coalescing mode the data is held (not copied) untill the coalescing window
+     * expires (see flush_coalesced) or the held data size reaches the threshold.
+     * params:
+     *      data - encoded frames
+     */
+    void send_data(std::shared_ptr<const std::vector<char>> data);
 
     /*
-     * Receives message msg from the user.
-     * returns received message
+     * Enables the coalescing mode: the frames sent within the window are sent at once.
+     * params:
+     *      window    - maximum time a frame is held for (0 - coalescing disabled)
+     *      max_bytes - held data size sent at once regardless of the window
+     */
+    void set_coalescing(std::chrono::microseconds window, size_t max_bytes);
+
+    /*
+     * Sends the held frames with a single system call, the data not sent at once is buffered (see flush).
+     */
+    void flush_coalesced();
+
+    /*
+     * Returns true if some frames are held in the coalescing mode.
+     */
+    bool has_coalesced_data() const;
+
+    /*
+     * Returns the time the held frames must be sent by.
      */
-    std::string recv_message();
+    Clock::time_point get_coalesce_deadline() const;
+
+    /*
+     * Sends the buffered data.
+     * returns true if all the buffered data are sent
+     */
+    bool flush();
+
+    /*
+     * Returns true if the output buffer contains data not sent yet.
+     */
+    bool has_pending_data() const;
+
+    /*
+     * Returns the frames received entirely. A v2 BATCH frame is unpacked to the frames it contains.
+     * v1 messages are translated to frames: "list" is LIST, any other text is SEND.
+     * WebSocket control frames are answered, the frames following a CLOSE one are ignored (see is_closing).
+     * params:
+     *      max_frames - stop decoding when max_frames frames are decoded (a batch is never split),
+     *                   the rest of the data is kept in the input buffer
+     * returns received frames
+     */
+    std::vector<protocol::Frame> recv_frames(size_t max_frames = SIZE_MAX);
 
     Status get_status() const;
 
     void set_status(Status s);
 
+    /*
+     * Returns true if the nick may be used: valid UTF-8 without control characters, tab or newline
+     * (the nick is a prefix of every message the other users see).
+     */
+    static bool is_valid_nick(const std::string& nick);
+
     std::string get_nick() const;
 
-private:
-    // protocol message header
-    struct msg_header {
-        uint16_t size;      // size of the following message
-    } __attribute__ ((__packed__));
+    int get_sockfd() const;
+
+    /*
+     * Returns the limiter of messages received from the client.
+     */
+    TokenBucket& get_rate_limiter();
+
+    /*
+     * Returns true if the user has closed the session (a WebSocket CLOSE is received),
+     * the client is to be dropped once the frames received before are taken.
+     */
+    bool is_closing() const;
+
+    bool is_paused() const;
+
+    /*
+     * Marks the client as a TLS connection relayed by the terminator thread (see TlsTerminator):
+     * the socket is a socket pair end, so the connection can't be passed to a successor.
+     */
+    void set_relayed(bool r);
+
+    bool is_relayed() const;
+
+    /*
+     * Marks the client as paused: the server doesn't read from its socket.
+     */
+    void set_paused(bool p);
+
+    protocol::Version get_version() const;
+
+    /*
+     * Returns the wire format frames to the user should be encoded with.
+     */
+    protocol::Format get_format() const;
 
-    Status status = Status::OFFLINE;
-    std::shared_ptr<net::Socket> sock_ptr;
+private:
+    // the members are ordered to be packed: the client size is multiplied by the connections number
+    Status status = Status::AWAITING_NICK;
+    protocol::Version version = protocol::Version::V1;
+    uint8_t flags = 0;                                      // negotiated hello flags
+    bool paused = false;
+    bool websocket = false;                                 // the client speaks over WebSocket
+    bool closing = false;                                   // the user has closed the WebSocket
+    bool relayed = false;                                   // TLS connection relayed through a socket pair
+    Clock::time_point handshake_deadline;
+    net::Socket sock;                                       // kept in place, not allocated separately
     std::string nick;
+    TokenBucket rate_limiter;
+
+    std::vector<char> in_buf;       // received data not processed yet
+    std::vector<char> out_buf;      // data to be sent
+    size_t out_offset = 0;          // output buffer data start position to be sent from
+    std::unique_ptr<std::string> ws_fragments;  // fragmented WebSocket message being received
+    std::unique_ptr<net::ShmChannel> channel;   // replaces the socket for the data if set
+
+    std::chrono::microseconds coalesce_window = std::chrono::microseconds(0);
+    size_t coalesce_max_bytes = 0;
+    std::vector<std::shared_ptr<const std::vector<char>>> coalesced;    // held frames, only if the output buffer is empty
+    size_t coalesced_size = 0;
+    Clock::time_point coalesce_deadline;
+
+    /*
+     * Receives data from the socket or the channel, returns 0 if no data available.
+     */
+    ssize_t recv_some(char* data, size_t size);
+
+    /*
+     * Sends data to the socket or the channel, returns 0 if it is not ready.
+     */
+    ssize_t send_some(const char* data, size_t size);
+
+    ssize_t send_some(const struct iovec* iov, size_t count);
+
+    /*
+     * Sends handshake message msg to the user: v1 framed or a WebSocket binary message.
+     */
+    void send_message(const std::string& msg);
+
+    /*
+     * Decodes a WebSocket frame from the beginning of the data, answers the control frames,
+     * joins the fragments of a message.
+     * params:
+     *      data     - received data
+     *      size     - data size
+     *      msg      - decoded message
+     *      complete - set if msg contains an entire message
+     * returns decoded frame size or 0 if the data doesn't contain an entire frame
+     */
+    size_t decode_ws_message(const char* data, size_t size, std::string& msg, bool& complete);
 };
 
 
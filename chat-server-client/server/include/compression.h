@@ -0,0 +1,57 @@
+#ifndef __COMPRESSION_H
+#define __COMPRESSION_H
+
+
+#include <stdexcept>
+#include <string>
+
+
+/*
+ * A bundled LZ77 block compressor. The output is compatible with the LZ4 block format,
+ * so any LZ4 implementation (lz4.block.decompress in python-lz4 for example) can decompress it.
+ * The compressor is a single pass greedy matcher with a 4K entries hash table:
+ * it trades the compression ratio for speed.
+ */
+namespace compression {
+
+
+/*
+ * Represents Compression exception (corrupted compressed data).
+ */
+class CompressionException: public std::runtime_error {
+public:
+    CompressionException(const std::string& what_arg):
+        std::runtime_error(what_arg)
+    { }
+};
+
+
+/*
+ * Returns the maximum compressed size of size bytes of data.
+ */
+size_t compress_bound(size_t size);
+
+/*
+ * Compresses data.
+ * params:
+ *      data - data to be compressed
+ *      size - data size
+ * returns compressed data
+ */
+std::string compress(const char* data, size_t size);
+
+/*
+ * Decompresses data.
+ * params:
+ *      data          - compressed data
+ *      size          - compressed data size
+ *      original_size - decompressed data size
+ * returns decompressed data
+ */
+std::string decompress(const char* data, size_t size, size_t original_size);
+
+
+} // namespace compression
+
+
+#endif // __COMPRESSION_H
@@ -0,0 +1,261 @@
+#ifndef __CORO_H
+#define __CORO_H
+
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <memory>
+#include <exception>
+#include <coroutine>
+
+#include <epoll.h>
+#include <socket.h>
+
+
+namespace io {
+
+
+/*
+ * Allocates the coroutine frames from per-thread free lists, so the frames of the coroutines
+ * started again and again (a coroutine per connection for example) are reused, not allocated.
+ */
+class FramePool {
+public:
+    static void* allocate(size_t size);
+
+    static void deallocate(void* ptr, size_t size);
+};
+
+
+/*
+ * Represents a detached coroutine: it starts at once and its frame is released when it ends.
+ * An exception should not escape the coroutine (std::terminate is called): there is no one awaiting
+ * a detached coroutine to rethrow it to, so the coroutine body should catch std::runtime_error at least.
+ */
+class Task {
+public:
+    struct promise_type {
+        Task get_return_object()
+        {
+            return Task();
+        }
+
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void return_void()
+        { }
+
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+
+        static void* operator new(size_t size)
+        {
+            return FramePool::allocate(size);
+        }
+
+        static void operator delete(void* ptr, size_t size)
+        {
+            FramePool::deallocate(ptr, size);
+        }
+    };
+};
+
+
+/*
+ * Suspends the coroutine untill the tasks and the events pending in the loop are processed,
+ * so a coroutine having a lot to do doesn't hold the loop.
+ * Usage: co_await io::Yield(epoll);
+ */
+class Yield {
+public:
+    explicit Yield(Epoll& epoll):
+        epoll(epoll)
+    { }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        epoll.post([handle] { handle.resume(); });
+    }
+
+    void await_resume() const noexcept
+    { }
+
+private:
+    Epoll& epoll;
+};
+
+
+/*
+ * Represents a non-blocking socket the coroutines can await on:
+ *      co_await sock.connect(addr);
+ *      co_await sock.read_frame(body, max_size);
+ *      co_await sock.write(data, size);
+ * An operation is tried at once, the coroutine is suspended only if the socket is not ready
+ * and is resumed by the loop once the operation is completed, so the loop thread never blocks.
+ * A failed operation throws net::SocketException from co_await.
+ * The socket is polled edge-triggered, it is registered in the loop once.
+ * One read and one write may be awaited at a time (by different coroutines).
+ * Non-copyable.
+ * Not thread-safe: used by the loop thread only.
+ */
+class AsyncSocket {
+public:
+    const size_t read_chunk_size = 64 << 10;
+
+    /*
+     * Constructor. Makes the socket non-blocking and registers it in the loop.
+     */
+    AsyncSocket(Epoll& epoll, std::unique_ptr<net::Socket> sock_ptr);
+
+   ~AsyncSocket();
+
+    AsyncSocket(const AsyncSocket&) = delete;
+
+    AsyncSocket& operator=(const AsyncSocket&) = delete;
+
+    /*
+     * Closes the socket. The awaiting coroutines are resumed by the loop (not by close)
+     * with an exception, so they should keep the socket alive while awaiting.
+     */
+    void close();
+
+    bool is_closed() const;
+
+    int get_sockfd() const;
+
+    class ReadAwaiter;
+    class WriteAwaiter;
+
+    /*
+     * Connects the socket to the address.
+     */
+    WriteAwaiter connect(const net::Address& addr);
+
+    /*
+     * Reads a frame: | varint size | body |.
+     * params:
+     *      body     - buffer the frame body is assigned to (its capacity is reused)
+     *      max_size - maximum body size, a larger frame fails the read
+     */
+    ReadAwaiter read_frame(std::vector<char>& body, size_t max_size);
+
+    /*
+     * Reads the data available (one byte at least), max_size bytes at most.
+     * co_await returns the number of bytes appended to buf.
+     */
+    ReadAwaiter read_some(std::vector<char>& buf, size_t max_size);
+
+    /*
+     * Writes all the data. The data should be valid untill the write is completed.
+     */
+    WriteAwaiter write(const char* data, size_t size);
+
+    class ReadAwaiter {
+    public:
+        ReadAwaiter(AsyncSocket& sock):
+            sock(sock)
+        { }
+
+        bool await_ready()
+        {
+            return sock.try_read();
+        }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            sock.read_waiter = handle;
+        }
+
+        size_t await_resume();
+
+    private:
+        AsyncSocket& sock;
+    };
+
+    class WriteAwaiter {
+    public:
+        WriteAwaiter(AsyncSocket& sock):
+            sock(sock)
+        { }
+
+        bool await_ready()
+        {
+            return sock.try_write();
+        }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            sock.write_waiter = handle;
+        }
+
+        void await_resume();
+
+    private:
+        AsyncSocket& sock;
+    };
+
+private:
+    Epoll& epoll;
+    std::unique_ptr<net::Socket> sock_ptr;
+    int sockfd;
+    bool closed = false;
+    std::shared_ptr<bool> alive;            // reset by the destructor, checked by on_event after a resume
+
+    std::vector<char> in_buf;               // data received but not read yet
+    size_t in_offset = 0;
+
+    // the pending read
+    std::coroutine_handle<> read_waiter;
+    std::vector<char>* read_dst = nullptr;
+    size_t read_max_size = 0;
+    bool read_frame_mode = false;
+    size_t read_result = 0;
+    std::exception_ptr read_error;
+
+    // the pending write or connect
+    std::coroutine_handle<> write_waiter;
+    const char* write_data = nullptr;
+    size_t write_size = 0;
+    size_t write_sent = 0;
+    bool connecting = false;
+    std::exception_ptr write_error;
+
+    /*
+     * Tries to complete the pending read, returns true if it is completed or failed
+     */
+    bool try_read();
+
+    /*
+     * Tries to complete the pending write or connect, returns true if it is completed or failed
+     */
+    bool try_write();
+
+    /*
+     * Receives the data available to in_buf, returns false if there is none
+     */
+    bool fill();
+
+    void on_event(int events);
+};
+
+
+} // namespace io
+
+
+#endif // __CORO_H
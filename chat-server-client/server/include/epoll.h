@@ -5,9 +5,14 @@
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
+#include <vector>
 #include <functional>
+#include <atomic>
+#include <cstdint>
 #include <sys/epoll.h>
 
+#include <mpsc_queue.hpp>
+
 
 namespace io {
 
@@ -27,9 +32,10 @@ public:
 
 
 /*
- * Represents a epoll selector. Dispatches epoll events to the added handlers.
+ * Represents a epoll selector. Dispatches epoll events to the added handlers
+ * and runs the tasks posted by the other threads (see post).
  * Non-copyable.
- * Not thread-safe.
+ * Not thread-safe, but stop, post and post_batch may be called from any thread.
  */
 class Epoll {
 public:
@@ -37,11 +43,16 @@ public:
         IN      = EPOLLIN,
         OUT     = EPOLLOUT,
         ONESHOT = EPOLLONESHOT,
+        ET      = EPOLLET,
         RDHUP   = EPOLLRDHUP,
         HUP     = EPOLLHUP,
         ERR     = EPOLLERR
     };
 
+    typedef std::function<void()> Task;
+
+    const size_t max_tasks_per_wakeup = 1024;     // tasks run at once, the rest runs after the pending events
+
     /*
      * Constructor.
      * params:
@@ -49,6 +60,8 @@ public:
      */
     Epoll(size_t max_events);
 
+   ~Epoll();
+
     Epoll(const Epoll&) = delete;
 
     Epoll& operator=(const Epoll&) = delete;
@@ -59,10 +72,24 @@ public:
     void start();
 
     /*
-     * Stops the epoll loop.
+     * Stops the epoll loop. Wakes the loop up if it is waiting for events,
+     * so the loop is stopped promptly. Can be called from any thread.
      */
     void stop();
 
+    /*
+     * Makes the loop thread run the task. Can be called from any thread.
+     * The tasks posted by a thread are run in order. The loop is woken up once
+     * for all the tasks posted while it is busy.
+     * The tasks posted after the loop is stopped are not run.
+     */
+    void post(Task task);
+
+    /*
+     * Posts the tasks at once (see post), the tasks are moved from.
+     */
+    void post_batch(std::vector<Task>& batch);
+
     /*
      * Adds a handler to the epoll event loop.
      * params:
@@ -73,18 +100,59 @@ public:
      */
     void add_handler(int fd, int event_mask, std::function<void(int, void*)> func, void* data = nullptr);
 
+    /*
+     * Changes the mask of events to be handled for a file descriptor.
+     * Does nothing if the mask is not changed.
+     * Removing IN from the mask is used to stop reading from a peer (backpressure).
+     * params:
+     *      fd          - file descriptor
+     *      event_mask  - new mask of events to be handled
+     */
+    void modify_handler(int fd, int event_mask);
+
     /*
      * Deletes a handler from the epoll event loop by a file descriptor.
+     * Should be called before the descriptor is closed. The handler may delete itself:
+     * it is destroyed after the events received with it are dispatched. The events of a deleted
+     * handler are not dispatched, even if the descriptor number is reused by a new handler.
      * params:
      *      fd - file descriptor to be deleted
      */
     void del_handler(int fd);
 
 private:
-    bool stop_flag = false;
+    struct Handler {
+        std::function<void(int, void*)> func;   // functional object to be called on a epoll event
+        void* data;                             // kept apart, so a small func is not allocated
+        int event_mask;                         // mask of events to be handled
+        uint32_t generation;                // tags the events of the handler (see del_handler)
+    };
+
+    std::atomic<bool> stop_flag;
     size_t max_events;
     int epollfd;
-    std::unordered_map<int, std::function<void(int)>> handlers;     // handlers map to be called by the events
+    int wakeup_fd;                  // event file descriptor waking the loop up on stop or a posted task
+    std::unordered_map<int, Handler> handlers;     // handlers map to be called by the events
+    std::vector<Handler> deleted_handlers;          // handlers deleted while the events are dispatched
+    uint32_t next_generation = 0;
+
+    concurrent::MpscQueue<Task> tasks;
+    std::atomic<bool> wakeup_pending;   // wakeup_fd is signaled and the tasks are not run yet
+
+    /*
+     * Signals wakeup_fd unless it is already signaled.
+     */
+    void wakeup();
+
+    /*
+     * wakeup_fd handler, runs the posted tasks
+     */
+    void run_tasks();
+
+    /*
+     * Returns the epoll event data identifying the handler: the generation and the descriptor.
+     */
+    static uint64_t make_event_data(int fd, uint32_t generation);
 };
 
 
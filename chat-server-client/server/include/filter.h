@@ -0,0 +1,158 @@
+#ifndef __FILTER_H
+#define __FILTER_H
+
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <sys/types.h>
+
+
+namespace chat {
+
+
+/*
+ * Represents Filter exception.
+ */
+class FilterException: public std::runtime_error {
+public:
+    FilterException(const std::string& what_arg):
+        std::runtime_error(what_arg)
+    { }
+};
+
+
+/*
+ * Represents a filter stage the texts from the users pass before being delivered (see ChatServer::add_filter).
+ */
+class MessageFilter {
+public:
+    virtual ~MessageFilter()
+    { }
+
+    /*
+     * Checks the text.
+     * params:
+     *      text   - valid UTF-8 text
+     *      reason - reason to be sent to the user if the text is blocked
+     * returns false if the text is blocked
+     */
+    virtual bool check(const std::string& text, std::string& reason) = 0;
+};
+
+
+/*
+ * Represents a set of patterns compiled into an Aho-Corasick automaton, finds any of them in a text
+ * in a single pass whatever the number of patterns is. The ASCII letters are matched case-insensitively.
+ *
+ * The bytes are mapped to classes (the bytes no pattern contains share a single one), the goto
+ * function is stored as a double array: the transition of state s by class c is cell base(s) + c
+ * if the cell check is s, the failure link is followed otherwise. A cell holds the state base,
+ * check, failure link and match, so a transition costs a single cache line access.
+ * Immutable, so thread-safe.
+ */
+class PatternSet {
+public:
+    static const size_t npos = static_cast<size_t>(-1);
+
+    /*
+     * Compiles the patterns, the empty ones are ignored.
+     */
+    PatternSet(const std::vector<std::string>& patterns);
+
+    /*
+     * Finds a pattern in the data.
+     * returns the index of a pattern found or npos if there is none
+     */
+    size_t find(const char* data, size_t size) const;
+
+    const std::string& get_pattern(size_t index) const;
+
+    size_t get_size() const;
+
+    /*
+     * Returns the number of automaton states.
+     */
+    size_t get_states() const;
+
+private:
+    struct Cell {
+        int32_t base = 0;               // the state transitions are cells base + class
+        int32_t check = -1;             // the state the cell is a transition of (-1 - free cell)
+        int32_t fail = 0;               // failure link
+        int32_t match = -1;             // index of a pattern ending in the state or its failure states
+    };
+
+    std::vector<std::string> patterns;
+    uint8_t classes[256];               // byte classes, 0 - the bytes of no pattern
+    size_t class_count = 1;
+    std::vector<Cell> cells;            // cell 0 is the root state
+    size_t states = 1;
+};
+
+
+/*
+ * Represents a filter blocking the texts containing any of the patterns (terms, URLs) listed in a file:
+ * a pattern per line, the empty lines and the lines starting with '#' are skipped.
+ * The file is polled for changes by a reloading thread, a changed file is compiled by the thread
+ * (see PatternSet) and swapped in atomically, so reloading never pauses the checks.
+ * A file failed to load is reported, the patterns loaded before are kept.
+ * Non-copyable.
+ * Thread-safe.
+ */
+class ContentFilter: public MessageFilter {
+public:
+    /*
+     * Constructor. Loads the file.
+     * params:
+     *      path            - patterns file path
+     *      reload_interval - file polling interval (0 - the file is not reloaded)
+     */
+    ContentFilter(const std::string& path, std::chrono::milliseconds reload_interval = std::chrono::milliseconds(1000));
+
+    /*
+     * Stops the reloading thread.
+     */
+   ~ContentFilter();
+
+    ContentFilter(const ContentFilter&) = delete;
+
+    ContentFilter& operator=(const ContentFilter&) = delete;
+
+    bool check(const std::string& text, std::string& reason) override;
+
+private:
+    std::string path;
+    std::chrono::milliseconds reload_interval;
+
+    std::atomic<std::shared_ptr<const PatternSet>> patterns;
+    struct timespec loaded_mtime = {0, 0};  // the loaded file modification time, used by reload only
+    off_t loaded_size = -1;
+
+    std::mutex mx;
+    std::condition_variable stop_cond;
+    bool stop_flag = false;
+    std::thread reload_thread;
+
+    /*
+     * Loads the file if it has changed since the last load.
+     * returns true if the file has been loaded
+     */
+    bool reload();
+
+    void reload_handler();
+};
+
+
+} // namespace chat
+
+
+#endif // __FILTER_H
@@ -0,0 +1,107 @@
+#ifndef __HANDOFF_H
+#define __HANDOFF_H
+
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <client.h>
+
+
+namespace chat {
+
+
+/*
+ * Represents Handoff exception.
+ */
+class HandoffException: public std::runtime_error {
+public:
+    HandoffException(const std::string& what_arg):
+        std::runtime_error(what_arg)
+    { }
+};
+
+
+/*
+ * Represents a hot restart channel: a unix socket connection between a running server
+ * and its successor. The running server passes its listening sockets and the client sockets
+ * (see man unix, SCM_RIGHTS) along with the client sessions state, so the successor continues
+ * serving the clients without them reconnecting.
+ *
+ * Every record is | type (1 byte) | uint32 body size (network order) | body |,
+ * a passed file descriptor is attached to the first byte of the record.
+ * CLIENT record body is | status | version | flags | varint size | nick |
+ * | varint size | input buffer | varint size | output buffer | websocket (1 byte) |
+ * | varint size | WebSocket message fragments |.
+ *
+ * Non-copyable.
+ * Not thread-safe.
+ */
+class Handoff {
+public:
+    enum class Record: uint8_t {
+        LISTENER     = 1,   // listening socket
+        CLIENT       = 2,   // client socket and session state
+        END          = 3,   // no more records
+        TLS_LISTENER = 4    // TLS listening socket
+    };
+
+    /*
+     * Constructor. Takes the ownership of a connected unix socket.
+     */
+    explicit Handoff(int sockfd):
+        sockfd(sockfd)
+    { }
+
+   ~Handoff();
+
+    Handoff(const Handoff&) = delete;
+
+    Handoff& operator=(const Handoff&) = delete;
+
+    /*
+     * Creates a unix socket listening for a successor process on the path.
+     * returns listening socket
+     */
+    static int listen(const std::string& path);
+
+    /*
+     * Accepts a successor process connection.
+     */
+    static std::unique_ptr<Handoff> accept(int listen_fd);
+
+    /*
+     * Connects to a running server listening on the path.
+     */
+    static std::unique_ptr<Handoff> connect(const std::string& path);
+
+    void send_listener(int fd);
+
+    void send_tls_listener(int fd);
+
+    void send_client(int fd, const Client::State& state);
+
+    void send_end();
+
+    /*
+     * Receives a record.
+     * params:
+     *      fd    - received file descriptor (-1 if none)
+     *      state - received client state (CLIENT record only)
+     * returns record type
+     */
+    Record recv(int& fd, Client::State& state);
+
+private:
+    int sockfd;
+
+    void send_record(Record type, int fd, const std::vector<char>& body);
+};
+
+
+} // namespace chat
+
+
+#endif // __HANDOFF_H
@@ -0,0 +1,68 @@
+#ifndef __HISTORY_H
+#define __HISTORY_H
+
+
+#include <string>
+#include <vector>
+#include <array>
+#include <protocol.h>
+
+
+namespace chat {
+
+
+/*
+ * Represents the chat history: a bounded ring of the last broadcast messages.
+ * The messages are kept framed (v1 and v2), so a replay is a concatenation
+ * of ready frames: v1 frames (WebSocket text messages) for a v1 client, a single BATCH frame for a v2 one.
+ * The replay is cached per wire format untill the next message is added,
+ * so a reconnect storm builds it once.
+ * Not thread-safe.
+ */
+class History {
+public:
+    /*
+     * Constructor.
+     * params:
+     *      capacity - maximum messages to be kept (0 - no history)
+     */
+    History(size_t capacity = 0);
+
+    void set_capacity(size_t capacity);
+
+    size_t get_capacity() const;
+
+    /*
+     * Adds the frame to the history, drops the oldest one if the history is full.
+     */
+    void push(const protocol::Frame& frame);
+
+    /*
+     * Returns the history encoded with the wire format fmt to be sent in one write.
+     * returns encoded frames (empty if there is no history)
+     */
+    const std::vector<char>& get_replay(protocol::Format fmt);
+
+    size_t size() const;
+
+private:
+    struct Entry {
+        std::vector<char> v1_frame;     // empty if the message is too long for v1
+        std::vector<char> v2_frame;
+    };
+
+    std::vector<Entry> ring;            // the slots are reused, so their buffers are allocated once
+    size_t head = 0;                    // the oldest entry position
+    size_t count = 0;
+
+    std::array<std::vector<char>, protocol::format_count> replay_cache;
+    std::array<bool, protocol::format_count> replay_valid;
+
+    void invalidate();
+};
+
+
+} // namespace chat
+
+
+#endif // __HISTORY_H
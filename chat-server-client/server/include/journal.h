@@ -0,0 +1,176 @@
+#ifndef __JOURNAL_H
+#define __JOURNAL_H
+
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+#include <protocol.h>
+
+
+namespace chat {
+
+
+/*
+ * Represents Journal exception.
+ */
+class JournalException: public std::runtime_error {
+public:
+    JournalException(const std::string& what_arg):
+        std::runtime_error(what_arg)
+    { }
+};
+
+
+/*
+ *   //                          Journal layout:                               //
+ *   //========================================================================//
+ *   //                                                                        //
+ *   //  DIR/<first sequence number>.log - segment: records, zero size ends it //
+ *   //  DIR/<first sequence number>.idx - sparse index of a sealed segment    //
+ *   //                                                                        //
+ *   //  record:      | uint32 size | uint32 checksum | v2 frame (size bytes) | //
+ *   //  index entry: | uint32 sequence number - first | uint32 position |    //
+ *   //                                                                        //
+ *   //========================================================================//
+ *
+ * Represents a durable append-only journal of frames. Every frame gets a sequence number.
+ * Segments are fixed-size memory-mapped files: an append is a memory copy, a sync thread
+ * flushes the appended records to the disk every sync_interval (or earlier if a lot of
+ * data is appended), so many appends share a single msync (group commit) and the appending
+ * thread never waits for the disk. A crash loses at most sync_interval of appends.
+ * The index has an entry every index_interval bytes, so a record is found by a short scan.
+ * The active segment index is rebuilt by a scan on recovery (it is stored when the segment is sealed);
+ * the scan stops at the first record with a wrong checksum (a torn write).
+ * The segments holding only the frames no longer needed (see release) are deleted by the sync thread too.
+ * Non-copyable.
+ * append is thread-safe with the sync thread, read should be called before appending.
+ */
+class Journal {
+public:
+    const size_t index_interval = 4096;                 // bytes between the index entries
+    const size_t sync_bytes = 1 << 20;                  // appended bytes waking the sync thread up early
+
+    /*
+     * Constructor. Opens the journal recovering the segments found in the directory.
+     * params:
+     *      dir           - journal directory (must exist)
+     *      segment_size  - segment file size
+     *      sync_interval - maximum time the appended records are not flushed for
+     */
+    Journal(const std::string& dir, size_t segment_size = 64 << 20,
+            std::chrono::milliseconds sync_interval = std::chrono::milliseconds(10));
+
+    /*
+     * Flushes the appended records, stops the sync thread.
+     */
+   ~Journal();
+
+    Journal(const Journal&) = delete;
+
+    Journal& operator=(const Journal&) = delete;
+
+    /*
+     * Appends the frame to the journal.
+     * returns the frame sequence number
+     */
+    uint64_t append(const protocol::Frame& frame);
+
+    /*
+     * Reads frames.
+     * params:
+     *      seq - the first frame sequence number
+     *      max - maximum frames to be read
+     * returns frames
+     */
+    std::vector<protocol::Frame> read(uint64_t seq, size_t max);
+
+    /*
+     * Lets the segments holding only the frames before seq be deleted.
+     * The active segment is never deleted.
+     */
+    void release(uint64_t seq);
+
+    /*
+     * Returns the sequence number of the first frame kept.
+     */
+    uint64_t get_first_seq() const;
+
+    /*
+     * Returns the sequence number the next appended frame gets.
+     */
+    uint64_t get_next_seq() const;
+
+private:
+    struct IndexEntry {
+        uint32_t seq;                   // sequence number relative to the segment first one
+        uint32_t pos;                   // record position
+    };
+
+    /*
+     * Represents a mapped segment file.
+     */
+    struct Segment {
+        uint64_t first_seq = 0;
+        uint64_t next_seq = 0;
+        int fd = -1;
+        char* data = nullptr;
+        size_t size = 0;
+        size_t pos = 0;                 // end of the records
+        size_t synced_pos = 0;          // end of the records flushed to the disk
+        std::vector<IndexEntry> index;
+
+       ~Segment();
+    };
+
+    typedef std::shared_ptr<Segment> SegmentPtr;
+
+    std::string dir;
+    size_t segment_size;
+    std::chrono::milliseconds sync_interval;
+
+    std::vector<uint64_t> segments;     // first sequence numbers of the segments, ascending
+    SegmentPtr active;
+    std::vector<SegmentPtr> sealed;     // segments to be flushed and sealed by the sync thread
+    bool dir_dirty = false;             // a segment file has been created since the last sync
+    uint64_t released_seq = 0;          // the frames before it are no longer needed (see release)
+    size_t unsynced_bytes = 0;
+
+    mutable std::mutex mx;
+    std::condition_variable sync_cond;
+    bool stop_flag = false;
+    std::thread sync_thread;
+
+    std::string segment_path(uint64_t first_seq, const char* ext) const;
+
+    /*
+     * maps an existing segment, recovers its records end and index
+     */
+    SegmentPtr open_segment(uint64_t first_seq, bool writable);
+
+    /*
+     * creates a new segment of at least min_size bytes
+     */
+    SegmentPtr create_segment(uint64_t first_seq, size_t min_size);
+
+    /*
+     * scans the segment records from the position of the last index entry
+     */
+    void scan_segment(Segment& segment);
+
+    void write_index(const Segment& segment);
+
+    void sync_handler();
+};
+
+
+} // namespace chat
+
+
+#endif // __JOURNAL_H
@@ -0,0 +1,160 @@
+#ifndef __LINK_H
+#define __LINK_H
+
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#include <socket.h>
+#include <epoll.h>
+#include <coro.h>
+#include <bus.h>
+
+
+namespace chat {
+
+
+/*
+ * Represents Link exception.
+ */
+class LinkException: public std::runtime_error {
+public:
+    LinkException(const std::string& what_arg):
+        std::runtime_error(what_arg)
+    { }
+};
+
+
+/*
+ * Represents a link between two federated servers (nodes).
+ * A link carries the same records as the workers bus (see Bus): broadcasts, private messages
+ * and the users joins and leaves.
+ *
+ * Link frame: | varint size | type (1 byte) | body |
+ * HELLO (type 0) body: | varint link protocol version | varint node id |
+ * record (type is the Bus::Event) body: | varint nick size | nick | payload |
+ *
+ * Both nodes send HELLO first, the link is ACTIVE once the peer hello is received.
+ * The link keeps the protocol state and the records to be sent, the socket I/O is done
+ * by the link coroutines (see ChatServer::run_link and ChatServer::write_link).
+ * The records are batched: they are buffered by send and written at once.
+ * Flow control: the broadcasts are shed while a peer not reading them fast enough has
+ * broadcast_max_buffered bytes buffered (see take_overruns), the users joins and leaves
+ * and the private messages are kept; a peer that doesn't read at all overflows
+ * the buffer and the link is closed.
+ *
+ * Non-copyable.
+ * Not thread-safe.
+ */
+class Link {
+public:
+    enum class State {
+        CONNECTING,     // outgoing link connect in progress
+        HANDSHAKE,      // hello sent, waiting for the peer hello
+        ACTIVE
+    };
+
+    static const size_t frame_max_size;                 // maximum frame (type and body) size
+    const size_t broadcast_max_buffered = 4 << 20;      // output buffer size the broadcasts are shed at
+    const size_t out_buf_max_size = 32 << 20;           // maximum output buffer size
+
+    /*
+     * Constructor. Wraps an accepted link socket.
+     */
+    Link(io::Epoll& epoll, std::unique_ptr<net::Socket> sock_ptr);
+
+    /*
+     * Constructor. Creates a socket to be connected to the peer.
+     */
+    Link(io::Epoll& epoll, const net::Address& peer_addr);
+
+    Link(const Link&) = delete;
+
+    Link& operator=(const Link&) = delete;
+
+    io::AsyncSocket& get_socket();
+
+    const net::Address& get_peer_address() const;
+
+    /*
+     * Buffers the hello. An outgoing link should be connected.
+     * params:
+     *      node_id - the local node id
+     */
+    void open(uint64_t node_id);
+
+    /*
+     * Processes the peer hello frame, the link becomes active.
+     */
+    void on_hello(const std::vector<char>& frame);
+
+    /*
+     * Decodes a record frame received by an active link. The record worker field is not set.
+     */
+    Bus::Record parse_record(const std::vector<char>& frame) const;
+
+    /*
+     * Buffers the record to be sent. A broadcast is dropped if the peer doesn't keep up.
+     */
+    void send(Bus::Event event, const std::string& nick, const std::string& payload);
+
+    bool has_pending_data() const;
+
+    /*
+     * Returns the number of the broadcasts dropped since the last call.
+     */
+    size_t take_overruns();
+
+    /*
+     * Returns the buffered data to be written, the buffer is empty afterwards.
+     * The returned data is valid untill the next call.
+     */
+    const std::vector<char>& take_pending();
+
+    /*
+     * Whether a coroutine writing the buffered data is running.
+     */
+    bool is_writing() const;
+
+    void set_writing(bool w);
+
+    State get_state() const;
+
+    bool is_outgoing() const;
+
+    /*
+     * Returns the peer node id, known once the link is active.
+     */
+    uint64_t get_node_id() const;
+
+    int get_sockfd() const;
+
+    /*
+     * Returns the peer address string for the logs.
+     */
+    std::string str() const;
+
+private:
+    net::Address peer_addr;
+    std::string peer_str;
+    io::AsyncSocket sock;
+    State state;
+    bool outgoing;
+    uint64_t node_id = 0;
+
+    std::vector<char> out_buf;              // records to be sent
+    std::vector<char> write_buf;            // records being written, the buffers are swapped
+    bool writing = false;
+    size_t overruns = 0;                    // broadcasts dropped
+
+    void put_frame(uint8_t type, const std::vector<char>& body);
+};
+
+
+} // namespace chat
+
+
+#endif // __LINK_H
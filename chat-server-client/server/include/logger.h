@@ -5,8 +5,12 @@
 #include <vector>
 #include <memory>
 #include <mutex>
+#include <thread>
+#include <utility>
 #include <map>
 #include <syslog.h>
+#include <queue.hpp>
+#include <affinity.h>
 
 
 namespace logging {
@@ -89,6 +93,9 @@ private:
  * Represents a simple logger. Logger should never be instantiated directly,
  * but always through get_instance static function.
  * Single for the entire application.
+ * In async mode (see start_async) the messages are written to the sinks by a logging thread,
+ * so the threads logging a message never wait for the console or syslog.
+ * While the binary log is open (see binlog.h) the messages are recorded to it instead of the sinks.
  * Thread-safe.
  */
 class Logger {
@@ -151,13 +158,45 @@ public:
      */
     void warning(const std::string& msg);
 
+    /*
+     * Starts the logging thread.
+     * params:
+     *      cpus - cpus the logging thread is pinned to (empty - not pinned)
+     */
+    void start_async(const concurrent::CpuList& cpus = concurrent::CpuList());
+
+    /*
+     * Writes the queued messages and stops the logging thread.
+     */
+    void stop_async();
+
 private:
+    typedef std::shared_ptr<std::pair<Loglevel, std::string>> RecordPtr;
+
     static Logger logger;                       // static logger object implementing a singleton pattern
     std::vector<std::shared_ptr<Sink>> sinks;   // logger sinks (outputs) list
     mutable std::mutex mx;                      // mutex for thread-safe support
 
+    std::thread log_thread;
+    concurrent::Queue<RecordPtr> records;       // messages to be written by the logging thread
+
+    /*
+     * Writes the message to the sinks.
+     */
+    void write(Loglevel lvl, const std::string& msg);
+
+    /*
+     * the logging thread body
+     */
+    void log_handler(const concurrent::CpuList& cpus);
+
     Logger()    // hides constructor to prevent direct instantiation
     { }
+
+   ~Logger()
+    {
+        stop_async();
+    }
 };
 
 
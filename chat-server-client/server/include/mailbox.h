@@ -0,0 +1,119 @@
+#ifndef __MAILBOX_H
+#define __MAILBOX_H
+
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <protocol.h>
+
+
+namespace chat {
+
+
+/*
+ * Represents Mailbox exception.
+ */
+class MailboxException: public std::runtime_error {
+public:
+    MailboxException(const std::string& what_arg):
+        std::runtime_error(what_arg)
+    { }
+};
+
+
+/*
+ * Represents a bounded mailbox of the messages to an offline user.
+ * The messages are kept as | varint size | payload | records in a byte queue;
+ * past spill_threshold bytes the new messages go to a memory-mapped unnamed file
+ * (see O_TMPFILE), so a large backlog is paged out by the kernel instead of holding memory.
+ * The file space of the popped records is reused, so the file size follows the records kept (max_bytes)
+ * rather than all the records ever spilled.
+ * A full mailbox drops the oldest message.
+ * Non-copyable.
+ * Not thread-safe.
+ */
+class Mailbox {
+public:
+    /*
+     * Constructor.
+     * params:
+     *      max_messages    - maximum messages to be kept
+     *      max_bytes       - maximum messages size to be kept
+     *      spill_threshold - in-memory messages size the messages are spilled to a file after
+     *      spill_dir       - directory the spill file is created in
+     */
+    Mailbox(size_t max_messages, size_t max_bytes, size_t spill_threshold, const std::string& spill_dir);
+
+   ~Mailbox();
+
+    Mailbox(const Mailbox&) = delete;
+
+    Mailbox& operator=(const Mailbox&) = delete;
+
+    void push(const std::string& payload);
+
+    /*
+     * Pops the oldest messages encoded with the wire format fmt as MESSAGE frames:
+     * v1 frames or a single BATCH frame.
+     * params:
+     *      fmt        - wire format
+     *      chunk_size - maximum encoded messages size (at least one message is popped)
+     *      buf        - buffer the encoded messages are appended to
+     * returns the number of popped messages
+     */
+    size_t pop_chunk(protocol::Format fmt, size_t chunk_size, std::vector<char>& buf);
+
+    /*
+     * Returns the oldest message, the mailbox should not be empty.
+     */
+    std::string front() const;
+
+    /*
+     * Drops the oldest message, the mailbox should not be empty.
+     */
+    void pop_front();
+
+    bool empty() const;
+
+    size_t size() const;
+
+    /*
+     * Returns the number of messages dropped because the mailbox was full.
+     */
+    size_t get_dropped() const;
+
+private:
+    size_t max_messages;
+    size_t max_bytes;
+    size_t spill_threshold;
+    std::string spill_dir;
+
+    size_t count = 0;
+    size_t bytes = 0;                   // records size
+    size_t dropped = 0;
+
+    std::vector<char> mem;              // in-memory records
+    size_t mem_head = 0;                // the first record position
+
+    int spill_fd = -1;                  // spilled records, follow the in-memory ones
+    char* spill_data = nullptr;
+    size_t spill_capacity = 0;
+    size_t spill_head = 0;
+    size_t spill_tail = 0;
+
+    void spill(const char* data, size_t size);
+
+    void release_spill();
+
+    /*
+     * pops the oldest record
+     */
+    std::string pop();
+};
+
+
+} // namespace chat
+
+
+#endif // __MAILBOX_H
@@ -0,0 +1,112 @@
+#ifndef __CONCURRENT_MPSC_QUEUE_H
+#define __CONCURRENT_MPSC_QUEUE_H
+
+
+#include <atomic>
+#include <utility>
+
+
+namespace concurrent {
+
+
+/*
+ * Represents a lock-free multi-producer single-consumer queue (intrusive linked list with a stub node,
+ * see D. Vyukov's MPSC queue). A push is a single atomic exchange, producers never wait for each other
+ * or for the consumer. A value pushed by a producer still linking its node is not popped untill the node
+ * is linked, the following values are not popped either (the order is kept).
+ * Non-copyable.
+ * push and push_batch may be called from any thread, try_pop from a single consumer thread.
+ */
+template<typename T>
+class MpscQueue {
+public:
+    MpscQueue():
+        head(new Node()), tail(head.load())
+    { }
+
+    MpscQueue(const MpscQueue&) = delete;
+
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+   ~MpscQueue()
+    {
+        T value;
+        while (try_pop(value));
+        delete tail;
+    }
+
+    void push(T value)
+    {
+        Node* node = new Node(std::move(value));
+        push_chain(node, node);
+    }
+
+    /*
+     * Pushes the values [first, last) moving them, the values are popped in a row.
+     */
+    template<typename Iterator>
+    void push_batch(Iterator first, Iterator last)
+    {
+        if (first == last) {
+            return;
+        }
+
+        Node* chain_first = new Node(std::move(*first));
+        Node* chain_last = chain_first;
+
+        for (++first; first != last; ++first) {
+            Node* node = new Node(std::move(*first));
+            chain_last->next.store(node, std::memory_order_relaxed);
+            chain_last = node;
+        }
+
+        push_chain(chain_first, chain_last);
+    }
+
+    /*
+     * Moves the first value to dst. If the queue is empty returns false, dst is untouched.
+     */
+    bool try_pop(T& dst)
+    {
+        Node* next = tail->next.load(std::memory_order_acquire);
+        if (!next) {
+            return false;
+        }
+
+        // the popped node becomes the stub
+        dst = std::move(next->value);
+        delete tail;
+        tail = next;
+
+        return true;
+    }
+
+private:
+    struct Node {
+        std::atomic<Node*> next;
+        T value;
+
+        Node():
+            next(nullptr)
+        { }
+
+        explicit Node(T&& value):
+            next(nullptr), value(std::move(value))
+        { }
+    };
+
+    alignas(64) std::atomic<Node*> head;    // the last pushed node, changed by the producers
+    alignas(64) Node* tail;                 // the stub node, changed by the consumer
+
+    void push_chain(Node* first, Node* last)
+    {
+        Node* prev = head.exchange(last, std::memory_order_acq_rel);
+        prev->next.store(first, std::memory_order_release);
+    }
+};
+
+
+} // namespace concurrent
+
+
+#endif // __CONCURRENT_MPSC_QUEUE_H
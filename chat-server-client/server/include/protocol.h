@@ -0,0 +1,231 @@
+#ifndef __PROTOCOL_H
+#define __PROTOCOL_H
+
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+
+/*
+ *   //                          Wire protocol:                                //
+ *   //========================================================================//
+ *   //                                                                        //
+ *   //  v1 frame:  | uint16 size (network order) | size bytes of text |       //
+ *   //                                                                        //
+ *   //  v2 frame:  | varint size | opcode (1 byte) | varint request id |      //
+ *   //             | payload ...                                      |      //
+ *   //             (size covers opcode, request id and payload)               //
+ *   //                                                                        //
+ *   //========================================================================//
+ *
+ * A connection always starts in v1 framing. The first v1 frame sent by a client
+ * is either its nick (v1 client) or a hello (v2 client):
+ *
+ *      | 0x00 | version (1 byte) | flags (1 byte) | nick ... |
+ *
+ * A nick never starts with a zero byte, so old clients are not affected.
+ * The server answers a hello with a v1 frame | 0x00 | version | flags |
+ * containing the negotiated version and flags, after that both sides switch
+ * to the negotiated framing.
+ *
+ * Hello flags request optional features, the server confirms the supported ones:
+ *
+ *      0x01 - compression: a frame with the opcode high bit set carries
+ *             | varint original payload size | LZ4 block compressed payload |
+ *             Only payloads of at least compress_min_size bytes are compressed.
+ *
+ * Varints are unsigned LEB128 (7 bits per byte, least significant group first).
+ * A BATCH frame payload is a sequence of complete v2 frames (batches can't be nested).
+ * Responses to a request (RESULT, ERROR) carry the request id of the request,
+ * so a client may pipeline several requests without waiting for the responses.
+ */
+namespace protocol {
+
+
+/*
+ * Represents Protocol exception (malformed data received).
+ */
+class ProtocolException: public std::runtime_error {
+public:
+    ProtocolException(const std::string& what_arg):
+        std::runtime_error(what_arg)
+    { }
+};
+
+
+enum class Version: uint8_t {
+    V1 = 1,
+    V2 = 2
+};
+
+enum class Opcode: uint8_t {
+    // handshake
+    HELLO   = 0x00,
+
+    // client requests
+    SEND    = 0x01,     // broadcast a text to all online users
+    PRIVATE = 0x02,     // send a text to a single user, payload: | varint nick size | nick | text |
+    LIST    = 0x03,     // request users status list
+
+    // server responses
+    MESSAGE = 0x10,     // chat message delivered to the user
+    RESULT  = 0x11,     // request result
+    ERROR   = 0x12,     // request error, payload is an error description
+
+    // framing
+    BATCH   = 0x20      // several frames packed in one
+};
+
+/*
+ * Wire formats a frame can be encoded with.
+ */
+enum class Format {
+    V1,                 // v1 framing, payload only
+    V2,                 // v2 framing
+    V2_COMPRESSED,      // v2 framing, payload compressed if worth it
+    WS_V1,              // WebSocket text message, payload only (see websocket.h)
+    WS_V2               // WebSocket binary message, v2 frame body
+};
+
+const size_t format_count = 5;
+
+const Version version_max = Version::V2;    // the newest supported protocol version
+
+const uint8_t flag_compression = 0x01;      // hello flag: compression
+const uint8_t flags_supported = flag_compression;
+
+const uint8_t opcode_compressed = 0x80;     // opcode flag: the payload is compressed
+const size_t compress_min_size = 512;       // minimum payload size to be compressed
+
+const size_t v1_frame_max_size = 65535;     // maximum v1 message size (limited by uint16 header)
+const size_t v2_frame_max_size = 16 << 20;  // maximum v2 frame size to be accepted
+const size_t varint_max_size = 10;          // maximum encoded uint64 varint size
+
+
+/*
+ * Returns true if the format carries the payloads only (v1 clients).
+ */
+bool is_v1(Format fmt);
+
+
+/*
+ * Represents a protocol frame (a command or a response).
+ */
+struct Frame {
+    Frame(Opcode op = Opcode::SEND, const std::string& payload = std::string(), uint64_t request_id = 0):
+        op(op), request_id(request_id), payload(payload)
+    { }
+
+    Opcode op;
+    uint64_t request_id;
+    std::string payload;
+};
+
+/*
+ * Represents a handshake hello (see above).
+ */
+struct Hello {
+    Version version = Version::V1;
+    uint8_t flags = 0;
+    std::string nick;
+};
+
+
+/*
+ * Appends an unsigned LEB128 encoded value to the buffer buf.
+ */
+void put_varint(std::vector<char>& buf, uint64_t value);
+
+/*
+ * Decodes an unsigned LEB128 value.
+ * params:
+ *      data  - encoded data
+ *      size  - data size
+ *      value - decoded value
+ * returns encoded value size or 0 if the data is incomplete
+ */
+size_t get_varint(const char* data, size_t size, uint64_t& value);
+
+/*
+ * Appends a v2 encoded frame to the buffer buf.
+ */
+void encode(const Frame& frame, std::vector<char>& buf);
+
+/*
+ * Appends a frame encoded with the wire format fmt to the buffer buf.
+ * v1 formats encode the frame payload only.
+ */
+void encode(const Frame& frame, Format fmt, std::vector<char>& buf);
+
+/*
+ * Appends a v1 encoded message to the buffer buf.
+ */
+void encode_v1(const std::string& msg, std::vector<char>& buf);
+
+/*
+ * Appends a v2 encoded BATCH frame containing frames to the buffer buf.
+ */
+void encode_batch(const std::vector<Frame>& frames, std::vector<char>& buf);
+
+/*
+ * Decodes a v2 frame body (everything after the size prefix).
+ * params:
+ *      data  - frame body
+ *      size  - frame body size
+ *      frame - decoded frame
+ */
+void decode_body(const char* data, size_t size, Frame& frame);
+
+/*
+ * Decodes a v2 frame from the beginning of the data.
+ * params:
+ *      data  - encoded data
+ *      size  - data size
+ *      frame - decoded frame
+ * returns decoded frame size or 0 if the data doesn't contain an entire frame
+ */
+size_t decode(const char* data, size_t size, Frame& frame);
+
+/*
+ * Decodes a v1 message from the beginning of the data.
+ * params:
+ *      data - encoded data
+ *      size - data size
+ *      msg  - decoded message
+ * returns decoded message size (including the header) or 0 if the data doesn't contain an entire message
+ */
+size_t decode_v1(const char* data, size_t size, std::string& msg);
+
+/*
+ * Unpacks a BATCH frame appending the nested frames to frames.
+ */
+void unbatch(const Frame& batch, std::vector<Frame>& frames);
+
+/*
+ * Returns true if the handshake payload is a hello, fills hello.
+ * Otherwise the payload is a v1 client nick.
+ */
+bool parse_hello(const std::string& payload, Hello& hello);
+
+/*
+ * Returns the hello handshake payload.
+ */
+std::string make_hello(const Hello& hello);
+
+/*
+ * Makes a PRIVATE request payload.
+ */
+std::string make_private(const std::string& nick, const std::string& text);
+
+/*
+ * Parses a PRIVATE request payload.
+ */
+void parse_private(const std::string& payload, std::string& nick, std::string& text);
+
+
+} // namespace protocol
+
+
+#endif // __PROTOCOL_H
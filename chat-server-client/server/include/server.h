@@ -4,12 +4,33 @@
 
 #include <string>
 #include <vector>
+#include <array>
+#include <memory>
+#include <unordered_set>
+#include <deque>
+#include <chrono>
+#include <atomic>
+#include <mutex>
 
 #include <socket.h>
 #include <epoll.h>
+#include <timer.h>
 #include <queue.hpp>
 #include <logger.h>
+#include <protocol.h>
 #include <client.h>
+#include <handoff.h>
+#include <affinity.h>
+#include <history.h>
+#include <journal.h>
+#include <filter.h>
+#include <tls.h>
+#include <shm.h>
+#include <mailbox.h>
+#include <bus.h>
+#include <link.h>
+#include <session.h>
+#include <coro.h>
 
 
 namespace chat {
@@ -32,7 +53,7 @@ public:
  *   //   _______________                             ______________________   //
  *   //  |               | --------in_queue--------> |                      |  //
  *   //  |  io_handler   | (in-messages to process)  |   message_handler    |  //
- *   //  | (sockets I/O) | <-------out_queue-------- | (processes commands) |  //
+ *   //  | (sockets I/O) | <------epoll.post-------- | (processes commands) |  //
  *   //  |_______________|  (out-messages to send)   |______________________|  //
  *   //                                                                        //
  *   //========================================================================//
@@ -40,13 +61,40 @@ public:
  *
  * Represents a chat server. Starts two threads: io_handler and message_handler.
  * The first one uses Epoll to dispatch I/O events to an approptiate handler;
+ * accepts connections, completes the clients handshake (all the sockets are non-blocking,
+ * so a slow client never blocks the thread, a client not sent its nick in time is disconnected);
  * receives data from client sockets, creates messages (see ChatServer::Message)
- * and sends it to in_queue; receives messages from out_queue and sends it to
- * message destination user sockets.
+ * and sends it to in_queue; runs the tasks posted to Epoll (see Epoll::post):
+ * sends the messages posted by message_handler to the message destination user sockets.
  * The second one processes commands received from in_queue, creates messages
- * and sends them to out_queue.
+ * and posts them to io_handler in batches. Commands are dispatched by the message opcode
+ * (see protocol.h) through a handlers table.
+ * A client is owned by io_handler and deleted soon after it is disconnected, message_handler
+ * learns the users status from the users directory (the only state shared by the two threads).
+ * The federation links run as coroutines on the same loop (see coro.h), the client connections
+ * are served by the event handlers.
+ *
+ * stop stops the server gracefully: the server stops accepting and reading, the messages
+ * received so far are processed and the responses are flushed to the clients (for shutdown_timeout at most).
+ * If a successor process has connected to the handoff socket (see set_handoff_path), the listening sockets
+ * and the client sessions are passed to the successor (see handoff.h) instead of being closed,
+ * so the server is restarted without dropping the connections (but the relayed TLS and the channel ones).
+ *
+ * Several servers (worker processes) may share the port (see set_reuse_port) and a Bus (see set_bus):
+ * io_handler publishes the broadcasts, the private messages to the users of the other workers
+ * and the users joins and leaves to the bus, and delivers the messages published by the other workers
+ * to its own clients, so the workers make a single chat.
+ * The servers on different hosts (nodes) are federated the same way through TCP links (see Link):
+ * a node links to its peers (see add_peer) and accepts the peer links (see set_link_address).
+ * The nodes should be fully meshed: the records received from a link are not forwarded to the other links.
+ *
+ * The server may be embedded: a bot running in the server process connects with connect_local
+ * and exchanges frames with the server through memory (see LocalSession), it is a user like any other.
+ * A co-located process (an archiver for example) may connect through shared memory (see set_shm):
+ * the same byte stream as a socket client, written to a ring the process reads (see ShmChannel).
  * params:
- *      iface               - interface the server will be listenig on
+ *      iface               - interface the server will be listenig on (ipv4 or ipv6 address,
+ *                            "::" listens on all ipv4 and ipv6 interfaces)
  *      port                - port the server will be listenig on
  *      max_clients         - epoll max file descriprots
  *      listen_queue_size   - server socket listen queue size
@@ -58,20 +106,188 @@ public:
 
     void start();
 
+    /*
+     * Stops the server (see above). Can be called from any thread, start returns once the server is stopped.
+     */
     void stop();
 
+    /*
+     * Connects an in-process user (see LocalSession), replaces the connection of the nick if any.
+     * The user gets the history and the mail like a network client; its requests are not rate limited,
+     * but are not accepted while in_queue is full. The session is closed by the server on stop.
+     * Can be called from any thread, before or after start.
+     * params:
+     *      nick - user nick
+     * returns the session
+     */
+    std::shared_ptr<LocalSession> connect_local(const std::string& nick);
+
+    /*
+     * Limits the messages rate accepted from every client.
+     * Should be called before start.
+     * params:
+     *      rate  - maximum messages per second (0 - unlimited)
+     *      burst - maximum messages to be accepted at once
+     */
+    void set_rate_limit(double rate, double burst);
+
+    /*
+     * Limits in_queue size. Should be called before start.
+     * params:
+     *      size - maximum messages waiting for message_handler
+     */
+    void set_in_queue_limit(size_t size);
+
+    /*
+     * Sets the time a client has to complete the handshake in. Should be called before start.
+     */
+    void set_handshake_timeout(std::chrono::milliseconds timeout);
+
+    /*
+     * Enables the write coalescing: the messages to a client are held for the window at most
+     * and sent with a single system call (see Client::set_coalescing). Saves system calls
+     * and packets in busy rooms at the cost of the window latency. Should be called before start.
+     * params:
+     *      window    - maximum time a message is held for (0 - coalescing disabled)
+     *      max_bytes - held messages size sent at once regardless of the window
+     */
+    void set_coalescing(std::chrono::microseconds window, size_t max_bytes);
+
+    /*
+     * Makes the server listen on one more address (a unix socket for example).
+     * Should be called before start.
+     */
+    void add_listener(const net::Address& addr);
+
+    /*
+     * Sets the number of the last broadcast messages replayed to a client on join (0 - none).
+     * Should be called before start.
+     */
+    void set_history_size(size_t size);
+
+    /*
+     * Enables offline delivery: the messages to a known offline user are kept in a mailbox
+     * and delivered when the user reconnects. Should be called before start.
+     * params:
+     *      size - maximum messages kept for a user (0 - offline delivery disabled)
+     *      dir  - directory a large mailbox is spilled to
+     *      ttl  - time an offline user (and its mail) is known for
+     */
+    void set_mailbox(size_t size, const std::string& dir, std::chrono::seconds ttl);
+
+    /*
+     * Makes message_handler append the delivered messages to a journal (see Journal).
+     * The history (see set_history_size) is restored from the journal on start,
+     * the segments older than the history messages are deleted.
+     * Should be called before start.
+     * params:
+     *      dir           - journal directory
+     *      segment_size  - journal segment file size
+     *      sync_interval - maximum time the journaled messages are not flushed to the disk for
+     */
+    void set_journal(const std::string& dir, size_t segment_size, std::chrono::milliseconds sync_interval);
+
+    /*
+     * Adds a filter stage the broadcast and private texts pass in message_handler (in the order added),
+     * a blocked text is answered with an error. Should be called before start.
+     */
+    void add_filter(std::shared_ptr<MessageFilter> filter_ptr);
+
+    /*
+     * Pins io_handler thread to the cpus. Should be called before start.
+     */
+    void set_io_cpus(const concurrent::CpuList& cpus);
+
+    /*
+     * Pins message_handler thread (the thread calling start) to the cpus. Should be called before start.
+     */
+    void set_worker_cpus(const concurrent::CpuList& cpus);
+
+    /*
+     * Makes the server share the TCP listening addresses with the other servers (see Socket::set_reuse_port).
+     * Should be called before start.
+     */
+    void set_reuse_port(bool reuse);
+
+    /*
+     * Connects the server with the other workers through the bus (attached to the worker),
+     * the bus should outlive the server. Should be called before start.
+     */
+    void set_bus(Bus* bus);
+
+    /*
+     * Makes the server accept the links of the peer nodes on the address.
+     * Should be called before start.
+     */
+    void set_link_address(const net::Address& addr);
+
+    /*
+     * Makes the server link to the peer node listening for the links on the address,
+     * the link is reestablished if lost. Should be called before start.
+     * The links can't be used with the bus (see set_bus).
+     */
+    void add_peer(const net::Address& addr);
+
+    /*
+     * Makes the server accept TLS connections on the address too (see TlsTerminator).
+     * The handshake has to be completed in the handshake timeout (see set_handshake_timeout).
+     * A successor process (see set_handoff_path) takes over the kTLS connections; the relayed ones
+     * and the ones being handshaked are closed, the clients reconnect.
+     * Should be called before start.
+     * params:
+     *      addr      - address to listen for TLS connections on
+     *      cert_path - certificate chain file path (PEM)
+     *      key_path  - private key file path (PEM)
+     */
+    void set_tls(const net::Address& addr, const std::string& cert_path, const std::string& key_path);
+
+    /*
+     * Makes the server pass a shared memory channel (see ShmChannel) to every client connected
+     * to the unix socket address, the client exchanges the data through the channel.
+     * The channel clients are not passed to a successor process (see set_handoff_path): they reconnect.
+     * Should be called before start.
+     * params:
+     *      addr      - unix socket address to listen for the channel clients on
+     *      ring_size - channel ring size of every direction, bytes
+     */
+    void set_shm(const net::Address& addr, size_t ring_size);
+
+    /*
+     * Makes the server wait for a successor process on the unix socket path.
+     * The server passes its connections to a connected successor and stops.
+     * Should be called before start.
+     */
+    void set_handoff_path(const std::string& path);
+
+    /*
+     * Makes the server take over the connections of a running server listening
+     * for a successor on the unix socket path instead of binding the port.
+     * Should be called before start.
+     */
+    void set_takeover_path(const std::string& path);
+
 private:
 
     /*
      * Represents a message to be passed between io_handler and message_handler
-     * through in_queue or out_queue
+     * through in_queue or Epoll::post
      */
     class Message {
     public:
-        Message(const std::string& msg, const std::string& src):
-            msg(msg), src(src)
+        Message(protocol::Opcode op, const std::string& msg, const std::string& src, uint64_t request_id = 0):
+            op(op), request_id(request_id), msg(msg), src(src)
         { }
 
+        protocol::Opcode get_opcode() const
+        {
+            return op;
+        }
+
+        uint64_t get_request_id() const
+        {
+            return request_id;
+        }
+
         std::string get_message() const
         {
             return msg;
@@ -92,30 +308,188 @@ private:
             dsts.push_back(dst);
         }
 
+        bool is_recorded() const
+        {
+            return recorded;
+        }
+
+        /*
+         * Makes io_handler keep the message in the history (see History).
+         */
+        void set_recorded(bool r)
+        {
+            recorded = r;
+        }
+
+        /*
+         * Returns the message encoded with the wire format fmt. The encoding is cached,
+         * so a broadcast is encoded (and compressed) once per format, not once per destination.
+         * The encoding is shared: a coalescing client holds it untill sent (see Client::set_coalescing).
+         * Used by io_handler only.
+         */
+        std::shared_ptr<const std::vector<char>> get_encoded(protocol::Format fmt)
+        {
+            std::shared_ptr<std::vector<char>>& encoded = encoded_cache[static_cast<size_t>(fmt)];
+            if (!encoded) {
+                auto buf_ptr = std::make_shared<std::vector<char>>();
+                protocol::encode(protocol::Frame(op, msg, request_id), fmt, *buf_ptr);
+                encoded = buf_ptr;
+            }
+            return encoded;
+        }
+
     private:
+        protocol::Opcode op;             // message command or response type
+        uint64_t request_id;             // request id the message is a response to (0 if none)
         std::string msg;                 // message text
         std::string src;                 // message source client name
         std::vector<std::string> dsts;   // mesasge destination clients name
+        bool recorded = false;           // the message is kept in the history
+
+        std::array<std::shared_ptr<std::vector<char>>, protocol::format_count> encoded_cache;  // encoded message per wire format
     };
 
     typedef std::shared_ptr<Message> MessagePtr;
     typedef std::unique_ptr<Client> ClientPtr;
+    typedef void (ChatServer::*CommandHandler)(MessagePtr msg_ptr);
 
-    io::Epoll epoll;
+    /*
+     * io_handler stop stages
+     */
+    enum class Stage {
+        RUNNING,
+        STOPPING,       // stop requested: waiting for message_handler to process the received messages
+        DRAINING        // message_handler stopped: flushing the responses
+    };
+
+    const std::chrono::milliseconds resume_interval = std::chrono::milliseconds(20);    // paused clients check interval
+    const std::chrono::milliseconds shutdown_timeout = std::chrono::milliseconds(5000); // maximum responses flush time
 
-    net::Socket server_sock;
-    std::unordered_map<std::string, ClientPtr> clients;
+    io::Epoll epoll;
+    io::Timer resume_timer;
+    io::Timer handshake_timer;
+    io::Timer shutdown_timer;
+    io::Timer coalesce_timer;
+    io::Timer offline_timer;
+
+    std::vector<net::Address> listen_addresses;
+    size_t listen_queue_size;
+    std::vector<std::unique_ptr<net::Socket>> listeners;   // listening sockets
+    std::unordered_map<std::string, ClientPtr> clients;     // online clients by nick, used by io_handler only
+    std::unordered_map<int, ClientPtr> pending_clients;     // clients not completed the handshake by socket
+    std::vector<ClientPtr> retired_clients;                 // disconnected clients to be deleted (see retire_client)
+    std::unordered_map<std::string, std::shared_ptr<LocalSession>> local_sessions;  // in-process users by nick,
+                                                                                    // used by io_handler only
+
+    // handshake deadlines of pending clients by socket. The timeout is the same for all the clients,
+    // so the deadlines are ordered by the connection time and a queue is enough to find the expired ones.
+    std::deque<std::pair<Client::Clock::time_point, int>> handshake_deadlines;
+    std::chrono::milliseconds handshake_timeout = std::chrono::milliseconds(10000);
 
     concurrent::Queue<MessagePtr> in_queue;
-    concurrent::Queue<MessagePtr> out_queue;
+    const size_t out_batch_size = 64;                       // messages posted to io_handler at once at most
+    std::vector<io::Epoll::Task> out_tasks;                 // messages to be posted, used by message_handler only
+    size_t in_queue_max_size = 65536;
+
+    double msg_rate = 0;                                    // per client messages rate limit
+    double msg_burst = 0;
+    std::unordered_set<std::string> paused_clients;         // clients not being read from
 
-    bool stop_flag;
+    std::chrono::microseconds coalesce_window = std::chrono::microseconds(0);
+    size_t coalesce_max_bytes = 16 << 10;
+    std::unordered_set<std::string> coalescing_clients;     // clients holding messages, used by io_handler only
+
+    History history;                                        // broadcast messages history, used by io_handler only
+
+    const size_t mailbox_max_bytes = 64 << 20;              // maximum messages size kept for a user
+    const size_t mailbox_spill_threshold = 64 << 10;        // mailbox size spilled to a file after
+    const size_t mail_chunk_size = 256 << 10;               // mail delivered at once
+    const size_t mail_chunks_per_event = 4;                 // mail chunks delivered to a client per event
+
+    size_t mailbox_size = 0;
+    std::string mailbox_dir;
+    std::unordered_map<std::string, std::unique_ptr<Mailbox>> mailboxes;    // offline users mail, used by io_handler only
+    std::unordered_set<std::string> mail_clients;           // online users the mail is being delivered to
+
+    // the time the offline users are forgotten at, used by io_handler only. The ttl is the same for all
+    // the users, so the deadlines are ordered and a queue is enough (the map holds the latest one of a user)
+    std::chrono::seconds mailbox_ttl = std::chrono::seconds(0);
+    std::deque<std::pair<Client::Clock::time_point, std::string>> offline_deadlines;
+    std::unordered_map<std::string, Client::Clock::time_point> offline_users;
+
+    std::string journal_dir;
+    size_t journal_segment_size = 0;
+    std::chrono::milliseconds journal_sync_interval;
+    std::unique_ptr<Journal> journal_ptr;                   // used by message_handler only
+    std::deque<uint64_t> history_seqs;                      // journal sequence numbers of the history messages
+
+    std::vector<std::shared_ptr<MessageFilter>> filters;    // used by message_handler only
+
+    std::array<CommandHandler, 256> command_handlers;     // command handlers indexed by opcode
+
+    concurrent::CpuList io_cpus;
+    concurrent::CpuList worker_cpus;
+
+    std::atomic<bool> stop_flag;
+    Stage stage = Stage::RUNNING;                           // used by io_handler only
+
+    bool reuse_port = false;
+    Bus* bus_ptr = nullptr;
+
+    // users connected to the server: nick -> online or offline (with offline delivery enabled
+    // an offline user is kept for mailbox_ttl, as the mail is kept for the user).
+    // Changed by io_handler, read by message_handler
+    std::unordered_map<std::string, Client::Status> users;
+
+    // users connected to the other workers or nodes: nick -> worker or link socket.
+    // Changed by io_handler, read by message_handler
+    std::unordered_map<std::string, size_t> remote_users;
+    std::mutex users_mx;                                    // guards users and remote_users
+
+    /*
+     * peer node to be linked to
+     */
+    struct Peer {
+        net::Address addr;
+        Link* link;                 // the link to the peer (null if not linked)
+        uint64_t node_id;           // peer node id, known once linked (0 if unknown)
+    };
+
+    const std::chrono::milliseconds link_retry_interval = std::chrono::milliseconds(1000);  // peers reconnect interval
+
+    uint64_t node_id;                                       // random node id, detects the duplicate links
+    std::vector<net::Address> link_addresses;
+    std::unique_ptr<net::Socket> link_listener;
+    std::vector<Peer> peers;
+    std::unordered_map<int, std::shared_ptr<Link>> links;  // links by socket, used by io_handler only
+    io::Timer link_timer;
+    const size_t link_records_per_yield = 256;             // records processed by a link coroutine at once
+
+    std::vector<net::Address> tls_addresses;
+    std::string tls_cert_path;
+    std::string tls_key_path;
+    std::unique_ptr<net::Socket> tls_listener;
+    std::unique_ptr<net::TlsTerminator> tls_terminator;
+
+    std::vector<net::Address> shm_addresses;
+    size_t shm_ring_size = 0;
+    std::unique_ptr<net::Socket> shm_listener;
+
+    std::string handoff_path;
+    std::string takeover_path;
+    int handoff_listen_fd = -1;
+    std::unique_ptr<Handoff> handoff_ptr;                   // connection to a successor process
 
     /*
      * see above
      */
     void message_handler();
 
+    /*
+     * queues the message to be posted to io_handler (see message_handler)
+     */
+    void post_message(MessagePtr msg_ptr);
+
     /*
      * process list command
      */
@@ -126,27 +500,326 @@ private:
      */
     void on_send(MessagePtr msg_ptr);
 
+    /*
+     * creates private message (a message to be sent to a single user)
+     */
+    void on_private(MessagePtr msg_ptr);
+
+    /*
+     * responds with an error to a command not supported by the server
+     */
+    void on_unknown(MessagePtr msg_ptr);
+
+    /*
+     * sends an error response to the command source
+     */
+    void send_error(MessagePtr msg_ptr, const std::string& error);
+
+    /*
+     * passes the text of the command through the filters
+     * returns false if the text is blocked (the error is sent to the source)
+     */
+    bool filter_text(MessagePtr msg_ptr, const std::string& text);
+
     std::string get_status_list();
 
+    /*
+     * returns whether a message to the user can be delivered: the user is online, connected
+     * to another worker or node, or known and offline with the offline delivery enabled
+     */
+    bool can_deliver(const std::string& nick);
+
+    /*
+     * appends the message to the journal if any
+     */
+    void journal_message(const protocol::Frame& frame);
+
+    /*
+     * opens the journal, restores the history from it
+     */
+    void open_journal();
+
     /*
      * see above
      */
     void io_handler();
 
     /*
-     * handler to be called by io_handler on out_queue message pushed by message_handler
+     * task posted to io_handler by message_handler for every out-message
+     */
+    void on_message(MessagePtr msg_ptr);
+
+    /*
+     * sends the message to its destination clients,
+     * params:
+     *      forward - the private messages to the users of the other workers are published to the bus
+     */
+    void deliver_message(MessagePtr msg_ptr, bool forward);
+
+    /*
+     * handler to be called by io_handler on the records published to the bus by the other workers
      */
-    void on_queue_available(int events, void* data);
+    void on_bus_event(int events, void* data);
 
     /*
-     * handler to be called by io_handler on client socket connetion
+     * processes the record received from another worker or node
+     */
+    void on_remote_record(const Bus::Record& record);
+
+    /*
+     * publishes the record to the bus if any and to the active links
+     */
+    void publish(Bus::Event event, const std::string& nick, const std::string& payload = std::string());
+
+    /*
+     * handler to be called by io_handler on a connection to the TLS listener
+     */
+    void on_tls_connect(int events, void* data);
+
+    /*
+     * adds the connection passed on by tls_terminator, posted to io_handler
+     */
+    void on_tls_client(net::Socket* raw_sock_ptr, bool relayed);
+
+    /*
+     * handler to be called by io_handler on a peer node connection to the link listener
+     */
+    void on_link_connect(int events, void* data);
+
+    /*
+     * the link coroutine: connects an outgoing link, completes the handshake
+     * and processes the received records untill the link is closed.
+     * An error closes the link, no exception escapes the coroutine (see io::Task)
+     */
+    io::Task run_link(std::shared_ptr<Link> link_ptr);
+
+    /*
+     * the coroutine writing the records buffered by the link
+     */
+    io::Task write_link(std::shared_ptr<Link> link_ptr);
+
+    /*
+     * starts write_link after the current events are processed, so the records are written in a batch
+     */
+    void flush_link(const std::shared_ptr<Link>& link_ptr);
+
+    /*
+     * closes the duplicate link or sends the local users to the peer once the link is active,
+     * returns false if the link is closed
+     */
+    bool on_link_active(Link* link_ptr);
+
+    /*
+     * registers the link and starts its coroutine
+     */
+    void add_link(std::shared_ptr<Link> link_ptr);
+
+    /*
+     * sends the record to the link, closes the link on failure
+     */
+    void send_to_link(int sockfd, Bus::Event event, const std::string& nick, const std::string& payload);
+
+    /*
+     * closes the link, the users of the peer node are removed
+     */
+    void close_link(Link* link_ptr);
+
+    /*
+     * closes the link listener and all the links on stop
+     */
+    void close_links();
+
+    /*
+     * connects to the peers not linked
+     */
+    void connect_peers();
+
+    /*
+     * handler to be called by io_handler periodically to reestablish the lost links
+     */
+    void on_link_timer(int events, void* data);
+
+    /*
+     * pushes the frame sent by a local session to in_queue, called by the session thread
+     */
+    bool on_local_send(const std::string& nick, const protocol::Frame& frame);
+
+    /*
+     * registers the local session, posted to io_handler by connect_local
+     */
+    void on_local_connect(std::shared_ptr<LocalSession> session_ptr);
+
+    /*
+     * unregisters the local session closed by its user, posted to io_handler
+     */
+    void on_local_close(const std::string& nick, LocalSession* session_ptr);
+
+    /*
+     * delivers the v2 encoded frames (a history replay, mail) to the local session
+     */
+    void deliver_local(LocalSession* session_ptr, const std::vector<char>& data);
+
+    /*
+     * closes the local session of the user, the user goes offline
+     */
+    void drop_local(const std::string& nick);
+
+    /*
+     * handler to be called by io_handler on client socket connetion,
+     * data is the listening socket
      */
     void on_client_connect(int events, void* data);
 
     /*
-     * handler to be called by io_handler on client socket data received
+     * handler to be called by io_handler on a connection to the shared memory listener,
+     * passes a channel to the connected client
+     */
+    void on_shm_connect(int events, void* data);
+
+    /*
+     * makes a client of the accepted socket waiting for the nick,
+     * the client exchanges the data through the channel if any
+     */
+    void add_pending_client(std::unique_ptr<net::Socket> client_sock_ptr,
+                            std::unique_ptr<net::ShmChannel> channel_ptr = nullptr);
+
+    /*
+     * handler to be called by io_handler on client socket data received.
+     * Not a coroutine like the links: the client socket is kept in the client and passed to a successor
+     * with the session state, a channel client has no socket to await on, and the handshake is not
+     * varint framed (v1 frame or HTTP upgrade), so AsyncSocket::read_frame doesn't fit the client protocol
      */
     void on_socket_data_available(int events, void* data);
+
+    /*
+     * processes the handshake data received from a pending client,
+     * moves the client to clients when the handshake is completed
+     */
+    void on_handshake_data(Client* client_ptr);
+
+    /*
+     * sends the history to the client just joined
+     */
+    void replay_history(Client* client_ptr);
+
+    /*
+     * keeps the message to the offline user in the user mailbox
+     */
+    void store_mail(const std::string& nick, const std::string& msg);
+
+    /*
+     * sends a few chunks of the user mail while the client socket accepts data,
+     * the rest is sent when the output buffer is flushed (see on_socket_data_available)
+     * or by on_resume_timer, so a large mailbox doesn't hold io_handler
+     */
+    void deliver_mail(Client* client_ptr);
+
+    /*
+     * pushes the messages received entirely from the client to in_queue
+     */
+    void recv_messages(Client* client_ptr);
+
+    /*
+     * disconnects the client
+     */
+    void drop_client(Client* client_ptr);
+
+    /*
+     * stops polling the client socket and disconnects the client. The client is deleted
+     * by a posted task, once the handler that retired it returns: the handler callers may hold the client yet
+     */
+    void retire_client(ClientPtr client_ptr);
+
+    /*
+     * sets the user status in the users directory. An offline user is deleted at once
+     * or, with offline delivery enabled, in mailbox_ttl (see on_offline_timer)
+     */
+    void set_user_status(const std::string& nick, Client::Status status);
+
+    /*
+     * updates the client socket events to be polled according to the client state
+     * (paused, has data to be sent)
+     */
+    void update_events(Client* client_ptr);
+
+    /*
+     * handler to be called by io_handler periodically to resume reading from paused clients
+     */
+    void on_resume_timer(int events, void* data);
+
+    /*
+     * handler to be called by io_handler when the coalescing window of a client expires:
+     * sends the messages held by the clients whose window has expired
+     */
+    void on_coalesce_timer(int events, void* data);
+
+    /*
+     * sends the messages held by all the coalescing clients
+     */
+    void flush_coalesced();
+
+    /*
+     * handler to be called by io_handler on the earliest handshake deadline,
+     * disconnects the clients not completed the handshake in time
+     */
+    void on_handshake_timer(int events, void* data);
+
+    /*
+     * arms handshake_timer for the earliest handshake deadline
+     */
+    void arm_handshake_timer();
+
+    /*
+     * handler to be called by io_handler on the earliest offline user deadline,
+     * deletes the users offline for mailbox_ttl together with their mail
+     */
+    void on_offline_timer(int events, void* data);
+
+    /*
+     * stops reading from the client socket
+     */
+    void pause_client(Client* client_ptr);
+
+    /*
+     * task posted to io_handler twice: the first one by stop,
+     * the second one by message_handler when it has stopped (after all the responses)
+     */
+    void on_stop_marker();
+
+    /*
+     * handler to be called by io_handler on a successor process connection to the handoff socket
+     */
+    void on_handoff_connect(int events, void* data);
+
+    /*
+     * passes the listening sockets and the client sessions to the successor process
+     */
+    void hand_off();
+
+    /*
+     * receives the listening sockets and the client sessions from the running server
+     */
+    void take_over();
+
+    /*
+     * registers the clients received from the running server, processes the data they have buffered
+     */
+    void restore_clients();
+
+    /*
+     * closes the listening socket and the pending clients, waits for the responses to be flushed
+     */
+    void drain();
+
+    /*
+     * stops io_handler if all the responses are flushed
+     */
+    void check_drained();
+
+    /*
+     * handler to be called by io_handler when the responses are not flushed in shutdown_timeout
+     */
+    void on_shutdown_timer(int events, void* data);
 };
 
 
@@ -0,0 +1,121 @@
+#ifndef __SESSION_H
+#define __SESSION_H
+
+
+#include <stdexcept>
+#include <string>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <mpsc_queue.hpp>
+#include <protocol.h>
+
+
+namespace chat {
+
+
+/*
+ * Represents Session exception.
+ */
+class SessionException: public std::runtime_error {
+public:
+    SessionException(const std::string& what_arg):
+        std::runtime_error(what_arg)
+    { }
+};
+
+
+/*
+ * Represents an in-process session of a user (a bot running in the server process, see
+ * ChatServer::connect_local): it is registered as an online user like a network client
+ * and exchanges v2 frames with the server without sockets, framing or copies to the kernel.
+ *
+ * The frames sent by the session go to the server in_queue directly, the frames delivered to it
+ * are pushed by io_handler to a lock-free queue (see MpscQueue) the session polls. A delivery costs
+ * no system call: the eventfd is written only if the receiver is blocked in recv.
+ *
+ * A session is closed by close or by the server (another connection of the nick, the server stop,
+ * the receive queue overflow); the frames delivered before are still received.
+ * Non-copyable.
+ * send and close may be called from any thread, try_recv and recv from a single receiver thread.
+ */
+class LocalSession {
+public:
+    typedef std::function<bool(const protocol::Frame&)> SendHandler;
+    typedef std::function<void(LocalSession*)> CloseHandler;
+
+    static constexpr size_t recv_queue_max_size = 65536;    // frames not received yet the session is closed after
+
+    /*
+     * Constructor.
+     * params:
+     *      nick     - user nick
+     *      on_send  - called with every frame sent, returns false if the frame is not accepted
+     *      on_close - called once if the session is closed by close
+     */
+    LocalSession(const std::string& nick, SendHandler on_send, CloseHandler on_close);
+
+   ~LocalSession();
+
+    LocalSession(const LocalSession&) = delete;
+
+    LocalSession& operator=(const LocalSession&) = delete;
+
+    const std::string& get_nick() const;
+
+    /*
+     * Sends the request frame (SEND, PRIVATE or LIST, see protocol.h) to the server.
+     * The responses carry the request id of the frame.
+     * returns false if the session is closed or the server is overloaded (the frame may be sent again later)
+     */
+    bool send(const protocol::Frame& frame);
+
+    /*
+     * Moves the first frame delivered to the session to frame.
+     * returns false if there is none
+     */
+    bool try_recv(protocol::Frame& frame);
+
+    /*
+     * Waits for a frame delivered to the session for the timeout at most.
+     * returns false if there is none or the session is closed and all the frames are received
+     */
+    bool recv(protocol::Frame& frame, std::chrono::milliseconds timeout);
+
+    /*
+     * Closes the session, the user goes offline.
+     */
+    void close();
+
+    bool is_closed() const;
+
+    /*
+     * Pushes the frame to the receive queue. Called by io_handler.
+     * returns false if the queue is full (the session should be closed)
+     */
+    bool deliver(protocol::Frame frame);
+
+    /*
+     * Marks the session closed by the server, wakes the receiver up. Called by io_handler.
+     */
+    void detach();
+
+private:
+    std::string nick;
+    SendHandler on_send;
+    CloseHandler on_close;
+
+    concurrent::MpscQueue<protocol::Frame> recv_queue;
+    std::atomic<size_t> recv_queue_size;
+    std::atomic<bool> closed;
+    std::atomic<bool> waiting;          // the receiver is blocked in recv
+    int event_fd;                       // wakes the blocked receiver up
+
+    void wakeup();
+};
+
+
+} // namespace chat
+
+
+#endif // __SESSION_H
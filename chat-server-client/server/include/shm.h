@@ -0,0 +1,176 @@
+#ifndef __SHM_H
+#define __SHM_H
+
+
+#include <stdexcept>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include <sys/uio.h>
+#include <socket.h>
+
+
+namespace net {
+
+
+/*
+ * Represents ShmChannel exception.
+ */
+class ShmException: public std::runtime_error {
+public:
+    ShmException(const std::string& what_arg):
+        std::runtime_error(what_arg)
+    { }
+};
+
+
+/*
+ * Represents a shared memory channel between two co-located processes, an alternative to a Socket
+ * carrying the same byte stream: two single-producer single-consumer byte rings in a memfd
+ * (a ring per direction) and an eventfd per end to notify it.
+ *
+ * The channel is created by the server and its peer end (the memory and the eventfds) is passed
+ * to the other process through a connected unix socket (see send_peer, receive). The socket is kept
+ * open by both processes: it tells an end that the other one is gone.
+ *
+ * Flow control is credit based: the writer may write as many bytes as the reader has freed
+ * (the ring size at first), the reader returns the credit by advancing its read position.
+ * A write or a read makes no system call: an end asks to be notified (see set_interest) and is
+ * signaled only once, by the first write (the data) or read (the credit) after it has asked.
+ *
+ * Memory: | ring header 0 | ring header 1 | ring 0 data | ring 1 data |
+ * the server writes ring 0 and reads ring 1. The memfd is sealed, so the peer can't resize it,
+ * and the positions written by the peer are checked: a broken peer can't make the other end read
+ * out of the rings.
+ *
+ * Non-copyable.
+ * Not thread-safe: an end should be used by a single thread.
+ */
+class ShmChannel {
+public:
+    static constexpr size_t ring_min_size = 4096;      // the ring size is rounded up to a power of two not less
+
+    /*
+     * Constructor. Creates the channel, the object is the server end.
+     * params:
+     *      ring_size - ring size of every direction, bytes
+     */
+    explicit ShmChannel(size_t ring_size);
+
+    /*
+     * Receives the peer end of a channel passed through the unix socket (see send_peer). Blocks.
+     * The socket should outlive the channel: wait watches it for the server to close it.
+     */
+    static std::unique_ptr<ShmChannel> receive(Socket& sock);
+
+   ~ShmChannel();
+
+    ShmChannel(const ShmChannel&) = delete;
+
+    ShmChannel& operator=(const ShmChannel&) = delete;
+
+    /*
+     * Passes the peer end of the channel to the process connected to the unix socket.
+     */
+    void send_peer(Socket& sock);
+
+    /*
+     * Writes data to the ring as far as the credit allows.
+     * returns a data size actually written (0 if the ring is full)
+     */
+    ssize_t send(const char* data, size_t size);
+
+    /*
+     * Writes the data of several buffers (see send above).
+     */
+    ssize_t send(const struct iovec* iov, size_t count);
+
+    /*
+     * Reads data from the ring, returns the credit to the writer.
+     * returns a data size actually read (0 if the ring is empty)
+     */
+    ssize_t recv(char* data, size_t size);
+
+    /*
+     * Asks to be notified through the eventfd (see get_event_fd) of the data to be read
+     * and (or) the credit to write. The eventfd is signaled at once if the end is ready already,
+     * so it can be polled like a socket (level-triggered). Should be called every time before waiting.
+     */
+    void set_interest(bool readable, bool writable);
+
+    /*
+     * Waits for the end to be ready (see set_interest) for the timeout at most (-1 - infinitely).
+     * Throws ShmException if the peer has closed the unix socket.
+     * returns false on timeout
+     */
+    bool wait(bool readable, bool writable, int timeout);
+
+    /*
+     * Resets the eventfd once signaled.
+     */
+    void acknowledge();
+
+    /*
+     * Returns the eventfd to be polled.
+     */
+    int get_event_fd() const;
+
+    size_t get_ring_size() const;
+
+private:
+    /*
+     * Ring header, the positions are in separate cache lines: each one is written by its own end only.
+     */
+    struct RingHeader {
+        alignas(64) std::atomic<uint64_t> head;             // bytes written
+        alignas(64) std::atomic<uint64_t> tail;             // bytes read (the credit returned)
+        alignas(64) std::atomic<uint32_t> reader_waiting;   // the reader asks to be notified of data
+        std::atomic<uint32_t> writer_waiting;               // the writer asks to be notified of credit
+    };
+
+    static constexpr size_t header_size = 4096;             // ring headers page
+
+    size_t ring_size;
+    char* mem;
+    size_t mem_size;
+    int mem_fd;             // kept by the server end untill the peer end is sent
+    int event_fd;           // notifies this end
+    int peer_event_fd;      // notifies the other end
+    int watch_fd = -1;      // unix socket the peer end watches (not owned)
+
+    RingHeader* tx;         // ring written by this end
+    RingHeader* rx;         // ring read by this end
+    char* tx_data;
+    char* rx_data;
+    uint64_t tx_head = 0;   // own positions are kept privately, the shared ones may be broken by the peer
+    uint64_t rx_tail = 0;
+
+    /*
+     * Constructor of the peer end received (see receive).
+     */
+    ShmChannel(char* mem, size_t mem_size, int event_fd, int peer_event_fd);
+
+    /*
+     * sets the ring pointers of the end
+     */
+    void init_rings(bool server_end);
+
+    /*
+     * returns the credit to write, checks the reader position
+     */
+    size_t get_credit() const;
+
+    /*
+     * returns the data size to be read, checks the writer position
+     */
+    size_t get_available() const;
+
+    void notify(int fd);
+};
+
+
+} // namespace net
+
+
+#endif // __SHM_H
@@ -8,6 +8,9 @@
 #include <memory>
 #include <cstring>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
 #include <arpa/inet.h>
 
 
@@ -24,19 +27,82 @@ public:
     { }
 };
 
+
+enum class Family {
+    INET  = AF_INET,
+    INET6 = AF_INET6,
+    UNIX  = AF_UNIX
+};
+
+
+/*
+ * Represents a socket address: an ipv4 or ipv6 address and a port or a unix socket path.
+ */
+class Address {
+public:
+    /*
+     * Constructs an empty address to be filled by accept.
+     */
+    Address():
+        storage(), len(sizeof(storage))
+    { }
+
+    /*
+     * Constructor.
+     * params:
+     *      ip   - ipv4 or ipv6 address ("::" accepts ipv4 connections too, see Socket::bind)
+     *      port - port
+     */
+    Address(const std::string& ip, uint16_t port);
+
+    /*
+     * Returns a unix socket address.
+     */
+    static Address from_path(const std::string& path);
+
+    Family get_family() const;
+
+    const sockaddr* get_sockaddr() const;
+
+    sockaddr* get_sockaddr();
+
+    socklen_t get_length() const;
+
+    socklen_t& get_length();
+
+    /*
+     * Returns the address string representation: ip:port, [ip6]:port or the unix socket path.
+     */
+    std::string str() const;
+
+private:
+    sockaddr_storage storage;
+    socklen_t len;
+};
+
+
 /*
- * Represents an ipv4 tcp socket.
+ * Represents a stream socket: ipv4 or ipv6 tcp or unix.
  * Non-copyable.
  * Not thread-safe.
  */
 class Socket {
 public:
-    Socket();
+    /*
+     * Constructor. Creates a socket of the address family.
+     */
+    explicit Socket(Family family = Family::INET);
 
-    Socket(int fd, sockaddr& addr):
+    Socket(int fd, const Address& addr):
         sockfd(fd), addr(addr)
     { }
 
+    /*
+     * Wraps an already opened socket (passed by another process for example).
+     * The socket address is the bound one.
+     */
+    explicit Socket(int fd);
+
     Socket(Socket&& other);
 
     Socket(const Socket&) = delete;
@@ -45,16 +111,48 @@ public:
 
     void bind(const std::string& ip, uint16_t port);
 
+    /*
+     * Binds the socket. An ipv6 socket is bound dual-stack (accepts ipv4 connections too).
+     */
+    void bind(const Address& addr);
+
     void connect(const std::string& ip, uint16_t port);
 
+    void connect(const Address& addr);
+
+    /*
+     * Starts connecting a non-blocking socket. The socket becomes writable
+     * once the connection is completed or has failed (see get_error).
+     * returns true if the socket is connected at once
+     */
+    bool connect_nonblocking(const Address& addr);
+
+    /*
+     * Returns the pending socket error (SO_ERROR), 0 if none.
+     */
+    int get_error();
+
     void listen(int backlog = 64);
 
-    std::unique_ptr<Socket> accept();
+    /*
+     * Accepts a connection. The accepted socket is close-on-exec.
+     * params:
+     *      nonblocking - makes the accepted socket non-blocking
+     * returns accepted socket or null pointer if the socket is non-blocking
+     * and there are no pending connections
+     */
+    std::unique_ptr<Socket> accept(bool nonblocking = false);
 
     void set_nonblocking();
 
     void set_reuse();
 
+    /*
+     * Allows several sockets to be bound to the same address,
+     * the kernel distributes the incoming connections among them.
+     */
+    void set_reuse_port();
+
     void close();
 
     /*
@@ -73,6 +171,24 @@ public:
      */
     ssize_t send(const std::vector<char>& buf, size_t offset = 0);
 
+    /*
+     * Sends data.
+     * params:
+     *      data - data to be sent
+     *      size - data size
+     * returns a data size actually sent (0 if the socket is non-blocking and not ready)
+     */
+    ssize_t send(const char* data, size_t size);
+
+    /*
+     * Sends the data of several buffers with a single system call (see man writev).
+     * params:
+     *      iov   - buffers to be sent
+     *      count - number of the buffers (IOV_MAX at most)
+     * returns a data size actually sent (0 if the socket is non-blocking and not ready)
+     */
+    ssize_t send(const struct iovec* iov, size_t count);
+
     /*
      * Receives data of required size from the socket. Blocks untill all the data are received.
      * params:
@@ -91,14 +207,26 @@ public:
      */
     ssize_t recv(std::vector<char>& buf, size_t max = -1);
 
+    /*
+     * Receives data from the socket.
+     * params:
+     *      data - buffer to save the received data to
+     *      size - buffer size
+     * returns actually received data size (0 if the socket is non-blocking and no data available)
+     */
+    ssize_t recv(char* data, size_t size);
+
     int get_sockfd() const;
 
+    /*
+     * Returns the bound address (listening socket) or the peer address (accepted socket).
+     */
+    const Address& get_address() const;
+
 private:
     int sockfd = -1;
-    sockaddr addr;
+    Address addr;
     size_t buf_size = 512;
-
-    void fill_sockaddr(sockaddr* addr, const std::string& ip, uint16_t port);
 };
 
 
@@ -0,0 +1,59 @@
+#ifndef __TEXT_H
+#define __TEXT_H
+
+
+#include <string>
+#include <cstddef>
+
+
+namespace text {
+
+
+/*
+ * Returns true if the data is valid UTF-8: no overlong encodings, surrogates,
+ * code points above U+10FFFF or truncated sequences.
+ * Uses AVX2 or SSSE3 if the cpu supports them (checked once), scalar code otherwise.
+ * params:
+ *      data - data to be checked
+ *      size - data size
+ */
+bool is_valid_utf8(const char* data, size_t size);
+
+/*
+ * Returns true if the valid UTF-8 data contains terminal control characters:
+ * C0 controls but tab and newline, DEL and C1 controls (U+0080 - U+009F).
+ * Vectorised the same way as is_valid_utf8.
+ */
+bool has_controls(const char* data, size_t size);
+
+/*
+ * Removes the terminal control characters (see has_controls) from the valid UTF-8 string.
+ * An escape sequence (ESC [ ... final byte, ESC ] ... BEL or ESC \, ESC and a character)
+ * is removed entirely, so the text can't move the cursor, change colors or the window title
+ * of a terminal showing it.
+ */
+void strip_controls(std::string& str);
+
+/*
+ * Validates the string and strips the terminal control characters from it.
+ * returns false if the string is not valid UTF-8 (the string is not changed then)
+ */
+bool sanitize(std::string& str);
+
+/*
+ * Returns the name of the instruction set used by is_valid_utf8 and has_controls: avx2, ssse3 or scalar.
+ */
+const char* get_isa();
+
+/*
+ * Makes is_valid_utf8 and has_controls use the instruction set (avx2, ssse3 or scalar),
+ * so the tests can check every implementation against the scalar one. Not thread-safe.
+ * returns false if the cpu doesn't support it
+ */
+bool set_isa(const std::string& isa);
+
+
+} // namespace text
+
+
+#endif // __TEXT_H
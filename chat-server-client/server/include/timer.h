@@ -0,0 +1,69 @@
+#ifndef __TIMER_H
+#define __TIMER_H
+
+
+#include <stdexcept>
+#include <string>
+#include <chrono>
+
+
+namespace io {
+
+
+/*
+ * Represents Timer exception.
+ */
+class TimerException: public std::runtime_error {
+public:
+    TimerException(const std::string& what_arg):
+        std::runtime_error(what_arg)
+    { }
+};
+
+
+/*
+ * Represents a timer file descriptor (see man timerfd_create) to be polled by Epoll.
+ * The descriptor becomes readable when the timer expires.
+ * Non-copyable.
+ * Not thread-safe.
+ */
+class Timer {
+public:
+    Timer();
+
+   ~Timer();
+
+    Timer(const Timer&) = delete;
+
+    Timer& operator=(const Timer&) = delete;
+
+    /*
+     * Arms the timer.
+     * params:
+     *      timeout  - time untill the timer expires
+     *      periodic - rearm the timer with the same timeout after every expiration
+     */
+    void start(std::chrono::microseconds timeout, bool periodic = false);
+
+    /*
+     * Disarms the timer.
+     */
+    void stop();
+
+    /*
+     * Resets the timer readability.
+     * returns the number of expirations since the last call
+     */
+    uint64_t acknowledge();
+
+    int get_fd() const;
+
+private:
+    int timerfd;
+};
+
+
+} // namespace io
+
+
+#endif // __TIMER_H
@@ -0,0 +1,184 @@
+#ifndef __TLS_H
+#define __TLS_H
+
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <openssl/ssl.h>
+#include <socket.h>
+#include <epoll.h>
+#include <timer.h>
+#include <affinity.h>
+
+
+namespace net {
+
+
+/*
+ * Represents TLS exception.
+ */
+class TlsException: public std::runtime_error {
+public:
+    TlsException(const std::string& what_arg):
+        std::runtime_error(what_arg)
+    { }
+};
+
+
+/*
+ * Represents a server TLS context: the certificate chain and the private key (PEM files).
+ * TLS 1.2 and 1.3 with AES-GCM ciphers only, so the keys can be installed into the kernel (kTLS).
+ * Non-copyable.
+ */
+class TlsContext {
+public:
+    /*
+     * Constructor.
+     * params:
+     *      cert_path - certificate chain file path
+     *      key_path  - private key file path
+     */
+    TlsContext(const std::string& cert_path, const std::string& key_path);
+
+   ~TlsContext();
+
+    TlsContext(const TlsContext&) = delete;
+
+    TlsContext& operator=(const TlsContext&) = delete;
+
+    SSL_CTX* get_native() const;
+
+private:
+    SSL_CTX* ctx;
+};
+
+
+/*
+ * Represents a TLS terminator: runs the handshakes of the accepted connections in its own thread,
+ * so the public key operations don't stall the reactor, and passes the connections on as plain sockets.
+ *
+ * Once a handshake is completed the negotiated keys are installed into the kernel (kTLS), the socket
+ * is passed on as is: send and recv on it are plain system calls, the kernel encrypts and decrypts
+ * the records. If the kernel can't take the keys (no tls module, unsupported cipher) the terminator
+ * relays the connection through a socket pair, encrypting and decrypting in its thread, and passes
+ * the other end of the pair on. A connection not completing the handshake in time is closed.
+ * Non-copyable.
+ * Not thread-safe, but add may be called from any thread.
+ */
+class TlsTerminator {
+public:
+    typedef std::function<void(std::unique_ptr<Socket>, bool)> ConnectHandler;   // socket, relayed
+
+    const size_t relay_buf_size = 16 << 10;                                 // a TLS record at most
+    const std::chrono::milliseconds expire_interval = std::chrono::milliseconds(100);
+
+    /*
+     * Constructor.
+     * params:
+     *      ctx_ptr           - TLS context
+     *      on_connect        - called in the terminator thread with every connection passed on
+     *                          and whether it is relayed (the socket pair end)
+     *      handshake_timeout - time a connection has to complete the handshake in
+     *      max_sessions      - epoll max file descriptors
+     */
+    TlsTerminator(std::shared_ptr<TlsContext> ctx_ptr, ConnectHandler on_connect,
+                  std::chrono::milliseconds handshake_timeout, size_t max_sessions = 128);
+
+    /*
+     * Stops the thread, closes the connections being handshaked or relayed.
+     */
+   ~TlsTerminator();
+
+    TlsTerminator(const TlsTerminator&) = delete;
+
+    TlsTerminator& operator=(const TlsTerminator&) = delete;
+
+    /*
+     * Starts the terminator thread.
+     * params:
+     *      cpus - cpus the thread is pinned to (empty - not pinned)
+     */
+    void start(const concurrent::CpuList& cpus = concurrent::CpuList());
+
+    /*
+     * Stops the terminator thread.
+     */
+    void stop();
+
+    /*
+     * Starts the handshake of an accepted non-blocking socket. Can be called from any thread.
+     */
+    void add(std::unique_ptr<Socket> sock_ptr);
+
+private:
+    struct Session {
+        std::unique_ptr<Socket> sock;           // TLS connection
+        SSL* ssl = nullptr;
+        std::chrono::steady_clock::time_point deadline;     // handshake deadline
+        bool handshaking = true;
+
+        std::unique_ptr<Socket> pair;           // relay end of the socket pair (relayed connection only)
+        std::vector<char> to_pair;              // decrypted data not written to the pair yet
+        std::vector<char> to_peer;              // data not accepted by SSL_write yet
+
+       ~Session();
+    };
+
+    std::shared_ptr<TlsContext> ctx_ptr;
+    ConnectHandler on_connect;
+    std::chrono::milliseconds handshake_timeout;
+
+    io::Epoll epoll;
+    io::Timer expire_timer;
+    std::thread thread;
+    std::unordered_map<int, std::unique_ptr<Session>> sessions;    // by the TLS connection socket
+    std::vector<char> relay_buf;
+
+    void run(const concurrent::CpuList& cpus);
+
+    void on_add(Socket* sock_ptr);
+
+    void on_peer_event(int events, void* data);
+
+    void on_pair_event(int events, void* data);
+
+    void on_expire_timer(int events, void* data);
+
+    /*
+     * continues the handshake, passes the connection on once it is completed
+     */
+    void handshake(Session* session_ptr);
+
+    /*
+     * passes the socket on as is if the kernel has taken the keys, starts relaying otherwise
+     */
+    void complete(Session* session_ptr);
+
+    /*
+     * moves the data between the TLS connection and the pair untill either would block,
+     * returns false if the session is closed
+     */
+    bool relay_from_peer(Session* session_ptr);
+
+    bool relay_to_peer(Session* session_ptr);
+
+    /*
+     * updates the events the session sockets are polled for
+     */
+    void update_events(Session* session_ptr);
+
+    void close_session(Session* session_ptr);
+};
+
+
+} // namespace net
+
+
+#endif // __TLS_H
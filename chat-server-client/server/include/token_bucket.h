@@ -0,0 +1,60 @@
+#ifndef __TOKEN_BUCKET_H
+#define __TOKEN_BUCKET_H
+
+
+#include <chrono>
+#include <cstddef>
+
+
+namespace chat {
+
+
+/*
+ * Represents a token bucket rate limiter. The bucket is refilled with rate tokens
+ * per second up to burst tokens. Consuming more tokens than available puts the bucket
+ * into debt, so a client sending a batch waits proportionally longer.
+ * A bucket with zero rate is unlimited.
+ * Not thread-safe.
+ */
+class TokenBucket {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    /*
+     * Constructor.
+     * params:
+     *      rate  - tokens per second
+     *      burst - bucket capacity
+     */
+    TokenBucket(double rate = 0, double burst = 0);
+
+    /*
+     * Refills the bucket and returns true if it contains at least one token.
+     */
+    bool available();
+
+    /*
+     * Refills the bucket and returns the number of whole tokens available.
+     * Returns SIZE_MAX for an unlimited bucket.
+     */
+    size_t allowance();
+
+    /*
+     * Takes n tokens from the bucket.
+     */
+    void consume(double n = 1);
+
+private:
+    double rate;
+    double burst;
+    double tokens;
+    Clock::time_point last_refill;
+
+    void refill();
+};
+
+
+} // namespace chat
+
+
+#endif // __TOKEN_BUCKET_H
@@ -0,0 +1,107 @@
+#ifndef __WEBSOCKET_H
+#define __WEBSOCKET_H
+
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+
+/*
+ *   //                    WebSocket transport (RFC 6455):                     //
+ *   //========================================================================//
+ *   //                                                                        //
+ *   //  A browser connects to the same port as the native clients and starts  //
+ *   //  with an HTTP upgrade request instead of a hello. After the 101        //
+ *   //  response the WebSocket messages replace the framing of the protocol:  //
+ *   //                                                                        //
+ *   //  the first message is the handshake payload: a nick (v1) or a hello;   //
+ *   //  v1: a text message is a v1 message, the server sends text messages;   //
+ *   //  v2: a binary message is a v2 frame body (opcode, varint request id,   //
+ *   //      payload - no size prefix), the hello reply is a binary message.   //
+ *   //                                                                        //
+ *   //  Extensions (permessage-deflate) are not negotiated, the hello         //
+ *   //  compression flag is ignored.                                          //
+ *   //                                                                        //
+ *   //========================================================================//
+ */
+
+
+namespace protocol {
+
+
+enum class WsOpcode: uint8_t {
+    CONTINUATION = 0x0,
+    TEXT         = 0x1,
+    BINARY       = 0x2,
+    CLOSE        = 0x8,
+    PING         = 0x9,
+    PONG         = 0xa
+};
+
+/*
+ * Represents a WebSocket frame received from a client.
+ */
+struct WsFrame {
+    WsOpcode op = WsOpcode::TEXT;
+    bool fin = true;                    // the last frame of a message
+    std::string payload;                // unmasked payload
+};
+
+const size_t ws_request_max_size = 8192;    // maximum upgrade request size
+
+
+/*
+ * Returns true if the data is (or may be, if it is too short to tell) the start of an HTTP GET request.
+ */
+bool is_http_request(const char* data, size_t size);
+
+/*
+ * Parses a WebSocket upgrade request from the beginning of the data.
+ * Throws ProtocolException if the request is not a valid upgrade request.
+ * params:
+ *      data - received data
+ *      size - data size
+ *      key  - Sec-WebSocket-Key of the request
+ * returns the request size or 0 if the data doesn't contain an entire request
+ */
+size_t parse_upgrade(const char* data, size_t size, std::string& key);
+
+/*
+ * Returns the 101 response accepting the upgrade request with the key.
+ */
+std::string make_upgrade_response(const std::string& key);
+
+/*
+ * Returns the 400 response rejecting a request.
+ */
+std::string make_upgrade_error();
+
+/*
+ * Decodes a client (masked) WebSocket frame from the beginning of the data.
+ * params:
+ *      data     - received data
+ *      size     - data size
+ *      frame    - decoded frame
+ *      max_size - maximum payload size to be accepted
+ * returns the frame size or 0 if the data doesn't contain an entire frame
+ */
+size_t decode_ws(const char* data, size_t size, WsFrame& frame, size_t max_size);
+
+/*
+ * Appends a server (unmasked) WebSocket frame, a message of a single frame, to the buffer buf.
+ */
+void encode_ws(WsOpcode op, const char* data, size_t size, std::vector<char>& buf);
+
+/*
+ * Unmasks (or masks) the data: XORs it with the 4-byte key repeated.
+ * Uses AVX2 or SSE2 if the cpu supports them (checked once), scalar code otherwise.
+ */
+void unmask(char* data, size_t size, const uint8_t key[4]);
+
+
+} // namespace protocol
+
+
+#endif // __WEBSOCKET_H
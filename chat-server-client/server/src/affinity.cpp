@@ -0,0 +1,149 @@
+#include <affinity.h>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+
+
+namespace concurrent {
+
+
+namespace {
+
+const char* irq_dir = "/proc/irq";
+
+
+/*
+ * The cpus the process has been started on, taken before any thread is pinned.
+ */
+struct ProcessCpus {
+    cpu_set_t set;
+    bool known;
+
+    ProcessCpus()
+    {
+        known = sched_getaffinity(0, sizeof(set), &set) == 0;
+    }
+};
+
+const ProcessCpus process_cpus;
+
+int parse_cpu(const std::string& str)
+{
+    size_t pos;
+    int cpu;
+
+    try {
+        cpu = std::stoi(str, &pos);
+    }
+    catch (std::logic_error&) {
+        throw AffinityException("affinity error: incorrect cpu list");
+    }
+    if (pos != str.size() || cpu < 0 || cpu >= CPU_SETSIZE) {
+        throw AffinityException("affinity error: incorrect cpu list");
+    }
+
+    return cpu;
+}
+
+} // namespace
+
+
+CpuList parse_cpu_list(const std::string& str)
+{
+    cpu_set_t available;
+    if (sched_getaffinity(0, sizeof(available), &available) != 0) {
+        throw AffinityException(std::string("sched_getaffinity error: ") + std::strerror(errno));
+    }
+
+    CpuList cpus;
+    std::stringstream in(str);
+    std::string range;
+
+    while (std::getline(in, range, ',')) {
+        size_t dash = range.find('-');
+        int first = parse_cpu(range.substr(0, dash));
+        int last = dash == std::string::npos ? first : parse_cpu(range.substr(dash + 1));
+
+        for (int cpu = first; cpu <= last; cpu++) {
+            if (!CPU_ISSET(cpu, &available)) {
+                throw AffinityException("affinity error: cpu " + std::to_string(cpu) + " is not available");
+            }
+            cpus.push_back(cpu);
+        }
+    }
+
+    if (cpus.empty()) {
+        throw AffinityException("affinity error: empty cpu list");
+    }
+
+    return cpus;
+}
+
+std::string format_cpu_list(const CpuList& cpus)
+{
+    std::string str;
+
+    for (int cpu: cpus) {
+        str += (str.empty() ? "" : ",") + std::to_string(cpu);
+    }
+
+    return str;
+}
+
+void set_thread_affinity(const CpuList& cpus)
+{
+    // a new thread inherits the mask of the thread created it, which may have been pinned
+    if (cpus.empty() && !process_cpus.known) {
+        return;
+    }
+
+    cpu_set_t set = process_cpus.set;
+    if (!cpus.empty()) {
+        CPU_ZERO(&set);
+        for (int cpu: cpus) {
+            CPU_SET(cpu, &set);
+        }
+    }
+
+    int res = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (res != 0) {
+        throw AffinityException(std::string("pthread_setaffinity_np error: ") + std::strerror(res));
+    }
+}
+
+size_t set_irq_affinity(const CpuList& cpus)
+{
+    DIR* dir = opendir(irq_dir);
+    if (dir == NULL) {
+        throw AffinityException(std::string("opendir error: ") + std::strerror(errno));
+    }
+
+    std::string cpu_list = format_cpu_list(cpus);
+    size_t moved = 0;
+
+    while (dirent* entry = readdir(dir)) {
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9') {
+            continue;   // not an interrupt directory
+        }
+
+        // some interrupts (timers, per cpu ones) can't be moved, the write fails for them
+        std::ofstream out(std::string(irq_dir) + "/" + entry->d_name + "/smp_affinity_list");
+        out << cpu_list << std::flush;
+        if (out.good()) {
+            moved++;
+        }
+    }
+    closedir(dir);
+
+    return moved;
+}
+
+
+} // namespace concurrent
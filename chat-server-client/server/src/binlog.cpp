@@ -0,0 +1,436 @@
+#include <binlog.h>
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <istream>
+#include <ostream>
+#include <iomanip>
+#include <algorithm>
+#include <ctime>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <boost/format.hpp>
+#include <logger.h>
+#include <affinity.h>
+
+
+namespace logging {
+
+
+namespace {
+
+/*
+ * thrown by the decoder at the end of a truncated log
+ */
+struct Truncated { };
+
+uint64_t read_varint(std::istream& in)
+{
+    uint64_t value = 0;
+    for (size_t shift = 0; shift < 64; shift += 7) {
+        int byte = in.get();
+        if (byte == std::char_traits<char>::eof()) {
+            throw Truncated();
+        }
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    throw BinaryLogException("binary log error: malformed varint");
+}
+
+std::string read_string(std::istream& in)
+{
+    std::string str(read_varint(in), '\0');
+    if (!in.read(&str[0], str.size())) {
+        throw Truncated();
+    }
+    return str;
+}
+
+uint64_t get_varint(const std::string& buf, size_t& pos)
+{
+    uint64_t value = 0;
+    for (size_t shift = 0; shift < 64 && pos < buf.size(); shift += 7) {
+        uint8_t byte = buf[pos++];
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    throw BinaryLogException("binary log error: malformed record");
+}
+
+std::string get_string(const std::string& buf, size_t& pos)
+{
+    size_t size = get_varint(buf, pos);
+    if (size > buf.size() - pos) {
+        throw BinaryLogException("binary log error: malformed record");
+    }
+    pos += size;
+    return buf.substr(pos - size, size);
+}
+
+void write_all(int fd, const std::vector<char>& data)
+{
+    size_t written = 0;
+    while (written != data.size()) {
+        ssize_t res = ::write(fd, data.data() + written, data.size() - written);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res < 0) {
+            return;     // nowhere to report: the log itself is failing
+        }
+        written += res;
+    }
+}
+
+Format affinity_warning(Loglevel::WARNING, "%1%");
+
+} // namespace
+
+
+BinaryLog* BinaryLog::get_instance()
+{
+    return &binlog;
+}
+
+void BinaryLog::open(const std::string& path, const concurrent::CpuList& cpus)
+{
+    if (write_thread.joinable()) {
+        throw BinaryLogException("binary log error: the log is already open");
+    }
+
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw BinaryLogException("binary log error: failed to open " + path + ": " + std::strerror(errno));
+    }
+    write_all(fd, std::vector<char>(magic, magic + sizeof(magic) - 1));
+
+    {
+        std::lock_guard<std::mutex> lk(mx);
+        buffers.clear();
+        formats_written = 0;
+        stop_flag = false;
+    }
+
+    session++;
+    open_flag = true;
+    write_thread = std::thread(&BinaryLog::write_handler, this, cpus);
+}
+
+void BinaryLog::close()
+{
+    if (!write_thread.joinable()) {
+        return;
+    }
+
+    open_flag = false;
+    {
+        std::lock_guard<std::mutex> lk(mx);
+        stop_flag = true;
+    }
+    stop_cv.notify_one();
+    write_thread.join();
+
+    ::close(fd);
+    fd = -1;
+}
+
+bool BinaryLog::is_open() const
+{
+    return open_flag.load(std::memory_order_relaxed);
+}
+
+uint32_t BinaryLog::get_format_id(Format& format, const char* signature)
+{
+    std::lock_guard<std::mutex> lk(mx);
+
+    // another thread may have registered the format meanwhile
+    uint32_t id = format.id.load(std::memory_order_relaxed);
+    if (id != 0) {
+        return id;
+    }
+
+    std::vector<char> entry;
+    entry.push_back('F');
+    put_varint(entry, formats.size() + 1);
+    entry.push_back(static_cast<char>(format.level));
+    put_arg(entry, format.fmt);
+    put_arg(entry, signature);
+
+    // the formats are kept for the next sessions: the ids are assigned once
+    formats.emplace_back(entry.begin(), entry.end());
+    id = formats.size();
+    format.id.store(id, std::memory_order_release);
+
+    return id;
+}
+
+BinaryLog::ThreadBuffer* BinaryLog::get_thread_buffer()
+{
+    static thread_local std::shared_ptr<ThreadBuffer> buf_ptr;
+    static thread_local uint64_t buf_session = 0;
+
+    uint64_t current = session.load(std::memory_order_acquire);
+    if (!buf_ptr || buf_session != current) {
+        auto new_buf_ptr = std::make_shared<ThreadBuffer>();
+        new_buf_ptr->ring.resize(ring_size);
+
+        std::lock_guard<std::mutex> lk(mx);
+        new_buf_ptr->index = buffers.size();
+        buffers.push_back(new_buf_ptr);
+
+        buf_ptr = new_buf_ptr;
+        buf_session = current;
+    }
+
+    return buf_ptr.get();
+}
+
+bool BinaryLog::commit(ThreadBuffer* buf_ptr, const std::vector<char>& rec)
+{
+    uint64_t head = buf_ptr->head.load(std::memory_order_relaxed);
+    uint64_t tail = buf_ptr->tail.load(std::memory_order_acquire);
+
+    if (head - tail + rec.size() > ring_size) {
+        buf_ptr->dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    size_t pos = head % ring_size;
+    size_t first = std::min(rec.size(), ring_size - pos);
+    std::memcpy(buf_ptr->ring.data() + pos, rec.data(), first);
+    std::memcpy(buf_ptr->ring.data(), rec.data() + first, rec.size() - first);
+
+    buf_ptr->head.store(head + rec.size(), std::memory_order_release);
+
+    return true;
+}
+
+void BinaryLog::write_handler(const concurrent::CpuList& cpus)
+{
+    try {
+        concurrent::set_thread_affinity(cpus);
+    }
+    catch (concurrent::AffinityException& e) {
+        record(affinity_warning, std::string(e.what()));
+    }
+
+    std::unique_lock<std::mutex> lk(mx);
+    while (true) {
+        bool stop = stop_cv.wait_for(lk, flush_interval, [this] { return stop_flag; });
+        lk.unlock();
+        write_records();
+        if (stop) {
+            break;
+        }
+        lk.lock();
+    }
+}
+
+void BinaryLog::write_records()
+{
+    std::vector<std::shared_ptr<ThreadBuffer>> snapshot;
+    std::vector<char> out;
+
+    {
+        std::lock_guard<std::mutex> lk(mx);
+        snapshot = buffers;
+    }
+
+    // the heads are read before the formats: a record is committed after its format is registered
+    std::vector<uint64_t> heads;
+    for (const auto& buf_ptr: snapshot) {
+        heads.push_back(buf_ptr->head.load(std::memory_order_acquire));
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(mx);
+        for (; formats_written < formats.size(); formats_written++) {
+            out.insert(out.end(), formats[formats_written].begin(), formats[formats_written].end());
+        }
+    }
+
+    for (size_t n = 0; n < snapshot.size(); n++) {
+        ThreadBuffer& buf = *snapshot[n];
+        uint64_t tail = buf.tail.load(std::memory_order_relaxed);
+
+        if (heads[n] != tail) {
+            size_t size = heads[n] - tail;
+            size_t pos = tail % ring_size;
+            size_t first = std::min(size, ring_size - pos);
+
+            out.push_back('C');
+            put_varint(out, buf.index);
+            put_varint(out, size);
+            out.insert(out.end(), buf.ring.cbegin() + pos, buf.ring.cbegin() + pos + first);
+            out.insert(out.end(), buf.ring.cbegin(), buf.ring.cbegin() + (size - first));
+
+            buf.tail.store(heads[n], std::memory_order_release);
+        }
+
+        uint64_t dropped = buf.dropped.exchange(0, std::memory_order_relaxed);
+        if (dropped != 0) {
+            out.push_back('D');
+            put_varint(out, buf.index);
+            put_varint(out, dropped);
+        }
+    }
+
+    write_all(fd, out);
+}
+
+void BinaryLog::put_varint(std::vector<char>& buf, uint64_t value)
+{
+    while (value >= 0x80) {
+        buf.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    buf.push_back(static_cast<char>(value));
+}
+
+BinaryLog BinaryLog::binlog;
+
+
+size_t BinaryLogDecoder::decode(std::istream& in, std::ostream& out)
+{
+    char header[sizeof(BinaryLog::magic) - 1];
+    if (!in.read(header, sizeof(header)) || std::memcmp(header, BinaryLog::magic, sizeof(header)) != 0) {
+        throw BinaryLogException("binary log error: not a binary log");
+    }
+
+    size_t count = 0;
+
+    try {
+        while (true) {
+            int type = in.get();
+            if (type == std::char_traits<char>::eof()) {
+                break;
+            }
+
+            switch (type) {
+            case 'F': {
+                uint64_t id = read_varint(in);
+                int level = in.get();
+                if (level == std::char_traits<char>::eof()) {
+                    throw Truncated();
+                }
+                Definition def{static_cast<Loglevel>(level), read_string(in), read_string(in)};
+                if (id == 0) {
+                    throw BinaryLogException("binary log error: malformed format definition");
+                }
+                if (formats.size() < id) {
+                    formats.resize(id);
+                }
+                formats[id - 1] = def;
+                break;
+            }
+            case 'C': {
+                uint64_t thread = read_varint(in);
+                std::string records = read_string(in);
+                decode_records(thread, records, out, count);
+                break;
+            }
+            case 'D': {
+                uint64_t thread = read_varint(in);
+                uint64_t dropped = read_varint(in);
+                if (max_level >= Loglevel::WARNING) {
+                    out << std::left << std::setw(10) << "[" + loglevel_str.at(Loglevel::WARNING) + "]"
+                        << str(boost::format("%1% messages of thread %2% dropped: log buffer full") % dropped % thread)
+                        << "\n";
+                }
+                break;
+            }
+            default:
+                throw BinaryLogException("binary log error: unknown entry");
+            }
+        }
+    }
+    catch (Truncated&) {
+        // the writer was stopped in the middle of an entry
+    }
+
+    return count;
+}
+
+void BinaryLogDecoder::decode_records(uint32_t thread, const std::string& records, std::ostream& out, size_t& count)
+{
+    if (last_times.size() <= thread) {
+        last_times.resize(thread + 1, 0);
+    }
+
+    size_t pos = 0;
+    while (pos < records.size()) {
+        uint64_t id = get_varint(records, pos);
+        if (id == 0 || id > formats.size() || formats[id - 1].fmt.empty()) {
+            throw BinaryLogException("binary log error: record of an unknown format");
+        }
+        const Definition& def = formats[id - 1];
+
+        last_times[thread] += get_varint(records, pos);
+
+        boost::format text(def.fmt);
+        text.exceptions(boost::io::all_error_bits ^ (boost::io::too_many_args_bit | boost::io::too_few_args_bit));
+
+        for (char type: def.signature) {
+            switch (type) {
+            case 'i': {
+                uint64_t v = get_varint(records, pos);
+                text % static_cast<int64_t>((v >> 1) ^ -(v & 1));
+                break;
+            }
+            case 'u':
+                text % get_varint(records, pos);
+                break;
+            case 'd': {
+                double d;
+                if (records.size() - pos < sizeof(double)) {
+                    throw BinaryLogException("binary log error: malformed record");
+                }
+                std::memcpy(&d, records.data() + pos, sizeof(double));
+                pos += sizeof(double);
+                text % d;
+                break;
+            }
+            case 's':
+                text % get_string(records, pos);
+                break;
+            default:
+                throw BinaryLogException("binary log error: unknown argument type");
+            }
+        }
+
+        if (def.level > max_level) {
+            continue;
+        }
+
+        auto level_it = loglevel_str.find(def.level);
+        std::string level = level_it != loglevel_str.end() ? level_it->second : "?";
+
+        std::time_t seconds = last_times[thread] / 1000000000;
+        uint64_t micros = last_times[thread] % 1000000000 / 1000;
+
+        out << std::left
+            << std::setw(10)
+            << "[" + level + "]"
+            << std::put_time(std::localtime(&seconds), "%D %T.")
+            << std::setw(6) << std::setfill('0') << std::right << micros << std::setfill(' ')
+            << " "
+            << text.str()
+            << "\n";
+        count++;
+    }
+}
+
+
+} // namespace logging
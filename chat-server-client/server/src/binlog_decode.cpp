@@ -0,0 +1,80 @@
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <map>
+#include <boost/program_options.hpp>
+#include <boost/format.hpp>
+
+#include <logger.h>
+#include <binlog.h>
+
+
+using namespace logging;
+namespace popt = boost::program_options;
+
+
+/*
+ * Converts a binary log written by ChatServer (see --binlog) to text.
+ */
+int main(int argc, char** argv)
+{
+    const std::map<std::string, Loglevel> levels = {
+        {"error",   Loglevel::ERROR},
+        {"warning", Loglevel::WARNING},
+        {"info",    Loglevel::INFO},
+        {"debug",   Loglevel::DEBUG}
+    };
+
+    popt::options_description options("Options");
+    options.add_options()
+            ("help,h", "show help")
+            ("file,f", popt::value<std::string>()->required(), "binary log file")
+            ("level,l", popt::value<std::string>()->default_value("debug"), "maximum loglevel to be shown: error, warning, info or debug");
+
+    popt::positional_options_description positional;
+    positional.add("file", 1);
+
+    popt::variables_map vm;
+    std::string path;
+    Loglevel level;
+
+    try {
+        popt::store(popt::command_line_parser(argc, argv).options(options).positional(positional).run(), vm);
+
+        if (vm.count("help")) {
+            std::cout << boost::format("Usage: %1% FILE") % argv[0] << std::endl;
+            std::cout << options << std::endl;
+            return 0;
+        }
+
+        popt::notify(vm);
+        path = vm["file"].as<std::string>();
+
+        auto it = levels.find(vm["level"].as<std::string>());
+        if (it == levels.end()) {
+            throw popt::error("unknown loglevel " + vm["level"].as<std::string>());
+        }
+        level = it->second;
+    }
+    catch (popt::error& e) {
+        std::cout << e.what() << std::endl;
+        return 1;
+    }
+
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        std::cerr << "failed to open " << path << std::endl;
+        return 1;
+    }
+
+    try {
+        BinaryLogDecoder decoder(level);
+        decoder.decode(in, std::cout);
+    }
+    catch (BinaryLogException& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,48 @@
+#include <buffer_pool.h>
+
+#include <vector>
+#include <cstddef>
+
+
+namespace chat {
+
+
+namespace {
+
+thread_local std::vector<std::vector<char>> free_buffers;
+
+} // namespace
+
+
+void BufferPool::acquire(std::vector<char>& buf)
+{
+    if (buf.capacity() != 0) {
+        return;
+    }
+
+    if (free_buffers.empty()) {
+        buf.reserve(initial_capacity);
+        return;
+    }
+
+    buf.swap(free_buffers.back());
+    free_buffers.pop_back();
+}
+
+void BufferPool::release(std::vector<char>& buf)
+{
+    if (!buf.empty() || buf.capacity() == 0) {
+        return;
+    }
+
+    if (buf.capacity() > max_capacity || free_buffers.size() >= max_buffers) {
+        std::vector<char>().swap(buf);
+        return;
+    }
+
+    free_buffers.emplace_back();
+    free_buffers.back().swap(buf);
+}
+
+
+} // namespace chat
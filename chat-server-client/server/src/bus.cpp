@@ -0,0 +1,244 @@
+#include <bus.h>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <new>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <protocol.h>
+
+
+namespace chat {
+
+
+namespace {
+
+const size_t size_header = 4;           // record size
+
+
+std::string error_str(const std::string& what)
+{
+    return "bus error: " + what + ": " + std::strerror(errno);
+}
+
+} // namespace
+
+
+Bus::Bus(size_t workers, size_t ring_size):
+    workers(workers), ring_size(ring_size), cursors(workers, 0)
+{
+    if (workers == 0 || ring_size < 2 * size_header) {
+        throw BusException("bus error: invalid size");
+    }
+    this->ring_size = (ring_size + 63) & ~static_cast<size_t>(63);     // keeps the ring headers cache line aligned
+
+    mem_size = workers * (sizeof(RingHeader) + this->ring_size);
+
+    // the mapping and eventfds are inherited by the forked workers, nothing is executed so they are close-on-exec
+    mem_fd = memfd_create("chat-bus", MFD_CLOEXEC);
+    if (mem_fd < 0) {
+        throw BusException(error_str("memfd_create error"));
+    }
+    if (ftruncate(mem_fd, mem_size) < 0) {
+        close(mem_fd);
+        throw BusException(error_str("ftruncate error"));
+    }
+
+    void* ptr = mmap(NULL, mem_size, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+    if (ptr == MAP_FAILED) {
+        close(mem_fd);
+        throw BusException(error_str("mmap error"));
+    }
+    mem = static_cast<char*>(ptr);
+
+    for (size_t ring = 0; ring < workers; ring++) {
+        new (header(ring)) RingHeader();
+    }
+
+    for (size_t n = 0; n < workers; n++) {
+        int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd < 0) {
+            std::string what = error_str("eventfd error");
+            for (int event_fd: event_fds) {
+                close(event_fd);
+            }
+            munmap(mem, mem_size);
+            close(mem_fd);
+            throw BusException(what);
+        }
+        event_fds.push_back(fd);
+    }
+}
+
+Bus::~Bus()
+{
+    for (int fd: event_fds) {
+        close(fd);
+    }
+    munmap(mem, mem_size);
+    close(mem_fd);
+}
+
+void Bus::attach(size_t worker)
+{
+    if (worker >= workers) {
+        throw BusException("bus error: invalid worker");
+    }
+    this->worker = worker;
+
+    // the records published before the worker has attached are skipped
+    for (size_t ring = 0; ring < workers; ring++) {
+        cursors[ring] = header(ring)->head.load(std::memory_order_acquire);
+    }
+}
+
+size_t Bus::get_worker() const
+{
+    return worker;
+}
+
+int Bus::get_eventfd() const
+{
+    return event_fds[worker];
+}
+
+void Bus::publish(Event event, const std::string& nick, const std::string& payload)
+{
+    std::vector<char> record(size_header);
+    record.push_back(static_cast<char>(event));
+    protocol::put_varint(record, nick.size());
+    record.insert(record.end(), nick.cbegin(), nick.cend());
+    record.insert(record.end(), payload.cbegin(), payload.cend());
+
+    if (record.size() > ring_size) {
+        throw BusException("bus error: record too large");
+    }
+    uint32_t size = record.size() - size_header;
+    std::memcpy(record.data(), &size, size_header);
+
+    // seqlock-like publication: a reader that has copied a record checks it has not been reserved for rewriting
+    RingHeader* hdr = header(worker);
+    uint64_t head = hdr->head.load(std::memory_order_relaxed);
+
+    hdr->reserved.store(head + record.size(), std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    copy_in(worker, head, record.data(), record.size());
+    hdr->head.store(head + record.size(), std::memory_order_release);
+
+    uint64_t value = 1;
+    for (size_t n = 0; n < workers; n++) {
+        if (n != worker) {
+            // the counter can't overflow in practice, an error means the worker is gone
+            ssize_t len = write(event_fds[n], &value, sizeof(value));
+            (void)len;
+        }
+    }
+}
+
+size_t Bus::consume(std::vector<Record>& records)
+{
+    uint64_t value;
+    while (read(event_fds[worker], &value, sizeof(value)) > 0);
+
+    size_t overruns = 0;
+    std::vector<char> buf;
+
+    for (size_t ring = 0; ring < workers; ring++) {
+        if (ring == worker) {
+            continue;
+        }
+
+        RingHeader* hdr = header(ring);
+        uint64_t head = hdr->head.load(std::memory_order_acquire);
+        uint64_t pos = cursors[ring];
+
+        if (head - pos > ring_size) {
+            overruns++;
+            pos = head;
+        }
+
+        while (pos != head) {
+            uint32_t size;
+            copy_out(ring, pos, reinterpret_cast<char*>(&size), size_header);
+            if (size <= ring_size - size_header) {
+                buf.resize(size);
+                copy_out(ring, pos + size_header, buf.data(), size);
+            }
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (hdr->reserved.load(std::memory_order_relaxed) - pos > ring_size) {
+                // the writer has lapped the cursor while the record was copied
+                overruns++;
+                pos = hdr->head.load(std::memory_order_acquire);
+                break;
+            }
+
+            uint64_t nick_size = 0;
+            size_t len = 0;
+            if (size != 0 && size <= ring_size - size_header) {
+                try {
+                    len = protocol::get_varint(buf.data() + 1, size - 1, nick_size);
+                }
+                catch (protocol::ProtocolException&) {
+                    len = 0;
+                }
+            }
+            if (len == 0 || size - 1 - len < nick_size) {
+                // the records following a malformed one can't be found, the rest is skipped as on overrun
+                overruns++;
+                pos = head;
+                break;
+            }
+
+            Record record;
+            record.event = static_cast<Event>(buf[0]);
+            record.worker = ring;
+            record.nick.assign(buf.data() + 1 + len, nick_size);
+            record.payload.assign(buf.data() + 1 + len + nick_size, buf.data() + size);
+            records.push_back(std::move(record));
+
+            pos += size_header + size;
+        }
+
+        cursors[ring] = pos;
+    }
+
+    return overruns;
+}
+
+Bus::RingHeader* Bus::header(size_t ring) const
+{
+    return reinterpret_cast<RingHeader*>(mem + ring * (sizeof(RingHeader) + ring_size));
+}
+
+char* Bus::data(size_t ring) const
+{
+    return mem + ring * (sizeof(RingHeader) + ring_size) + sizeof(RingHeader);
+}
+
+void Bus::copy_in(size_t ring, uint64_t pos, const char* src, size_t size)
+{
+    size_t offset = pos % ring_size;
+    size_t first = std::min(size, ring_size - offset);
+
+    std::memcpy(data(ring) + offset, src, first);
+    std::memcpy(data(ring), src + first, size - first);
+}
+
+void Bus::copy_out(size_t ring, uint64_t pos, char* dst, size_t size) const
+{
+    size_t offset = pos % ring_size;
+    size_t first = std::min(size, ring_size - offset);
+
+    std::memcpy(dst, data(ring) + offset, first);
+    std::memcpy(dst + first, data(ring), size - first);
+}
+
+
+} // namespace chat
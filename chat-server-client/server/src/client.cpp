@@ -2,11 +2,20 @@
 
 #include <stdexcept>
 #include <string>
+#include <vector>
 #include <memory>
 #include <map>
+#include <algorithm>
+#include <sys/uio.h>
 #include <boost/format.hpp>
 #include <socket.h>
+#include <shm.h>
+#include <buffer_pool.h>
+#include <protocol.h>
+#include <websocket.h>
+#include <text.h>
 #include <logger.h>
+#include <binlog.h>
 
 
 using namespace logging;
@@ -15,23 +24,218 @@ using namespace logging;
 namespace chat {
 
 
+Client::Client(std::unique_ptr<net::Socket> sock_ptr, const State& state, double msg_rate, double msg_burst):
+    status(state.status), version(state.version), flags(state.flags), websocket(state.websocket),
+    sock(std::move(*sock_ptr)), nick(state.nick), rate_limiter(msg_rate, msg_burst),
+    in_buf(state.in_buf), out_buf(state.out_buf)
+{
+    if (!state.ws_fragments.empty()) {
+        ws_fragments = std::make_unique<std::string>(state.ws_fragments);
+    }
+}
+
 Client::~Client()
 {
     disconnect();
 }
 
-void Client::connect()
+bool Client::connect()
 {
-    nick = recv_message();
+    std::string payload;
+    protocol::Hello hello;
+
+    // a browser starts with an HTTP upgrade request, the handshake is the first WebSocket message then
+    if (!websocket && protocol::is_http_request(in_buf.data(), in_buf.size())) {
+        std::string key;
+        size_t len;
+
+        try {
+            len = protocol::parse_upgrade(in_buf.data(), in_buf.size(), key);
+        }
+        catch (protocol::ProtocolException& e) {
+            std::string response = protocol::make_upgrade_error();
+            send_data(std::vector<char>(response.cbegin(), response.cend()));
+            throw ClientException(std::string("client connect error: ") + e.what());
+        }
+        if (len == 0) {
+            return false;
+        }
+        in_buf.erase(in_buf.begin(), in_buf.begin() + len);
+
+        std::string response = protocol::make_upgrade_response(key);
+        send_data(std::vector<char>(response.cbegin(), response.cend()));
+        websocket = true;
+    }
+
+    try {
+        if (websocket) {
+            // control frames may come first
+            bool complete = false;
+            while (!complete) {
+                size_t len = decode_ws_message(in_buf.data(), in_buf.size(), payload, complete);
+                if (len == 0) {
+                    return false;
+                }
+                in_buf.erase(in_buf.begin(), in_buf.begin() + len);
+                if (closing) {
+                    throw ClientException("client connect error: websocket closed by the peer");
+                }
+            }
+        }
+        else {
+            size_t len = protocol::decode_v1(in_buf.data(), in_buf.size(), payload);
+            if (len == 0) {
+                return false;
+            }
+            in_buf.erase(in_buf.begin(), in_buf.begin() + len);
+        }
+
+        if (protocol::parse_hello(payload, hello)) {
+            if (hello.version < protocol::Version::V1) {
+                throw ClientException("client connect error: unsupported protocol version");
+            }
+            version = std::min(hello.version, protocol::version_max);
+            // no compression over WebSocket: the browser would have to decompress LZ4 in script
+            if (version >= protocol::Version::V2 && !websocket) {
+                flags = hello.flags & protocol::flags_supported;
+            }
+            nick = hello.nick;
+
+            // confirm the negotiated version and flags, the reply is always v1 framed (or a WebSocket message)
+            protocol::Hello reply;
+            reply.version = version;
+            reply.flags = flags;
+            send_message(protocol::make_hello(reply));
+        }
+        else {
+            nick = payload;
+        }
+    }
+    catch (protocol::ProtocolException& e) {
+        throw ClientException(std::string("client connect error: ") + e.what());
+    }
+
+    if (!is_valid_nick(nick)) {
+        throw ClientException("client connect error: invalid nick");
+    }
+
     status = Status::ONLINE;
-    Logger::get_instance()->info(str(boost::format("user %1% connected") % nick));
+    static Format connected(Loglevel::INFO, "user %1% connected");
+    log(connected, nick);
+
+    return true;
+}
+
+void Client::set_channel(std::unique_ptr<net::ShmChannel> channel_ptr)
+{
+    channel = std::move(channel_ptr);
+}
+
+net::ShmChannel* Client::get_channel() const
+{
+    return channel.get();
+}
+
+Client::Clock::time_point Client::get_handshake_deadline() const
+{
+    return handshake_deadline;
+}
+
+void Client::set_handshake_deadline(Clock::time_point deadline)
+{
+    handshake_deadline = deadline;
 }
 
 void Client::disconnect()
 {
+    if (status == Status::ONLINE) {
+        static Format disconnected(Loglevel::INFO, "user %1% disconnected");
+        log(disconnected, nick);
+    }
+
     status = Status::OFFLINE;
-    sock_ptr->close();
-    Logger::get_instance()->info(str(boost::format("user %1% disconnected") % nick));
+    sock.close();
+    channel.reset();
+}
+
+Client::State Client::detach()
+{
+    State state;
+    state.status = status;
+    state.version = version;
+    state.flags = flags;
+    state.websocket = websocket;
+    state.nick = nick;
+    state.in_buf = in_buf;
+    state.out_buf.assign(out_buf.cbegin() + out_offset, out_buf.cend());
+    for (const auto& data_ptr: coalesced) {
+        state.out_buf.insert(state.out_buf.end(), data_ptr->cbegin(), data_ptr->cend());
+    }
+    if (ws_fragments) {
+        state.ws_fragments = *ws_fragments;
+    }
+
+    status = Status::OFFLINE;
+
+    return state;
+}
+
+void Client::read()
+{
+    static thread_local std::vector<char> read_buf(read_max_size);
+    size_t recved = 0;
+
+    while (recved < read_max_size) {
+        ssize_t res = recv_some(read_buf.data(), read_max_size - recved);
+        if (res == 0) {
+            break;      // no more data available
+        }
+        BufferPool::acquire(in_buf);
+        in_buf.insert(in_buf.end(), read_buf.cbegin(), read_buf.cbegin() + res);
+        recved += res;
+    }
+}
+
+ssize_t Client::recv_some(char* data, size_t size)
+{
+    if (!channel) {
+        return sock.recv(data, size);
+    }
+
+    try {
+        return channel->recv(data, size);
+    }
+    catch (net::ShmException& e) {
+        throw ClientException(std::string("client recv error: ") + e.what());
+    }
+}
+
+ssize_t Client::send_some(const char* data, size_t size)
+{
+    if (!channel) {
+        return sock.send(data, size);
+    }
+
+    try {
+        return channel->send(data, size);
+    }
+    catch (net::ShmException& e) {
+        throw ClientException(std::string("client send error: ") + e.what());
+    }
+}
+
+ssize_t Client::send_some(const struct iovec* iov, size_t count)
+{
+    if (!channel) {
+        return sock.send(iov, count);
+    }
+
+    try {
+        return channel->send(iov, count);
+    }
+    catch (net::ShmException& e) {
+        throw ClientException(std::string("client send error: ") + e.what());
+    }
 }
 
 void Client::send_message(const std::string& msg)
@@ -40,30 +244,286 @@ void Client::send_message(const std::string& msg)
         throw ClientException("client send message error: message too long");
     }
 
-    msg_header hdr;
-    hdr.size = htons(msg.size());
+    std::vector<char> buf;
+    if (websocket) {
+        protocol::encode_ws(protocol::WsOpcode::BINARY, msg.data(), msg.size(), buf);
+    }
+    else {
+        protocol::encode_v1(msg, buf);
+    }
+
+    send_data(buf);
+}
+
+size_t Client::decode_ws_message(const char* data, size_t size, std::string& msg, bool& complete)
+{
+    protocol::WsFrame frame;
+    std::vector<char> reply;
+
+    // a v1 message is limited by the v1 framing whatever the transport is
+    size_t max_size = version == protocol::Version::V1 ? msg_max_size : frame_max_size;
+
+    complete = false;
+    size_t len = protocol::decode_ws(data, size, frame, max_size);
+    if (len == 0) {
+        return 0;
+    }
+
+    switch (frame.op) {
+    case protocol::WsOpcode::PING:
+        protocol::encode_ws(protocol::WsOpcode::PONG, frame.payload.data(), frame.payload.size(), reply);
+        send_data(reply);
+        break;
 
-    std::vector<char> hdr_buf((const char*)&hdr,
-                              (const char*)&hdr + sizeof(msg_header));
-    std::vector<char> msg_buf(msg.cbegin(), msg.cend());
+    case protocol::WsOpcode::PONG:
+        break;
 
-    sock_ptr->sendall(hdr_buf);
-    sock_ptr->sendall(msg_buf);
+    case protocol::WsOpcode::CLOSE:
+        // echoes the status code, the connection is closed by the server (see is_closing)
+        protocol::encode_ws(protocol::WsOpcode::CLOSE, frame.payload.data(),
+                            std::min<size_t>(frame.payload.size(), 2), reply);
+        send_data(reply);
+        closing = true;
+        break;
+
+    case protocol::WsOpcode::CONTINUATION:
+        if (!ws_fragments) {
+            throw protocol::ProtocolException("protocol error: unexpected websocket continuation frame");
+        }
+        if (ws_fragments->size() + frame.payload.size() > max_size) {
+            throw protocol::ProtocolException("protocol error: websocket message too long");
+        }
+        ws_fragments->append(frame.payload);
+        if (frame.fin) {
+            msg = std::move(*ws_fragments);
+            ws_fragments.reset();
+            complete = true;
+        }
+        break;
+
+    default:
+        if (ws_fragments) {
+            throw protocol::ProtocolException("protocol error: websocket message interleaved with another one");
+        }
+        if (frame.fin) {
+            msg = std::move(frame.payload);
+            complete = true;
+        }
+        else {
+            ws_fragments = std::make_unique<std::string>(std::move(frame.payload));
+        }
+    }
+
+    return len;
 }
 
-std::string Client::recv_message()
+void Client::send_frame(const protocol::Frame& frame)
 {
-    msg_header hdr;
-    std::vector<char> msg_buf;
-    std::vector<char> hdr_buf;
+    std::vector<char> buf;
+
+    try {
+        protocol::encode(frame, get_format(), buf);
+    }
+    catch (protocol::ProtocolException& e) {
+        throw ClientException(std::string("client send frame error: ") + e.what());
+    }
 
-    sock_ptr->recvall(hdr_buf, sizeof(msg_header));
-    std::copy(hdr_buf.cbegin(), hdr_buf.cend(), (char*)&hdr);
+    send_data(buf);
+}
 
-    size_t size = ntohs(hdr.size);
-    sock_ptr->recvall(msg_buf, size);
+void Client::send_data(const std::vector<char>& data)
+{
+    size_t sent = 0;
 
-    return std::string(msg_buf.cbegin(), msg_buf.cend());
+    // the held frames go first to keep the order
+    if (has_coalesced_data()) {
+        flush_coalesced();
+    }
+
+    // sends directly if nothing is buffered to avoid copying
+    if (!has_pending_data()) {
+        while (sent != data.size()) {
+            ssize_t res = send_some(data.data() + sent, data.size() - sent);
+            if (res == 0) {
+                break;      // the socket is not ready
+            }
+            sent += res;
+        }
+    }
+
+    if (sent != data.size()) {
+        size_t pending = out_buf.size() - out_offset;
+        if (pending != 0 && pending + data.size() - sent > out_buf_max_size) {
+            throw ClientException("client send error: output buffer overflow");
+        }
+        BufferPool::acquire(out_buf);
+        out_buf.insert(out_buf.end(), data.cbegin() + sent, data.cend());
+    }
+}
+
+void Client::send_data(std::shared_ptr<const std::vector<char>> data)
+{
+    // the buffered data is sent at once anyway when the socket is writable
+    if (coalesce_window.count() == 0 || has_pending_data()) {
+        send_data(*data);
+        return;
+    }
+
+    if (coalesced.empty()) {
+        coalesce_deadline = Clock::now() + coalesce_window;
+    }
+    coalesced_size += data->size();
+    coalesced.push_back(std::move(data));
+
+    if (coalesced_size >= coalesce_max_bytes || coalesced.size() >= iov_max_count) {
+        flush_coalesced();
+    }
+}
+
+void Client::set_coalescing(std::chrono::microseconds window, size_t max_bytes)
+{
+    coalesce_window = window;
+    coalesce_max_bytes = max_bytes;
+}
+
+void Client::flush_coalesced()
+{
+    static thread_local std::vector<struct iovec> iov;
+    size_t chunk = 0;       // first held frame not sent entirely
+    size_t offset = 0;      // the frame data start position to be sent from
+
+    while (chunk != coalesced.size()) {
+        iov.clear();
+        for (size_t n = chunk; n != coalesced.size() && iov.size() != iov_max_count; n++) {
+            size_t start = (n == chunk) ? offset : 0;
+            iov.push_back({const_cast<char*>(coalesced[n]->data()) + start, coalesced[n]->size() - start});
+        }
+
+        ssize_t res = send_some(iov.data(), iov.size());
+        if (res == 0) {
+            break;      // the socket is not ready
+        }
+
+        size_t sent = res;
+        while (sent != 0) {
+            size_t left = coalesced[chunk]->size() - offset;
+            if (sent < left) {
+                offset += sent;
+                break;
+            }
+            sent -= left;
+            chunk++;
+            offset = 0;
+        }
+    }
+
+    if (chunk != coalesced.size()) {
+        BufferPool::acquire(out_buf);
+    }
+    for (; chunk != coalesced.size(); chunk++, offset = 0) {
+        out_buf.insert(out_buf.end(), coalesced[chunk]->cbegin() + offset, coalesced[chunk]->cend());
+    }
+
+    coalesced.clear();
+    coalesced.shrink_to_fit();
+    coalesced_size = 0;
+}
+
+bool Client::has_coalesced_data() const
+{
+    return !coalesced.empty();
+}
+
+Client::Clock::time_point Client::get_coalesce_deadline() const
+{
+    return coalesce_deadline;
+}
+
+bool Client::flush()
+{
+    while (out_offset != out_buf.size()) {
+        ssize_t res = send_some(out_buf.data() + out_offset, out_buf.size() - out_offset);
+        if (res == 0) {
+            return false;   // the socket is not ready
+        }
+        out_offset += res;
+    }
+
+    out_buf.clear();
+    out_offset = 0;
+    BufferPool::release(out_buf);
+
+    return true;
+}
+
+bool Client::has_pending_data() const
+{
+    return out_offset != out_buf.size();
+}
+
+std::vector<protocol::Frame> Client::recv_frames(size_t max_frames)
+{
+    std::vector<protocol::Frame> frames;
+    size_t offset = 0;
+
+    try {
+        while (frames.size() < max_frames && !closing) {
+            size_t len;
+
+            if (websocket) {
+                std::string msg;
+                bool complete;
+                len = decode_ws_message(in_buf.data() + offset, in_buf.size() - offset, msg, complete);
+                if (len != 0 && complete) {
+                    if (version == protocol::Version::V1) {
+                        frames.emplace_back(msg == "list" ? protocol::Opcode::LIST : protocol::Opcode::SEND, msg);
+                    }
+                    else {
+                        protocol::Frame frame;
+                        protocol::decode_body(msg.data(), msg.size(), frame);
+                        if (frame.op == protocol::Opcode::BATCH) {
+                            protocol::unbatch(frame, frames);
+                        }
+                        else {
+                            frames.push_back(std::move(frame));
+                        }
+                    }
+                }
+            }
+            else if (version == protocol::Version::V1) {
+                std::string msg;
+                len = protocol::decode_v1(in_buf.data() + offset, in_buf.size() - offset, msg);
+                if (len != 0) {
+                    frames.emplace_back(msg == "list" ? protocol::Opcode::LIST : protocol::Opcode::SEND, msg);
+                }
+            }
+            else {
+                protocol::Frame frame;
+                len = protocol::decode(in_buf.data() + offset, in_buf.size() - offset, frame);
+                if (len != 0) {
+                    if (frame.op == protocol::Opcode::BATCH) {
+                        protocol::unbatch(frame, frames);
+                    }
+                    else {
+                        frames.push_back(std::move(frame));
+                    }
+                }
+            }
+
+            if (len == 0) {
+                break;      // the rest of the frame is not received yet
+            }
+            offset += len;
+        }
+    }
+    catch (protocol::ProtocolException& e) {
+        throw ClientException(std::string("client recv frame error: ") + e.what());
+    }
+
+    in_buf.erase(in_buf.begin(), in_buf.begin() + offset);
+    BufferPool::release(in_buf);
+
+    return frames;
 }
 
 Client::Status Client::get_status() const
@@ -76,15 +536,76 @@ void Client::set_status(Status s)
     status = s;
 }
 
+bool Client::is_valid_nick(const std::string& nick)
+{
+    return text::is_valid_utf8(nick.data(), nick.size()) && !text::has_controls(nick.data(), nick.size()) &&
+           nick.find_first_of("\t\n") == std::string::npos;
+}
+
 std::string Client::get_nick() const
 {
     return nick;
 }
 
+int Client::get_sockfd() const
+{
+    return sock.get_sockfd();
+}
+
+TokenBucket& Client::get_rate_limiter()
+{
+    return rate_limiter;
+}
+
+bool Client::is_closing() const
+{
+    return closing;
+}
+
+bool Client::is_paused() const
+{
+    return paused;
+}
+
+void Client::set_paused(bool p)
+{
+    paused = p;
+}
+
+void Client::set_relayed(bool r)
+{
+    relayed = r;
+}
+
+bool Client::is_relayed() const
+{
+    return relayed;
+}
+
+protocol::Version Client::get_version() const
+{
+    return version;
+}
+
+protocol::Format Client::get_format() const
+{
+    if (websocket) {
+        return version == protocol::Version::V1 ? protocol::Format::WS_V1 : protocol::Format::WS_V2;
+    }
+    if (version == protocol::Version::V1) {
+        return protocol::Format::V1;
+    }
+    if (flags & protocol::flag_compression) {
+        return protocol::Format::V2_COMPRESSED;
+    }
+    return protocol::Format::V2;
+}
+
 const std::map<Client::Status, std::string> Client::status_str = {
-    {Status::ONLINE,  "online"},
-    {Status::OFFLINE, "offline"}
+    {Status::AWAITING_NICK, "awaiting nick"},
+    {Status::ONLINE,        "online"},
+    {Status::OFFLINE,       "offline"}
 };
 
 
-} // chat namespace
\ No newline at end of file
+} // chat namespace
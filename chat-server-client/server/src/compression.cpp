@@ -0,0 +1,182 @@
+#include <compression.h>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+
+
+namespace compression {
+
+
+namespace {
+
+const size_t min_match = 4;         // minimum match length
+const size_t last_literals = 5;     // the last bytes of a block are always literals
+const size_t match_limit = 12;      // the last match must start at least match_limit bytes before the end
+const size_t max_offset = 65535;    // maximum match distance
+const int hash_log = 12;            // hash table size log
+
+
+uint32_t read32(const char* p)
+{
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+uint32_t hash(uint32_t value)
+{
+    return (value * 2654435761u) >> (32 - hash_log);
+}
+
+void put_length(std::string& out, size_t len)
+{
+    while (len >= 255) {
+        out.push_back(static_cast<char>(255));
+        len -= 255;
+    }
+    out.push_back(static_cast<char>(len));
+}
+
+size_t get_length(const char* data, size_t size, size_t& pos)
+{
+    size_t len = 0;
+    uint8_t byte;
+
+    do {
+        if (pos == size) {
+            throw CompressionException("decompress error: truncated length");
+        }
+        byte = static_cast<uint8_t>(data[pos++]);
+        len += byte;
+    } while (byte == 255);
+
+    return len;
+}
+
+/*
+ * Writes a sequence: token, literals and a match (if match_len is not 0).
+ */
+void put_sequence(std::string& out, const char* literals, size_t literals_len, size_t offset, size_t match_len)
+{
+    size_t match_code = match_len ? match_len - min_match : 0;
+    uint8_t token = (std::min<size_t>(literals_len, 15) << 4) | std::min<size_t>(match_code, 15);
+
+    out.push_back(static_cast<char>(token));
+    if (literals_len >= 15) {
+        put_length(out, literals_len - 15);
+    }
+    out.append(literals, literals_len);
+
+    if (match_len) {
+        out.push_back(static_cast<char>(offset & 0xff));
+        out.push_back(static_cast<char>(offset >> 8));
+        if (match_code >= 15) {
+            put_length(out, match_code - 15);
+        }
+    }
+}
+
+} // namespace
+
+
+size_t compress_bound(size_t size)
+{
+    return size + size / 255 + 16;
+}
+
+std::string compress(const char* data, size_t size)
+{
+    std::string out;
+    out.reserve(compress_bound(size));
+
+    std::vector<uint32_t> table(1 << hash_log, 0);     // last positions of 4-byte sequences
+    size_t anchor = 0;                                  // the first not yet written byte
+    size_t pos = 1;
+
+    while (size >= match_limit && pos <= size - match_limit) {
+        uint32_t seq = read32(data + pos);
+        uint32_t& slot = table[hash(seq)];
+        size_t ref = slot;
+        slot = pos;
+
+        if (pos - ref > max_offset || read32(data + ref) != seq) {
+            pos++;
+            continue;
+        }
+
+        size_t len = min_match;
+        while (pos + len < size - last_literals && data[ref + len] == data[pos + len]) {
+            len++;
+        }
+
+        put_sequence(out, data + anchor, pos - anchor, pos - ref, len);
+        pos += len;
+        anchor = pos;
+    }
+
+    put_sequence(out, data + anchor, size - anchor, 0, 0);
+
+    return out;
+}
+
+std::string decompress(const char* data, size_t size, size_t original_size)
+{
+    std::string out(original_size, '\0');
+    size_t in_pos = 0;
+    size_t out_pos = 0;
+
+    while (in_pos < size) {
+        uint8_t token = static_cast<uint8_t>(data[in_pos++]);
+
+        size_t literals_len = token >> 4;
+        if (literals_len == 15) {
+            literals_len += get_length(data, size, in_pos);
+        }
+        if (size - in_pos < literals_len || original_size - out_pos < literals_len) {
+            throw CompressionException("decompress error: literals out of bounds");
+        }
+        std::memcpy(&out[out_pos], data + in_pos, literals_len);
+        in_pos += literals_len;
+        out_pos += literals_len;
+
+        if (in_pos == size) {
+            break;      // the last sequence has no match
+        }
+
+        if (size - in_pos < 2) {
+            throw CompressionException("decompress error: truncated offset");
+        }
+        size_t offset = static_cast<uint8_t>(data[in_pos]) | (static_cast<uint8_t>(data[in_pos + 1]) << 8);
+        in_pos += 2;
+        if (offset == 0 || offset > out_pos) {
+            throw CompressionException("decompress error: offset out of bounds");
+        }
+
+        size_t match_len = token & 15;
+        if (match_len == 15) {
+            match_len += get_length(data, size, in_pos);
+        }
+        match_len += min_match;
+        if (original_size - out_pos < match_len) {
+            throw CompressionException("decompress error: match out of bounds");
+        }
+
+        // the match may overlap the output, so copy byte by byte
+        for (size_t n = 0; n < match_len; n++, out_pos++) {
+            out[out_pos] = out[out_pos - offset];
+        }
+    }
+
+    if (out_pos != original_size) {
+        throw CompressionException("decompress error: size mismatch");
+    }
+
+    return out;
+}
+
+
+} // namespace compression
@@ -0,0 +1,316 @@
+#include <coro.h>
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <exception>
+#include <coroutine>
+#include <new>
+#include <cstring>
+#include <epoll.h>
+#include <socket.h>
+#include <protocol.h>
+
+
+namespace io {
+
+
+namespace {
+
+const size_t pool_granularity = 64;
+const size_t pool_max_size = 4096;              // larger frames are not pooled
+const size_t pool_max_free = 1024;              // free frames kept per size
+
+std::vector<void*>& free_list(size_t size)
+{
+    static thread_local std::vector<std::vector<void*>> lists(pool_max_size / pool_granularity + 1);
+    return lists[(size + pool_granularity - 1) / pool_granularity];
+}
+
+} // namespace
+
+
+void* FramePool::allocate(size_t size)
+{
+    if (size > pool_max_size) {
+        return ::operator new(size);
+    }
+
+    std::vector<void*>& frames = free_list(size);
+    if (frames.empty()) {
+        // rounded up, so a frame fits any size of the list
+        return ::operator new((size + pool_granularity - 1) / pool_granularity * pool_granularity);
+    }
+
+    void* ptr = frames.back();
+    frames.pop_back();
+    return ptr;
+}
+
+void FramePool::deallocate(void* ptr, size_t size)
+{
+    if (size > pool_max_size) {
+        ::operator delete(ptr);
+        return;
+    }
+
+    std::vector<void*>& frames = free_list(size);
+    if (frames.size() >= pool_max_free) {
+        ::operator delete(ptr);
+        return;
+    }
+    frames.push_back(ptr);
+}
+
+
+AsyncSocket::AsyncSocket(Epoll& epoll, std::unique_ptr<net::Socket> sock_ptr):
+    epoll(epoll), sock_ptr(std::move(sock_ptr)), alive(std::make_shared<bool>(true))
+{
+    sockfd = this->sock_ptr->get_sockfd();
+    this->sock_ptr->set_nonblocking();
+
+    epoll.add_handler(sockfd, Epoll::Event::IN | Epoll::Event::OUT | Epoll::Event::RDHUP | Epoll::Event::ET,
+                      [this, guard = alive] (int events, void* data) {
+                          // the handler is kept by the loop after the socket is destroyed
+                          if (*guard) {
+                              on_event(events);
+                          }
+                      });
+}
+
+AsyncSocket::~AsyncSocket()
+{
+    *alive = false;
+    close();
+}
+
+void AsyncSocket::close()
+{
+    if (closed) {
+        return;
+    }
+    closed = true;
+
+    try {
+        epoll.del_handler(sockfd);
+        sock_ptr->close();
+    }
+    catch (std::runtime_error&) { }
+
+    // the waiters are resumed by the loop: close may be called by a coroutine the waiter shares the socket with
+    auto error = std::make_exception_ptr(net::SocketException("socket error: socket has been closed"));
+    if (read_waiter) {
+        read_error = error;
+        epoll.post([handle = read_waiter] { handle.resume(); });
+        read_waiter = nullptr;
+    }
+    if (write_waiter) {
+        write_error = error;
+        epoll.post([handle = write_waiter] { handle.resume(); });
+        write_waiter = nullptr;
+    }
+}
+
+bool AsyncSocket::is_closed() const
+{
+    return closed;
+}
+
+int AsyncSocket::get_sockfd() const
+{
+    return sockfd;
+}
+
+AsyncSocket::WriteAwaiter AsyncSocket::connect(const net::Address& addr)
+{
+    write_error = nullptr;
+    write_size = 0;
+    write_sent = 0;
+    connecting = false;
+
+    try {
+        connecting = !sock_ptr->connect_nonblocking(addr);
+    }
+    catch (net::SocketException&) {
+        write_error = std::current_exception();
+    }
+
+    return WriteAwaiter(*this);
+}
+
+AsyncSocket::ReadAwaiter AsyncSocket::read_frame(std::vector<char>& body, size_t max_size)
+{
+    read_error = nullptr;
+    read_dst = &body;
+    read_max_size = max_size;
+    read_frame_mode = true;
+
+    return ReadAwaiter(*this);
+}
+
+AsyncSocket::ReadAwaiter AsyncSocket::read_some(std::vector<char>& buf, size_t max_size)
+{
+    read_error = nullptr;
+    read_dst = &buf;
+    read_max_size = max_size;
+    read_frame_mode = false;
+
+    return ReadAwaiter(*this);
+}
+
+AsyncSocket::WriteAwaiter AsyncSocket::write(const char* data, size_t size)
+{
+    write_error = nullptr;
+    write_data = data;
+    write_size = size;
+    write_sent = 0;
+    connecting = false;
+
+    return WriteAwaiter(*this);
+}
+
+size_t AsyncSocket::ReadAwaiter::await_resume()
+{
+    if (sock.read_error) {
+        std::rethrow_exception(sock.read_error);
+    }
+    return sock.read_result;
+}
+
+void AsyncSocket::WriteAwaiter::await_resume()
+{
+    if (sock.write_error) {
+        std::rethrow_exception(sock.write_error);
+    }
+}
+
+bool AsyncSocket::fill()
+{
+    if (in_offset == in_buf.size()) {
+        in_buf.clear();
+        in_offset = 0;
+    }
+
+    size_t size = in_buf.size();
+    in_buf.resize(size + read_chunk_size);
+    ssize_t res = sock_ptr->recv(in_buf.data() + size, read_chunk_size);
+    in_buf.resize(size + res);
+
+    return res != 0;
+}
+
+bool AsyncSocket::try_read()
+{
+    if (read_error) {
+        return true;
+    }
+
+    try {
+        if (closed) {
+            throw net::SocketException("socket error: socket has been closed");
+        }
+
+        while (true) {
+            const char* data = in_buf.data() + in_offset;
+            size_t size = in_buf.size() - in_offset;
+
+            if (!read_frame_mode && size != 0) {
+                read_result = std::min(size, read_max_size);
+                read_dst->insert(read_dst->end(), data, data + read_result);
+                in_offset += read_result;
+                return true;
+            }
+
+            if (read_frame_mode) {
+                uint64_t body_size;
+                size_t len = protocol::get_varint(data, size, body_size);
+                if (len != 0 && body_size > read_max_size) {
+                    throw net::SocketException("socket error: frame too large");
+                }
+                if (len != 0 && size - len >= body_size) {
+                    read_dst->assign(data + len, data + len + body_size);
+                    in_offset += len + body_size;
+                    read_result = body_size;
+                    return true;
+                }
+            }
+
+            if (!fill()) {
+                return false;       // the rest is received on the next IN event
+            }
+        }
+    }
+    catch (std::runtime_error&) {
+        // the socket and protocol exceptions are rethrown by co_await
+        read_error = std::current_exception();
+        return true;
+    }
+}
+
+bool AsyncSocket::try_write()
+{
+    if (write_error) {
+        return true;
+    }
+
+    try {
+        if (closed) {
+            throw net::SocketException("socket error: socket has been closed");
+        }
+
+        if (connecting) {
+            return false;           // completed on the OUT event
+        }
+
+        while (write_sent != write_size) {
+            ssize_t res = sock_ptr->send(write_data + write_sent, write_size - write_sent);
+            if (res == 0) {
+                return false;       // the socket is not ready
+            }
+            write_sent += res;
+        }
+        return true;
+    }
+    catch (std::runtime_error&) {
+        write_error = std::current_exception();
+        return true;
+    }
+}
+
+void AsyncSocket::on_event(int events)
+{
+    std::shared_ptr<bool> guard = alive;
+
+    if (write_waiter && (events & (Epoll::Event::OUT | Epoll::Event::ERR | Epoll::Event::HUP))) {
+        if (connecting) {
+            connecting = false;
+            int error = sock_ptr->get_error();
+            if (error != 0) {
+                write_error = std::make_exception_ptr(
+                    net::SocketException(std::string("socket connect error: ") + std::strerror(error)));
+            }
+        }
+
+        if (try_write()) {
+            auto handle = write_waiter;
+            write_waiter = nullptr;
+            handle.resume();
+            if (!*guard) {
+                return;     // the socket has been destroyed by the resumed coroutine
+            }
+        }
+    }
+
+    if (read_waiter && !closed &&
+        (events & (Epoll::Event::IN | Epoll::Event::RDHUP | Epoll::Event::ERR | Epoll::Event::HUP))) {
+        if (try_read()) {
+            auto handle = read_waiter;
+            read_waiter = nullptr;
+            handle.resume();
+        }
+    }
+}
+
+
+} // namespace io
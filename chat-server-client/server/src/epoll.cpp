@@ -3,22 +3,37 @@
 #include <string>
 #include <cstring>
 #include <functional>
+#include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 
 namespace io {
 
 
-using namespace std::placeholders;
-
-
 Epoll::Epoll(size_t max_events):
-    max_events(max_events)
+    stop_flag(false), max_events(max_events), wakeup_pending(false)
 {
-    epollfd = epoll_create1(0);
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
     if (epollfd == -1) {
         throw EpollExcepton(std::string("epoll_create1 error: ") + std::strerror(errno));
     }
+
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd == -1) {
+        throw EpollExcepton(std::string("eventfd error: ") + std::strerror(errno));
+    }
+
+    // the loop checks stop_flag after every wakeup
+    add_handler(wakeup_fd, Event::IN, [this] (int events, void* data) {
+        run_tasks();
+    });
+}
+
+Epoll::~Epoll()
+{
+    close(wakeup_fd);
+    close(epollfd);
 }
 
 
@@ -28,13 +43,26 @@ void Epoll::start()
 
     while (!stop_flag) {
         int nfds = epoll_wait(epollfd, events, max_events, -1);
+        if (nfds == -1 && errno == EINTR) {
+            continue;
+        }
         if (nfds == -1) {
             throw EpollExcepton(std::string("epoll_wait error: ") + std::strerror(errno));
         }
 
         for (size_t n = 0; n < nfds; n++) {
-            handlers[events[n].data.fd](events[n].events);
+            int fd = static_cast<int>(events[n].data.u64 & 0xffffffff);
+            uint32_t generation = static_cast<uint32_t>(events[n].data.u64 >> 32);
+
+            // the handler may have been deleted (and the descriptor reused) by a previous event
+            auto it = handlers.find(fd);
+            if (it == handlers.end() || it->second.generation != generation) {
+                continue;
+            }
+            it->second.func(events[n].events, it->second.data);
         }
+
+        deleted_handlers.clear();
     }
 }
 
@@ -42,29 +70,105 @@ void Epoll::start()
 void Epoll::stop()
 {
     stop_flag = true;
+
+    uint64_t cnt = 1;
+    write(wakeup_fd, &cnt, sizeof(uint64_t));
 }
 
 
+void Epoll::post(Task task)
+{
+    tasks.push(std::move(task));
+    wakeup();
+}
+
+void Epoll::post_batch(std::vector<Task>& batch)
+{
+    tasks.push_batch(batch.begin(), batch.end());
+    batch.clear();
+    wakeup();
+}
+
+void Epoll::wakeup()
+{
+    // the exchange synchronizes with the loop clearing the flag, so a task pushed before it is seen by the loop
+    if (!wakeup_pending.exchange(true, std::memory_order_acq_rel)) {
+        uint64_t cnt = 1;
+        write(wakeup_fd, &cnt, sizeof(uint64_t));
+    }
+}
+
+void Epoll::run_tasks()
+{
+    uint64_t cnt;
+    read(wakeup_fd, &cnt, sizeof(uint64_t));
+
+    // cleared before the queue is drained: a task posted while the tasks run wakes the loop up again
+    wakeup_pending.exchange(false, std::memory_order_acq_rel);
+
+    Task task;
+    for (size_t n = 0; n < max_tasks_per_wakeup; n++) {
+        if (!tasks.try_pop(task)) {
+            return;
+        }
+        task();
+    }
+
+    // the rest is run after the events pending meanwhile
+    wakeup();
+}
+
 void Epoll::add_handler(int fd, int event_mask, std::function<void(int, void*)> func, void* data)
 {
+    uint32_t generation = next_generation++;
+
     epoll_event ev;
-    ev.data.fd = fd;
+    ev.data.u64 = make_event_data(fd, generation);
     ev.events = event_mask;
 
     if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
         throw EpollExcepton(std::string("epoll_ctl error: ") + std::strerror(errno));
     }
 
-    handlers[fd] = std::bind(func, _1, data);
+    handlers[fd] = Handler{std::move(func), data, event_mask, generation};
+}
+
+void Epoll::modify_handler(int fd, int event_mask)
+{
+    Handler& handler = handlers.at(fd);
+    if (handler.event_mask == event_mask) {
+        return;
+    }
+
+    epoll_event ev;
+    ev.data.u64 = make_event_data(fd, handler.generation);
+    ev.events = event_mask;
+
+    if (epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+        throw EpollExcepton(std::string("epoll_ctl error: ") + std::strerror(errno));
+    }
+    handler.event_mask = event_mask;
 }
 
 void Epoll::del_handler(int fd)
 {
+    auto it = handlers.find(fd);
+    if (it != handlers.end()) {
+        // the handler may be running, it is destroyed after the events are dispatched
+        deleted_handlers.push_back(std::move(it->second));
+        handlers.erase(it);
+    }
+
     if (epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL) == -1) {
         throw EpollExcepton(std::string("epoll_ctl error: ") + std::strerror(errno));
     }
 }
 
+uint64_t Epoll::make_event_data(int fd, uint32_t generation)
+{
+    return (static_cast<uint64_t>(generation) << 32) | static_cast<uint32_t>(fd);
+}
+
 
 } // namespace io
 
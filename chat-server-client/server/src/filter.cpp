@@ -0,0 +1,323 @@
+#include <filter.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <memory>
+#include <fstream>
+#include <cerrno>
+#include <cstring>
+#include <sys/stat.h>
+#include <logger.h>
+#include <binlog.h>
+
+
+using namespace logging;
+
+
+namespace chat {
+
+
+namespace {
+
+/*
+ * trie node the automaton is compiled from
+ */
+struct Node {
+    std::map<uint8_t, int32_t> next;    // child nodes by byte class
+    int32_t fail = 0;
+    int32_t match = -1;
+    int32_t cell = 0;                   // the node cell in the double array
+};
+
+const uint8_t max_fails = 16;          // times a free cell is tried as the first child cell
+
+uint8_t fold(uint8_t byte)
+{
+    return byte >= 'A' && byte <= 'Z' ? byte + ('a' - 'A') : byte;
+}
+
+} // namespace
+
+
+PatternSet::PatternSet(const std::vector<std::string>& pattern_list)
+{
+    std::memset(classes, 0, sizeof(classes));
+
+    for (const std::string& pattern: pattern_list) {
+        if (pattern.empty()) {
+            continue;
+        }
+        patterns.push_back(pattern);
+        for (char ch: pattern) {
+            uint8_t byte = fold(ch);
+            if (classes[byte] == 0) {
+                classes[byte] = class_count++;
+            }
+        }
+    }
+    for (uint8_t byte = 'A'; byte <= 'Z'; byte++) {
+        classes[byte] = classes[fold(byte)];
+    }
+
+    // the trie of the patterns
+    std::vector<Node> nodes(1);
+    for (size_t n = 0; n < patterns.size(); n++) {
+        int32_t state = 0;
+        for (char ch: patterns[n]) {
+            uint8_t cls = classes[static_cast<uint8_t>(ch)];
+            auto it = nodes[state].next.find(cls);
+            if (it != nodes[state].next.end()) {
+                state = it->second;
+                continue;
+            }
+            nodes.emplace_back();
+            nodes[state].next[cls] = nodes.size() - 1;
+            state = nodes.size() - 1;
+        }
+        if (nodes[state].match < 0) {
+            nodes[state].match = n;
+        }
+    }
+    states = nodes.size();
+
+    // the failure links, breadth first: the failure state of a node is closer to the root
+    std::vector<int32_t> order(1, 0);
+    for (size_t n = 0; n < order.size(); n++) {
+        int32_t state = order[n];
+        for (const auto& cls_next_pair: nodes[state].next) {
+            int32_t next = cls_next_pair.second;
+            order.push_back(next);
+
+            if (state != 0) {
+                int32_t fail = nodes[state].fail;
+                while (fail != 0 && nodes[fail].next.count(cls_next_pair.first) == 0) {
+                    fail = nodes[fail].fail;
+                }
+                auto it = nodes[fail].next.find(cls_next_pair.first);
+                nodes[next].fail = it != nodes[fail].next.end() ? it->second : 0;
+            }
+            if (nodes[next].match < 0) {
+                nodes[next].match = nodes[nodes[next].fail].match;
+            }
+        }
+    }
+
+    // the double array: a state children are placed at the first base all their cells are free at,
+    // the array is kept large enough for base + any class of every state.
+    // The free cells are tried in order as the first child cell, a cell failed too many times is
+    // not tried any more (it stays free), so the placement does not rescan the holes
+    cells.resize(class_count + 1);
+    cells[0].check = -2;
+    std::set<size_t> free_cells;
+    std::vector<uint8_t> fails(cells.size(), 0);
+    for (size_t n = 1; n < cells.size(); n++) {
+        free_cells.insert(n);
+    }
+
+    for (int32_t state: order) {
+        const Node& node = nodes[state];
+        if (node.next.empty()) {
+            continue;
+        }
+
+        size_t min_cls = node.next.begin()->first;
+        size_t base = 0;
+        for (auto it = free_cells.begin(); ; ) {
+            size_t cell = it != free_cells.end() ? *it : cells.size();
+            if (cell > min_cls) {
+                base = cell - min_cls;
+                if (cells.size() < base + class_count) {
+                    size_t size = cells.size();
+                    cells.resize(base + class_count);
+                    fails.resize(cells.size(), 0);
+                    for (size_t n = size; n < cells.size(); n++) {
+                        free_cells.insert(n);
+                    }
+                }
+                bool fits = true;
+                for (const auto& cls_next_pair: node.next) {
+                    if (cells[base + cls_next_pair.first].check != -1) {
+                        fits = false;
+                        break;
+                    }
+                }
+                if (fits) {
+                    break;
+                }
+            }
+            if (it == free_cells.end()) {
+                it = free_cells.find(cell);     // the array has grown
+                continue;
+            }
+            if (++fails[cell] == max_fails) {
+                it = free_cells.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+
+        cells[node.cell].base = base;
+        for (const auto& cls_next_pair: node.next) {
+            cells[base + cls_next_pair.first].check = node.cell;
+            nodes[cls_next_pair.second].cell = base + cls_next_pair.first;
+            free_cells.erase(base + cls_next_pair.first);
+        }
+    }
+
+    for (const Node& node: nodes) {
+        cells[node.cell].fail = nodes[node.fail].cell;
+        cells[node.cell].match = node.match;
+    }
+}
+
+size_t PatternSet::find(const char* data, size_t size) const
+{
+    const Cell* cell_ptr = cells.data();
+    int32_t state = 0;
+
+    for (size_t pos = 0; pos < size; pos++) {
+        size_t cls = classes[static_cast<uint8_t>(data[pos])];
+        if (cls == 0) {
+            state = 0;      // no pattern contains the byte
+            continue;
+        }
+
+        while (true) {
+            int32_t next = cell_ptr[state].base + cls;
+            if (cell_ptr[next].check == state) {
+                state = next;
+                break;
+            }
+            if (state == 0) {
+                break;
+            }
+            state = cell_ptr[state].fail;
+        }
+
+        if (cell_ptr[state].match >= 0) {
+            return cell_ptr[state].match;
+        }
+    }
+
+    return npos;
+}
+
+const std::string& PatternSet::get_pattern(size_t index) const
+{
+    return patterns.at(index);
+}
+
+size_t PatternSet::get_size() const
+{
+    return patterns.size();
+}
+
+size_t PatternSet::get_states() const
+{
+    return states;
+}
+
+
+ContentFilter::ContentFilter(const std::string& path, std::chrono::milliseconds reload_interval):
+    path(path), reload_interval(reload_interval)
+{
+    reload();
+
+    if (reload_interval.count() != 0) {
+        reload_thread = std::thread(&ContentFilter::reload_handler, this);
+    }
+}
+
+ContentFilter::~ContentFilter()
+{
+    if (reload_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lk(mx);
+            stop_flag = true;
+        }
+        stop_cond.notify_one();
+        reload_thread.join();
+    }
+}
+
+bool ContentFilter::check(const std::string& text, std::string& reason)
+{
+    std::shared_ptr<const PatternSet> set_ptr = patterns.load(std::memory_order_acquire);
+
+    if (set_ptr->find(text.data(), text.size()) == PatternSet::npos) {
+        return true;
+    }
+
+    reason = "message blocked by the content filter";
+    return false;
+}
+
+bool ContentFilter::reload()
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0) {
+        throw FilterException("filter error: failed to stat " + path + ": " + std::strerror(errno));
+    }
+    if (st.st_mtim.tv_sec == loaded_mtime.tv_sec && st.st_mtim.tv_nsec == loaded_mtime.tv_nsec &&
+        st.st_size == loaded_size) {
+        return false;
+    }
+
+    std::ifstream in(path);
+    if (!in) {
+        throw FilterException("filter error: failed to open " + path);
+    }
+
+    std::vector<std::string> pattern_list;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        pattern_list.push_back(line);
+    }
+    if (in.bad()) {
+        throw FilterException("filter error: failed to read " + path);
+    }
+
+    auto set_ptr = std::make_shared<const PatternSet>(pattern_list);
+    patterns.store(set_ptr, std::memory_order_release);
+    loaded_mtime = st.st_mtim;
+    loaded_size = st.st_size;
+
+    static Format loaded(Loglevel::INFO, "filter: %1% patterns loaded from %2% (%3% states)");
+    log(loaded, set_ptr->get_size(), path, set_ptr->get_states());
+
+    return true;
+}
+
+void ContentFilter::reload_handler()
+{
+    std::string last_error;     // a failure is reported once, not every poll
+
+    std::unique_lock<std::mutex> lk(mx);
+    while (!stop_cond.wait_for(lk, reload_interval, [this] { return stop_flag; })) {
+        lk.unlock();
+        try {
+            reload();
+            last_error.clear();
+        }
+        catch (FilterException& e) {
+            if (last_error != e.what()) {
+                last_error = e.what();
+                static Format reload_failed(Loglevel::WARNING, "%1%, the patterns loaded before are kept");
+                log(reload_failed, last_error);
+            }
+        }
+        lk.lock();
+    }
+}
+
+
+} // namespace chat
@@ -0,0 +1,242 @@
+#include <handoff.h>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <socket.h>
+#include <protocol.h>
+#include <client.h>
+
+
+namespace chat {
+
+
+namespace {
+
+const size_t header_size = 5;           // record type and body size
+
+
+net::Address to_address(const std::string& path)
+{
+    try {
+        return net::Address::from_path(path);
+    }
+    catch (net::SocketException& e) {
+        throw HandoffException(std::string("handoff error: ") + e.what());
+    }
+}
+
+void put_bytes(std::vector<char>& buf, const char* data, size_t size)
+{
+    protocol::put_varint(buf, size);
+    buf.insert(buf.end(), data, data + size);
+}
+
+void get_bytes(const std::vector<char>& buf, size_t& pos, std::vector<char>& bytes)
+{
+    uint64_t size;
+
+    size_t len = protocol::get_varint(buf.data() + pos, buf.size() - pos, size);
+    if (len == 0 || buf.size() - pos - len < size) {
+        throw HandoffException("handoff error: malformed client record");
+    }
+    pos += len;
+
+    bytes.assign(buf.cbegin() + pos, buf.cbegin() + pos + size);
+    pos += size;
+}
+
+} // namespace
+
+
+Handoff::~Handoff()
+{
+    close(sockfd);
+}
+
+int Handoff::listen(const std::string& path)
+{
+    net::Address addr = to_address(path);
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        throw HandoffException(std::string("handoff socket error: ") + std::strerror(errno));
+    }
+
+    // the previous server may have left the socket file
+    unlink(path.c_str());
+
+    if (::bind(fd, addr.get_sockaddr(), addr.get_length()) != 0 || ::listen(fd, 1) != 0) {
+        close(fd);
+        throw HandoffException(std::string("handoff listen error: ") + std::strerror(errno));
+    }
+
+    return fd;
+}
+
+std::unique_ptr<Handoff> Handoff::accept(int listen_fd)
+{
+    int fd = ::accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+        throw HandoffException(std::string("handoff accept error: ") + std::strerror(errno));
+    }
+
+    return std::unique_ptr<Handoff>(new Handoff(fd));
+}
+
+std::unique_ptr<Handoff> Handoff::connect(const std::string& path)
+{
+    net::Address addr = to_address(path);
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        throw HandoffException(std::string("handoff socket error: ") + std::strerror(errno));
+    }
+
+    if (::connect(fd, addr.get_sockaddr(), addr.get_length()) != 0) {
+        close(fd);
+        throw HandoffException(std::string("handoff connect error: ") + std::strerror(errno));
+    }
+
+    return std::unique_ptr<Handoff>(new Handoff(fd));
+}
+
+void Handoff::send_listener(int fd)
+{
+    send_record(Record::LISTENER, fd, std::vector<char>());
+}
+
+void Handoff::send_tls_listener(int fd)
+{
+    send_record(Record::TLS_LISTENER, fd, std::vector<char>());
+}
+
+void Handoff::send_client(int fd, const Client::State& state)
+{
+    std::vector<char> body;
+
+    body.push_back(static_cast<char>(state.status));
+    body.push_back(static_cast<char>(state.version));
+    body.push_back(static_cast<char>(state.flags));
+    put_bytes(body, state.nick.data(), state.nick.size());
+    put_bytes(body, state.in_buf.data(), state.in_buf.size());
+    put_bytes(body, state.out_buf.data(), state.out_buf.size());
+    body.push_back(static_cast<char>(state.websocket));
+    put_bytes(body, state.ws_fragments.data(), state.ws_fragments.size());
+
+    send_record(Record::CLIENT, fd, body);
+}
+
+void Handoff::send_end()
+{
+    send_record(Record::END, -1, std::vector<char>());
+}
+
+void Handoff::send_record(Record type, int fd, const std::vector<char>& body)
+{
+    std::vector<char> buf;
+    uint32_t size = htonl(body.size());
+
+    buf.push_back(static_cast<char>(type));
+    buf.insert(buf.end(), (const char*)&size, (const char*)&size + sizeof(size));
+    buf.insert(buf.end(), body.cbegin(), body.cend());
+
+    iovec iov = {buf.data(), buf.size()};
+    char control[CMSG_SPACE(sizeof(int))] = {};
+
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (fd >= 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    // the descriptor goes with the first chunk, the rest of the record is sent as is
+    ssize_t sent = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+    while (sent >= 0 && static_cast<size_t>(sent) != buf.size()) {
+        ssize_t res = ::send(sockfd, buf.data() + sent, buf.size() - sent, MSG_NOSIGNAL);
+        sent = res < 0 ? res : sent + res;
+    }
+    if (sent < 0) {
+        throw HandoffException(std::string("handoff send error: ") + std::strerror(errno));
+    }
+}
+
+Handoff::Record Handoff::recv(int& fd, Client::State& state)
+{
+    char header[header_size];
+    iovec iov = {header, header_size};
+    char control[CMSG_SPACE(sizeof(int))] = {};
+
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    // reads the header only: the kernel doesn't merge data carrying different descriptors,
+    // so the received descriptor belongs to this record
+    ssize_t res = recvmsg(sockfd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    if (res != static_cast<ssize_t>(header_size)) {
+        throw HandoffException("handoff recv error: connection closed");
+    }
+
+    fd = -1;
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    Record type = static_cast<Record>(header[0]);
+    uint32_t size;
+    std::memcpy(&size, header + 1, sizeof(size));
+
+    std::vector<char> body(ntohl(size));
+    if (!body.empty() && ::recv(sockfd, body.data(), body.size(), MSG_WAITALL) != static_cast<ssize_t>(body.size())) {
+        throw HandoffException("handoff recv error: truncated record");
+    }
+
+    if (type == Record::CLIENT) {
+        if (body.size() < 3) {
+            throw HandoffException("handoff error: malformed client record");
+        }
+        state.status = static_cast<Client::Status>(body[0]);
+        state.version = static_cast<protocol::Version>(body[1]);
+        state.flags = static_cast<uint8_t>(body[2]);
+
+        size_t pos = 3;
+        std::vector<char> nick;
+        get_bytes(body, pos, nick);
+        state.nick.assign(nick.cbegin(), nick.cend());
+        get_bytes(body, pos, state.in_buf);
+        get_bytes(body, pos, state.out_buf);
+
+        // the WebSocket fields are absent in the records of a predecessor without WebSocket support
+        state.websocket = false;
+        state.ws_fragments.clear();
+        if (pos < body.size()) {
+            state.websocket = body[pos++] != 0;
+            std::vector<char> fragments;
+            get_bytes(body, pos, fragments);
+            state.ws_fragments.assign(fragments.cbegin(), fragments.cend());
+        }
+    }
+
+    return type;
+}
+
+
+} // namespace chat
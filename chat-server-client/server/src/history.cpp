@@ -0,0 +1,127 @@
+#include <history.h>
+
+#include <string>
+#include <vector>
+#include <protocol.h>
+#include <websocket.h>
+
+
+namespace chat {
+
+
+namespace {
+
+// leaves room for the batch frame header
+const size_t batch_max_size = protocol::v2_frame_max_size - 1 - protocol::varint_max_size;
+
+} // namespace
+
+
+History::History(size_t capacity):
+    ring(capacity)
+{
+    invalidate();
+}
+
+void History::set_capacity(size_t capacity)
+{
+    ring.assign(capacity, Entry());
+    head = 0;
+    count = 0;
+    invalidate();
+}
+
+size_t History::get_capacity() const
+{
+    return ring.size();
+}
+
+void History::push(const protocol::Frame& frame)
+{
+    if (ring.empty()) {
+        return;
+    }
+
+    Entry& entry = ring[(head + count) % ring.size()];
+    if (count == ring.size()) {
+        head = (head + 1) % ring.size();    // the oldest entry is overwritten
+    }
+    else {
+        count++;
+    }
+
+    entry.v1_frame.clear();
+    entry.v2_frame.clear();
+
+    if (frame.payload.size() <= protocol::v1_frame_max_size) {
+        protocol::encode_v1(frame.payload, entry.v1_frame);
+    }
+    protocol::encode(frame, entry.v2_frame);
+
+    invalidate();
+}
+
+const std::vector<char>& History::get_replay(protocol::Format fmt)
+{
+    size_t idx = static_cast<size_t>(fmt);
+    std::vector<char>& replay = replay_cache[idx];
+
+    if (replay_valid[idx]) {
+        return replay;
+    }
+    replay_valid[idx] = true;
+    replay.clear();
+
+    if (count == 0) {
+        return replay;
+    }
+
+    if (fmt == protocol::Format::V1) {
+        for (size_t n = 0; n < count; n++) {
+            const Entry& entry = ring[(head + n) % ring.size()];
+            replay.insert(replay.end(), entry.v1_frame.cbegin(), entry.v1_frame.cend());
+        }
+        return replay;
+    }
+
+    if (fmt == protocol::Format::WS_V1) {
+        // a text message per v1 frame payload
+        for (size_t n = 0; n < count; n++) {
+            const Entry& entry = ring[(head + n) % ring.size()];
+            if (!entry.v1_frame.empty()) {
+                protocol::encode_ws(protocol::WsOpcode::TEXT, entry.v1_frame.data() + sizeof(uint16_t),
+                                    entry.v1_frame.size() - sizeof(uint16_t), replay);
+            }
+        }
+        return replay;
+    }
+
+    // a compressed client gets a batch compressed at once,
+    // the batch is split if it would exceed the maximum frame size a client accepts
+    std::string body;
+    for (size_t n = 0; n < count; n++) {
+        const Entry& entry = ring[(head + n) % ring.size()];
+
+        if (!body.empty() && body.size() + entry.v2_frame.size() > batch_max_size) {
+            protocol::encode(protocol::Frame(protocol::Opcode::BATCH, body), fmt, replay);
+            body.clear();
+        }
+        body.append(entry.v2_frame.cbegin(), entry.v2_frame.cend());
+    }
+    protocol::encode(protocol::Frame(protocol::Opcode::BATCH, body), fmt, replay);
+
+    return replay;
+}
+
+size_t History::size() const
+{
+    return count;
+}
+
+void History::invalidate()
+{
+    replay_valid.fill(false);
+}
+
+
+} // namespace chat
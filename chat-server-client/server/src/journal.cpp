@@ -0,0 +1,431 @@
+#include <journal.h>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <protocol.h>
+#include <logger.h>
+
+
+using namespace logging;
+
+
+namespace chat {
+
+
+namespace {
+
+const size_t header_size = 8;           // record size and checksum
+const size_t end_marker_size = 4;       // zero record size following the last record
+
+
+/*
+ * FNV-1a hash, detects a record torn by a crash
+ */
+uint32_t checksum(const char* data, size_t size)
+{
+    uint32_t hash = 2166136261u;
+
+    for (size_t n = 0; n < size; n++) {
+        hash ^= static_cast<uint8_t>(data[n]);
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+uint32_t load32(const char* p)
+{
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return ntohl(value);
+}
+
+void store32(char* p, uint32_t value)
+{
+    value = htonl(value);
+    std::memcpy(p, &value, sizeof(value));
+}
+
+std::string errno_str(const std::string& what)
+{
+    return "journal " + what + " error: " + std::strerror(errno);
+}
+
+} // namespace
+
+
+Journal::Segment::~Segment()
+{
+    if (data) {
+        munmap(data, size);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+
+Journal::Journal(const std::string& dir, size_t segment_size, std::chrono::milliseconds sync_interval):
+    dir(dir), segment_size(segment_size), sync_interval(sync_interval)
+{
+    DIR* dirp = opendir(dir.c_str());
+    if (dirp == NULL) {
+        throw JournalException(errno_str("opendir"));
+    }
+
+    while (dirent* entry = readdir(dirp)) {
+        unsigned long long first_seq;
+        int len = 0;
+
+        if (std::sscanf(entry->d_name, "%llu.log%n", &first_seq, &len) == 1 &&
+            static_cast<size_t>(len) == std::strlen(entry->d_name)) {
+            segments.push_back(first_seq);
+        }
+    }
+    closedir(dirp);
+
+    std::sort(segments.begin(), segments.end());
+
+    if (segments.empty()) {
+        segments.push_back(0);
+        active = create_segment(0, segment_size);
+    }
+    else {
+        active = open_segment(segments.back(), true);
+    }
+
+    sync_thread = std::thread(&Journal::sync_handler, this);
+}
+
+Journal::~Journal()
+{
+    {
+        std::lock_guard<std::mutex> lk(mx);
+        stop_flag = true;
+    }
+    sync_cond.notify_one();
+    sync_thread.join();
+}
+
+uint64_t Journal::append(const protocol::Frame& frame)
+{
+    static thread_local std::vector<char> buf;
+
+    buf.assign(header_size, 0);
+    protocol::encode(frame, buf);
+    store32(buf.data(), buf.size() - header_size);
+    store32(buf.data() + 4, checksum(buf.data() + header_size, buf.size() - header_size));
+
+    std::lock_guard<std::mutex> lk(mx);
+
+    if (active->pos + buf.size() + end_marker_size > active->size) {
+        // the full segment is flushed and sealed by the sync thread
+        sealed.push_back(active);
+        active = create_segment(active->next_seq, buf.size() + end_marker_size);
+        segments.push_back(active->first_seq);
+    }
+
+    Segment& segment = *active;
+    uint64_t seq = segment.next_seq;
+
+    if (segment.index.empty() || segment.pos - segment.index.back().pos >= index_interval) {
+        segment.index.push_back(IndexEntry{static_cast<uint32_t>(seq - segment.first_seq),
+                                           static_cast<uint32_t>(segment.pos)});
+    }
+
+    std::memcpy(segment.data + segment.pos, buf.data(), buf.size());
+    segment.pos += buf.size();
+    segment.next_seq++;
+    std::memset(segment.data + segment.pos, 0, end_marker_size);
+
+    unsynced_bytes += buf.size();
+    if (unsynced_bytes >= sync_bytes) {
+        sync_cond.notify_one();
+    }
+
+    return seq;
+}
+
+std::vector<protocol::Frame> Journal::read(uint64_t seq, size_t max)
+{
+    std::lock_guard<std::mutex> lk(mx);
+    std::vector<protocol::Frame> frames;
+
+    if (segments.empty() || seq < segments.front()) {
+        seq = segments.front();     // the older segments have been deleted
+    }
+
+    while (frames.size() < max && seq < active->next_seq) {
+        auto it = std::upper_bound(segments.cbegin(), segments.cend(), seq) - 1;
+        SegmentPtr segment = *it == active->first_seq ? active : open_segment(*it, false);
+
+        // the last index entry not after the required record
+        auto entry = std::upper_bound(segment->index.cbegin(), segment->index.cend(), seq - segment->first_seq,
+                                      [] (uint64_t rel_seq, const IndexEntry& e) {
+                                          return rel_seq < e.seq;
+                                      }) - 1;
+        uint64_t cur = segment->first_seq + entry->seq;
+        size_t pos = entry->pos;
+
+        while (cur < segment->next_seq && frames.size() < max) {
+            size_t size = load32(segment->data + pos);
+
+            if (cur >= seq) {
+                protocol::Frame frame;
+                protocol::decode(segment->data + pos + header_size, size, frame);
+                frames.push_back(std::move(frame));
+            }
+            pos += header_size + size;
+            cur++;
+        }
+
+        seq = cur;
+    }
+
+    return frames;
+}
+
+void Journal::release(uint64_t seq)
+{
+    std::lock_guard<std::mutex> lk(mx);
+    released_seq = std::max(released_seq, seq);
+}
+
+uint64_t Journal::get_first_seq() const
+{
+    std::lock_guard<std::mutex> lk(mx);
+    return segments.front();
+}
+
+uint64_t Journal::get_next_seq() const
+{
+    std::lock_guard<std::mutex> lk(mx);
+    return active->next_seq;
+}
+
+std::string Journal::segment_path(uint64_t first_seq, const char* ext) const
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "%020llu.%s", static_cast<unsigned long long>(first_seq), ext);
+
+    return dir + "/" + name;
+}
+
+Journal::SegmentPtr Journal::open_segment(uint64_t first_seq, bool writable)
+{
+    auto segment = std::make_shared<Segment>();
+    segment->first_seq = first_seq;
+
+    segment->fd = open(segment_path(first_seq, "log").c_str(), (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (segment->fd < 0) {
+        throw JournalException(errno_str("open"));
+    }
+
+    struct stat st;
+    if (fstat(segment->fd, &st) != 0) {
+        throw JournalException(errno_str("fstat"));
+    }
+    segment->size = st.st_size;
+
+    void* data = mmap(NULL, segment->size, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, segment->fd, 0);
+    if (data == MAP_FAILED) {
+        throw JournalException(errno_str("mmap"));
+    }
+    segment->data = static_cast<char*>(data);
+
+    // a sealed segment has its index stored, the rest is scanned
+    if (!writable) {
+        int idx_fd = open(segment_path(first_seq, "idx").c_str(), O_RDONLY | O_CLOEXEC);
+        if (idx_fd >= 0) {
+            char entry[sizeof(uint32_t) * 2];
+            while (::read(idx_fd, entry, sizeof(entry)) == sizeof(entry)) {
+                segment->index.push_back(IndexEntry{load32(entry), load32(entry + 4)});
+            }
+            close(idx_fd);
+        }
+    }
+
+    scan_segment(*segment);
+
+    return segment;
+}
+
+Journal::SegmentPtr Journal::create_segment(uint64_t first_seq, size_t min_size)
+{
+    auto segment = std::make_shared<Segment>();
+    segment->first_seq = first_seq;
+    segment->next_seq = first_seq;
+    segment->size = std::max(segment_size, min_size);
+
+    segment->fd = open(segment_path(first_seq, "log").c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (segment->fd < 0) {
+        throw JournalException(errno_str("open"));
+    }
+
+    // reserves the disk space: a write to a mapped file on a full disk is SIGBUS, not an error
+    int res = posix_fallocate(segment->fd, 0, segment->size);
+    if (res != 0) {
+        throw JournalException(std::string("journal fallocate error: ") + std::strerror(res));
+    }
+
+    void* data = mmap(NULL, segment->size, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0);
+    if (data == MAP_FAILED) {
+        throw JournalException(errno_str("mmap"));
+    }
+    segment->data = static_cast<char*>(data);
+
+    dir_dirty = true;
+
+    return segment;
+}
+
+void Journal::scan_segment(Segment& segment)
+{
+    size_t pos = 0;
+    uint64_t seq = segment.first_seq;
+
+    if (!segment.index.empty()) {
+        pos = segment.index.back().pos;
+        seq += segment.index.back().seq;
+    }
+
+    while (segment.size - pos >= header_size) {
+        size_t size = load32(segment.data + pos);
+        if (size == 0 || segment.size - pos - header_size < size ||
+            load32(segment.data + pos + 4) != checksum(segment.data + pos + header_size, size)) {
+            break;      // the end of the records or a torn record
+        }
+
+        if (segment.index.empty() || pos - segment.index.back().pos >= index_interval) {
+            segment.index.push_back(IndexEntry{static_cast<uint32_t>(seq - segment.first_seq),
+                                               static_cast<uint32_t>(pos)});
+        }
+
+        pos += header_size + size;
+        seq++;
+    }
+
+    // a torn record is overwritten by the next append
+    segment.pos = pos;
+    segment.synced_pos = pos;
+    segment.next_seq = seq;
+}
+
+void Journal::write_index(const Segment& segment)
+{
+    std::vector<char> buf(segment.index.size() * sizeof(uint32_t) * 2);
+
+    for (size_t n = 0; n < segment.index.size(); n++) {
+        store32(&buf[n * 8], segment.index[n].seq);
+        store32(&buf[n * 8 + 4], segment.index[n].pos);
+    }
+
+    // the index is replaced atomically, a lost index is rebuilt by a scan
+    std::string path = segment_path(segment.first_seq, "idx");
+    std::string tmp_path = path + ".tmp";
+
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw JournalException(errno_str("open"));
+    }
+    ssize_t res = write(fd, buf.data(), buf.size());
+    close(fd);
+
+    if (res != static_cast<ssize_t>(buf.size()) || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        throw JournalException(errno_str("index write"));
+    }
+}
+
+void Journal::sync_handler()
+{
+    std::unique_lock<std::mutex> lk(mx);
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+
+    while (true) {
+        sync_cond.wait_for(lk, sync_interval, [this] {
+            return stop_flag || unsynced_bytes >= sync_bytes;
+        });
+
+        SegmentPtr segment = active;
+        size_t from = segment->synced_pos;
+        size_t to = segment->pos;
+        std::vector<SegmentPtr> to_seal;
+        to_seal.swap(sealed);
+        bool stopping = stop_flag;
+
+        // a segment is wholly released if the next one starts not after the released frames end.
+        // It is deleted after it is sealed below, so its index is not written back
+        std::vector<uint64_t> to_delete;
+        while (segments.size() > 1 && segments[1] <= released_seq) {
+            to_delete.push_back(segments.front());
+            segments.erase(segments.begin());
+        }
+        bool sync_dir = dir_dirty || !to_delete.empty();
+
+        dir_dirty = false;
+        unsynced_bytes = 0;
+
+        // the appends go on while the data is being flushed
+        lk.unlock();
+
+        try {
+            for (const SegmentPtr& s: to_seal) {
+                if (msync(s->data, s->size, MS_SYNC) != 0) {
+                    throw JournalException(errno_str("msync"));
+                }
+                write_index(*s);
+            }
+
+            if (to > from) {
+                // msync requires a page aligned address, the end marker is flushed too
+                size_t start = from / page_size * page_size;
+                size_t end = std::min(to + end_marker_size, segment->size);
+                if (msync(segment->data + start, end - start, MS_SYNC) != 0) {
+                    throw JournalException(errno_str("msync"));
+                }
+            }
+
+            for (uint64_t first_seq: to_delete) {
+                if (unlink(segment_path(first_seq, "log").c_str()) != 0 ||
+                    (unlink(segment_path(first_seq, "idx").c_str()) != 0 && errno != ENOENT)) {
+                    throw JournalException(errno_str("unlink"));
+                }
+            }
+
+            if (sync_dir) {
+                int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (dir_fd < 0 || fsync(dir_fd) != 0) {
+                    close(dir_fd);
+                    throw JournalException(errno_str("fsync"));
+                }
+                close(dir_fd);
+            }
+        }
+        catch (JournalException& e) {
+            Logger::get_instance()->error(e.what());
+        }
+
+        lk.lock();
+        segment->synced_pos = std::max(segment->synced_pos, to);
+
+        if (stopping) {
+            break;
+        }
+    }
+}
+
+
+} // namespace chat
@@ -0,0 +1,194 @@
+#include <link.h>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <memory>
+#include <socket.h>
+#include <epoll.h>
+#include <coro.h>
+#include <protocol.h>
+#include <bus.h>
+
+
+namespace chat {
+
+
+namespace {
+
+const uint8_t hello_type = 0;
+const uint64_t link_version = 1;
+
+
+net::Address peer_address(const net::Socket& sock)
+{
+    net::Address addr;
+    getpeername(sock.get_sockfd(), addr.get_sockaddr(), &addr.get_length());
+    return addr;
+}
+
+} // namespace
+
+
+const size_t Link::frame_max_size = protocol::v2_frame_max_size + 4096;     // a chat message and the nick
+
+
+Link::Link(io::Epoll& epoll, std::unique_ptr<net::Socket> sock_ptr):
+    peer_addr(peer_address(*sock_ptr)), peer_str(peer_addr.str()), sock(epoll, std::move(sock_ptr)),
+    state(State::HANDSHAKE), outgoing(false)
+{ }
+
+Link::Link(io::Epoll& epoll, const net::Address& peer_addr):
+    peer_addr(peer_addr), peer_str(peer_addr.str()),
+    sock(epoll, std::unique_ptr<net::Socket>(new net::Socket(peer_addr.get_family()))),
+    state(State::CONNECTING), outgoing(true)
+{ }
+
+io::AsyncSocket& Link::get_socket()
+{
+    return sock;
+}
+
+const net::Address& Link::get_peer_address() const
+{
+    return peer_addr;
+}
+
+void Link::open(uint64_t node_id)
+{
+    std::vector<char> body;
+    protocol::put_varint(body, link_version);
+    protocol::put_varint(body, node_id);
+    put_frame(hello_type, body);
+
+    state = State::HANDSHAKE;
+}
+
+void Link::on_hello(const std::vector<char>& frame)
+{
+    uint64_t version;
+
+    size_t len = !frame.empty() && static_cast<uint8_t>(frame[0]) == hello_type ?
+        protocol::get_varint(frame.data() + 1, frame.size() - 1, version) : 0;
+    if (len == 0 || protocol::get_varint(frame.data() + 1 + len, frame.size() - 1 - len, node_id) == 0) {
+        throw LinkException("link " + peer_str + " error: hello expected");
+    }
+    if (version != link_version) {
+        throw LinkException("link " + peer_str + " error: unsupported link version");
+    }
+
+    state = State::ACTIVE;
+}
+
+Bus::Record Link::parse_record(const std::vector<char>& frame) const
+{
+    if (frame.empty()) {
+        throw LinkException("link " + peer_str + " error: malformed record");
+    }
+
+    const char* body = frame.data() + 1;
+    size_t body_size = frame.size() - 1;
+
+    uint64_t nick_size;
+    size_t len = protocol::get_varint(body, body_size, nick_size);
+    if (len == 0 || body_size - len < nick_size) {
+        throw LinkException("link " + peer_str + " error: malformed record");
+    }
+
+    Bus::Record record;
+    record.event = static_cast<Bus::Event>(frame[0]);
+    record.worker = 0;
+    record.nick.assign(body + len, nick_size);
+    record.payload.assign(body + len + nick_size, body + body_size);
+
+    return record;
+}
+
+void Link::send(Bus::Event event, const std::string& nick, const std::string& payload)
+{
+    std::vector<char> body;
+    protocol::put_varint(body, nick.size());
+    body.insert(body.end(), nick.cbegin(), nick.cend());
+    body.insert(body.end(), payload.cbegin(), payload.cend());
+
+    // write_buf holds the records being written, so the peer is behind by both the buffers
+    size_t buffered = write_buf.size() + out_buf.size() + body.size();
+    if (event == Bus::Event::BROADCAST && buffered > broadcast_max_buffered) {
+        overruns++;
+        return;
+    }
+    if (buffered > out_buf_max_size) {
+        throw LinkException("link " + peer_str + " send error: output buffer overflow");
+    }
+    put_frame(static_cast<uint8_t>(event), body);
+}
+
+void Link::put_frame(uint8_t type, const std::vector<char>& body)
+{
+    protocol::put_varint(out_buf, 1 + body.size());
+    out_buf.push_back(static_cast<char>(type));
+    out_buf.insert(out_buf.end(), body.cbegin(), body.cend());
+}
+
+bool Link::has_pending_data() const
+{
+    return !out_buf.empty();
+}
+
+const std::vector<char>& Link::take_pending()
+{
+    // the buffers capacity is reused, so a busy link doesn't allocate
+    write_buf.clear();
+    write_buf.swap(out_buf);
+
+    return write_buf;
+}
+
+size_t Link::take_overruns()
+{
+    size_t n = overruns;
+    overruns = 0;
+
+    return n;
+}
+
+bool Link::is_writing() const
+{
+    return writing;
+}
+
+void Link::set_writing(bool w)
+{
+    writing = w;
+    if (!writing) {
+        write_buf.clear();      // written, see send
+    }
+}
+
+Link::State Link::get_state() const
+{
+    return state;
+}
+
+bool Link::is_outgoing() const
+{
+    return outgoing;
+}
+
+uint64_t Link::get_node_id() const
+{
+    return node_id;
+}
+
+int Link::get_sockfd() const
+{
+    return sock.get_sockfd();
+}
+
+std::string Link::str() const
+{
+    return peer_str;
+}
+
+
+} // namespace chat
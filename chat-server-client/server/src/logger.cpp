@@ -8,12 +8,42 @@
 #include <memory>
 #include <mutex>
 #include <map>
+#include <thread>
+#include <utility>
 #include <syslog.h>
+#include <queue.hpp>
+#include <affinity.h>
+#include <binlog.h>
 
 
 namespace logging {
 
 
+namespace {
+
+// formats of the messages logged as text while the binary log is open
+Format error_text(Loglevel::ERROR, "%1%");
+Format warning_text(Loglevel::WARNING, "%1%");
+Format info_text(Loglevel::INFO, "%1%");
+Format debug_text(Loglevel::DEBUG, "%1%");
+
+Format& get_text_format(Loglevel lvl)
+{
+    switch (lvl) {
+    case Loglevel::ERROR:
+        return error_text;
+    case Loglevel::WARNING:
+        return warning_text;
+    case Loglevel::INFO:
+        return info_text;
+    default:
+        return debug_text;
+    }
+}
+
+} // namespace
+
+
 void Sink::set_level(Loglevel lvl)
 {
     level = lvl;
@@ -72,12 +102,29 @@ void Logger::add_sink(const std::shared_ptr<Sink>& sink_ptr)
 void Logger::del_sink(const std::shared_ptr<Sink>& sink_ptr)
 {
     std::lock_guard<std::mutex> lk(mx);
-    std::remove_if(sinks.begin(), sinks.end(), [&sink_ptr] (const std::shared_ptr<Sink>& sp) {
+    sinks.erase(std::remove_if(sinks.begin(), sinks.end(), [&sink_ptr] (const std::shared_ptr<Sink>& sp) {
         return sp.get() == sink_ptr.get();
-    });
+    }), sinks.end());
 }
 
 void Logger::log(Loglevel lvl, const std::string& msg)
+{
+    BinaryLog* binlog_ptr = BinaryLog::get_instance();
+    if (binlog_ptr->is_open()) {
+        binlog_ptr->record(get_text_format(lvl), msg);
+        return;
+    }
+
+    // log_thread is changed by the main thread only, before or after the other threads run
+    if (log_thread.joinable()) {
+        records.push(std::make_shared<std::pair<Loglevel, std::string>>(lvl, msg));
+    }
+    else {
+        write(lvl, msg);
+    }
+}
+
+void Logger::write(Loglevel lvl, const std::string& msg)
 {
     std::lock_guard<std::mutex> lk(mx);
     for (auto sink_ptr: sinks) {
@@ -85,6 +132,41 @@ void Logger::log(Loglevel lvl, const std::string& msg)
     }
 }
 
+void Logger::start_async(const concurrent::CpuList& cpus)
+{
+    if (!log_thread.joinable()) {
+        log_thread = std::thread(&Logger::log_handler, this, cpus);
+    }
+}
+
+void Logger::stop_async()
+{
+    if (log_thread.joinable()) {
+        records.push(RecordPtr());
+        log_thread.join();
+    }
+}
+
+void Logger::log_handler(const concurrent::CpuList& cpus)
+{
+    try {
+        concurrent::set_thread_affinity(cpus);
+    }
+    catch (concurrent::AffinityException& e) {
+        write(Loglevel::WARNING, e.what());
+    }
+
+    RecordPtr record_ptr;
+
+    while (true) {
+        records.wait_pop(record_ptr);
+        if (!record_ptr) {
+            break;      // stop marker, all the messages before it are written
+        }
+        write(record_ptr->first, record_ptr->second);
+    }
+}
+
 void Logger::debug(const std::string& msg)
 {
     log(Loglevel::DEBUG, msg);
@@ -0,0 +1,217 @@
+#include <mailbox.h>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <protocol.h>
+
+
+namespace chat {
+
+
+namespace {
+
+const size_t spill_min_capacity = 1 << 20;
+const size_t mem_compact_size = 64 << 10;       // consumed in-memory bytes the queue is compacted after
+
+} // namespace
+
+
+Mailbox::Mailbox(size_t max_messages, size_t max_bytes, size_t spill_threshold, const std::string& spill_dir):
+    max_messages(max_messages), max_bytes(max_bytes), spill_threshold(spill_threshold), spill_dir(spill_dir)
+{ }
+
+Mailbox::~Mailbox()
+{
+    release_spill();
+}
+
+void Mailbox::push(const std::string& payload)
+{
+    std::vector<char> header;
+    protocol::put_varint(header, payload.size());
+    size_t record_size = header.size() + payload.size();
+
+    if (record_size > max_bytes) {
+        dropped++;
+        return;
+    }
+    while (count != 0 && (count >= max_messages || bytes + record_size > max_bytes)) {
+        pop_front();
+        dropped++;
+    }
+
+    // once spilled, the records go to the file untill it is drained to keep the order
+    if (spill_fd < 0 && mem.size() - mem_head + record_size <= spill_threshold) {
+        mem.insert(mem.end(), header.cbegin(), header.cend());
+        mem.insert(mem.end(), payload.cbegin(), payload.cend());
+    }
+    else {
+        spill(header.data(), header.size());
+        spill(payload.data(), payload.size());
+    }
+
+    count++;
+    bytes += record_size;
+}
+
+size_t Mailbox::pop_chunk(protocol::Format fmt, size_t chunk_size, std::vector<char>& buf)
+{
+    std::string body;
+    size_t popped = 0;
+    size_t size = 0;
+
+    while (count != 0 && (popped == 0 || size < chunk_size)) {
+        protocol::Frame frame(protocol::Opcode::MESSAGE, pop());
+        popped++;
+        size += frame.payload.size();
+
+        if (protocol::is_v1(fmt)) {
+            if (frame.payload.size() <= protocol::v1_frame_max_size) {
+                protocol::encode(frame, fmt, buf);
+            }
+        }
+        else {
+            std::vector<char> encoded;
+            protocol::encode(frame, encoded);
+            body.append(encoded.cbegin(), encoded.cend());
+        }
+    }
+
+    if (!body.empty()) {
+        protocol::encode(protocol::Frame(protocol::Opcode::BATCH, body), fmt, buf);
+    }
+
+    return popped;
+}
+
+bool Mailbox::empty() const
+{
+    return count == 0;
+}
+
+size_t Mailbox::size() const
+{
+    return count;
+}
+
+size_t Mailbox::get_dropped() const
+{
+    return dropped;
+}
+
+void Mailbox::spill(const char* data, size_t size)
+{
+    if (spill_fd < 0) {
+        // an unnamed file: it is removed when closed, even if the server crashes
+        spill_fd = open(spill_dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (spill_fd < 0) {
+            throw MailboxException(std::string("mailbox spill file error: ") + std::strerror(errno));
+        }
+    }
+
+    // the consumed space is reused: the records are moved to the file start if at most a half is left,
+    // so the file grows only with the records kept (bounded by max_bytes)
+    if (spill_tail + size > spill_capacity && spill_head >= spill_capacity / 2) {
+        std::memmove(spill_data, spill_data + spill_head, spill_tail - spill_head);
+        spill_tail -= spill_head;
+        spill_head = 0;
+    }
+
+    if (spill_tail + size > spill_capacity) {
+        size_t capacity = std::max(spill_min_capacity, spill_capacity);
+        while (capacity < spill_tail + size) {
+            capacity *= 2;
+        }
+
+        if (ftruncate(spill_fd, capacity) != 0) {
+            throw MailboxException(std::string("mailbox spill file error: ") + std::strerror(errno));
+        }
+
+        void* mapped = spill_data ? mremap(spill_data, spill_capacity, capacity, MREMAP_MAYMOVE)
+                                  : mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, spill_fd, 0);
+        if (mapped == MAP_FAILED) {
+            throw MailboxException(std::string("mailbox spill file error: ") + std::strerror(errno));
+        }
+        spill_data = static_cast<char*>(mapped);
+        spill_capacity = capacity;
+    }
+
+    std::memcpy(spill_data + spill_tail, data, size);
+    spill_tail += size;
+}
+
+void Mailbox::release_spill()
+{
+    if (spill_data) {
+        munmap(spill_data, spill_capacity);
+    }
+    if (spill_fd >= 0) {
+        close(spill_fd);
+    }
+
+    spill_fd = -1;
+    spill_data = nullptr;
+    spill_capacity = spill_head = spill_tail = 0;
+}
+
+std::string Mailbox::front() const
+{
+    uint64_t size;
+    size_t len;
+
+    if (mem_head != mem.size()) {
+        len = protocol::get_varint(mem.data() + mem_head, mem.size() - mem_head, size);
+        return std::string(mem.data() + mem_head + len, size);
+    }
+
+    len = protocol::get_varint(spill_data + spill_head, spill_tail - spill_head, size);
+    return std::string(spill_data + spill_head + len, size);
+}
+
+void Mailbox::pop_front()
+{
+    uint64_t size;
+    size_t len;
+
+    if (mem_head != mem.size()) {
+        len = protocol::get_varint(mem.data() + mem_head, mem.size() - mem_head, size);
+        mem_head += len + size;
+
+        if (mem_head == mem.size()) {
+            mem.clear();
+            mem_head = 0;
+        }
+        else if (mem_head >= mem_compact_size) {
+            mem.erase(mem.begin(), mem.begin() + mem_head);
+            mem_head = 0;
+        }
+    }
+    else {
+        len = protocol::get_varint(spill_data + spill_head, spill_tail - spill_head, size);
+        spill_head += len + size;
+
+        // the drained file is released, new records go to memory again
+        if (spill_head == spill_tail) {
+            release_spill();
+        }
+    }
+
+    count--;
+    bytes -= len + size;
+}
+
+std::string Mailbox::pop()
+{
+    std::string payload = front();
+    pop_front();
+    return payload;
+}
+
+
+} // namespace chat
@@ -1,11 +1,24 @@
 #include <stdint.h>
 #include <string>
+#include <vector>
 #include <iostream>
+#include <thread>
+#include <csignal>
+#include <cerrno>
+#include <cstring>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/prctl.h>
 #include <boost/program_options.hpp>
 #include <boost/format.hpp>
 
 #include <server.h>
 #include <logger.h>
+#include <binlog.h>
+#include <affinity.h>
+#include <bus.h>
 
 
 using namespace logging;
@@ -15,9 +28,65 @@ namespace popt = boost::program_options;
 struct Arguments {
     std::string iface;
     uint16_t port;
+    double msg_rate;
+    double msg_burst;
+    size_t queue_size;
+    size_t handshake_timeout;
+    size_t coalesce_us;
+    size_t coalesce_bytes;
+    size_t history_size;
+    size_t mailbox_size;
+    std::string mailbox_dir;
+    size_t mailbox_ttl;
+    std::string journal_dir;
+    size_t journal_segment_size;
+    size_t journal_sync_interval;
+    std::string filter_path;
+    size_t filter_reload_interval;
+    std::vector<std::string> unix_paths;
+    std::string shm_path;
+    size_t shm_ring_size;
+    std::string handoff_path;
+    std::string takeover_path;
+    concurrent::CpuList io_cpus;
+    concurrent::CpuList worker_cpus;
+    concurrent::CpuList log_cpus;
+    std::string binlog_path;
+    concurrent::CpuList irq_cpus;
+    size_t workers;
+    size_t bus_size;
+    uint16_t link_port;
+    uint16_t tls_port;
+    std::string tls_cert_path;
+    std::string tls_key_path;
+    std::vector<net::Address> peers;
 };
 
 
+/*
+ * Parses a peer address: ip:port or [ip6]:port
+ */
+net::Address parse_peer(const std::string& peer)
+{
+    size_t pos = peer.rfind(':');
+    if (pos == std::string::npos || pos == 0) {
+        throw popt::error("invalid peer address " + peer);
+    }
+
+    std::string ip = peer.substr(0, pos);
+    if (ip.front() == '[' && ip.back() == ']') {
+        ip = ip.substr(1, ip.size() - 2);
+    }
+
+    try {
+        return net::Address(ip, std::stoi(peer.substr(pos + 1)));
+    }
+    catch (std::exception& e) {
+        throw popt::error("invalid peer address " + peer);
+    }
+}
+
+
 Arguments parse_args(int argc, char** argv)
 {
     Arguments args;
@@ -26,7 +95,39 @@ Arguments parse_args(int argc, char** argv)
     options.add_options()
             ("help,h", "show help")
             ("iface,i", popt::value<std::string>()->required(), "interface to listen on")
-            ("port,p", popt::value<uint16_t>()->required(), "port to listen on");
+            ("port,p", popt::value<uint16_t>()->required(), "port to listen on")
+            ("unix", popt::value<std::vector<std::string>>()->composing(), "unix socket path to listen on too (may be repeated)")
+            ("shm", popt::value<std::string>()->default_value(""), "unix socket path to pass shared memory channels to co-located clients through")
+            ("shm-ring-size", popt::value<size_t>()->default_value(4), "shared memory channel ring size of every direction, MB")
+            ("rate", popt::value<double>()->default_value(100), "messages per second accepted from a client (0 - unlimited)")
+            ("burst", popt::value<double>()->default_value(200), "messages accepted from a client at once")
+            ("queue-size", popt::value<size_t>()->default_value(65536), "maximum messages waiting to be processed")
+            ("handshake-timeout", popt::value<size_t>()->default_value(10000), "milliseconds a client has to send its nick in")
+            ("coalesce-us", popt::value<size_t>()->default_value(0), "microseconds the messages to a client are held for to be sent together (0 - disabled)")
+            ("coalesce-bytes", popt::value<size_t>()->default_value(16384), "held messages size sent at once")
+            ("history", popt::value<size_t>()->default_value(0), "last messages replayed to a client on join")
+            ("mailbox-size", popt::value<size_t>()->default_value(0), "messages kept for an offline user (0 - offline delivery disabled)")
+            ("mailbox-dir", popt::value<std::string>()->default_value("/tmp"), "directory large mailboxes are spilled to")
+            ("mailbox-ttl", popt::value<size_t>()->default_value(86400), "seconds an offline user and its mail are kept for")
+            ("journal", popt::value<std::string>()->default_value(""), "directory to journal the messages to")
+            ("journal-segment-size", popt::value<size_t>()->default_value(64), "journal segment file size, MB")
+            ("journal-sync", popt::value<size_t>()->default_value(10), "milliseconds the journaled messages may be not flushed to the disk for")
+            ("filter", popt::value<std::string>()->default_value(""), "file of the terms and URLs the messages containing are blocked, a pattern per line")
+            ("filter-reload", popt::value<size_t>()->default_value(1000), "milliseconds the filter file is checked for changes every (0 - never)")
+            ("handoff-path", popt::value<std::string>()->default_value(""), "unix socket to pass the connections to a restarted server through")
+            ("takeover", popt::value<std::string>()->default_value(""), "unix socket to take the connections of a running server over from")
+            ("io-cpus", popt::value<std::string>(), "cpus to pin the I/O thread to (like 0-1,4)")
+            ("worker-cpus", popt::value<std::string>(), "cpus to pin the message processing thread to")
+            ("log-cpus", popt::value<std::string>(), "cpus to pin the logging thread to")
+            ("binlog", popt::value<std::string>()->default_value(""), "file to write the log to in binary (see BinlogDecode) instead of the console and syslog")
+            ("irq-cpus", popt::value<std::string>(), "cpus to steer the interrupts to (requires root)")
+            ("workers", popt::value<size_t>()->default_value(1), "worker processes sharing the port")
+            ("bus-size", popt::value<size_t>()->default_value(32), "messages ring size of a worker, MB")
+            ("tls-port", popt::value<uint16_t>()->default_value(0), "port to accept TLS connections on (0 - none)")
+            ("tls-cert", popt::value<std::string>()->default_value(""), "TLS certificate chain file (PEM)")
+            ("tls-key", popt::value<std::string>()->default_value(""), "TLS private key file (PEM)")
+            ("link-port", popt::value<uint16_t>()->default_value(0), "port to accept the peer nodes links on (0 - none)")
+            ("peer", popt::value<std::vector<std::string>>()->composing(), "peer node link address ip:port (may be repeated)");
 
     popt::variables_map vm;
 
@@ -42,29 +143,314 @@ Arguments parse_args(int argc, char** argv)
         popt::notify(vm);
         args.iface = vm["iface"].as<std::string>();
         args.port = vm["port"].as<uint16_t>();
+        if (vm.count("unix")) {
+            args.unix_paths = vm["unix"].as<std::vector<std::string>>();
+        }
+        args.shm_path = vm["shm"].as<std::string>();
+        args.shm_ring_size = vm["shm-ring-size"].as<size_t>();
+        if (args.shm_ring_size == 0) {
+            throw popt::error("the option '--shm-ring-size' must be positive");
+        }
+        args.msg_rate = vm["rate"].as<double>();
+        args.msg_burst = vm["burst"].as<double>();
+        args.queue_size = vm["queue-size"].as<size_t>();
+        args.handshake_timeout = vm["handshake-timeout"].as<size_t>();
+        args.coalesce_us = vm["coalesce-us"].as<size_t>();
+        args.coalesce_bytes = vm["coalesce-bytes"].as<size_t>();
+        args.history_size = vm["history"].as<size_t>();
+        args.mailbox_size = vm["mailbox-size"].as<size_t>();
+        args.mailbox_dir = vm["mailbox-dir"].as<std::string>();
+        args.mailbox_ttl = vm["mailbox-ttl"].as<size_t>();
+        args.journal_dir = vm["journal"].as<std::string>();
+        args.journal_segment_size = vm["journal-segment-size"].as<size_t>();
+        args.journal_sync_interval = vm["journal-sync"].as<size_t>();
+        args.filter_path = vm["filter"].as<std::string>();
+        args.filter_reload_interval = vm["filter-reload"].as<size_t>();
+        args.handoff_path = vm["handoff-path"].as<std::string>();
+        args.takeover_path = vm["takeover"].as<std::string>();
+        args.binlog_path = vm["binlog"].as<std::string>();
+        args.workers = vm["workers"].as<size_t>();
+        args.bus_size = vm["bus-size"].as<size_t>();
+
+        args.tls_port = vm["tls-port"].as<uint16_t>();
+        args.tls_cert_path = vm["tls-cert"].as<std::string>();
+        args.tls_key_path = vm["tls-key"].as<std::string>();
+        if (args.tls_port != 0 && (args.tls_cert_path.empty() || args.tls_key_path.empty())) {
+            throw popt::error("the option '--tls-port' requires '--tls-cert' and '--tls-key'");
+        }
+
+        args.link_port = vm["link-port"].as<uint16_t>();
+        if (vm.count("peer")) {
+            for (const std::string& peer: vm["peer"].as<std::vector<std::string>>()) {
+                args.peers.push_back(parse_peer(peer));
+            }
+        }
+
+        if (args.workers == 0) {
+            throw popt::error("the option '--workers' must be positive");
+        }
+        if (args.workers > 1 && (!args.handoff_path.empty() || !args.takeover_path.empty())) {
+            throw popt::error("the options '--handoff-path' and '--takeover' can't be used with '--workers'");
+        }
+        if (args.workers > 1 && (args.link_port != 0 || !args.peers.empty())) {
+            throw popt::error("the options '--link-port' and '--peer' can't be used with '--workers'");
+        }
+
+        if (vm.count("io-cpus")) {
+            args.io_cpus = concurrent::parse_cpu_list(vm["io-cpus"].as<std::string>());
+        }
+        if (vm.count("worker-cpus")) {
+            args.worker_cpus = concurrent::parse_cpu_list(vm["worker-cpus"].as<std::string>());
+        }
+        if (vm.count("log-cpus")) {
+            args.log_cpus = concurrent::parse_cpu_list(vm["log-cpus"].as<std::string>());
+        }
+        if (vm.count("irq-cpus")) {
+            args.irq_cpus = concurrent::parse_cpu_list(vm["irq-cpus"].as<std::string>());
+        }
     }
     catch(popt::error& e) {
         std::cout << e.what() << std::endl;
         std::exit(1);
     }
+    catch(concurrent::AffinityException& e) {
+        std::cout << e.what() << std::endl;
+        std::exit(1);
+    }
 
     return args;
 }
 
-int main(int argc, char** argv)
+/*
+ * Starts the logging thread: the binary log writer if the binary log path is given, the text logger otherwise.
+ */
+void start_logging(const Arguments& args, const std::string& binlog_path)
 {
-    Arguments args = parse_args(argc, argv);
+    if (!binlog_path.empty()) {
+        try {
+            BinaryLog::get_instance()->open(binlog_path, args.log_cpus);
+            return;
+        }
+        catch (BinaryLogException& e) {
+            Logger::get_instance()->error(e.what());
+        }
+    }
+    Logger::get_instance()->start_async(args.log_cpus);
+}
 
-    Logger::get_instance()->add_sink(std::make_shared<ConsoleSink>(Loglevel::DEBUG));
-    Logger::get_instance()->add_sink(std::make_shared<SyslogSink>(Loglevel::INFO));
+/*
+ * Writes the messages logged so far and stops the logging thread.
+ */
+void stop_logging()
+{
+    BinaryLog::get_instance()->close();
+    Logger::get_instance()->stop_async();
+}
 
+/*
+ * Runs a server untill it is stopped by a signal or an error.
+ * params:
+ *      bus_ptr - bus attached to the worker the server is run by (null if there is a single server)
+ *      signals - signals stopping the server, blocked by the caller
+ */
+void run_server(const Arguments& args, chat::Bus* bus_ptr, const sigset_t& signals)
+{
     try {
         chat::ChatServer server(args.iface, args.port);
-        server.start();
+        server.set_rate_limit(args.msg_rate, args.msg_burst);
+        server.set_in_queue_limit(args.queue_size);
+        server.set_handshake_timeout(std::chrono::milliseconds(args.handshake_timeout));
+        server.set_coalescing(std::chrono::microseconds(args.coalesce_us), args.coalesce_bytes);
+        // a unix socket can't be shared by the workers, it is served by the first one
+        if (!bus_ptr || bus_ptr->get_worker() == 0) {
+            for (const std::string& path: args.unix_paths) {
+                server.add_listener(net::Address::from_path(path));
+            }
+            if (!args.shm_path.empty()) {
+                server.set_shm(net::Address::from_path(args.shm_path), args.shm_ring_size << 20);
+            }
+        }
+        server.set_history_size(args.history_size);
+        server.set_mailbox(args.mailbox_size, args.mailbox_dir, std::chrono::seconds(args.mailbox_ttl));
+        if (!args.journal_dir.empty()) {
+            std::string journal_dir = args.journal_dir;
+            // every worker journals the messages it has received to its own directory
+            if (bus_ptr) {
+                journal_dir += "/worker-" + std::to_string(bus_ptr->get_worker());
+                if (mkdir(journal_dir.c_str(), 0755) < 0 && errno != EEXIST) {
+                    throw std::runtime_error("failed to create journal directory " + journal_dir);
+                }
+            }
+            server.set_journal(journal_dir, args.journal_segment_size << 20,
+                               std::chrono::milliseconds(args.journal_sync_interval));
+        }
+        if (!args.filter_path.empty()) {
+            server.add_filter(std::make_shared<chat::ContentFilter>(args.filter_path,
+                                                                    std::chrono::milliseconds(args.filter_reload_interval)));
+        }
+        if (args.tls_port != 0) {
+            server.set_tls(net::Address(args.iface, args.tls_port), args.tls_cert_path, args.tls_key_path);
+        }
+        if (args.link_port != 0) {
+            server.set_link_address(net::Address(args.iface, args.link_port));
+        }
+        for (const net::Address& peer: args.peers) {
+            server.add_peer(peer);
+        }
+        if (bus_ptr) {
+            server.set_reuse_port(true);
+            server.set_bus(bus_ptr);
+        }
+        server.set_handoff_path(args.handoff_path);
+        server.set_takeover_path(args.takeover_path);
+        server.set_io_cpus(args.io_cpus);
+        server.set_worker_cpus(args.worker_cpus);
+
+        std::thread signal_thread([&server, &signals] {
+            int sig;
+            sigwait(&signals, &sig);
+            server.stop();
+        });
+
+        try {
+            server.start();
+        }
+        catch (std::runtime_error& e) {
+            Logger::get_instance()->error(e.what());
+        }
+
+        // wakes signal_thread up if the server has stopped by itself
+        pthread_kill(signal_thread.native_handle(), SIGTERM);
+        signal_thread.join();
     }
     catch (std::runtime_error& e) {
         Logger::get_instance()->error(e.what());
     }
+}
+
+/*
+ * Forks the workers sharing the bus, waits for them to exit.
+ * The workers are stopped on a signal or once any of them has exited:
+ * the users of an exited worker would stay online for the others.
+ */
+void run_workers(const Arguments& args, const sigset_t& signals)
+{
+    // the bus is created before fork, so it is shared by all the workers
+    chat::Bus bus(args.workers, args.bus_size << 20);
+
+    sigset_t master_signals = signals;
+    sigaddset(&master_signals, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &master_signals, NULL);
+
+    pid_t master_pid = getpid();
+    std::vector<pid_t> pids;
+
+    for (size_t n = 0; n < args.workers; n++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            Logger::get_instance()->error(std::string("fork error: ") + std::strerror(errno));
+            break;
+        }
+
+        if (pid == 0) {
+            // the worker is stopped with the master even if the master is killed
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            if (getppid() != master_pid) {
+                std::exit(0);
+            }
+
+            sigset_t child_signals;
+            sigemptyset(&child_signals);
+            sigaddset(&child_signals, SIGCHLD);
+            pthread_sigmask(SIG_UNBLOCK, &child_signals, NULL);
+
+            bus.attach(n);
+            start_logging(args, args.binlog_path.empty() ? "" : args.binlog_path + ".worker-" + std::to_string(n));
+            run_server(args, &bus, signals);
+            stop_logging();
+            std::exit(0);
+        }
+
+        pids.push_back(pid);
+    }
+
+    Logger::get_instance()->info(str(boost::format("%1% workers started") % pids.size()));
+
+    bool stopping = pids.size() != args.workers;
+    size_t alive = pids.size();
+
+    if (stopping) {
+        for (pid_t pid: pids) {
+            kill(pid, SIGTERM);
+        }
+    }
+
+    while (alive != 0) {
+        int sig;
+        sigwait(&master_signals, &sig);
+
+        if (sig == SIGCHLD) {
+            pid_t pid;
+            int status;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                alive--;
+                if (!stopping) {
+                    Logger::get_instance()->error(str(boost::format("worker %1% exited unexpectedly, stopping") % pid));
+                }
+            }
+        }
+        else {
+            Logger::get_instance()->info("stopping workers");
+        }
+
+        if (!stopping && alive != 0) {
+            stopping = true;
+            for (pid_t pid: pids) {
+                kill(pid, SIGTERM);
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Arguments args = parse_args(argc, argv);
+
+    // SIGINT and SIGTERM are handled by signal_thread only (the mask is inherited by the server and logging threads)
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    Logger::get_instance()->add_sink(std::make_shared<ConsoleSink>(Loglevel::DEBUG));
+    Logger::get_instance()->add_sink(std::make_shared<SyslogSink>(Loglevel::INFO));
+
+    if (!args.irq_cpus.empty()) {
+        try {
+            size_t moved = concurrent::set_irq_affinity(args.irq_cpus);
+            Logger::get_instance()->info(str(boost::format("%1% interrupts moved to cpus %2%")
+                                                % moved % concurrent::format_cpu_list(args.irq_cpus)));
+        }
+        catch (concurrent::AffinityException& e) {
+            Logger::get_instance()->warning(e.what());
+        }
+    }
+
+    if (args.workers > 1) {
+        // threads don't survive fork, so the workers start their own logging threads
+        try {
+            run_workers(args, signals);
+        }
+        catch (chat::BusException& e) {
+            Logger::get_instance()->error(e.what());
+        }
+        return 0;
+    }
+
+    start_logging(args, args.binlog_path);
+    run_server(args, nullptr, signals);
+    stop_logging();
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,289 @@
+#include <protocol.h>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <arpa/inet.h>
+#include <compression.h>
+#include <websocket.h>
+
+
+namespace protocol {
+
+
+void put_varint(std::vector<char>& buf, uint64_t value)
+{
+    while (value >= 0x80) {
+        buf.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    buf.push_back(static_cast<char>(value));
+}
+
+size_t get_varint(const char* data, size_t size, uint64_t& value)
+{
+    value = 0;
+
+    for (size_t n = 0; n < size; n++) {
+        if (n == varint_max_size) {
+            throw ProtocolException("protocol error: varint too long");
+        }
+
+        uint8_t byte = static_cast<uint8_t>(data[n]);
+        // the last byte holds the 64th bit only, the higher ones would be shifted out
+        if (n == varint_max_size - 1 && byte > 1) {
+            throw ProtocolException("protocol error: varint too long");
+        }
+        value |= static_cast<uint64_t>(byte & 0x7f) << (7 * n);
+
+        if ((byte & 0x80) == 0) {
+            return n + 1;
+        }
+    }
+
+    return 0;
+}
+
+namespace {
+
+void encode_v2(uint8_t op, uint64_t request_id, const std::vector<char>& prefix,
+               const std::string& payload, std::vector<char>& buf)
+{
+    std::vector<char> request_id_buf;
+    put_varint(request_id_buf, request_id);
+
+    put_varint(buf, 1 + request_id_buf.size() + prefix.size() + payload.size());
+    buf.push_back(static_cast<char>(op));
+    buf.insert(buf.end(), request_id_buf.cbegin(), request_id_buf.cend());
+    buf.insert(buf.end(), prefix.cbegin(), prefix.cend());
+    buf.insert(buf.end(), payload.cbegin(), payload.cend());
+}
+
+} // namespace
+
+
+bool is_v1(Format fmt)
+{
+    return fmt == Format::V1 || fmt == Format::WS_V1;
+}
+
+void encode(const Frame& frame, std::vector<char>& buf)
+{
+    encode_v2(static_cast<uint8_t>(frame.op), frame.request_id, std::vector<char>(), frame.payload, buf);
+}
+
+void encode(const Frame& frame, Format fmt, std::vector<char>& buf)
+{
+    if (fmt == Format::V1) {
+        encode_v1(frame.payload, buf);
+        return;
+    }
+
+    // a v1 client gets the messages fitting v1 framing whatever its transport is
+    if (fmt == Format::WS_V1) {
+        if (frame.payload.size() > v1_frame_max_size) {
+            throw ProtocolException("protocol error: message too long");
+        }
+        encode_ws(WsOpcode::TEXT, frame.payload.data(), frame.payload.size(), buf);
+        return;
+    }
+
+    if (fmt == Format::WS_V2) {
+        std::vector<char> body;
+        body.push_back(static_cast<char>(frame.op));
+        put_varint(body, frame.request_id);
+        body.insert(body.end(), frame.payload.cbegin(), frame.payload.cend());
+        encode_ws(WsOpcode::BINARY, body.data(), body.size(), buf);
+        return;
+    }
+
+    if (fmt == Format::V2_COMPRESSED && frame.payload.size() >= compress_min_size) {
+        std::string compressed = compression::compress(frame.payload.data(), frame.payload.size());
+
+        std::vector<char> original_size;
+        put_varint(original_size, frame.payload.size());
+
+        // sends the payload as is if it is incompressible
+        if (original_size.size() + compressed.size() < frame.payload.size()) {
+            encode_v2(static_cast<uint8_t>(frame.op) | opcode_compressed, frame.request_id,
+                      original_size, compressed, buf);
+            return;
+        }
+    }
+
+    encode(frame, buf);
+}
+
+void encode_v1(const std::string& msg, std::vector<char>& buf)
+{
+    if (msg.size() > v1_frame_max_size) {
+        throw ProtocolException("protocol error: message too long");
+    }
+
+    uint16_t size = htons(msg.size());
+    buf.insert(buf.end(), (const char*)&size, (const char*)&size + sizeof(size));
+    buf.insert(buf.end(), msg.cbegin(), msg.cend());
+}
+
+void encode_batch(const std::vector<Frame>& frames, std::vector<char>& buf)
+{
+    std::vector<char> body;
+    for (const Frame& frame: frames) {
+        encode(frame, body);
+    }
+
+    Frame batch(Opcode::BATCH, std::string(body.cbegin(), body.cend()));
+    encode(batch, buf);
+}
+
+void decode_body(const char* data, size_t size, Frame& frame)
+{
+    if (size == 0) {
+        throw ProtocolException("protocol error: empty frame");
+    }
+
+    uint8_t op = static_cast<uint8_t>(data[0]);
+    frame.op = static_cast<Opcode>(op & ~opcode_compressed);
+
+    size_t len = get_varint(data + 1, size - 1, frame.request_id);
+    if (len == 0) {
+        throw ProtocolException("protocol error: truncated request id");
+    }
+    data += 1 + len;
+    size -= 1 + len;
+
+    if ((op & opcode_compressed) == 0) {
+        frame.payload.assign(data, data + size);
+        return;
+    }
+
+    uint64_t original_size;
+    len = get_varint(data, size, original_size);
+    if (len == 0) {
+        throw ProtocolException("protocol error: truncated compressed payload size");
+    }
+    if (original_size > v2_frame_max_size) {
+        throw ProtocolException("protocol error: compressed payload too long");
+    }
+
+    try {
+        frame.payload = compression::decompress(data + len, size - len, original_size);
+    }
+    catch (compression::CompressionException& e) {
+        throw ProtocolException(std::string("protocol error: ") + e.what());
+    }
+}
+
+size_t decode(const char* data, size_t size, Frame& frame)
+{
+    uint64_t body_size;
+
+    size_t len = get_varint(data, size, body_size);
+    if (len == 0) {
+        return 0;
+    }
+    if (body_size > v2_frame_max_size) {
+        throw ProtocolException("protocol error: frame too long");
+    }
+    if (size - len < body_size) {
+        return 0;
+    }
+
+    decode_body(data + len, body_size, frame);
+
+    return len + body_size;
+}
+
+size_t decode_v1(const char* data, size_t size, std::string& msg)
+{
+    uint16_t msg_size;
+
+    if (size < sizeof(msg_size)) {
+        return 0;
+    }
+    std::memcpy(&msg_size, data, sizeof(msg_size));
+    msg_size = ntohs(msg_size);
+
+    if (size - sizeof(msg_size) < msg_size) {
+        return 0;
+    }
+    msg.assign(data + sizeof(msg_size), data + sizeof(msg_size) + msg_size);
+
+    return sizeof(msg_size) + msg_size;
+}
+
+void unbatch(const Frame& batch, std::vector<Frame>& frames)
+{
+    const char* data = batch.payload.data();
+    size_t size = batch.payload.size();
+
+    while (size != 0) {
+        Frame frame;
+
+        size_t len = decode(data, size, frame);
+        if (len == 0) {
+            throw ProtocolException("protocol error: truncated batch");
+        }
+        if (frame.op == Opcode::BATCH) {
+            throw ProtocolException("protocol error: nested batch");
+        }
+        frames.push_back(std::move(frame));
+
+        data += len;
+        size -= len;
+    }
+}
+
+bool parse_hello(const std::string& payload, Hello& hello)
+{
+    if (payload.empty() || payload[0] != static_cast<char>(Opcode::HELLO)) {
+        return false;
+    }
+    if (payload.size() < 3) {
+        throw ProtocolException("protocol error: truncated hello");
+    }
+
+    hello.version = static_cast<Version>(payload[1]);
+    hello.flags = static_cast<uint8_t>(payload[2]);
+    hello.nick = payload.substr(3);
+
+    return true;
+}
+
+std::string make_hello(const Hello& hello)
+{
+    std::string payload;
+
+    payload.push_back(static_cast<char>(Opcode::HELLO));
+    payload.push_back(static_cast<char>(hello.version));
+    payload.push_back(static_cast<char>(hello.flags));
+    payload += hello.nick;
+
+    return payload;
+}
+
+std::string make_private(const std::string& nick, const std::string& text)
+{
+    std::vector<char> buf;
+    put_varint(buf, nick.size());
+
+    return std::string(buf.cbegin(), buf.cend()) + nick + text;
+}
+
+void parse_private(const std::string& payload, std::string& nick, std::string& text)
+{
+    uint64_t nick_size;
+
+    size_t len = get_varint(payload.data(), payload.size(), nick_size);
+    if (len == 0 || payload.size() - len < nick_size) {
+        throw ProtocolException("protocol error: malformed private message");
+    }
+
+    nick = payload.substr(len, nick_size);
+    text = payload.substr(len + nick_size);
+}
+
+
+} // namespace protocol
@@ -6,13 +6,24 @@
 #include <vector>
 #include <thread>
 #include <algorithm>
+#include <random>
+#include <unistd.h>
 #include <boost/format.hpp>
 
 #include <socket.h>
 #include <epoll.h>
 #include <queue.hpp>
 #include <logger.h>
+#include <binlog.h>
+#include <protocol.h>
+#include <text.h>
 #include <client.h>
+#include <handoff.h>
+#include <affinity.h>
+#include <bus.h>
+#include <link.h>
+#include <session.h>
+#include <shm.h>
 
 
 namespace chat {
@@ -25,23 +36,253 @@ using namespace logging;
 
 ChatServer::ChatServer(const std::string& iface, uint16_t port,
     size_t max_clients, size_t listen_queue_size):
-    epoll(max_clients)
+    epoll(max_clients), listen_addresses{net::Address(iface, port)}, listen_queue_size(listen_queue_size),
+    stop_flag(false)
 {
-    server_sock.bind(iface, port);
-    server_sock.listen(listen_queue_size);
+    std::random_device rd;
+    node_id = (static_cast<uint64_t>(rd()) << 32) | rd();
+
+    command_handlers.fill(&ChatServer::on_unknown);
+    command_handlers[static_cast<uint8_t>(protocol::Opcode::SEND)]    = &ChatServer::on_send;
+    command_handlers[static_cast<uint8_t>(protocol::Opcode::PRIVATE)] = &ChatServer::on_private;
+    command_handlers[static_cast<uint8_t>(protocol::Opcode::LIST)]    = &ChatServer::on_list;
 }
 
 void ChatServer::start()
 {
+    if (!journal_dir.empty()) {
+        open_journal();
+    }
+
+    if (!takeover_path.empty()) {
+        take_over();
+    }
+
+    // the listening sockets may have been passed by the previous server
+    if (listeners.empty()) {
+        for (const net::Address& addr: listen_addresses) {
+            if (addr.get_family() == net::Family::UNIX) {
+                unlink(addr.str().c_str());     // the socket file left by the previous server
+            }
+
+            auto listener_ptr = std::unique_ptr<net::Socket>(new net::Socket(addr.get_family()));
+            if (addr.get_family() != net::Family::UNIX) {
+                // a restarted node binds the port while the connections of the previous one are in TIME_WAIT
+                listener_ptr->set_reuse();
+                if (reuse_port) {
+                    listener_ptr->set_reuse_port();
+                }
+            }
+            listener_ptr->bind(addr);
+            listener_ptr->listen(listen_queue_size);
+            listener_ptr->set_nonblocking();
+            listeners.push_back(std::move(listener_ptr));
+        }
+    }
+
+    if (bus_ptr && (!link_addresses.empty() || !peers.empty())) {
+        throw ChatServerException("the links can't be used with the bus");
+    }
+    if (!link_addresses.empty()) {
+        link_listener = std::unique_ptr<net::Socket>(new net::Socket(link_addresses.front().get_family()));
+        link_listener->set_reuse();
+        link_listener->bind(link_addresses.front());
+        link_listener->listen(listen_queue_size);
+        link_listener->set_nonblocking();
+    }
+
+    if (!tls_addresses.empty()) {
+        // the connections completing the handshake are added by io_handler
+        auto tls_ctx_ptr = std::make_shared<net::TlsContext>(tls_cert_path, tls_key_path);
+        tls_terminator = std::unique_ptr<net::TlsTerminator>(new net::TlsTerminator(tls_ctx_ptr,
+            [this] (std::unique_ptr<net::Socket> sock_ptr, bool relayed) {
+                net::Socket* raw_sock_ptr = sock_ptr.release();
+                epoll.post([this, raw_sock_ptr, relayed] { on_tls_client(raw_sock_ptr, relayed); });
+            }, handshake_timeout));
+
+        // the listening socket may have been passed by the previous server too
+        if (!tls_listener) {
+            tls_listener = std::unique_ptr<net::Socket>(new net::Socket(tls_addresses.front().get_family()));
+            tls_listener->set_reuse();
+            if (reuse_port) {
+                tls_listener->set_reuse_port();
+            }
+            tls_listener->bind(tls_addresses.front());
+            tls_listener->listen(listen_queue_size);
+            tls_listener->set_nonblocking();
+        }
+    }
+
+    if (!shm_addresses.empty()) {
+        // the socket file may have been left by the previous server, a successor binds its own
+        unlink(shm_addresses.front().str().c_str());
+        shm_listener = std::unique_ptr<net::Socket>(new net::Socket(net::Family::UNIX));
+        shm_listener->bind(shm_addresses.front());
+        shm_listener->listen(listen_queue_size);
+        shm_listener->set_nonblocking();
+    }
+
+    if (!handoff_path.empty()) {
+        handoff_listen_fd = Handoff::listen(handoff_path);
+    }
+
+    if (tls_terminator) {
+        tls_terminator->start();
+    }
+
     std::thread io_thread(&ChatServer::io_handler, this);   // start io_handler in a new thread
+
+    // pinned after the threads above are started, so they don't inherit the mask
+    try {
+        concurrent::set_thread_affinity(worker_cpus);
+    }
+    catch (concurrent::AffinityException& e) {
+        Logger::get_instance()->warning(e.what());
+    }
     message_handler();                                      // start message handler in the current thread
 
     io_thread.join();
+
+    // the relayed TLS connections are closed by the terminator
+    if (tls_terminator) {
+        tls_terminator->stop();
+        tls_listener->close();
+    }
 }
 
 void ChatServer::stop()
 {
-    stop_flag = true;
+    if (stop_flag.exchange(true)) {
+        return;
+    }
+
+    // the stop is processed by io_handler (see on_stop_marker)
+    epoll.post(std::bind(&ChatServer::on_stop_marker, this));
+}
+
+std::shared_ptr<LocalSession> ChatServer::connect_local(const std::string& nick)
+{
+    if (nick.empty() || !Client::is_valid_nick(nick)) {
+        throw ChatServerException("local session error: invalid nick");
+    }
+
+    // the server keeps the session untill it is closed, so the pointer passed on close is only compared
+    auto session_ptr = std::make_shared<LocalSession>(nick,
+        [this, nick] (const protocol::Frame& frame) {
+            return on_local_send(nick, frame);
+        },
+        [this] (LocalSession* session_ptr) {
+            std::string nick = session_ptr->get_nick();
+            epoll.post([this, nick, session_ptr] { on_local_close(nick, session_ptr); });
+        });
+
+    epoll.post([this, session_ptr] { on_local_connect(session_ptr); });
+
+    return session_ptr;
+}
+
+void ChatServer::set_rate_limit(double rate, double burst)
+{
+    msg_rate = rate;
+    msg_burst = burst;
+}
+
+void ChatServer::set_in_queue_limit(size_t size)
+{
+    in_queue_max_size = size;
+}
+
+void ChatServer::set_handshake_timeout(std::chrono::milliseconds timeout)
+{
+    handshake_timeout = timeout;
+}
+
+void ChatServer::set_coalescing(std::chrono::microseconds window, size_t max_bytes)
+{
+    coalesce_window = window;
+    coalesce_max_bytes = max_bytes;
+}
+
+void ChatServer::add_listener(const net::Address& addr)
+{
+    listen_addresses.push_back(addr);
+}
+
+void ChatServer::set_tls(const net::Address& addr, const std::string& cert_path, const std::string& key_path)
+{
+    tls_addresses.assign(1, addr);
+    tls_cert_path = cert_path;
+    tls_key_path = key_path;
+}
+
+void ChatServer::set_shm(const net::Address& addr, size_t ring_size)
+{
+    shm_addresses = {addr};
+    shm_ring_size = ring_size;
+}
+
+void ChatServer::set_history_size(size_t size)
+{
+    history.set_capacity(size);
+}
+
+void ChatServer::set_mailbox(size_t size, const std::string& dir, std::chrono::seconds ttl)
+{
+    mailbox_size = size;
+    mailbox_dir = dir;
+    mailbox_ttl = ttl;
+}
+
+void ChatServer::set_journal(const std::string& dir, size_t segment_size, std::chrono::milliseconds sync_interval)
+{
+    journal_dir = dir;
+    journal_segment_size = segment_size;
+    journal_sync_interval = sync_interval;
+}
+
+void ChatServer::add_filter(std::shared_ptr<MessageFilter> filter_ptr)
+{
+    filters.push_back(filter_ptr);
+}
+
+void ChatServer::set_io_cpus(const concurrent::CpuList& cpus)
+{
+    io_cpus = cpus;
+}
+
+void ChatServer::set_worker_cpus(const concurrent::CpuList& cpus)
+{
+    worker_cpus = cpus;
+}
+
+void ChatServer::set_reuse_port(bool reuse)
+{
+    reuse_port = reuse;
+}
+
+void ChatServer::set_bus(Bus* bus)
+{
+    bus_ptr = bus;
+}
+
+void ChatServer::set_link_address(const net::Address& addr)
+{
+    link_addresses.assign(1, addr);
+}
+
+void ChatServer::add_peer(const net::Address& addr)
+{
+    peers.push_back(Peer{addr, nullptr, 0});
+}
+
+void ChatServer::set_handoff_path(const std::string& path)
+{
+    handoff_path = path;
+}
+
+void ChatServer::set_takeover_path(const std::string& path)
+{
+    takeover_path = path;
 }
 
 
@@ -49,158 +290,1764 @@ void ChatServer::message_handler()
 {
     auto msg_ptr = std::shared_ptr<Message>();
 
-    while (!stop_flag) {
+    while (true) {
         in_queue.wait_pop(msg_ptr);
+        if (!msg_ptr) {
+            break;      // stop marker pushed by io_handler after the last received message
+        }
 
-        Logger::get_instance()->debug("got message from user " + msg_ptr->get_source());
+        static Format got_message(Loglevel::DEBUG, "got message from user %1%");
+        log(got_message, msg_ptr->get_source());
 
-        if (msg_ptr->get_message() == "list") {
-            on_list(msg_ptr);
-        }
-        else {
-            on_send(msg_ptr);
+        (this->*command_handlers[static_cast<uint8_t>(msg_ptr->get_opcode())])(msg_ptr);
+
+        // the responses are posted at once when there is nothing more to process
+        if (out_tasks.size() >= out_batch_size || in_queue.size() == 0) {
+            epoll.post_batch(out_tasks);
         }
     }
+
+    // lets io_handler know all the responses are posted
+    out_tasks.push_back(std::bind(&ChatServer::on_stop_marker, this));
+    epoll.post_batch(out_tasks);
+}
+
+void ChatServer::post_message(MessagePtr msg_ptr)
+{
+    out_tasks.push_back(std::bind(&ChatServer::on_message, this, msg_ptr));
 }
 
 void ChatServer::on_list(MessagePtr msg_ptr)
 {
     // get a status of the users, format status list and send it back
-    auto resp_msg_ptr = std::make_shared<Message>(get_status_list(), msg_ptr->get_source());
+    auto resp_msg_ptr = std::make_shared<Message>(protocol::Opcode::RESULT, get_status_list(),
+                                                  msg_ptr->get_source(), msg_ptr->get_request_id());
     resp_msg_ptr->add_destination(msg_ptr->get_source());
-    out_queue.push(resp_msg_ptr);
+    post_message(resp_msg_ptr);
 }
 
 void ChatServer::on_send(MessagePtr msg_ptr)
 {
-    auto resp_msg_ptr = std::make_shared<Message>(str(boost::format("%1%: %2%")
+    // the text is shown by the terminals of the other users as is
+    std::string text = msg_ptr->get_message();
+    if (!text::sanitize(text)) {
+        send_error(msg_ptr, "message is not valid UTF-8");
+        return;
+    }
+    if (!filter_text(msg_ptr, text)) {
+        return;
+    }
+
+    auto resp_msg_ptr = std::make_shared<Message>(protocol::Opcode::MESSAGE,
+                                                  str(boost::format("%1%: %2%")
                                                         % msg_ptr->get_source()
-                                                        % msg_ptr->get_message()), msg_ptr->get_source());
+                                                        % text), msg_ptr->get_source());
+    resp_msg_ptr->set_recorded(true);
+    journal_message(protocol::Frame(resp_msg_ptr->get_opcode(), resp_msg_ptr->get_message()));
 
-    // send the message to all online users but source
-    for (const auto& nick_client_pair: clients) {
-        if (nick_client_pair.first != msg_ptr->get_source() &&
-            nick_client_pair.second->get_status() == Client::Status::ONLINE) {
-            resp_msg_ptr->add_destination(nick_client_pair.first);
+    // send the message to all online users but source,
+    // the offline ones get it on reconnect if offline delivery is enabled
+    {
+        std::lock_guard<std::mutex> lk(users_mx);
+        for (const auto& nick_status_pair: users) {
+            if (nick_status_pair.first != msg_ptr->get_source() &&
+                (nick_status_pair.second == Client::Status::ONLINE || mailbox_size != 0)) {
+                resp_msg_ptr->add_destination(nick_status_pair.first);
+            }
+        }
+    }
+    post_message(resp_msg_ptr);
+}
+
+void ChatServer::on_private(MessagePtr msg_ptr)
+{
+    std::string nick, text;
+
+    try {
+        protocol::parse_private(msg_ptr->get_message(), nick, text);
+    }
+    catch (protocol::ProtocolException& e) {
+        send_error(msg_ptr, e.what());
+        return;
+    }
+
+    if (!text::sanitize(text)) {
+        send_error(msg_ptr, "message is not valid UTF-8");
+        return;
+    }
+    if (!filter_text(msg_ptr, text)) {
+        return;
+    }
+
+    if (!can_deliver(nick)) {
+        send_error(msg_ptr, "user " + nick + " is not online");
+        return;
+    }
+
+    auto resp_msg_ptr = std::make_shared<Message>(protocol::Opcode::MESSAGE,
+                                                  str(boost::format("%1% (private): %2%")
+                                                        % msg_ptr->get_source()
+                                                        % text), msg_ptr->get_source());
+    resp_msg_ptr->add_destination(nick);
+    journal_message(protocol::Frame(protocol::Opcode::PRIVATE, protocol::make_private(nick, resp_msg_ptr->get_message())));
+    post_message(resp_msg_ptr);
+}
+
+void ChatServer::on_unknown(MessagePtr msg_ptr)
+{
+    send_error(msg_ptr, "unknown command");
+}
+
+void ChatServer::send_error(MessagePtr msg_ptr, const std::string& error)
+{
+    auto resp_msg_ptr = std::make_shared<Message>(protocol::Opcode::ERROR, error,
+                                                  msg_ptr->get_source(), msg_ptr->get_request_id());
+    resp_msg_ptr->add_destination(msg_ptr->get_source());
+    post_message(resp_msg_ptr);
+}
+
+bool ChatServer::filter_text(MessagePtr msg_ptr, const std::string& text)
+{
+    std::string reason;
+
+    for (const auto& filter_ptr: filters) {
+        if (!filter_ptr->check(text, reason)) {
+            static Format blocked(Loglevel::DEBUG, "message from user %1% blocked by a filter");
+            log(blocked, msg_ptr->get_source());
+            send_error(msg_ptr, reason);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void ChatServer::journal_message(const protocol::Frame& frame)
+{
+    if (!journal_ptr) {
+        return;
+    }
+
+    try {
+        uint64_t seq = journal_ptr->append(frame);
+
+        // the journal keeps the broadcast messages the history is restored from
+        if (frame.op == protocol::Opcode::MESSAGE) {
+            history_seqs.push_back(seq);
+            if (history_seqs.size() > history.get_capacity()) {
+                history_seqs.pop_front();
+            }
+        }
+        journal_ptr->release(history_seqs.empty() ? seq + 1 : history_seqs.front());
+    }
+    catch (JournalException& e) {
+        Logger::get_instance()->error(e.what());
+    }
+}
+
+void ChatServer::open_journal()
+{
+    journal_ptr = std::unique_ptr<Journal>(new Journal(journal_dir, journal_segment_size, journal_sync_interval));
+
+    // broadcast messages are journaled as MESSAGE frames, private ones as PRIVATE frames,
+    // so the journal is read backwards untill the history is full
+    size_t capacity = history.get_capacity();
+    uint64_t first_seq = journal_ptr->get_first_seq();
+    uint64_t next_seq = journal_ptr->get_next_seq();
+    std::deque<protocol::Frame> messages;
+
+    for (uint64_t end = next_seq; end != first_seq && messages.size() < capacity; ) {
+        uint64_t start = end - std::min<uint64_t>(end - first_seq, capacity);
+        std::vector<protocol::Frame> frames = journal_ptr->read(start, end - start);
+
+        for (size_t n = frames.size(); n-- != 0 && messages.size() < capacity; ) {
+            if (frames[n].op == protocol::Opcode::MESSAGE) {
+                messages.push_front(std::move(frames[n]));
+                history_seqs.push_front(start + n);
+            }
         }
+        end = start;
+    }
+
+    for (const protocol::Frame& frame: messages) {
+        history.push(frame);
     }
-    out_queue.push(resp_msg_ptr);
+
+    Logger::get_instance()->info(str(boost::format("journal opened, %1% messages journaled") % next_seq));
 }
 
 std::string ChatServer::get_status_list()
 {
     std::stringstream out;
+    std::lock_guard<std::mutex> lk(users_mx);
 
-    for (const auto& nick_client_pair: clients) {
+    for (const auto& nick_status_pair: users) {
+        if (nick_status_pair.second != Client::Status::ONLINE && remote_users.count(nick_status_pair.first)) {
+            continue;   // the user has reconnected to another worker
+        }
+        out << std::left
+            << std::setw(10)
+            << nick_status_pair.first
+            << ": "
+            << Client::status_str.at(nick_status_pair.second)
+            << "\n";
+    }
+
+    for (const auto& nick_worker_pair: remote_users) {
+        auto it = users.find(nick_worker_pair.first);
+        if (it != users.end() && it->second == Client::Status::ONLINE) {
+            continue;   // the worker leave is not received yet
+        }
         out << std::left
             << std::setw(10)
-            << nick_client_pair.first
+            << nick_worker_pair.first
             << ": "
-            << Client::status_str.at(nick_client_pair.second->get_status())
+            << Client::status_str.at(Client::Status::ONLINE)
             << "\n";
     }
 
     return out.str();
 }
 
+bool ChatServer::can_deliver(const std::string& nick)
+{
+    std::lock_guard<std::mutex> lk(users_mx);
+
+    auto it = users.find(nick);
+    if (it != users.end() && (it->second == Client::Status::ONLINE || mailbox_size != 0)) {
+        return true;
+    }
+    return remote_users.count(nick) != 0;
+}
+
 
 
 void ChatServer::io_handler()
 {
+    // pins the thread before any buffer is allocated by it, so the buffers are allocated
+    // on the thread NUMA node (the cpus are checked by parse_cpu_list, so it doesn't fail)
+    try {
+        concurrent::set_thread_affinity(io_cpus);
+    }
+    catch (concurrent::AffinityException& e) {
+        Logger::get_instance()->warning(e.what());
+    }
+
     auto handler1 = std::bind(&ChatServer::on_client_connect, this, _1, _2);
-    epoll.add_handler(server_sock.get_sockfd(), io::Epoll::Event::IN, handler1);
+    for (auto& listener_ptr: listeners) {
+        epoll.add_handler(listener_ptr->get_sockfd(), io::Epoll::Event::IN, handler1, listener_ptr.get());
+    }
+
+    auto handler3 = std::bind(&ChatServer::on_resume_timer, this, _1, _2);
+    epoll.add_handler(resume_timer.get_fd(),    io::Epoll::Event::IN, handler3);
+    resume_timer.start(resume_interval, true);
+
+    auto handler4 = std::bind(&ChatServer::on_handshake_timer, this, _1, _2);
+    epoll.add_handler(handshake_timer.get_fd(), io::Epoll::Event::IN, handler4);
+
+    auto handler5 = std::bind(&ChatServer::on_shutdown_timer, this, _1, _2);
+    epoll.add_handler(shutdown_timer.get_fd(),  io::Epoll::Event::IN, handler5);
+
+    auto handler10 = std::bind(&ChatServer::on_coalesce_timer, this, _1, _2);
+    epoll.add_handler(coalesce_timer.get_fd(),  io::Epoll::Event::IN, handler10);
+
+    auto handler13 = std::bind(&ChatServer::on_offline_timer, this, _1, _2);
+    epoll.add_handler(offline_timer.get_fd(),   io::Epoll::Event::IN, handler13);
+
+    if (handoff_listen_fd >= 0) {
+        auto handler6 = std::bind(&ChatServer::on_handoff_connect, this, _1, _2);
+        epoll.add_handler(handoff_listen_fd, io::Epoll::Event::IN, handler6);
+    }
+
+    if (bus_ptr) {
+        auto handler7 = std::bind(&ChatServer::on_bus_event, this, _1, _2);
+        epoll.add_handler(bus_ptr->get_eventfd(), io::Epoll::Event::IN, handler7);
+    }
+
+    if (tls_listener) {
+        auto handler11 = std::bind(&ChatServer::on_tls_connect, this, _1, _2);
+        epoll.add_handler(tls_listener->get_sockfd(), io::Epoll::Event::IN, handler11);
+    }
+
+    if (shm_listener) {
+        auto handler12 = std::bind(&ChatServer::on_shm_connect, this, _1, _2);
+        epoll.add_handler(shm_listener->get_sockfd(), io::Epoll::Event::IN, handler12);
+    }
+
+    if (link_listener) {
+        auto handler8 = std::bind(&ChatServer::on_link_connect, this, _1, _2);
+        epoll.add_handler(link_listener->get_sockfd(), io::Epoll::Event::IN, handler8);
+    }
+    if (!peers.empty()) {
+        auto handler9 = std::bind(&ChatServer::on_link_timer, this, _1, _2);
+        epoll.add_handler(link_timer.get_fd(), io::Epoll::Event::IN, handler9);
+        link_timer.start(link_retry_interval, true);
+        connect_peers();
+    }
 
-    auto handler2 = std::bind(&ChatServer::on_queue_available, this, _1, _2);
-    epoll.add_handler(out_queue.get_eventfd(),  io::Epoll::Event::IN, handler2);
+    restore_clients();
 
     epoll.start();
 }
 
-void ChatServer::on_queue_available(int events, void* data)
+void ChatServer::on_message(MessagePtr msg_ptr)
 {
-    if ((events & io::Epoll::Event::ERR) ||
-        (events & io::Epoll::Event::HUP)) {
-        throw ChatServerException("epoll error: queue eventfd unexpected error occured");
+    // the broadcasts are delivered by every worker to its own clients
+    if (msg_ptr->is_recorded()) {
+        publish(Bus::Event::BROADCAST, msg_ptr->get_source(), msg_ptr->get_message());
     }
 
-    auto msg_ptr = std::shared_ptr<Message>();
+    deliver_message(msg_ptr, true);
+}
+
+void ChatServer::deliver_message(MessagePtr msg_ptr, bool forward)
+{
+    if (msg_ptr->is_recorded()) {
+        history.push(protocol::Frame(msg_ptr->get_opcode(), msg_ptr->get_message()));
+    }
 
-    if (out_queue.try_pop(msg_ptr)) {
-        std::vector<std::string> dsts = msg_ptr->get_destinations();
+    std::vector<std::string> dsts = msg_ptr->get_destinations();
 
-        for (const std::string& dst: dsts) {
-            try {
-                clients[dst]->send_message(msg_ptr->get_message());
-            }
-            catch (ClientException& e) {
-                Logger::get_instance()->warning(e.what());
-                clients[dst]->disconnect();
-            }
-            catch (net::SocketException& e) {
-                Logger::get_instance()->warning(e.what());
-                clients[dst]->disconnect();
+    // chat messages to offline users are kept for them, responses are not
+    bool mail = mailbox_size != 0 && msg_ptr->get_opcode() == protocol::Opcode::MESSAGE;
+
+    for (const std::string& dst: dsts) {
+        auto local_it = local_sessions.find(dst);
+        if (local_it != local_sessions.end()) {
+            protocol::Frame frame(msg_ptr->get_opcode(), msg_ptr->get_message(), msg_ptr->get_request_id());
+            if (!local_it->second->deliver(std::move(frame))) {
+                Logger::get_instance()->warning("local session " + dst + " error: receive queue overflow");
+                drop_local(dst);
+                if (mail) {
+                    store_mail(dst, msg_ptr->get_message());
+                }
             }
+            continue;
         }
-    }
-}
 
-void ChatServer::on_client_connect(int events, void* data)
-{
-    if ((events & io::Epoll::Event::ERR) ||
-        (events & io::Epoll::Event::HUP)) {
-        throw ChatServerException("epoll error: server socket unexpected error occured");
-    }
+        auto it = clients.find(dst);
+        bool online = it != clients.end() && it->second->get_status() == Client::Status::ONLINE;
 
-    auto client_sock_ptr = server_sock.accept();
-    int sock_fd = client_sock_ptr->get_sockfd();
+        if (!online && remote_users.count(dst)) {
+            if (forward && msg_ptr->get_opcode() == protocol::Opcode::MESSAGE && !msg_ptr->is_recorded()) {
+                // all the workers read the bus, a link goes to the user node only
+                if (bus_ptr) {
+                    publish(Bus::Event::PRIVATE, dst, msg_ptr->get_message());
+                }
+                else {
+                    send_to_link(remote_users.at(dst), Bus::Event::PRIVATE, dst, msg_ptr->get_message());
+                }
+            }
+            continue;
+        }
+        // while the mail is being delivered the new messages are queued after it to keep the order
+        if (!online || (mail && mail_clients.count(dst))) {
+            if (mail && users.count(dst)) {
+                store_mail(dst, msg_ptr->get_message());
+            }
+            continue;
+        }
+        Client* client_ptr = it->second.get();
 
-    auto client_ptr = std::unique_ptr<Client>(new Client(std::move(client_sock_ptr)));
+        try {
+            client_ptr->send_data(msg_ptr->get_encoded(client_ptr->get_format()));
+            update_events(client_ptr);
 
-    try {
-        client_ptr->connect();
-        auto handler = std::bind(&ChatServer::on_socket_data_available, this, _1, _2);
-        // handler will be called in the current thread before client_ptr is destructed,
-        // therefore we don't get dangling pointer, so using client_ptr.get() is safe.
-        epoll.add_handler(sock_fd, io::Epoll::Event::IN |
-                                   io::Epoll::Event::RDHUP, handler, client_ptr.get());
-        clients[client_ptr->get_nick()] = std::move(client_ptr);
-    }
-    catch (ClientException& e) {
-        Logger::get_instance()->warning(e.what());
-        client_ptr->disconnect();
-    }
-    catch (net::SocketException& e) {
-        Logger::get_instance()->info(e.what());
-        client_ptr->disconnect();
+            // a single timer serves all the clients: it is armed by the first one holding messages
+            if (client_ptr->has_coalesced_data() && coalescing_clients.insert(dst).second &&
+                coalescing_clients.size() == 1) {
+                coalesce_timer.start(coalesce_window);
+            }
+        }
+        catch (protocol::ProtocolException& e) {
+            Logger::get_instance()->warning(e.what());
+        }
+        catch (ClientException& e) {
+            Logger::get_instance()->warning(e.what());
+            drop_client(client_ptr);
+            if (mail) {
+                store_mail(dst, msg_ptr->get_message());
+            }
+        }
+        catch (net::SocketException& e) {
+            Logger::get_instance()->warning(e.what());
+            drop_client(client_ptr);
+            if (mail) {
+                store_mail(dst, msg_ptr->get_message());
+            }
+        }
     }
 }
 
-void ChatServer::on_socket_data_available(int events, void* data)
+void ChatServer::on_coalesce_timer(int events, void* data)
 {
-    Client* client_ptr = static_cast<Client*>(data);
+    coalesce_timer.acknowledge();
 
-    if (events & io::Epoll::Event::ERR) {
-        Logger::get_instance()->warning("epoll error: client socket unexpected error occured");
-        client_ptr->disconnect();
-    }
-    else if ((events & io::Epoll::Event::HUP) || (events & io::Epoll::Event::RDHUP)) {
-        Logger::get_instance()->debug("epoll: client socket has been closed by the remote peer");
-        client_ptr->disconnect();
+    auto now = Client::Clock::now();
+    auto next_deadline = Client::Clock::time_point::max();
+    std::vector<Client*> expired;
+
+    for (auto it = coalescing_clients.begin(); it != coalescing_clients.end(); ) {
+        auto client_it = clients.find(*it);
+        if (client_it == clients.end() || client_it->second->get_status() != Client::Status::ONLINE ||
+            !client_it->second->has_coalesced_data()) {
+            it = coalescing_clients.erase(it);
+        }
+        else if (client_it->second->get_coalesce_deadline() <= now) {
+            expired.push_back(client_it->second.get());
+            it = coalescing_clients.erase(it);
+        }
+        else {
+            next_deadline = std::min(next_deadline, client_it->second->get_coalesce_deadline());
+            ++it;
+        }
     }
-    else {
+
+    for (Client* client_ptr: expired) {
         try {
-            in_queue.push(std::make_shared<Message>(client_ptr->recv_message(), client_ptr->get_nick()));
+            client_ptr->flush_coalesced();
+            update_events(client_ptr);
         }
         catch (ClientException& e) {
             Logger::get_instance()->warning(e.what());
-            client_ptr->disconnect();
+            drop_client(client_ptr);
         }
         catch (net::SocketException& e) {
             Logger::get_instance()->warning(e.what());
-            client_ptr->disconnect();
+            drop_client(client_ptr);
         }
     }
+
+    if (!coalescing_clients.empty()) {
+        coalesce_timer.start(std::max(std::chrono::duration_cast<std::chrono::microseconds>(next_deadline - now),
+                                      std::chrono::microseconds(1)));
+    }
+}
+
+void ChatServer::flush_coalesced()
+{
+    std::vector<Client*> holders;
+    for (const std::string& nick: coalescing_clients) {
+        auto client_it = clients.find(nick);
+        if (client_it != clients.end() && client_it->second->get_status() == Client::Status::ONLINE) {
+            holders.push_back(client_it->second.get());
+        }
+    }
+    coalescing_clients.clear();
+    coalesce_timer.stop();
+
+    for (Client* client_ptr: holders) {
+        try {
+            client_ptr->flush_coalesced();
+            update_events(client_ptr);
+        }
+        catch (ClientException& e) {
+            Logger::get_instance()->warning(e.what());
+            drop_client(client_ptr);
+        }
+        catch (net::SocketException& e) {
+            Logger::get_instance()->warning(e.what());
+            drop_client(client_ptr);
+        }
+    }
+}
+
+void ChatServer::on_bus_event(int events, void* data)
+{
+    if ((events & io::Epoll::Event::ERR) ||
+        (events & io::Epoll::Event::HUP)) {
+        throw ChatServerException("epoll error: bus eventfd unexpected error occured");
+    }
+
+    std::vector<Bus::Record> records;
+
+    try {
+        size_t overruns = bus_ptr->consume(records);
+        if (overruns != 0) {
+            Logger::get_instance()->warning(str(boost::format("bus overrun: messages of %1% workers lost") % overruns));
+        }
+    }
+    catch (BusException& e) {
+        Logger::get_instance()->error(e.what());
+    }
+
+    for (const Bus::Record& record: records) {
+        on_remote_record(record);
+    }
+}
+
+void ChatServer::on_remote_record(const Bus::Record& record)
+{
+    switch (record.event) {
+    case Bus::Event::BROADCAST: {
+        auto msg_ptr = std::make_shared<Message>(protocol::Opcode::MESSAGE, record.payload, record.nick);
+        msg_ptr->set_recorded(true);
+        for (const auto& nick_status_pair: users) {
+            if (nick_status_pair.second == Client::Status::ONLINE || mailbox_size != 0) {
+                msg_ptr->add_destination(nick_status_pair.first);
+            }
+        }
+        deliver_message(msg_ptr, false);
+        break;
+    }
+    case Bus::Event::PRIVATE: {
+        auto msg_ptr = std::make_shared<Message>(protocol::Opcode::MESSAGE, record.payload, std::string());
+        msg_ptr->add_destination(record.nick);
+        deliver_message(msg_ptr, false);
+        break;
+    }
+    case Bus::Event::JOIN: {
+        {
+            std::lock_guard<std::mutex> lk(users_mx);
+            remote_users[record.nick] = record.worker;
+        }
+        // a user is connected once: the previous connection is closed as on reconnect to the same worker
+        auto it = clients.find(record.nick);
+        if (it != clients.end() && it->second->get_status() == Client::Status::ONLINE) {
+            drop_client(it->second.get());
+        }
+        if (local_sessions.count(record.nick)) {
+            drop_local(record.nick);
+        }
+        break;
+    }
+    case Bus::Event::LEAVE: {
+        // the leave may be received after the join to another worker
+        std::lock_guard<std::mutex> lk(users_mx);
+        auto it = remote_users.find(record.nick);
+        if (it != remote_users.end() && it->second == record.worker) {
+            remote_users.erase(it);
+        }
+        break;
+    }
+    default:
+        Logger::get_instance()->warning("bus error: unknown event");
+    }
+}
+
+void ChatServer::publish(Bus::Event event, const std::string& nick, const std::string& payload)
+{
+    if (bus_ptr) {
+        try {
+            bus_ptr->publish(event, nick, payload);
+        }
+        catch (BusException& e) {
+            Logger::get_instance()->warning(e.what());
+        }
+    }
+
+    // send_to_link may close a link
+    std::vector<int> active_links;
+    for (const auto& fd_link_pair: links) {
+        if (fd_link_pair.second->get_state() == Link::State::ACTIVE) {
+            active_links.push_back(fd_link_pair.first);
+        }
+    }
+    for (int sockfd: active_links) {
+        send_to_link(sockfd, event, nick, payload);
+    }
+}
+
+void ChatServer::on_link_connect(int events, void* data)
+{
+    if ((events & io::Epoll::Event::ERR) ||
+        (events & io::Epoll::Event::HUP)) {
+        throw ChatServerException("epoll error: link socket unexpected error occured");
+    }
+
+    while (true) {
+        std::unique_ptr<net::Socket> sock_ptr;
+
+        try {
+            sock_ptr = link_listener->accept(true);
+        }
+        catch (net::SocketException& e) {
+            Logger::get_instance()->warning(e.what());
+            break;
+        }
+        if (!sock_ptr) {
+            break;      // no more pending connections
+        }
+
+        add_link(std::make_shared<Link>(epoll, std::move(sock_ptr)));
+    }
+}
+
+io::Task ChatServer::run_link(std::shared_ptr<Link> link_ptr)
+{
+    io::AsyncSocket& sock = link_ptr->get_socket();
+    std::vector<char> frame;
+
+    try {
+        if (link_ptr->is_outgoing()) {
+            co_await sock.connect(link_ptr->get_peer_address());
+        }
+        link_ptr->open(node_id);
+        flush_link(link_ptr);
+
+        co_await sock.read_frame(frame, Link::frame_max_size);
+        link_ptr->on_hello(frame);
+        if (!on_link_active(link_ptr.get())) {
+            co_return;
+        }
+
+        for (size_t n = 1; !sock.is_closed(); n++) {
+            co_await sock.read_frame(frame, Link::frame_max_size);
+
+            Bus::Record record = link_ptr->parse_record(frame);
+            record.worker = sock.get_sockfd();
+            on_remote_record(record);
+
+            // a busy link doesn't hold the clients
+            if (n % link_records_per_yield == 0) {
+                co_await io::Yield(epoll);
+            }
+        }
+    }
+    catch (LinkException& e) {
+        Logger::get_instance()->warning(e.what());
+        close_link(link_ptr.get());
+    }
+    catch (protocol::ProtocolException& e) {
+        Logger::get_instance()->warning(e.what());
+        close_link(link_ptr.get());
+    }
+    catch (net::SocketException& e) {
+        Logger::get_instance()->debug("link " + link_ptr->str() + ": " + e.what());
+        close_link(link_ptr.get());
+    }
+    catch (std::runtime_error& e) {
+        // a failure of the server state (epoll for example) drops the link rather than the process
+        Logger::get_instance()->error("link " + link_ptr->str() + ": " + e.what());
+        close_link(link_ptr.get());
+    }
+}
+
+io::Task ChatServer::write_link(std::shared_ptr<Link> link_ptr)
+{
+    try {
+        while (link_ptr->has_pending_data() && !link_ptr->get_socket().is_closed()) {
+            const std::vector<char>& buf = link_ptr->take_pending();
+            co_await link_ptr->get_socket().write(buf.data(), buf.size());
+
+            size_t overruns = link_ptr->take_overruns();
+            if (overruns != 0) {
+                Logger::get_instance()->warning(str(boost::format("link %1% overrun: %2% messages lost")
+                                                    % link_ptr->str() % overruns));
+            }
+        }
+    }
+    catch (net::SocketException& e) {
+        Logger::get_instance()->debug("link " + link_ptr->str() + ": " + e.what());
+        close_link(link_ptr.get());
+    }
+    catch (std::runtime_error& e) {
+        Logger::get_instance()->error("link " + link_ptr->str() + ": " + e.what());
+        close_link(link_ptr.get());
+    }
+
+    link_ptr->set_writing(false);
+}
+
+void ChatServer::flush_link(const std::shared_ptr<Link>& link_ptr)
+{
+    if (link_ptr->is_writing() || !link_ptr->has_pending_data()) {
+        return;
+    }
+
+    link_ptr->set_writing(true);
+    epoll.post([this, link_ptr] {
+        write_link(link_ptr);
+    });
+}
+
+bool ChatServer::on_link_active(Link* link_ptr)
+{
+    uint64_t peer_id = link_ptr->get_node_id();
+
+    for (Peer& peer: peers) {
+        if (peer.link == link_ptr) {
+            peer.node_id = peer_id;
+        }
+    }
+
+    if (peer_id == node_id) {
+        Logger::get_instance()->warning("link " + link_ptr->str() + " leads to the node itself");
+        close_link(link_ptr);
+        return false;
+    }
+
+    // both nodes may have linked to each other, they both keep the link initiated by the node with the lower id
+    for (const auto& fd_link_pair: links) {
+        Link* other_ptr = fd_link_pair.second.get();
+        if (other_ptr != link_ptr && other_ptr->get_state() == Link::State::ACTIVE &&
+            other_ptr->get_node_id() == peer_id) {
+            if (link_ptr->is_outgoing() == (node_id < peer_id)) {
+                close_link(other_ptr);
+                break;
+            }
+            close_link(link_ptr);
+            return false;
+        }
+    }
+
+    Logger::get_instance()->info(str(boost::format("link %1% to node %2$016x established")
+                                        % link_ptr->str() % peer_id));
+
+    // the peer learns the local users
+    for (const auto& nick_client_pair: clients) {
+        if (nick_client_pair.second->get_status() == Client::Status::ONLINE) {
+            send_to_link(link_ptr->get_sockfd(), Bus::Event::JOIN, nick_client_pair.first, std::string());
+        }
+    }
+    for (const auto& nick_session_pair: local_sessions) {
+        send_to_link(link_ptr->get_sockfd(), Bus::Event::JOIN, nick_session_pair.first, std::string());
+    }
+
+    return true;
+}
+
+void ChatServer::add_link(std::shared_ptr<Link> link_ptr)
+{
+    links[link_ptr->get_sockfd()] = link_ptr;
+    run_link(std::move(link_ptr));
+}
+
+void ChatServer::send_to_link(int sockfd, Bus::Event event, const std::string& nick, const std::string& payload)
+{
+    auto it = links.find(sockfd);
+    if (it == links.end()) {
+        return;
+    }
+
+    try {
+        it->second->send(event, nick, payload);
+        flush_link(it->second);
+    }
+    catch (LinkException& e) {
+        // the peer doesn't keep up, it learns the users again once the link is reestablished
+        Logger::get_instance()->warning(e.what());
+        close_link(it->second.get());
+    }
+}
+
+void ChatServer::close_link(Link* link_ptr)
+{
+    int sockfd = link_ptr->get_sockfd();
+
+    // the socket may have been reused by a new link
+    auto it = links.find(sockfd);
+    if (it == links.end() || it->second.get() != link_ptr) {
+        return;
+    }
+
+    if (link_ptr->get_state() == Link::State::ACTIVE) {
+        Logger::get_instance()->info("link " + link_ptr->str() + " closed");
+    }
+
+    // the link coroutines are resumed with an error and release the link
+    link_ptr->get_socket().close();
+
+    for (Peer& peer: peers) {
+        if (peer.link == link_ptr) {
+            peer.link = nullptr;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(users_mx);
+        for (auto user_it = remote_users.begin(); user_it != remote_users.end(); ) {
+            if (user_it->second == static_cast<size_t>(sockfd)) {
+                user_it = remote_users.erase(user_it);
+            }
+            else {
+                ++user_it;
+            }
+        }
+    }
+
+    links.erase(it);
+}
+
+void ChatServer::close_links()
+{
+    if (link_listener) {
+        link_listener->close();
+    }
+
+    std::vector<Link*> closed;
+    for (const auto& fd_link_pair: links) {
+        closed.push_back(fd_link_pair.second.get());
+    }
+    for (Link* link_ptr: closed) {
+        close_link(link_ptr);
+    }
+}
+
+void ChatServer::connect_peers()
+{
+    for (Peer& peer: peers) {
+        if (peer.link || peer.node_id == node_id) {
+            continue;
+        }
+
+        // the peer may have linked to the node
+        bool linked = false;
+        for (const auto& fd_link_pair: links) {
+            if (peer.node_id != 0 && fd_link_pair.second->get_state() == Link::State::ACTIVE &&
+                fd_link_pair.second->get_node_id() == peer.node_id) {
+                linked = true;
+            }
+        }
+        if (linked) {
+            continue;
+        }
+
+        try {
+            auto link_ptr = std::make_shared<Link>(epoll, peer.addr);
+            peer.link = link_ptr.get();
+            add_link(std::move(link_ptr));
+        }
+        catch (net::SocketException& e) {
+            Logger::get_instance()->debug("link " + peer.addr.str() + ": " + e.what());
+        }
+    }
+}
+
+void ChatServer::on_link_timer(int events, void* data)
+{
+    link_timer.acknowledge();
+
+    if (stage == Stage::RUNNING) {
+        connect_peers();
+    }
+}
+
+bool ChatServer::on_local_send(const std::string& nick, const protocol::Frame& frame)
+{
+    // the frames sent after the stop are not processed anyway
+    if (stop_flag.load() || in_queue.size() >= in_queue_max_size) {
+        return false;
+    }
+
+    in_queue.push(std::make_shared<Message>(frame.op, frame.payload, nick, frame.request_id));
+    return true;
+}
+
+void ChatServer::on_local_connect(std::shared_ptr<LocalSession> session_ptr)
+{
+    std::string nick = session_ptr->get_nick();
+
+    if (stage != Stage::RUNNING) {
+        session_ptr->detach();
+        return;
+    }
+
+    // the previous connection of the user (if any) is closed
+    auto client_it = clients.find(nick);
+    if (client_it != clients.end()) {
+        retire_client(std::move(client_it->second));
+        clients.erase(client_it);
+    }
+    auto session_it = local_sessions.find(nick);
+    if (session_it != local_sessions.end()) {
+        session_it->second->detach();
+    }
+    local_sessions[nick] = session_ptr;
+
+    set_user_status(nick, Client::Status::ONLINE);
+    publish(Bus::Event::JOIN, nick);
+
+    static Format connected(Loglevel::INFO, "local user %1% connected");
+    log(connected, nick);
+
+    deliver_local(session_ptr.get(), history.get_replay(protocol::Format::V2));
+
+    // the mail is delivered at once: the session queue doesn't block io_handler.
+    // A message is popped once the session has accepted it, the rest is kept if the session overflows
+    auto mail_it = mailboxes.find(nick);
+    if (mail_it != mailboxes.end()) {
+        Mailbox& mailbox = *mail_it->second;
+        while (!mailbox.empty() && !session_ptr->is_closed()) {
+            if (!session_ptr->deliver(protocol::Frame(protocol::Opcode::MESSAGE, mailbox.front()))) {
+                Logger::get_instance()->warning("local session " + nick + " error: receive queue overflow");
+                drop_local(nick);
+                break;
+            }
+            mailbox.pop_front();
+        }
+        if (mailbox.empty()) {
+            if (mailbox.get_dropped() != 0) {
+                Logger::get_instance()->warning(str(boost::format("%1% messages to user %2% were dropped: mailbox full")
+                                                    % mailbox.get_dropped() % nick));
+            }
+            mailboxes.erase(mail_it);
+        }
+        mail_clients.erase(nick);
+    }
+}
+
+void ChatServer::on_local_close(const std::string& nick, LocalSession* session_ptr)
+{
+    auto it = local_sessions.find(nick);
+    if (it != local_sessions.end() && it->second.get() == session_ptr) {
+        drop_local(nick);
+    }
+}
+
+void ChatServer::deliver_local(LocalSession* session_ptr, const std::vector<char>& data)
+{
+    std::vector<protocol::Frame> frames;
+    size_t offset = 0;
+
+    while (offset < data.size()) {
+        protocol::Frame frame;
+        offset += protocol::decode(data.data() + offset, data.size() - offset, frame);
+        if (frame.op == protocol::Opcode::BATCH) {
+            protocol::unbatch(frame, frames);
+        }
+        else {
+            frames.push_back(std::move(frame));
+        }
+    }
+
+    for (protocol::Frame& frame: frames) {
+        if (!session_ptr->deliver(std::move(frame))) {
+            Logger::get_instance()->warning("local session " + session_ptr->get_nick() + " error: receive queue overflow");
+            drop_local(session_ptr->get_nick());
+            return;
+        }
+    }
+}
+
+void ChatServer::drop_local(const std::string& nick)
+{
+    auto it = local_sessions.find(nick);
+    it->second->detach();
+    local_sessions.erase(it);
+
+    set_user_status(nick, Client::Status::OFFLINE);
+    publish(Bus::Event::LEAVE, nick);
+
+    static Format disconnected(Loglevel::INFO, "local user %1% disconnected");
+    log(disconnected, nick);
+}
+
+void ChatServer::on_client_connect(int events, void* data)
+{
+    if ((events & io::Epoll::Event::ERR) ||
+        (events & io::Epoll::Event::HUP)) {
+        throw ChatServerException("epoll error: server socket unexpected error occured");
+    }
+
+    net::Socket* listener_ptr = static_cast<net::Socket*>(data);
+
+    // accepts all the pending connections at once, so a reconnect storm is drained quickly
+    while (true) {
+        std::unique_ptr<net::Socket> client_sock_ptr;
+
+        try {
+            client_sock_ptr = listener_ptr->accept(true);
+        }
+        catch (net::SocketException& e) {
+            Logger::get_instance()->warning(e.what());
+            break;
+        }
+        if (!client_sock_ptr) {
+            break;      // no more pending connections
+        }
+
+        add_pending_client(std::move(client_sock_ptr));
+    }
+}
+
+void ChatServer::on_tls_connect(int events, void* data)
+{
+    if ((events & io::Epoll::Event::ERR) ||
+        (events & io::Epoll::Event::HUP)) {
+        throw ChatServerException("epoll error: tls server socket unexpected error occured");
+    }
+
+    // the handshakes are run by tls_terminator, the connections come back to add_pending_client
+    while (true) {
+        std::unique_ptr<net::Socket> sock_ptr;
+
+        try {
+            sock_ptr = tls_listener->accept(true);
+        }
+        catch (net::SocketException& e) {
+            Logger::get_instance()->warning(e.what());
+            break;
+        }
+        if (!sock_ptr) {
+            break;
+        }
+
+        tls_terminator->add(std::move(sock_ptr));
+    }
+}
+
+void ChatServer::on_shm_connect(int events, void* data)
+{
+    if ((events & io::Epoll::Event::ERR) ||
+        (events & io::Epoll::Event::HUP)) {
+        throw ChatServerException("epoll error: shm server socket unexpected error occured");
+    }
+
+    while (true) {
+        std::unique_ptr<net::Socket> sock_ptr;
+
+        try {
+            sock_ptr = shm_listener->accept(true);
+        }
+        catch (net::SocketException& e) {
+            Logger::get_instance()->warning(e.what());
+            break;
+        }
+        if (!sock_ptr) {
+            break;
+        }
+
+        // the client starts the handshake through the channel once it has received it
+        try {
+            auto channel_ptr = std::unique_ptr<net::ShmChannel>(new net::ShmChannel(shm_ring_size));
+            channel_ptr->send_peer(*sock_ptr);
+            add_pending_client(std::move(sock_ptr), std::move(channel_ptr));
+        }
+        catch (net::ShmException& e) {
+            Logger::get_instance()->warning(e.what());
+        }
+    }
+}
+
+void ChatServer::on_tls_client(net::Socket* raw_sock_ptr, bool relayed)
+{
+    auto sock_ptr = std::unique_ptr<net::Socket>(raw_sock_ptr);
+
+    // the handshake may have been completed after the server has stopped accepting
+    if (stage != Stage::RUNNING) {
+        sock_ptr->close();
+        return;
+    }
+
+    int sock_fd = sock_ptr->get_sockfd();
+    add_pending_client(std::move(sock_ptr));
+    pending_clients[sock_fd]->set_relayed(relayed);
+}
+
+void ChatServer::add_pending_client(std::unique_ptr<net::Socket> client_sock_ptr,
+                                    std::unique_ptr<net::ShmChannel> channel_ptr)
+{
+    // captures this only: the handler copied for every client is kept by std::function in place
+    auto handler = [this] (int events, void* data) {
+        on_socket_data_available(events, data);
+    };
+
+    int sock_fd = client_sock_ptr->get_sockfd();
+    auto client_ptr = std::unique_ptr<Client>(new Client(std::move(client_sock_ptr), msg_rate, msg_burst));
+
+    auto deadline = Client::Clock::now() + handshake_timeout;
+    client_ptr->set_handshake_deadline(deadline);
+    handshake_deadlines.emplace_back(deadline, sock_fd);
+    if (handshake_deadlines.size() == 1) {
+        arm_handshake_timer();
+    }
+
+    // the handshake is completed by on_socket_data_available when the nick is received.
+    // handler will be called in the current thread before client_ptr is destructed,
+    // therefore we don't get dangling pointer, so using client_ptr.get() is safe.
+    if (channel_ptr) {
+        // the data comes through the channel (its eventfd calls the same handler), the socket tells
+        // the client has gone only. A channel write is no system call, so the messages are not held
+        int event_fd = channel_ptr->get_event_fd();
+        channel_ptr->set_interest(true, false);
+        client_ptr->set_channel(std::move(channel_ptr));
+        epoll.add_handler(sock_fd, io::Epoll::Event::RDHUP, handler, client_ptr.get());
+        epoll.add_handler(event_fd, io::Epoll::Event::IN, handler, client_ptr.get());
+    }
+    else {
+        client_ptr->set_coalescing(coalesce_window, coalesce_max_bytes);
+        epoll.add_handler(sock_fd, io::Epoll::Event::IN |
+                                   io::Epoll::Event::RDHUP, handler, client_ptr.get());
+    }
+    pending_clients[sock_fd] = std::move(client_ptr);
+}
+
+void ChatServer::on_socket_data_available(int events, void* data)
+{
+    Client* client_ptr = static_cast<Client*>(data);
+
+    if (events & io::Epoll::Event::ERR) {
+        Logger::get_instance()->warning("epoll error: client socket unexpected error occured");
+        drop_client(client_ptr);
+        return;
+    }
+    if ((events & io::Epoll::Event::HUP) || (events & io::Epoll::Event::RDHUP)) {
+        static Format closed_by_peer(Loglevel::DEBUG, "epoll: client socket has been closed by the remote peer");
+        log(closed_by_peer);
+        drop_client(client_ptr);
+        return;
+    }
+
+    if (client_ptr->get_status() == Client::Status::OFFLINE) {
+        return;     // the client has been disconnected by a previous event
+    }
+
+    net::ShmChannel* channel_ptr = client_ptr->get_channel();
+    if (channel_ptr && (events & io::Epoll::Event::IN)) {
+        // the channel eventfd: the client is ready for what update_events has asked for
+        channel_ptr->acknowledge();
+        events = 0;
+        if (!client_ptr->is_paused()) {
+            events |= io::Epoll::Event::IN;
+        }
+        if (client_ptr->has_pending_data()) {
+            events |= io::Epoll::Event::OUT;
+        }
+    }
+
+    try {
+        if (events & io::Epoll::Event::OUT) {
+            if (client_ptr->flush() && mail_clients.count(client_ptr->get_nick())) {
+                deliver_mail(client_ptr);
+            }
+        }
+
+        if (events & io::Epoll::Event::IN) {
+            if (stage != Stage::RUNNING) {
+                // the data is left in the socket: it is read by the successor process or not at all
+                client_ptr->set_paused(true);
+                update_events(client_ptr);
+            }
+            else if (client_ptr->get_status() == Client::Status::AWAITING_NICK) {
+                on_handshake_data(client_ptr);
+            }
+            else if (!client_ptr->get_rate_limiter().available() || in_queue.size() >= in_queue_max_size) {
+                pause_client(client_ptr);
+            }
+            else {
+                client_ptr->read();
+                recv_messages(client_ptr);
+            }
+        }
+
+        // a channel client asks for the next notification during the handshake too
+        if (client_ptr->get_status() == Client::Status::ONLINE || client_ptr->get_channel()) {
+            update_events(client_ptr);
+        }
+    }
+    catch (ClientException& e) {
+        Logger::get_instance()->warning(e.what());
+        drop_client(client_ptr);
+    }
+    catch (net::SocketException& e) {
+        Logger::get_instance()->warning(e.what());
+        drop_client(client_ptr);
+    }
+}
+
+void ChatServer::on_handshake_data(Client* client_ptr)
+{
+    client_ptr->read();
+    if (!client_ptr->connect()) {
+        return;     // the nick is not received entirely yet
+    }
+
+    // the previous connection of the user (if any) is closed
+    int sock_fd = client_ptr->get_sockfd();
+    ClientPtr& slot = clients[client_ptr->get_nick()];
+    if (slot) {
+        retire_client(std::move(slot));
+    }
+    auto session_it = local_sessions.find(client_ptr->get_nick());
+    if (session_it != local_sessions.end()) {
+        session_it->second->detach();
+        local_sessions.erase(session_it);
+    }
+    slot = std::move(pending_clients.at(sock_fd));
+    pending_clients.erase(sock_fd);
+
+    set_user_status(client_ptr->get_nick(), Client::Status::ONLINE);
+    publish(Bus::Event::JOIN, client_ptr->get_nick());
+
+    replay_history(client_ptr);
+    deliver_mail(client_ptr);
+
+    // the frames sent right after the nick
+    recv_messages(client_ptr);
+}
+
+void ChatServer::replay_history(Client* client_ptr)
+{
+    const std::vector<char>& replay = history.get_replay(client_ptr->get_format());
+    if (!replay.empty()) {
+        client_ptr->send_data(replay);
+    }
+}
+
+void ChatServer::store_mail(const std::string& nick, const std::string& msg)
+{
+    auto& mailbox_ptr = mailboxes[nick];
+    if (!mailbox_ptr) {
+        mailbox_ptr = std::unique_ptr<Mailbox>(new Mailbox(mailbox_size, mailbox_max_bytes,
+                                                           mailbox_spill_threshold, mailbox_dir));
+    }
+
+    try {
+        mailbox_ptr->push(msg);
+    }
+    catch (MailboxException& e) {
+        Logger::get_instance()->warning(e.what());
+    }
+}
+
+void ChatServer::deliver_mail(Client* client_ptr)
+{
+    std::string nick = client_ptr->get_nick();
+
+    auto it = mailboxes.find(nick);
+    if (it == mailboxes.end()) {
+        mail_clients.erase(nick);
+        return;
+    }
+    Mailbox& mailbox = *it->second;
+
+    for (size_t n = 0; n < mail_chunks_per_event && !mailbox.empty() && !client_ptr->has_pending_data(); n++) {
+        std::vector<char> buf;
+        mailbox.pop_chunk(client_ptr->get_format(), mail_chunk_size, buf);
+        client_ptr->send_data(buf);
+    }
+
+    if (mailbox.empty()) {
+        if (mailbox.get_dropped() != 0) {
+            Logger::get_instance()->warning(str(boost::format("%1% messages to user %2% were dropped: mailbox full")
+                                                % mailbox.get_dropped() % nick));
+        }
+        mailboxes.erase(it);
+        mail_clients.erase(nick);
+    }
+    else {
+        mail_clients.insert(nick);
+    }
+
+    update_events(client_ptr);
+}
+
+void ChatServer::recv_messages(Client* client_ptr)
+{
+    // takes no more messages than the client is allowed to send and in_queue can hold,
+    // the rest stays in the client input buffer untill the client is resumed
+    size_t queue_size = in_queue.size();
+    size_t max_frames = std::min(client_ptr->get_rate_limiter().allowance(),
+                                 in_queue_max_size > queue_size ? in_queue_max_size - queue_size : 0);
+
+    std::vector<protocol::Frame> frames = client_ptr->recv_frames(max_frames);
+    client_ptr->get_rate_limiter().consume(frames.size());
+
+    for (const protocol::Frame& frame: frames) {
+        in_queue.push(std::make_shared<Message>(frame.op, frame.payload,
+                                                client_ptr->get_nick(), frame.request_id));
+    }
+
+    // the messages sent before the session was closed are delivered anyway
+    if (client_ptr->is_closing()) {
+        throw ClientException("client " + client_ptr->get_nick() + " closed the session");
+    }
+
+    if (frames.size() >= max_frames) {
+        pause_client(client_ptr);
+    }
+}
+
+void ChatServer::drop_client(Client* client_ptr)
+{
+    std::string nick = client_ptr->get_nick();
+
+    switch (client_ptr->get_status()) {
+    case Client::Status::ONLINE: {
+        auto it = clients.find(nick);
+        retire_client(std::move(it->second));
+        clients.erase(it);
+
+        set_user_status(nick, Client::Status::OFFLINE);
+        publish(Bus::Event::LEAVE, nick);
+        break;
+    }
+    case Client::Status::AWAITING_NICK: {
+        auto it = pending_clients.find(client_ptr->get_sockfd());
+        retire_client(std::move(it->second));
+        pending_clients.erase(it);
+        break;
+    }
+    default:
+        break;      // has been dropped already
+    }
+}
+
+void ChatServer::retire_client(ClientPtr client_ptr)
+{
+    // the socket is closed by disconnect, so it is deleted from epoll first
+    epoll.del_handler(client_ptr->get_sockfd());
+    if (client_ptr->get_channel()) {
+        epoll.del_handler(client_ptr->get_channel()->get_event_fd());
+    }
+    client_ptr->disconnect();
+
+    retired_clients.push_back(std::move(client_ptr));
+    if (retired_clients.size() == 1) {
+        epoll.post([this] {
+            retired_clients.clear();
+        });
+    }
+}
+
+void ChatServer::set_user_status(const std::string& nick, Client::Status status)
+{
+    {
+        std::lock_guard<std::mutex> lk(users_mx);
+
+        // an offline user is kept only to get the mail
+        if (status == Client::Status::OFFLINE && mailbox_size == 0) {
+            users.erase(nick);
+        }
+        else {
+            users[nick] = status;
+        }
+        if (status == Client::Status::ONLINE) {
+            remote_users.erase(nick);
+        }
+    }
+
+    if (mailbox_size == 0) {
+        return;
+    }
+    if (status == Client::Status::ONLINE) {
+        offline_users.erase(nick);
+        return;
+    }
+
+    auto deadline = Client::Clock::now() + mailbox_ttl;
+    offline_users[nick] = deadline;
+    offline_deadlines.emplace_back(deadline, nick);
+    if (offline_deadlines.size() == 1) {
+        offline_timer.start(std::max(std::chrono::duration_cast<std::chrono::microseconds>(mailbox_ttl),
+                                     std::chrono::microseconds(1)));
+    }
+}
+
+void ChatServer::update_events(Client* client_ptr)
+{
+    // the channel eventfd is always polled, the client end tells when to signal it instead
+    net::ShmChannel* channel_ptr = client_ptr->get_channel();
+    if (channel_ptr) {
+        channel_ptr->set_interest(!client_ptr->is_paused(), client_ptr->has_pending_data());
+        return;
+    }
+
+    // keeps RDHUP to be notified if the client disconnects while paused
+    int event_mask = io::Epoll::Event::RDHUP;
+
+    if (!client_ptr->is_paused()) {
+        event_mask |= io::Epoll::Event::IN;
+    }
+    if (client_ptr->has_pending_data()) {
+        event_mask |= io::Epoll::Event::OUT;
+    }
+
+    epoll.modify_handler(client_ptr->get_sockfd(), event_mask);
+}
+
+void ChatServer::on_handshake_timer(int events, void* data)
+{
+    handshake_timer.acknowledge();
+
+    auto now = Client::Clock::now();
+
+    while (!handshake_deadlines.empty() && handshake_deadlines.front().first <= now) {
+        auto deadline = handshake_deadlines.front();
+        handshake_deadlines.pop_front();
+
+        // the client may have completed the handshake or the socket may have been reused since
+        auto it = pending_clients.find(deadline.second);
+        if (it != pending_clients.end() && it->second->get_handshake_deadline() == deadline.first) {
+            static Format handshake_expired(Loglevel::DEBUG, "client handshake timeout");
+            log(handshake_expired);
+            drop_client(it->second.get());
+        }
+    }
+
+    arm_handshake_timer();
+}
+
+void ChatServer::arm_handshake_timer()
+{
+    if (handshake_deadlines.empty()) {
+        return;
+    }
+
+    auto timeout = handshake_deadlines.front().first - Client::Clock::now();
+    handshake_timer.start(std::max(std::chrono::duration_cast<std::chrono::microseconds>(timeout),
+                                   std::chrono::microseconds(1)));
+}
+
+void ChatServer::on_offline_timer(int events, void* data)
+{
+    offline_timer.acknowledge();
+
+    auto now = Client::Clock::now();
+
+    while (!offline_deadlines.empty() && offline_deadlines.front().first <= now) {
+        auto deadline = std::move(offline_deadlines.front());
+        offline_deadlines.pop_front();
+
+        // the user may have reconnected (and may have gone offline again) since
+        auto it = offline_users.find(deadline.second);
+        if (it == offline_users.end() || it->second != deadline.first) {
+            continue;
+        }
+        offline_users.erase(it);
+
+        // the mail not delivered in time is dropped with the user
+        auto mail_it = mailboxes.find(deadline.second);
+        if (mail_it != mailboxes.end()) {
+            static Format mail_expired(Loglevel::INFO, "user %1% has been offline for too long, %2% messages dropped");
+            log(mail_expired, deadline.second, mail_it->second->size());
+            mailboxes.erase(mail_it);
+        }
+
+        std::lock_guard<std::mutex> lk(users_mx);
+        users.erase(deadline.second);
+    }
+
+    if (!offline_deadlines.empty()) {
+        auto timeout = offline_deadlines.front().first - now;
+        offline_timer.start(std::max(std::chrono::duration_cast<std::chrono::microseconds>(timeout),
+                                     std::chrono::microseconds(1)));
+    }
+}
+
+void ChatServer::on_resume_timer(int events, void* data)
+{
+    resume_timer.acknowledge();
+
+    if (stage == Stage::DRAINING) {
+        check_drained();
+        return;
+    }
+
+    // continues the mail delivery to the clients with nothing to be flushed
+    std::vector<Client*> mail_receivers;
+    for (auto it = mail_clients.begin(); it != mail_clients.end(); ) {
+        auto client_it = clients.find(*it);
+        if (client_it == clients.end() || client_it->second->get_status() != Client::Status::ONLINE) {
+            it = mail_clients.erase(it);
+        }
+        else {
+            if (!client_it->second->has_pending_data()) {
+                mail_receivers.push_back(client_it->second.get());
+            }
+            ++it;
+        }
+    }
+
+    for (Client* client_ptr: mail_receivers) {
+        try {
+            deliver_mail(client_ptr);
+        }
+        catch (ClientException& e) {
+            Logger::get_instance()->warning(e.what());
+            drop_client(client_ptr);
+        }
+        catch (net::SocketException& e) {
+            Logger::get_instance()->warning(e.what());
+            drop_client(client_ptr);
+        }
+    }
+
+    // resumes reading when the queue is half drained to avoid pausing the clients again at once
+    if (stage != Stage::RUNNING || paused_clients.empty() || in_queue.size() > in_queue_max_size / 2) {
+        return;
+    }
+
+    std::vector<Client*> resumed;
+
+    for (auto it = paused_clients.begin(); it != paused_clients.end(); ) {
+        auto client_it = clients.find(*it);
+
+        if (client_it == clients.end() ||
+            client_it->second->get_status() != Client::Status::ONLINE ||
+            !client_it->second->is_paused()) {
+            it = paused_clients.erase(it);
+        }
+        else if (client_it->second->get_rate_limiter().available()) {
+            resumed.push_back(client_it->second.get());
+            it = paused_clients.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+
+    for (Client* client_ptr: resumed) {
+        try {
+            // processes the messages left in the input buffer first, it may pause the client again
+            client_ptr->set_paused(false);
+            recv_messages(client_ptr);
+            update_events(client_ptr);
+        }
+        catch (ClientException& e) {
+            Logger::get_instance()->warning(e.what());
+            drop_client(client_ptr);
+        }
+    }
+}
+
+void ChatServer::pause_client(Client* client_ptr)
+{
+    if (client_ptr->is_paused()) {
+        return;
+    }
+
+    static Format paused(Loglevel::DEBUG, "user %1% paused");
+    log(paused, client_ptr->get_nick());
+
+    client_ptr->set_paused(true);
+    update_events(client_ptr);
+    paused_clients.insert(client_ptr->get_nick());
+}
+
+void ChatServer::on_stop_marker()
+{
+    if (stage == Stage::RUNNING) {
+        Logger::get_instance()->info("stopping the server");
+
+        // stops accepting (the pending connections are left for the successor process if any)
+        // and lets message_handler process the messages received so far
+        stage = Stage::STOPPING;
+        for (auto& listener_ptr: listeners) {
+            epoll.del_handler(listener_ptr->get_sockfd());
+        }
+        if (tls_listener) {
+            epoll.del_handler(tls_listener->get_sockfd());
+        }
+        if (shm_listener) {
+            epoll.del_handler(shm_listener->get_sockfd());
+        }
+        in_queue.push(MessagePtr());
+        return;
+    }
+
+    // message_handler has stopped, all the responses are buffered by the clients
+    // and queued to the local sessions, which can't be passed to a successor
+    for (auto& nick_session_pair: local_sessions) {
+        nick_session_pair.second->detach();
+    }
+    local_sessions.clear();
+
+    if (handoff_ptr) {
+        hand_off();
+    }
+    else {
+        drain();
+    }
+}
+
+void ChatServer::on_handoff_connect(int events, void* data)
+{
+    try {
+        handoff_ptr = Handoff::accept(handoff_listen_fd);
+    }
+    catch (HandoffException& e) {
+        Logger::get_instance()->warning(e.what());
+        return;
+    }
+
+    Logger::get_instance()->info("successor process connected, handing off the connections");
+
+    epoll.del_handler(handoff_listen_fd);
+    close(handoff_listen_fd);
+    handoff_listen_fd = -1;
+
+    stop();
+}
+
+void ChatServer::hand_off()
+{
+    size_t count = 0;
+
+    try {
+        for (auto& listener_ptr: listeners) {
+            handoff_ptr->send_listener(listener_ptr->get_sockfd());
+        }
+        // the connections being handshaked are closed with tls_terminator, the queued ones are passed on
+        if (tls_listener) {
+            handoff_ptr->send_tls_listener(tls_listener->get_sockfd());
+        }
+
+        // a channel or a relayed TLS connection can't be passed on:
+        // such clients are closed with the server and reconnect
+        for (auto& nick_client_pair: clients) {
+            Client* client_ptr = nick_client_pair.second.get();
+            if (client_ptr->get_status() == Client::Status::ONLINE && !client_ptr->get_channel() &&
+                !client_ptr->is_relayed()) {
+                handoff_ptr->send_client(client_ptr->get_sockfd(), client_ptr->detach());
+                count++;
+            }
+        }
+        for (auto& fd_client_pair: pending_clients) {
+            Client* client_ptr = fd_client_pair.second.get();
+            if (client_ptr->get_status() == Client::Status::AWAITING_NICK && !client_ptr->get_channel() &&
+                !client_ptr->is_relayed()) {
+                handoff_ptr->send_client(client_ptr->get_sockfd(), client_ptr->detach());
+                count++;
+            }
+        }
+
+        // the successor has its own links, it binds the link address once the handoff is ended
+        close_links();
+
+        handoff_ptr->send_end();
+    }
+    catch (HandoffException& e) {
+        // the clients not handed off yet are served untill the responses are flushed
+        Logger::get_instance()->error(e.what());
+        drain();
+        return;
+    }
+
+    Logger::get_instance()->info(str(boost::format("%1% connections handed off") % count));
+
+    // the sockets are closed with the clients, the successor has its own descriptors
+    epoll.stop();
+}
+
+void ChatServer::take_over()
+{
+    auto handoff = Handoff::connect(takeover_path);
+    auto deadline = Client::Clock::now() + handshake_timeout;
+    size_t count = 0;
+
+    while (true) {
+        int fd;
+        Client::State state;
+
+        Handoff::Record record = handoff->recv(fd, state);
+        if (record == Handoff::Record::END) {
+            break;
+        }
+        if (fd < 0) {
+            throw ChatServerException("takeover error: no file descriptor received");
+        }
+
+        if (record == Handoff::Record::LISTENER) {
+            listeners.push_back(std::unique_ptr<net::Socket>(new net::Socket(fd)));
+            continue;
+        }
+        if (record == Handoff::Record::TLS_LISTENER) {
+            // a server started without TLS doesn't accept on the TLS address
+            if (tls_addresses.empty()) {
+                close(fd);
+            }
+            else {
+                tls_listener = std::unique_ptr<net::Socket>(new net::Socket(fd));
+            }
+            continue;
+        }
+
+        auto client_ptr = std::unique_ptr<Client>(new Client(std::unique_ptr<net::Socket>(new net::Socket(fd)),
+                                                             state, msg_rate, msg_burst));
+        client_ptr->set_coalescing(coalesce_window, coalesce_max_bytes);
+        if (state.status == Client::Status::ONLINE) {
+            clients[state.nick] = std::move(client_ptr);
+            set_user_status(state.nick, Client::Status::ONLINE);
+        }
+        else {
+            // the handshake starts over, so the deadline is restarted too
+            client_ptr->set_handshake_deadline(deadline);
+            handshake_deadlines.emplace_back(deadline, fd);
+            pending_clients[fd] = std::move(client_ptr);
+        }
+        count++;
+    }
+
+    Logger::get_instance()->info(str(boost::format("%1% connections taken over") % count));
+}
+
+void ChatServer::restore_clients()
+{
+    // captures this only: the handler copied for every client is kept by std::function in place
+    auto handler = [this] (int events, void* data) {
+        on_socket_data_available(events, data);
+    };
+    std::vector<Client*> restored;
+
+    // online clients go first: a pending client completing the handshake may replace an online one
+    for (auto& nick_client_pair: clients) {
+        restored.push_back(nick_client_pair.second.get());
+    }
+    for (auto& fd_client_pair: pending_clients) {
+        restored.push_back(fd_client_pair.second.get());
+    }
+
+    for (Client* client_ptr: restored) {
+        epoll.add_handler(client_ptr->get_sockfd(), io::Epoll::Event::IN |
+                                                    io::Epoll::Event::RDHUP, handler, client_ptr);
+    }
+    arm_handshake_timer();
+
+    // the buffers may contain data received or not sent by the previous server
+    for (Client* client_ptr: restored) {
+        on_socket_data_available(io::Epoll::Event::IN | io::Epoll::Event::OUT, client_ptr);
+    }
+}
+
+void ChatServer::drain()
+{
+    stage = Stage::DRAINING;
+
+    for (auto& listener_ptr: listeners) {
+        listener_ptr->close();
+        if (listener_ptr->get_address().get_family() == net::Family::UNIX) {
+            unlink(listener_ptr->get_address().str().c_str());
+        }
+    }
+    if (shm_listener) {
+        shm_listener->close();
+        unlink(shm_addresses.front().str().c_str());
+    }
+
+    for (auto& fd_client_pair: pending_clients) {
+        retire_client(std::move(fd_client_pair.second));
+    }
+    pending_clients.clear();
+
+    close_links();
+    flush_coalesced();
+
+    shutdown_timer.start(shutdown_timeout);
+    check_drained();
+}
+
+void ChatServer::check_drained()
+{
+    for (const auto& nick_client_pair: clients) {
+        if (nick_client_pair.second->get_status() == Client::Status::ONLINE &&
+            nick_client_pair.second->has_pending_data()) {
+            return;
+        }
+    }
+
+    Logger::get_instance()->info("server stopped");
+    epoll.stop();
+}
+
+void ChatServer::on_shutdown_timer(int events, void* data)
+{
+    shutdown_timer.acknowledge();
+
+    Logger::get_instance()->warning("server stopped: responses flush timeout expired");
+    epoll.stop();
 }
 
 
-} // namespace chat
\ No newline at end of file
+} // namespace chat
@@ -0,0 +1,137 @@
+#include <session.h>
+
+#include <string>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <protocol.h>
+
+
+namespace chat {
+
+
+LocalSession::LocalSession(const std::string& nick, SendHandler on_send, CloseHandler on_close):
+    nick(nick), on_send(on_send), on_close(on_close), recv_queue_size(0), closed(false), waiting(false)
+{
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd == -1) {
+        throw SessionException(std::string("eventfd error: ") + std::strerror(errno));
+    }
+}
+
+LocalSession::~LocalSession()
+{
+    ::close(event_fd);
+}
+
+const std::string& LocalSession::get_nick() const
+{
+    return nick;
+}
+
+bool LocalSession::send(const protocol::Frame& frame)
+{
+    if (closed.load(std::memory_order_acquire)) {
+        return false;
+    }
+    return on_send(frame);
+}
+
+bool LocalSession::try_recv(protocol::Frame& frame)
+{
+    if (!recv_queue.try_pop(frame)) {
+        return false;
+    }
+    recv_queue_size.fetch_sub(1, std::memory_order_relaxed);
+
+    return true;
+}
+
+bool LocalSession::recv(protocol::Frame& frame, std::chrono::milliseconds timeout)
+{
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+
+    while (true) {
+        if (try_recv(frame)) {
+            return true;
+        }
+        if (closed.load(std::memory_order_acquire)) {
+            return try_recv(frame);     // a frame delivered just before the session was closed
+        }
+
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (left.count() <= 0) {
+            return false;
+        }
+
+        // the queue and the close are checked again after the flag is set: a frame pushed before
+        // is seen here, a frame pushed after makes the deliverer write the eventfd
+        waiting.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (try_recv(frame)) {
+            waiting.store(false);
+            return true;
+        }
+        if (closed.load()) {
+            waiting.store(false);
+            return try_recv(frame);
+        }
+
+        struct pollfd pfd = {event_fd, POLLIN, 0};
+        poll(&pfd, 1, static_cast<int>(left.count()));
+        waiting.store(false);
+
+        uint64_t cnt;
+        read(event_fd, &cnt, sizeof(cnt));
+    }
+}
+
+void LocalSession::close()
+{
+    if (!closed.exchange(true)) {
+        on_close(this);
+    }
+}
+
+bool LocalSession::is_closed() const
+{
+    return closed.load(std::memory_order_acquire);
+}
+
+bool LocalSession::deliver(protocol::Frame frame)
+{
+    if (recv_queue_size.load(std::memory_order_relaxed) >= recv_queue_max_size) {
+        return false;
+    }
+
+    recv_queue_size.fetch_add(1, std::memory_order_relaxed);
+    recv_queue.push(std::move(frame));
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiting.load(std::memory_order_relaxed)) {
+        wakeup();
+    }
+
+    return true;
+}
+
+void LocalSession::detach()
+{
+    closed.store(true, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiting.load(std::memory_order_relaxed)) {
+        wakeup();
+    }
+}
+
+void LocalSession::wakeup()
+{
+    uint64_t cnt = 1;
+    write(event_fd, &cnt, sizeof(cnt));
+}
+
+
+} // namespace chat
@@ -0,0 +1,348 @@
+#include <shm.h>
+
+#include <stdexcept>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <new>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <socket.h>
+
+
+namespace net {
+
+
+namespace {
+
+const size_t fds_count = 3;             // passed to the peer: memfd, peer eventfd, server eventfd
+
+
+std::string error_str(const std::string& what)
+{
+    return "shm channel error: " + what + ": " + std::strerror(errno);
+}
+
+void copy_in(char* ring, size_t ring_size, uint64_t pos, const char* src, size_t size)
+{
+    size_t offset = pos & (ring_size - 1);
+    size_t first = std::min(size, ring_size - offset);
+
+    std::memcpy(ring + offset, src, first);
+    std::memcpy(ring, src + first, size - first);
+}
+
+void copy_out(const char* ring, size_t ring_size, uint64_t pos, char* dst, size_t size)
+{
+    size_t offset = pos & (ring_size - 1);
+    size_t first = std::min(size, ring_size - offset);
+
+    std::memcpy(dst, ring + offset, first);
+    std::memcpy(dst + first, ring, size - first);
+}
+
+} // namespace
+
+
+ShmChannel::ShmChannel(size_t ring_size):
+    ring_size(ring_min_size)
+{
+    while (this->ring_size < ring_size) {
+        this->ring_size <<= 1;
+    }
+    mem_size = header_size + 2 * this->ring_size;
+
+    // sealed: the peer can't shrink the memory under the server (the access would fault)
+    mem_fd = memfd_create("chat-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (mem_fd < 0) {
+        throw ShmException(error_str("memfd_create error"));
+    }
+    if (ftruncate(mem_fd, mem_size) < 0 ||
+        fcntl(mem_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        std::string what = error_str("memfd setup error");
+        close(mem_fd);
+        throw ShmException(what);
+    }
+
+    void* ptr = mmap(NULL, mem_size, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+    if (ptr == MAP_FAILED) {
+        std::string what = error_str("mmap error");
+        close(mem_fd);
+        throw ShmException(what);
+    }
+    mem = static_cast<char*>(ptr);
+
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    peer_event_fd = event_fd < 0 ? -1 : eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (peer_event_fd < 0) {
+        std::string what = error_str("eventfd error");
+        if (event_fd >= 0) {
+            close(event_fd);
+        }
+        munmap(mem, mem_size);
+        close(mem_fd);
+        throw ShmException(what);
+    }
+
+    new (mem) RingHeader();
+    new (mem + sizeof(RingHeader)) RingHeader();
+    init_rings(true);
+}
+
+ShmChannel::ShmChannel(char* mem, size_t mem_size, int event_fd, int peer_event_fd):
+    ring_size((mem_size - header_size) / 2), mem(mem), mem_size(mem_size), mem_fd(-1),
+    event_fd(event_fd), peer_event_fd(peer_event_fd)
+{
+    init_rings(false);
+}
+
+std::unique_ptr<ShmChannel> ShmChannel::receive(Socket& sock)
+{
+    uint64_t ring_size = 0;
+    iovec iov = {&ring_size, sizeof(ring_size)};
+    char control[CMSG_SPACE(fds_count * sizeof(int))] = {};
+
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t res = recvmsg(sock.get_sockfd(), &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    if (res < 0) {
+        throw ShmException(error_str("recvmsg error"));
+    }
+
+    int fds[fds_count] = {-1, -1, -1};
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(fds_count * sizeof(int))) {
+        std::memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    }
+
+    auto close_fds = [&fds] {
+        for (int fd: fds) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    };
+
+    struct stat st;
+    if (res != sizeof(ring_size) || fds[0] < 0 || fstat(fds[0], &st) < 0 ||
+        ring_size < ring_min_size || (ring_size & (ring_size - 1)) != 0 ||
+        static_cast<uint64_t>(st.st_size) != header_size + 2 * ring_size) {
+        close_fds();
+        throw ShmException("shm channel error: malformed channel received");
+    }
+
+    void* ptr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (ptr == MAP_FAILED) {
+        std::string what = error_str("mmap error");
+        close_fds();
+        throw ShmException(what);
+    }
+    close(fds[0]);
+
+    auto channel_ptr = std::unique_ptr<ShmChannel>(new ShmChannel(static_cast<char*>(ptr), st.st_size,
+                                                                  fds[1], fds[2]));
+    channel_ptr->watch_fd = sock.get_sockfd();
+
+    return channel_ptr;
+}
+
+ShmChannel::~ShmChannel()
+{
+    munmap(mem, mem_size);
+    close(event_fd);
+    close(peer_event_fd);
+    if (mem_fd >= 0) {
+        close(mem_fd);
+    }
+}
+
+void ShmChannel::send_peer(Socket& sock)
+{
+    if (mem_fd < 0) {
+        throw ShmException("shm channel error: peer end sent already");
+    }
+
+    uint64_t size = ring_size;
+    iovec iov = {&size, sizeof(size)};
+    char control[CMSG_SPACE(fds_count * sizeof(int))] = {};
+    int fds[fds_count] = {mem_fd, peer_event_fd, event_fd};
+
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    // a few bytes to a just accepted socket: sent at once or not at all
+    ssize_t res = sendmsg(sock.get_sockfd(), &msg, MSG_NOSIGNAL);
+    if (res != sizeof(size)) {
+        throw ShmException(res < 0 ? error_str("sendmsg error") : "shm channel error: peer end not sent");
+    }
+
+    // the mapping is kept, the memory is freed once both ends have unmapped it
+    close(mem_fd);
+    mem_fd = -1;
+}
+
+ssize_t ShmChannel::send(const char* data, size_t size)
+{
+    iovec iov = {const_cast<char*>(data), size};
+    return send(&iov, 1);
+}
+
+ssize_t ShmChannel::send(const struct iovec* iov, size_t count)
+{
+    size_t credit = get_credit();
+    size_t sent = 0;
+
+    for (size_t n = 0; n < count && sent < credit; n++) {
+        size_t size = std::min(iov[n].iov_len, credit - sent);
+        copy_in(tx_data, ring_size, tx_head + sent, static_cast<const char*>(iov[n].iov_base), size);
+        sent += size;
+    }
+    if (sent == 0) {
+        return 0;
+    }
+
+    tx_head += sent;
+    tx->head.store(tx_head, std::memory_order_release);
+
+    // pairs with the fence in set_interest: either the reader sees the data or the flag is seen here
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (tx->reader_waiting.load(std::memory_order_relaxed) && tx->reader_waiting.exchange(0)) {
+        notify(peer_event_fd);
+    }
+
+    return sent;
+}
+
+ssize_t ShmChannel::recv(char* data, size_t size)
+{
+    size = std::min(size, get_available());
+    if (size == 0) {
+        return 0;
+    }
+
+    copy_out(rx_data, ring_size, rx_tail, data, size);
+    rx_tail += size;
+    rx->tail.store(rx_tail, std::memory_order_release);
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (rx->writer_waiting.load(std::memory_order_relaxed) && rx->writer_waiting.exchange(0)) {
+        notify(peer_event_fd);
+    }
+
+    return size;
+}
+
+void ShmChannel::set_interest(bool readable, bool writable)
+{
+    rx->reader_waiting.store(readable, std::memory_order_relaxed);
+    tx->writer_waiting.store(writable, std::memory_order_relaxed);
+
+    // the data written or the credit returned before the flags were seen is checked here.
+    // Broken positions don't throw here, they make the end ready: the read or write following throws
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool has_data = rx->head.load(std::memory_order_acquire) != rx_tail;
+    bool has_credit = tx_head - tx->tail.load(std::memory_order_acquire) != ring_size;
+    if ((readable && has_data) || (writable && has_credit)) {
+        notify(event_fd);
+    }
+}
+
+bool ShmChannel::wait(bool readable, bool writable, int timeout)
+{
+    set_interest(readable, writable);
+
+    struct pollfd pfds[2] = {{event_fd, POLLIN, 0}, {watch_fd, POLLRDHUP, 0}};
+    int res = poll(pfds, watch_fd >= 0 ? 2 : 1, timeout);
+    if (res < 0 && errno != EINTR) {
+        throw ShmException(error_str("poll error"));
+    }
+    if (res > 0 && pfds[1].revents != 0) {
+        throw ShmException("shm channel error: closed by the peer");
+    }
+    if (res <= 0) {
+        return false;
+    }
+
+    acknowledge();
+    return true;
+}
+
+void ShmChannel::acknowledge()
+{
+    uint64_t value;
+    ssize_t len = read(event_fd, &value, sizeof(value));
+    (void)len;
+}
+
+int ShmChannel::get_event_fd() const
+{
+    return event_fd;
+}
+
+size_t ShmChannel::get_ring_size() const
+{
+    return ring_size;
+}
+
+void ShmChannel::init_rings(bool server_end)
+{
+    RingHeader* headers[2] = {reinterpret_cast<RingHeader*>(mem),
+                              reinterpret_cast<RingHeader*>(mem + sizeof(RingHeader))};
+    char* data[2] = {mem + header_size, mem + header_size + ring_size};
+
+    tx = headers[server_end ? 0 : 1];
+    rx = headers[server_end ? 1 : 0];
+    tx_data = data[server_end ? 0 : 1];
+    rx_data = data[server_end ? 1 : 0];
+}
+
+size_t ShmChannel::get_credit() const
+{
+    uint64_t used = tx_head - tx->tail.load(std::memory_order_acquire);
+    if (used > ring_size) {
+        throw ShmException("shm channel error: invalid read position");
+    }
+    return ring_size - used;
+}
+
+size_t ShmChannel::get_available() const
+{
+    uint64_t available = rx->head.load(std::memory_order_acquire) - rx_tail;
+    if (available > ring_size) {
+        throw ShmException("shm channel error: invalid write position");
+    }
+    return available;
+}
+
+void ShmChannel::notify(int fd)
+{
+    // the counter can't overflow in practice, an error means the peer is gone
+    uint64_t value = 1;
+    ssize_t len = write(fd, &value, sizeof(value));
+    (void)len;
+}
+
+
+} // namespace net
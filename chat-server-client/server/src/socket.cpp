@@ -5,8 +5,11 @@
 #include <vector>
 #include <memory>
 #include <cstring>
+#include <cstddef>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
@@ -15,14 +18,120 @@
 namespace net {
 
 
-Socket::Socket()
+Address::Address(const std::string& ip, uint16_t port):
+    storage(), len()
 {
-    sockfd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in* addr_in = (sockaddr_in*)&storage;
+    sockaddr_in6* addr_in6 = (sockaddr_in6*)&storage;
+
+    // an ipv6 address always contains a colon, an ipv4 one never does
+    bool ipv6 = ip.find(':') != std::string::npos;
+
+    int res;
+    if (ipv6) {
+        addr_in6->sin6_family = AF_INET6;
+        addr_in6->sin6_port = htons(port);
+        res = inet_pton(AF_INET6, ip.c_str(), &addr_in6->sin6_addr);
+        len = sizeof(sockaddr_in6);
+    }
+    else {
+        addr_in->sin_family = AF_INET;
+        addr_in->sin_port = htons(port);
+        res = inet_pton(AF_INET, ip.c_str(), &addr_in->sin_addr);
+        len = sizeof(sockaddr_in);
+    }
+
+    if (res == -1) {
+        throw SocketException(std::string("socket inet_pton error: ") + std::strerror(errno));
+    }
+    else if (res == 0) {
+        throw SocketException(std::string("socket inet_pton error: incorrect ip address"));
+    }
+}
+
+Address Address::from_path(const std::string& path)
+{
+    Address addr;
+    sockaddr_un* addr_un = (sockaddr_un*)&addr.storage;
+
+    if (path.empty() || path.size() >= sizeof(addr_un->sun_path)) {
+        throw SocketException("socket address error: incorrect unix socket path");
+    }
+    addr_un->sun_family = AF_UNIX;
+    std::memcpy(addr_un->sun_path, path.c_str(), path.size() + 1);
+    addr.len = offsetof(sockaddr_un, sun_path) + path.size() + 1;
+
+    return addr;
+}
+
+Family Address::get_family() const
+{
+    return static_cast<Family>(storage.ss_family);
+}
+
+const sockaddr* Address::get_sockaddr() const
+{
+    return (const sockaddr*)&storage;
+}
+
+sockaddr* Address::get_sockaddr()
+{
+    return (sockaddr*)&storage;
+}
+
+socklen_t Address::get_length() const
+{
+    return len;
+}
+
+socklen_t& Address::get_length()
+{
+    return len;
+}
+
+std::string Address::str() const
+{
+    char buf[INET6_ADDRSTRLEN];
+
+    switch (storage.ss_family) {
+    case AF_INET: {
+        const sockaddr_in* addr_in = (const sockaddr_in*)&storage;
+        inet_ntop(AF_INET, &addr_in->sin_addr, buf, sizeof(buf));
+        return std::string(buf) + ":" + std::to_string(ntohs(addr_in->sin_port));
+    }
+    case AF_INET6: {
+        const sockaddr_in6* addr_in6 = (const sockaddr_in6*)&storage;
+        inet_ntop(AF_INET6, &addr_in6->sin6_addr, buf, sizeof(buf));
+        return "[" + std::string(buf) + "]:" + std::to_string(ntohs(addr_in6->sin6_port));
+    }
+    case AF_UNIX: {
+        // an accepted unix socket peer is usually unnamed
+        const sockaddr_un* addr_un = (const sockaddr_un*)&storage;
+        size_t max = len > offsetof(sockaddr_un, sun_path) ? len - offsetof(sockaddr_un, sun_path) : 0;
+        return std::string(addr_un->sun_path, strnlen(addr_un->sun_path, max));
+    }
+    default:
+        return std::string();
+    }
+}
+
+
+Socket::Socket(Family family)
+{
+    sockfd = ::socket(static_cast<int>(family), SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (sockfd < 0) {
         throw SocketException(std::string("socket error: ") + std::strerror(errno));
     }
 }
 
+Socket::Socket(int fd):
+    sockfd(fd)
+{
+    if (getsockname(sockfd, addr.get_sockaddr(), &addr.get_length()) != 0) {
+        throw SocketException(std::string("socket getsockname error: ") + std::strerror(errno));
+    }
+}
+
 Socket::Socket(Socket&& other)
 {
     addr = other.addr;
@@ -31,23 +140,57 @@ Socket::Socket(Socket&& other)
 
 void Socket::bind(const std::string& ip, uint16_t port)
 {
-    fill_sockaddr(&addr, ip, port);
+    bind(Address(ip, port));
+}
 
-    if (::bind(sockfd, &addr, sizeof(sockaddr)) != 0) {
+void Socket::bind(const Address& addr)
+{
+    if (addr.get_family() == Family::INET6) {
+        int disable = 0;
+        if (setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &disable, sizeof(int)) < 0) {
+            throw SocketException(std::string("socket setsockopt error: ") + std::strerror(errno));
+        }
+    }
+
+    if (::bind(sockfd, addr.get_sockaddr(), addr.get_length()) != 0) {
         throw SocketException(std::string("socket bind error: ") + std::strerror(errno));
     }
+    this->addr = addr;
 }
 
 void Socket::connect(const std::string& ip, uint16_t port)
 {
-    sockaddr remote;
-    fill_sockaddr(&remote, ip, port);
+    connect(Address(ip, port));
+}
 
-    if (::connect(sockfd, &remote, sizeof(sockaddr)) != 0) {
+void Socket::connect(const Address& addr)
+{
+    if (::connect(sockfd, addr.get_sockaddr(), addr.get_length()) != 0) {
         throw SocketException(std::string("socket connect error: ") + std::strerror(errno));
     }
 }
 
+bool Socket::connect_nonblocking(const Address& addr)
+{
+    if (::connect(sockfd, addr.get_sockaddr(), addr.get_length()) == 0) {
+        return true;
+    }
+    if (errno != EINPROGRESS) {
+        throw SocketException(std::string("socket connect error: ") + std::strerror(errno));
+    }
+    return false;
+}
+
+int Socket::get_error()
+{
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+        throw SocketException(std::string("socket getsockopt error: ") + std::strerror(errno));
+    }
+    return error;
+}
+
 void Socket::listen(int backlog)
 {
     if (::listen(sockfd, backlog) != 0) {
@@ -55,13 +198,17 @@ void Socket::listen(int backlog)
     }
 }
 
-std::unique_ptr<Socket> Socket::accept()
+std::unique_ptr<Socket> Socket::accept(bool nonblocking)
 {
-    sockaddr addr;
-    socklen_t len = sizeof(sockaddr);
+    Address addr;
 
-    int fd = ::accept(sockfd, &addr, &len);
-    if (fd < 0 || len != sizeof(sockaddr)) {
+    // sets the accepted socket flags atomically, no extra fcntl calls needed
+    int fd = ::accept4(sockfd, addr.get_sockaddr(), &addr.get_length(),
+                       SOCK_CLOEXEC | (nonblocking ? SOCK_NONBLOCK : 0));
+    if (fd < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+        return std::unique_ptr<Socket>();
+    }
+    if (fd < 0) {
         throw SocketException(std::string("socket accept error: ") + std::strerror(errno));
     }
 
@@ -71,7 +218,8 @@ std::unique_ptr<Socket> Socket::accept()
 
 void Socket::Socket::set_nonblocking()
 {
-    if (fcntl(sockfd, F_SETFL, O_NONBLOCK) == -1) {
+    int flags = fcntl(sockfd, F_GETFL);
+    if (flags == -1 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) == -1) {
         throw SocketException(std::string("socket fcntl error: ") + std::strerror(errno));
     }
 }
@@ -84,6 +232,14 @@ void Socket::set_reuse()
     }
 }
 
+void Socket::set_reuse_port()
+{
+    int enable = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0) {
+        throw SocketException(std::string("socket setsockopt error: ") + std::strerror(errno));
+    }
+}
+
 void Socket::close()
 {
     if (sockfd > 0) {
@@ -106,7 +262,12 @@ ssize_t Socket::sendall(const std::vector<char>& buf)
 
 ssize_t Socket::send(const std::vector<char>& buf, size_t offset)
 {
-    ssize_t res = ::send(sockfd, buf.data() + offset, buf.size() - offset, MSG_NOSIGNAL);
+    return send(buf.data() + offset, buf.size() - offset);
+}
+
+ssize_t Socket::send(const char* data, size_t size)
+{
+    ssize_t res = ::send(sockfd, data, size, MSG_NOSIGNAL);
     if (res == 0) {
         throw SocketException("socket send error: socket has been closed");
     }
@@ -124,11 +285,35 @@ ssize_t Socket::send(const std::vector<char>& buf, size_t offset)
     return res;
 }
 
+ssize_t Socket::send(const struct iovec* iov, size_t count)
+{
+    // sendmsg is writev with flags: MSG_NOSIGNAL is not available to writev
+    struct msghdr msg = {};
+    msg.msg_iov = const_cast<struct iovec*>(iov);
+    msg.msg_iovlen = count;
+
+    ssize_t res = ::sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+    if (res == 0) {
+        throw SocketException("socket send error: socket has been closed");
+    }
+    if (res == -1) {
+        if (errno == EWOULDBLOCK || errno == EAGAIN) {
+            return 0;
+        }
+        if (errno == EPIPE) {
+            throw SocketException("socket send error: socket has been unexpectedly closed");
+        }
+        throw SocketException(std::string("socket send error: ") + std::strerror(errno));
+    }
+
+    return res;
+}
+
 ssize_t Socket::recvall(std::vector<char>& buf, size_t size)
 {
     ssize_t recved = 0;
     while(recved != size) {
-        recved += recv(buf, size);
+        recved += recv(buf, size - recved);
     }
 
     return recved;
@@ -136,10 +321,17 @@ ssize_t Socket::recvall(std::vector<char>& buf, size_t size)
 
 ssize_t Socket::recv(std::vector<char>& buf, size_t max)
 {
-    ssize_t res;
     char tmp[buf_size];
 
-    res = ::recv(sockfd, tmp, std::min(buf_size, max), MSG_NOSIGNAL);
+    ssize_t res = recv(tmp, std::min(buf_size, max));
+    std::copy(tmp, tmp + res, std::back_inserter(buf));
+
+    return res;
+}
+
+ssize_t Socket::recv(char* data, size_t size)
+{
+    ssize_t res = ::recv(sockfd, data, size, MSG_NOSIGNAL);
     if (res == 0) {
         throw SocketException("socket recv error: socket has been closed");
     }
@@ -153,9 +345,8 @@ ssize_t Socket::recv(std::vector<char>& buf, size_t max)
         }
         throw SocketException(std::string("socket recv error: ") + std::strerror(errno));
     }
-    std::copy(tmp, tmp + res, std::back_inserter(buf));
 
-    return buf.size();
+    return res;
 }
 
 int Socket::get_sockfd() const
@@ -163,20 +354,9 @@ int Socket::get_sockfd() const
     return sockfd;
 }
 
-void Socket::fill_sockaddr(sockaddr* addr, const std::string& ip, uint16_t port)
+const Address& Socket::get_address() const
 {
-    sockaddr_in* addr_in = (sockaddr_in*)addr;
-
-    addr_in->sin_family = AF_INET;
-    addr_in->sin_port = htons(port);
-
-    int res = inet_pton(AF_INET, ip.c_str(), &addr_in->sin_addr);
-    if (res == -1) {
-        throw SocketException(std::string("socket inet_pton error: ") + std::strerror(errno));
-    }
-    else if (res == 0) {
-        throw SocketException(std::string("socket inet_pton error: incorrect ip address"));
-    }
+    return addr;
 }
 
 
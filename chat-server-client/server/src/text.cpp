@@ -0,0 +1,533 @@
+#include <text.h>
+
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TEXT_X86
+#include <immintrin.h>
+#endif
+
+
+namespace text {
+
+
+namespace {
+
+/*
+ * The vectorised validation is the lookup algorithm by J. Keiser and D. Lemire
+ * ("Validating UTF-8 In Less Than One Instruction Per Byte"): every error of a two byte
+ * sequence is found by three table lookups (the high and the low nibbles of the first byte
+ * and the high nibble of the second one), the bits of the tables are the error kinds.
+ * The third and the fourth bytes of the longer sequences are checked by the byte 2 and 3 positions back.
+ */
+const uint8_t too_short = 1 << 0;       // 11______ 0_______ or 11______ 11______
+const uint8_t too_long = 1 << 1;        // 0_______ 10______
+const uint8_t overlong_3 = 1 << 2;      // 11100000 100_____
+const uint8_t too_large = 1 << 3;       // 11110100 1001____ and above
+const uint8_t surrogate = 1 << 4;       // 11101101 101_____
+const uint8_t overlong_2 = 1 << 5;      // 1100000_ 10______
+const uint8_t too_large_1000 = 1 << 6;  // 11110101 1000____ and above
+const uint8_t overlong_4 = 1 << 6;      // 11110000 1000____
+const uint8_t two_conts = 1 << 7;       // 10______ 10______
+const uint8_t carry = too_short | too_long | two_conts;
+
+alignas(16) const uint8_t byte_1_high[16] = {
+    // 0_______ ________ ascii
+    too_long, too_long, too_long, too_long, too_long, too_long, too_long, too_long,
+    // 10______ ________ continuation
+    two_conts, two_conts, two_conts, two_conts,
+    // 1100____ ________ two byte lead
+    too_short | overlong_2,
+    // 1101____ ________ two byte lead
+    too_short,
+    // 1110____ ________ three byte lead
+    too_short | overlong_3 | surrogate,
+    // 1111____ ________ four byte lead
+    too_short | too_large | too_large_1000 | overlong_4
+};
+
+alignas(16) const uint8_t byte_1_low[16] = {
+    carry | overlong_3 | overlong_2 | overlong_4,   // ____0000
+    carry | overlong_2,                             // ____0001
+    carry,                                          // ____001_
+    carry,
+    carry | too_large,                              // ____0100
+    carry | too_large | too_large_1000,             // ____0101
+    carry | too_large | too_large_1000,             // ____011_
+    carry | too_large | too_large_1000,
+    carry | too_large | too_large_1000,             // ____1___
+    carry | too_large | too_large_1000,
+    carry | too_large | too_large_1000,
+    carry | too_large | too_large_1000,
+    carry | too_large | too_large_1000,
+    carry | too_large | too_large_1000 | surrogate, // ____1101
+    carry | too_large | too_large_1000,
+    carry | too_large | too_large_1000
+};
+
+alignas(16) const uint8_t byte_2_high[16] = {
+    // ________ 0_______ ascii
+    too_short, too_short, too_short, too_short, too_short, too_short, too_short, too_short,
+    // ________ 1000____
+    too_long | overlong_2 | two_conts | overlong_3 | too_large_1000 | overlong_4,
+    // ________ 1001____
+    too_long | overlong_2 | two_conts | overlong_3 | too_large,
+    // ________ 101_____
+    too_long | overlong_2 | two_conts | surrogate | too_large,
+    too_long | overlong_2 | two_conts | surrogate | too_large,
+    // ________ 11______ lead
+    too_short, too_short, too_short, too_short
+};
+
+/*
+ * returns true if the byte at pos starts a terminal control character (see has_controls)
+ */
+inline bool is_control_at(const uint8_t* data, size_t size, size_t pos)
+{
+    uint8_t c = data[pos];
+    if (c < 0x20) {
+        return c != '\t' && c != '\n';
+    }
+    if (c == 0x7f) {
+        return true;
+    }
+    // C1 controls are encoded as C2 80 - C2 9F
+    return c == 0xc2 && pos + 1 < size && data[pos + 1] >= 0x80 && data[pos + 1] <= 0x9f;
+}
+
+bool is_valid_utf8_scalar(const char* chars, size_t size)
+{
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(chars);
+    size_t pos = 0;
+
+    while (pos < size) {
+        // skips the ascii 8 bytes at once
+        if (pos + 8 <= size) {
+            uint64_t word;
+            std::memcpy(&word, data + pos, sizeof(word));
+            if ((word & 0x8080808080808080ull) == 0) {
+                pos += 8;
+                continue;
+            }
+        }
+
+        uint8_t c = data[pos];
+        if (c < 0x80) {
+            pos++;
+            continue;
+        }
+
+        size_t len;
+        uint32_t code;
+        if (c >= 0xc2 && c <= 0xdf) {
+            len = 2;
+            code = c & 0x1f;
+        }
+        else if ((c & 0xf0) == 0xe0) {
+            len = 3;
+            code = c & 0x0f;
+        }
+        else if (c >= 0xf0 && c <= 0xf4) {
+            len = 4;
+            code = c & 0x07;
+        }
+        else {
+            return false;   // a continuation, an overlong two byte lead or a lead above U+10FFFF
+        }
+
+        if (size - pos < len) {
+            return false;
+        }
+        for (size_t n = 1; n < len; n++) {
+            if ((data[pos + n] & 0xc0) != 0x80) {
+                return false;
+            }
+            code = (code << 6) | (data[pos + n] & 0x3f);
+        }
+
+        if (len == 3 && (code < 0x800 || (code >= 0xd800 && code <= 0xdfff))) {
+            return false;
+        }
+        if (len == 4 && (code < 0x10000 || code > 0x10ffff)) {
+            return false;
+        }
+        pos += len;
+    }
+
+    return true;
+}
+
+bool has_controls_scalar(const char* chars, size_t size)
+{
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(chars);
+
+    for (size_t pos = 0; pos < size; pos++) {
+        if (is_control_at(data, size, pos)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+#ifdef TEXT_X86
+
+__attribute__((target("avx2")))
+inline __m256i avx2_lookup(const uint8_t* table, __m256i nibbles)
+{
+    __m256i t = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(table)));
+    return _mm256_shuffle_epi8(t, nibbles);
+}
+
+__attribute__((target("avx2")))
+inline void avx2_check_block(__m256i input, __m256i& prev_input, __m256i& prev_incomplete, __m256i& error)
+{
+    if (_mm256_movemask_epi8(input) == 0) {
+        // an ascii block can't continue a sequence
+        error = _mm256_or_si256(error, prev_incomplete);
+        prev_incomplete = _mm256_setzero_si256();
+        prev_input = input;
+        return;
+    }
+
+    const __m256i low_nibble = _mm256_set1_epi8(0x0f);
+
+    // the input shifted by 1, 2 and 3 bytes, the previous block bytes are shifted in
+    __m256i prev_cross = _mm256_permute2x128_si256(prev_input, input, 0x21);
+    __m256i prev1 = _mm256_alignr_epi8(input, prev_cross, 15);
+    __m256i prev2 = _mm256_alignr_epi8(input, prev_cross, 14);
+    __m256i prev3 = _mm256_alignr_epi8(input, prev_cross, 13);
+
+    __m256i b1h = avx2_lookup(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low_nibble));
+    __m256i b1l = avx2_lookup(byte_1_low, _mm256_and_si256(prev1, low_nibble));
+    __m256i b2h = avx2_lookup(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), low_nibble));
+    __m256i special = _mm256_and_si256(_mm256_and_si256(b1h, b1l), b2h);
+
+    // the third and the fourth bytes of a sequence must be continuations (the only allowed two_conts)
+    __m256i third = _mm256_subs_epu8(prev2, _mm256_set1_epi8(static_cast<char>(0xe0 - 0x80)));
+    __m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8(static_cast<char>(0xf0 - 0x80)));
+    __m256i must23 = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8(static_cast<char>(0x80)));
+
+    error = _mm256_or_si256(error, _mm256_xor_si256(must23, special));
+
+    // a sequence started in the last three bytes continues in the next block
+    const __m256i max_complete = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        static_cast<char>(0xf0 - 1), static_cast<char>(0xe0 - 1), static_cast<char>(0xc0 - 1));
+    prev_incomplete = _mm256_subs_epu8(input, max_complete);
+    prev_input = input;
+}
+
+__attribute__((target("avx2")))
+bool is_valid_utf8_avx2(const char* data, size_t size)
+{
+    __m256i prev_input = _mm256_setzero_si256();
+    __m256i prev_incomplete = _mm256_setzero_si256();
+    __m256i error = _mm256_setzero_si256();
+    size_t pos = 0;
+
+    for (; pos + 32 <= size; pos += 32) {
+        __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+        avx2_check_block(input, prev_input, prev_incomplete, error);
+    }
+
+    // the tail is padded with zeros: ascii, so a truncated sequence is an error
+    if (pos < size) {
+        alignas(32) char tail[32] = {0};
+        std::memcpy(tail, data + pos, size - pos);
+        avx2_check_block(_mm256_load_si256(reinterpret_cast<const __m256i*>(tail)), prev_input, prev_incomplete, error);
+    }
+
+    error = _mm256_or_si256(error, prev_incomplete);
+    return _mm256_testz_si256(error, error);
+}
+
+__attribute__((target("avx2")))
+bool has_controls_avx2(const char* chars, size_t size)
+{
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(chars);
+    const __m256i max_c0 = _mm256_set1_epi8(0x1f);
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    const __m256i c1_lead = _mm256_set1_epi8(static_cast<char>(0xc2));
+    size_t pos = 0;
+
+    for (; pos + 32 <= size; pos += 32) {
+        __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+
+        __m256i c0 = _mm256_cmpeq_epi8(_mm256_min_epu8(input, max_c0), input);
+        c0 = _mm256_andnot_si256(_mm256_or_si256(_mm256_cmpeq_epi8(input, tab), _mm256_cmpeq_epi8(input, newline)), c0);
+        __m256i controls = _mm256_or_si256(c0, _mm256_cmpeq_epi8(input, del));
+        if (_mm256_movemask_epi8(controls) != 0) {
+            return true;
+        }
+
+        // C2 starts a C1 control or a printable character, the next byte tells
+        uint32_t leads = _mm256_movemask_epi8(_mm256_cmpeq_epi8(input, c1_lead));
+        for (; leads != 0; leads &= leads - 1) {
+            if (is_control_at(data, size, pos + __builtin_ctz(leads))) {
+                return true;
+            }
+        }
+    }
+
+    return has_controls_scalar(chars + pos, size - pos);
+}
+
+__attribute__((target("ssse3")))
+inline __m128i ssse3_lookup(const uint8_t* table, __m128i nibbles)
+{
+    return _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(table)), nibbles);
+}
+
+__attribute__((target("ssse3")))
+inline void ssse3_check_block(__m128i input, __m128i& prev_input, __m128i& prev_incomplete, __m128i& error)
+{
+    if (_mm_movemask_epi8(input) == 0) {
+        error = _mm_or_si128(error, prev_incomplete);
+        prev_incomplete = _mm_setzero_si128();
+        prev_input = input;
+        return;
+    }
+
+    const __m128i low_nibble = _mm_set1_epi8(0x0f);
+
+    __m128i prev1 = _mm_alignr_epi8(input, prev_input, 15);
+    __m128i prev2 = _mm_alignr_epi8(input, prev_input, 14);
+    __m128i prev3 = _mm_alignr_epi8(input, prev_input, 13);
+
+    __m128i b1h = ssse3_lookup(byte_1_high, _mm_and_si128(_mm_srli_epi16(prev1, 4), low_nibble));
+    __m128i b1l = ssse3_lookup(byte_1_low, _mm_and_si128(prev1, low_nibble));
+    __m128i b2h = ssse3_lookup(byte_2_high, _mm_and_si128(_mm_srli_epi16(input, 4), low_nibble));
+    __m128i special = _mm_and_si128(_mm_and_si128(b1h, b1l), b2h);
+
+    __m128i third = _mm_subs_epu8(prev2, _mm_set1_epi8(static_cast<char>(0xe0 - 0x80)));
+    __m128i fourth = _mm_subs_epu8(prev3, _mm_set1_epi8(static_cast<char>(0xf0 - 0x80)));
+    __m128i must23 = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8(static_cast<char>(0x80)));
+
+    error = _mm_or_si128(error, _mm_xor_si128(must23, special));
+
+    const __m128i max_complete = _mm_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        static_cast<char>(0xf0 - 1), static_cast<char>(0xe0 - 1), static_cast<char>(0xc0 - 1));
+    prev_incomplete = _mm_subs_epu8(input, max_complete);
+    prev_input = input;
+}
+
+__attribute__((target("ssse3")))
+bool is_valid_utf8_ssse3(const char* data, size_t size)
+{
+    __m128i prev_input = _mm_setzero_si128();
+    __m128i prev_incomplete = _mm_setzero_si128();
+    __m128i error = _mm_setzero_si128();
+    size_t pos = 0;
+
+    for (; pos + 16 <= size; pos += 16) {
+        __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+        ssse3_check_block(input, prev_input, prev_incomplete, error);
+    }
+
+    if (pos < size) {
+        alignas(16) char tail[16] = {0};
+        std::memcpy(tail, data + pos, size - pos);
+        ssse3_check_block(_mm_load_si128(reinterpret_cast<const __m128i*>(tail)), prev_input, prev_incomplete, error);
+    }
+
+    error = _mm_or_si128(error, prev_incomplete);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xffff;
+}
+
+__attribute__((target("ssse3")))
+bool has_controls_ssse3(const char* chars, size_t size)
+{
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(chars);
+    const __m128i max_c0 = _mm_set1_epi8(0x1f);
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i del = _mm_set1_epi8(0x7f);
+    const __m128i c1_lead = _mm_set1_epi8(static_cast<char>(0xc2));
+    size_t pos = 0;
+
+    for (; pos + 16 <= size; pos += 16) {
+        __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+
+        __m128i c0 = _mm_cmpeq_epi8(_mm_min_epu8(input, max_c0), input);
+        c0 = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi8(input, tab), _mm_cmpeq_epi8(input, newline)), c0);
+        __m128i controls = _mm_or_si128(c0, _mm_cmpeq_epi8(input, del));
+        if (_mm_movemask_epi8(controls) != 0) {
+            return true;
+        }
+
+        uint32_t leads = _mm_movemask_epi8(_mm_cmpeq_epi8(input, c1_lead));
+        for (; leads != 0; leads &= leads - 1) {
+            if (is_control_at(data, size, pos + __builtin_ctz(leads))) {
+                return true;
+            }
+        }
+    }
+
+    return has_controls_scalar(chars + pos, size - pos);
+}
+
+#endif // TEXT_X86
+
+
+/*
+ * the implementation chosen for the cpu
+ */
+struct Implementation {
+    bool (*is_valid_utf8)(const char*, size_t);
+    bool (*has_controls)(const char*, size_t);
+    const char* isa;
+};
+
+Implementation select_implementation()
+{
+#ifdef TEXT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return Implementation{is_valid_utf8_avx2, has_controls_avx2, "avx2"};
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return Implementation{is_valid_utf8_ssse3, has_controls_ssse3, "ssse3"};
+    }
+#endif
+    return Implementation{is_valid_utf8_scalar, has_controls_scalar, "scalar"};
+}
+
+Implementation implementation = select_implementation();
+
+/*
+ * skips the escape sequence starting at pos (after ESC or a C1 control), returns the position after it
+ */
+size_t skip_sequence(const std::string& str, size_t pos, char type)
+{
+    if (type == '[') {
+        // CSI: parameter and intermediate bytes, then a final byte
+        while (pos < str.size() && str[pos] >= 0x20 && str[pos] <= 0x3f) {
+            pos++;
+        }
+        if (pos < str.size() && str[pos] >= 0x40 && str[pos] <= 0x7e) {
+            pos++;
+        }
+        return pos;
+    }
+
+    // OSC, DCS, PM, APC: a string terminated by BEL or ESC backslash
+    while (pos < str.size()) {
+        if (str[pos] == '\a') {
+            return pos + 1;
+        }
+        if (str[pos] == '\x1b' && pos + 1 < str.size() && str[pos + 1] == '\\') {
+            return pos + 2;
+        }
+        pos++;
+    }
+    return pos;
+}
+
+} // namespace
+
+
+bool is_valid_utf8(const char* data, size_t size)
+{
+    return implementation.is_valid_utf8(data, size);
+}
+
+bool has_controls(const char* data, size_t size)
+{
+    return implementation.has_controls(data, size);
+}
+
+void strip_controls(std::string& str)
+{
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(str.data());
+    size_t out = 0;
+    size_t pos = 0;
+
+    while (pos < str.size()) {
+        if (!is_control_at(data, str.size(), pos)) {
+            str[out++] = str[pos++];
+            continue;
+        }
+
+        uint8_t c = data[pos];
+        if (c == 0x1b && pos + 1 < str.size()) {
+            char type = str[pos + 1];
+            if (type == '[' || type == ']' || type == 'P' || type == '^' || type == '_') {
+                pos = skip_sequence(str, pos + 2, type);
+            }
+            else if (type >= 0x20 && type <= 0x7e) {
+                pos += 2;   // a two character sequence
+            }
+            else {
+                pos++;
+            }
+        }
+        else if (c == 0xc2) {
+            // the C1 forms of CSI, OSC, DCS, PM and APC
+            switch (data[pos + 1]) {
+            case 0x9b:
+                pos = skip_sequence(str, pos + 2, '[');
+                break;
+            case 0x90:
+            case 0x9d:
+            case 0x9e:
+            case 0x9f:
+                pos = skip_sequence(str, pos + 2, ']');
+                break;
+            default:
+                pos += 2;
+            }
+        }
+        else {
+            pos++;
+        }
+    }
+
+    str.resize(out);
+}
+
+bool sanitize(std::string& str)
+{
+    if (!is_valid_utf8(str.data(), str.size())) {
+        return false;
+    }
+    if (has_controls(str.data(), str.size())) {
+        strip_controls(str);
+    }
+    return true;
+}
+
+const char* get_isa()
+{
+    return implementation.isa;
+}
+
+bool set_isa(const std::string& isa)
+{
+    if (isa == "scalar") {
+        implementation = Implementation{is_valid_utf8_scalar, has_controls_scalar, "scalar"};
+        return true;
+    }
+#ifdef TEXT_X86
+    __builtin_cpu_init();
+    if (isa == "avx2" && __builtin_cpu_supports("avx2")) {
+        implementation = Implementation{is_valid_utf8_avx2, has_controls_avx2, "avx2"};
+        return true;
+    }
+    if (isa == "ssse3" && __builtin_cpu_supports("ssse3")) {
+        implementation = Implementation{is_valid_utf8_ssse3, has_controls_ssse3, "ssse3"};
+        return true;
+    }
+#endif
+    return false;
+}
+
+
+} // namespace text
@@ -0,0 +1,70 @@
+#include <timer.h>
+
+#include <string>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+
+namespace io {
+
+
+Timer::Timer()
+{
+    timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerfd == -1) {
+        throw TimerException(std::string("timerfd_create error: ") + std::strerror(errno));
+    }
+}
+
+Timer::~Timer()
+{
+    close(timerfd);
+}
+
+void Timer::start(std::chrono::microseconds timeout, bool periodic)
+{
+    itimerspec spec = {};
+
+    // zero it_value disarms the timer, so round it up to a microsecond
+    long long usec = std::max<long long>(timeout.count(), 1);
+    spec.it_value.tv_sec = usec / 1000000;
+    spec.it_value.tv_nsec = usec % 1000000 * 1000;
+    if (periodic) {
+        spec.it_interval = spec.it_value;
+    }
+
+    if (timerfd_settime(timerfd, 0, &spec, NULL) == -1) {
+        throw TimerException(std::string("timerfd_settime error: ") + std::strerror(errno));
+    }
+}
+
+void Timer::stop()
+{
+    itimerspec spec = {};
+
+    if (timerfd_settime(timerfd, 0, &spec, NULL) == -1) {
+        throw TimerException(std::string("timerfd_settime error: ") + std::strerror(errno));
+    }
+}
+
+uint64_t Timer::acknowledge()
+{
+    uint64_t expirations = 0;
+
+    if (read(timerfd, &expirations, sizeof(uint64_t)) == -1 && errno != EAGAIN) {
+        throw TimerException(std::string("timerfd read error: ") + std::strerror(errno));
+    }
+
+    return expirations;
+}
+
+int Timer::get_fd() const
+{
+    return timerfd;
+}
+
+
+} // namespace io
@@ -0,0 +1,432 @@
+#include <tls.h>
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <socket.h>
+#include <epoll.h>
+#include <logger.h>
+#include <binlog.h>
+#include <affinity.h>
+
+
+using namespace logging;
+
+
+namespace net {
+
+
+namespace {
+
+/*
+ * returns the description of the last OpenSSL error of the thread
+ */
+std::string get_ssl_error()
+{
+    unsigned long code = ERR_get_error();
+    if (code == 0) {
+        return std::strerror(errno);
+    }
+
+    char buf[256];
+    ERR_error_string_n(code, buf, sizeof(buf));
+    return buf;
+}
+
+} // namespace
+
+
+TlsContext::TlsContext(const std::string& cert_path, const std::string& key_path)
+{
+    ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        throw TlsException("tls context error: " + get_ssl_error());
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION);
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+    // the session tickets sent after a TLS 1.3 handshake would be records the kernel is given the keys after
+    SSL_CTX_set_num_tickets(ctx, 0);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    if (SSL_CTX_set_cipher_list(ctx, "ECDHE+AESGCM") != 1 ||
+        SSL_CTX_set_ciphersuites(ctx, "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384") != 1) {
+        std::string error = get_ssl_error();
+        SSL_CTX_free(ctx);
+        throw TlsException("tls context error: " + error);
+    }
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_path.c_str()) != 1) {
+        std::string error = get_ssl_error();
+        SSL_CTX_free(ctx);
+        throw TlsException("tls context error: failed to load certificate " + cert_path + ": " + error);
+    }
+    if (SSL_CTX_use_PrivateKey_file(ctx, key_path.c_str(), SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        std::string error = get_ssl_error();
+        SSL_CTX_free(ctx);
+        throw TlsException("tls context error: failed to load private key " + key_path + ": " + error);
+    }
+}
+
+TlsContext::~TlsContext()
+{
+    SSL_CTX_free(ctx);
+}
+
+SSL_CTX* TlsContext::get_native() const
+{
+    return ctx;
+}
+
+
+TlsTerminator::Session::~Session()
+{
+    if (ssl) {
+        SSL_free(ssl);
+    }
+
+    try {
+        if (sock) {
+            sock->close();
+        }
+        if (pair) {
+            pair->close();
+        }
+    }
+    catch (SocketException& e) {
+        Logger::get_instance()->warning(e.what());
+    }
+}
+
+
+TlsTerminator::TlsTerminator(std::shared_ptr<TlsContext> ctx_ptr, ConnectHandler on_connect,
+    std::chrono::milliseconds handshake_timeout, size_t max_sessions):
+    ctx_ptr(ctx_ptr), on_connect(on_connect), handshake_timeout(handshake_timeout),
+    epoll(max_sessions), relay_buf(relay_buf_size)
+{ }
+
+TlsTerminator::~TlsTerminator()
+{
+    stop();
+}
+
+void TlsTerminator::start(const concurrent::CpuList& cpus)
+{
+    thread = std::thread(&TlsTerminator::run, this, cpus);
+}
+
+void TlsTerminator::stop()
+{
+    if (thread.joinable()) {
+        epoll.stop();
+        thread.join();
+    }
+}
+
+void TlsTerminator::add(std::unique_ptr<Socket> sock_ptr)
+{
+    // the task is copyable, so the socket is passed by a raw pointer
+    Socket* raw_sock_ptr = sock_ptr.release();
+    epoll.post([this, raw_sock_ptr] { on_add(raw_sock_ptr); });
+}
+
+void TlsTerminator::run(const concurrent::CpuList& cpus)
+{
+    try {
+        concurrent::set_thread_affinity(cpus);
+    }
+    catch (concurrent::AffinityException& e) {
+        Logger::get_instance()->warning(e.what());
+    }
+
+    epoll.add_handler(expire_timer.get_fd(), io::Epoll::Event::IN, [this] (int events, void* data) {
+        on_expire_timer(events, data);
+    });
+    expire_timer.start(expire_interval, true);
+
+    try {
+        epoll.start();
+    }
+    catch (std::runtime_error& e) {
+        Logger::get_instance()->error(e.what());
+    }
+}
+
+void TlsTerminator::on_add(Socket* raw_sock_ptr)
+{
+    auto session_ptr = std::unique_ptr<Session>(new Session());
+    session_ptr->sock.reset(raw_sock_ptr);
+
+    session_ptr->ssl = SSL_new(ctx_ptr->get_native());
+    if (!session_ptr->ssl) {
+        Logger::get_instance()->warning("tls error: " + get_ssl_error());
+        return;
+    }
+    int sock_fd = raw_sock_ptr->get_sockfd();
+    SSL_set_fd(session_ptr->ssl, sock_fd);
+    SSL_set_accept_state(session_ptr->ssl);
+    session_ptr->deadline = std::chrono::steady_clock::now() + handshake_timeout;
+
+    Session* raw_session_ptr = session_ptr.get();
+    epoll.add_handler(sock_fd, io::Epoll::Event::IN, [this] (int events, void* data) {
+        on_peer_event(events, data);
+    }, raw_session_ptr);
+    sessions[sock_fd] = std::move(session_ptr);
+
+    handshake(raw_session_ptr);
+}
+
+void TlsTerminator::on_peer_event(int events, void* data)
+{
+    Session* session_ptr = static_cast<Session*>(data);
+
+    if (events & io::Epoll::Event::ERR) {
+        close_session(session_ptr);
+        return;
+    }
+
+    if (session_ptr->handshaking) {
+        handshake(session_ptr);
+        return;
+    }
+
+    // a hang up is detected by SSL_read
+    if ((events & io::Epoll::Event::OUT) && !relay_to_peer(session_ptr)) {
+        return;
+    }
+    if ((events & (io::Epoll::Event::IN | io::Epoll::Event::HUP)) && !relay_from_peer(session_ptr)) {
+        return;
+    }
+    update_events(session_ptr);
+}
+
+void TlsTerminator::on_pair_event(int events, void* data)
+{
+    Session* session_ptr = static_cast<Session*>(data);
+
+    if (events & io::Epoll::Event::ERR) {
+        close_session(session_ptr);
+        return;
+    }
+
+    // the data left in the pair by a closed server end is read before the close is detected
+    if ((events & io::Epoll::Event::OUT) && !relay_from_peer(session_ptr)) {
+        return;
+    }
+    if ((events & (io::Epoll::Event::IN | io::Epoll::Event::HUP)) && !relay_to_peer(session_ptr)) {
+        return;
+    }
+    update_events(session_ptr);
+}
+
+void TlsTerminator::on_expire_timer(int events, void* data)
+{
+    expire_timer.acknowledge();
+
+    auto now = std::chrono::steady_clock::now();
+    std::vector<Session*> expired;
+    for (const auto& fd_session_pair: sessions) {
+        if (fd_session_pair.second->handshaking && fd_session_pair.second->deadline <= now) {
+            expired.push_back(fd_session_pair.second.get());
+        }
+    }
+
+    for (Session* session_ptr: expired) {
+        static Format handshake_expired(Loglevel::DEBUG, "tls handshake timeout");
+        log(handshake_expired);
+        close_session(session_ptr);
+    }
+}
+
+void TlsTerminator::handshake(Session* session_ptr)
+{
+    ERR_clear_error();
+    int res = SSL_do_handshake(session_ptr->ssl);
+    if (res == 1) {
+        complete(session_ptr);
+        return;
+    }
+
+    int sock_fd = session_ptr->sock->get_sockfd();
+    switch (SSL_get_error(session_ptr->ssl, res)) {
+    case SSL_ERROR_WANT_READ:
+        epoll.modify_handler(sock_fd, io::Epoll::Event::IN);
+        break;
+    case SSL_ERROR_WANT_WRITE:
+        epoll.modify_handler(sock_fd, io::Epoll::Event::OUT);
+        break;
+    default: {
+        static Format handshake_failed(Loglevel::DEBUG, "tls handshake error: %1%");
+        log(handshake_failed, get_ssl_error());
+        close_session(session_ptr);
+    }
+    }
+}
+
+void TlsTerminator::complete(Session* session_ptr)
+{
+    session_ptr->handshaking = false;
+    int sock_fd = session_ptr->sock->get_sockfd();
+
+    bool kernel = false;
+#ifndef OPENSSL_NO_KTLS
+    kernel = BIO_get_ktls_send(SSL_get_wbio(session_ptr->ssl)) &&
+             BIO_get_ktls_recv(SSL_get_rbio(session_ptr->ssl));
+#endif
+
+    if (kernel) {
+        // the kernel has the keys and the records state, the session is not needed any more
+        static Format ktls_connected(Loglevel::DEBUG, "tls connection established, %1% with kTLS");
+        log(ktls_connected, SSL_get_cipher_name(session_ptr->ssl));
+
+        std::unique_ptr<Socket> sock_ptr = std::move(session_ptr->sock);
+        epoll.del_handler(sock_fd);
+        sessions.erase(sock_fd);
+        on_connect(std::move(sock_ptr), false);
+        return;
+    }
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0) {
+        Logger::get_instance()->warning(std::string("tls error: socketpair error: ") + std::strerror(errno));
+        close_session(session_ptr);
+        return;
+    }
+
+    static Format relay_connected(Loglevel::DEBUG, "tls connection established, %1% relayed");
+    log(relay_connected, SSL_get_cipher_name(session_ptr->ssl));
+
+    const Address& addr = session_ptr->sock->get_address();
+    session_ptr->pair.reset(new Socket(fds[0], addr));
+    epoll.add_handler(fds[0], io::Epoll::Event::IN, [this] (int events, void* data) {
+        on_pair_event(events, data);
+    }, session_ptr);
+    on_connect(std::unique_ptr<Socket>(new Socket(fds[1], addr)), true);
+
+    // the client may have sent the data with its last handshake message
+    if (relay_from_peer(session_ptr)) {
+        update_events(session_ptr);
+    }
+}
+
+bool TlsTerminator::relay_from_peer(Session* session_ptr)
+{
+    std::vector<char>& pending = session_ptr->to_pair;
+
+    try {
+        while (true) {
+            if (!pending.empty()) {
+                ssize_t sent = session_ptr->pair->send(pending.data(), pending.size());
+                pending.erase(pending.begin(), pending.begin() + sent);
+                if (!pending.empty()) {
+                    return true;    // the pair is full
+                }
+            }
+
+            ERR_clear_error();
+            int res = SSL_read(session_ptr->ssl, relay_buf.data(), relay_buf.size());
+            if (res <= 0) {
+                int error = SSL_get_error(session_ptr->ssl, res);
+                if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+                    return true;
+                }
+                // close_notify, a closed connection or a protocol error
+                close_session(session_ptr);
+                return false;
+            }
+
+            ssize_t sent = session_ptr->pair->send(relay_buf.data(), res);
+            pending.assign(relay_buf.begin() + sent, relay_buf.begin() + res);
+        }
+    }
+    catch (SocketException& e) {
+        // the server end has been closed
+        close_session(session_ptr);
+        return false;
+    }
+}
+
+bool TlsTerminator::relay_to_peer(Session* session_ptr)
+{
+    std::vector<char>& pending = session_ptr->to_peer;
+
+    while (true) {
+        if (!pending.empty()) {
+            ERR_clear_error();
+            int res = SSL_write(session_ptr->ssl, pending.data(), pending.size());
+            if (res <= 0) {
+                int error = SSL_get_error(session_ptr->ssl, res);
+                if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+                    return true;
+                }
+                close_session(session_ptr);
+                return false;
+            }
+            pending.erase(pending.begin(), pending.begin() + res);
+            continue;
+        }
+
+        ssize_t received;
+        try {
+            received = session_ptr->pair->recv(relay_buf.data(), relay_buf.size());
+        }
+        catch (SocketException& e) {
+            // the server has closed the connection: close_notify is sent if the socket takes it at once
+            ERR_clear_error();
+            SSL_shutdown(session_ptr->ssl);
+            close_session(session_ptr);
+            return false;
+        }
+        if (received == 0) {
+            return true;
+        }
+        pending.assign(relay_buf.begin(), relay_buf.begin() + received);
+    }
+}
+
+void TlsTerminator::update_events(Session* session_ptr)
+{
+    // a side is not read while the other one does not take the data
+    int peer_mask = 0;
+    int pair_mask = 0;
+
+    if (session_ptr->to_pair.empty()) {
+        peer_mask |= io::Epoll::Event::IN;
+    }
+    else {
+        pair_mask |= io::Epoll::Event::OUT;
+    }
+    if (session_ptr->to_peer.empty()) {
+        pair_mask |= io::Epoll::Event::IN;
+    }
+    else {
+        peer_mask |= io::Epoll::Event::OUT;
+    }
+
+    epoll.modify_handler(session_ptr->sock->get_sockfd(), peer_mask);
+    epoll.modify_handler(session_ptr->pair->get_sockfd(), pair_mask);
+}
+
+void TlsTerminator::close_session(Session* session_ptr)
+{
+    int sock_fd = session_ptr->sock->get_sockfd();
+
+    epoll.del_handler(sock_fd);
+    if (session_ptr->pair) {
+        epoll.del_handler(session_ptr->pair->get_sockfd());
+    }
+    sessions.erase(sock_fd);
+}
+
+
+} // namespace net
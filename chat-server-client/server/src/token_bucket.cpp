@@ -0,0 +1,55 @@
+#include <token_bucket.h>
+
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+
+
+namespace chat {
+
+
+TokenBucket::TokenBucket(double rate, double burst):
+    rate(rate), burst(std::max(burst, 1.0)), tokens(this->burst), last_refill(Clock::now())
+{ }
+
+bool TokenBucket::available()
+{
+    if (rate == 0) {
+        return true;
+    }
+
+    refill();
+    return tokens >= 1;
+}
+
+size_t TokenBucket::allowance()
+{
+    if (rate == 0) {
+        return SIZE_MAX;
+    }
+
+    refill();
+    return tokens >= 1 ? static_cast<size_t>(tokens) : 0;
+}
+
+void TokenBucket::consume(double n)
+{
+    if (rate == 0) {
+        return;
+    }
+
+    refill();
+    tokens -= n;
+}
+
+void TokenBucket::refill()
+{
+    Clock::time_point now = Clock::now();
+    std::chrono::duration<double> elapsed = now - last_refill;
+
+    tokens = std::min(burst, tokens + elapsed.count() * rate);
+    last_refill = now;
+}
+
+
+} // namespace chat
@@ -0,0 +1,330 @@
+#include <websocket.h>
+
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <strings.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+#include <protocol.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define WEBSOCKET_X86
+#include <immintrin.h>
+#endif
+
+
+namespace protocol {
+
+
+namespace {
+
+const char http_get[] = "GET ";
+const size_t http_get_size = sizeof(http_get) - 1;
+
+const char ws_guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+const uint8_t ws_fin = 0x80;
+const uint8_t ws_rsv = 0x70;
+const uint8_t ws_opcode = 0x0f;
+const uint8_t ws_mask = 0x80;
+const uint8_t ws_len = 0x7f;
+const size_t ws_control_max_size = 125;
+
+std::string trim(const std::string& str)
+{
+    size_t begin = str.find_first_not_of(" \t");
+    if (begin == std::string::npos) {
+        return std::string();
+    }
+    size_t end = str.find_last_not_of(" \t");
+    return str.substr(begin, end - begin + 1);
+}
+
+/*
+ * returns true if the comma separated header value contains the token (case-insensitive)
+ */
+bool has_token(const std::string& value, const char* token)
+{
+    size_t pos = 0;
+
+    while (pos <= value.size()) {
+        size_t end = value.find(',', pos);
+        if (end == std::string::npos) {
+            end = value.size();
+        }
+        if (strcasecmp(trim(value.substr(pos, end - pos)).c_str(), token) == 0) {
+            return true;
+        }
+        pos = end + 1;
+    }
+    return false;
+}
+
+void unmask_scalar(uint8_t* data, size_t size, const uint8_t key[4], size_t offset)
+{
+    for (size_t i = offset; i < size; i++) {
+        data[i] ^= key[i & 3];
+    }
+}
+
+#ifdef WEBSOCKET_X86
+
+/*
+ * the key is repeated over a vector, a vector is XORed at a time; the vectors start at multiples of 4,
+ * so the key is aligned with every one of them
+ */
+__attribute__((target("avx2")))
+void unmask_avx2(uint8_t* data, size_t size, const uint8_t key[4])
+{
+    uint32_t key32;
+    std::memcpy(&key32, key, sizeof(key32));
+    const __m256i mask = _mm256_set1_epi32(static_cast<int>(key32));
+
+    size_t i = 0;
+    for (; i + 128 <= size; i += 128) {
+        __m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 32));
+        __m256i v2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 64));
+        __m256i v3 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 96));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(data + i), _mm256_xor_si256(v0, mask));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(data + i + 32), _mm256_xor_si256(v1, mask));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(data + i + 64), _mm256_xor_si256(v2, mask));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(data + i + 96), _mm256_xor_si256(v3, mask));
+    }
+    for (; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(data + i), _mm256_xor_si256(v, mask));
+    }
+    unmask_scalar(data, size, key, i);
+}
+
+__attribute__((target("sse2")))
+void unmask_sse2(uint8_t* data, size_t size, const uint8_t key[4])
+{
+    uint32_t key32;
+    std::memcpy(&key32, key, sizeof(key32));
+    const __m128i mask = _mm_set1_epi32(static_cast<int>(key32));
+
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        __m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 16));
+        __m128i v2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 32));
+        __m128i v3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 48));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(data + i), _mm_xor_si128(v0, mask));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(data + i + 16), _mm_xor_si128(v1, mask));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(data + i + 32), _mm_xor_si128(v2, mask));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(data + i + 48), _mm_xor_si128(v3, mask));
+    }
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(data + i), _mm_xor_si128(v, mask));
+    }
+    unmask_scalar(data, size, key, i);
+}
+
+#endif
+
+void unmask_portable(uint8_t* data, size_t size, const uint8_t key[4])
+{
+    unmask_scalar(data, size, key, 0);
+}
+
+typedef void (*UnmaskFunction)(uint8_t*, size_t, const uint8_t*);
+
+UnmaskFunction select_unmask()
+{
+#ifdef WEBSOCKET_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return unmask_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return unmask_sse2;
+    }
+#endif
+    return unmask_portable;
+}
+
+const UnmaskFunction unmask_impl = select_unmask();
+
+} // namespace
+
+
+bool is_http_request(const char* data, size_t size)
+{
+    return std::memcmp(data, http_get, std::min(size, http_get_size)) == 0;
+}
+
+size_t parse_upgrade(const char* data, size_t size, std::string& key)
+{
+    const char* end = static_cast<const char*>(memmem(data, size, "\r\n\r\n", 4));
+    if (end == nullptr) {
+        if (size >= ws_request_max_size) {
+            throw ProtocolException("protocol error: upgrade request too long");
+        }
+        return 0;
+    }
+
+    size_t request_size = end - data + 4;
+    std::string request(data, end - data + 2);
+
+    // request line: GET <target> HTTP/1.1
+    size_t pos = request.find("\r\n");
+    std::string line = request.substr(0, pos);
+    if (line.compare(0, http_get_size, http_get) != 0 || line.find(" HTTP/1.1") == std::string::npos) {
+        throw ProtocolException("protocol error: invalid upgrade request line");
+    }
+
+    bool upgrade = false;
+    bool connection = false;
+    bool version = false;
+    key.clear();
+
+    for (pos += 2; pos < request.size(); ) {
+        size_t next = request.find("\r\n", pos);
+        line = request.substr(pos, next - pos);
+        pos = next + 2;
+
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) {
+            throw ProtocolException("protocol error: invalid upgrade request header");
+        }
+        std::string name = trim(line.substr(0, colon));
+        std::string value = trim(line.substr(colon + 1));
+
+        if (strcasecmp(name.c_str(), "Upgrade") == 0) {
+            upgrade = has_token(value, "websocket");
+        }
+        else if (strcasecmp(name.c_str(), "Connection") == 0) {
+            connection = has_token(value, "upgrade");
+        }
+        else if (strcasecmp(name.c_str(), "Sec-WebSocket-Version") == 0) {
+            version = value == "13";
+        }
+        else if (strcasecmp(name.c_str(), "Sec-WebSocket-Key") == 0) {
+            key = value;
+        }
+    }
+
+    if (!upgrade || !connection || !version || key.empty()) {
+        throw ProtocolException("protocol error: not a websocket upgrade request");
+    }
+    return request_size;
+}
+
+std::string make_upgrade_response(const std::string& key)
+{
+    std::string accept_key = key + ws_guid;
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const unsigned char*>(accept_key.data()), accept_key.size(), digest);
+
+    unsigned char accept[4 * ((SHA_DIGEST_LENGTH + 2) / 3) + 1];
+    int accept_size = EVP_EncodeBlock(accept, digest, SHA_DIGEST_LENGTH);
+
+    return "HTTP/1.1 101 Switching Protocols\r\n"
+           "Upgrade: websocket\r\n"
+           "Connection: Upgrade\r\n"
+           "Sec-WebSocket-Accept: " + std::string(reinterpret_cast<char*>(accept), accept_size) + "\r\n\r\n";
+}
+
+std::string make_upgrade_error()
+{
+    return "HTTP/1.1 400 Bad Request\r\n"
+           "Sec-WebSocket-Version: 13\r\n"
+           "Content-Length: 0\r\n"
+           "Connection: close\r\n\r\n";
+}
+
+size_t decode_ws(const char* data, size_t size, WsFrame& frame, size_t max_size)
+{
+    if (size < 2) {
+        return 0;
+    }
+
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+    if (bytes[0] & ws_rsv) {
+        throw ProtocolException("protocol error: websocket extension bits set");
+    }
+    if ((bytes[1] & ws_mask) == 0) {
+        throw ProtocolException("protocol error: websocket frame not masked");
+    }
+
+    uint8_t op = bytes[0] & ws_opcode;
+    if ((op > 2 && op < 8) || op > 10) {
+        throw ProtocolException("protocol error: unknown websocket opcode");
+    }
+    bool fin = (bytes[0] & ws_fin) != 0;
+
+    uint64_t length = bytes[1] & ws_len;
+    size_t header_size = 2;
+    if (length == 126) {
+        header_size += 2;
+    }
+    else if (length == 127) {
+        header_size += 8;
+    }
+    if (size < header_size + 4) {
+        return 0;
+    }
+    if (header_size > 2) {
+        length = 0;
+        for (size_t n = 2; n < header_size; n++) {
+            length = (length << 8) | bytes[n];
+        }
+    }
+
+    if (op >= static_cast<uint8_t>(WsOpcode::CLOSE) && (!fin || length > ws_control_max_size)) {
+        throw ProtocolException("protocol error: invalid websocket control frame");
+    }
+    if (length > max_size) {
+        throw ProtocolException("protocol error: websocket frame too long");
+    }
+
+    const uint8_t* key = bytes + header_size;
+    header_size += 4;
+    if (size - header_size < length) {
+        return 0;
+    }
+
+    frame.op = static_cast<WsOpcode>(op);
+    frame.fin = fin;
+    frame.payload.assign(data + header_size, length);
+    unmask(frame.payload.data(), frame.payload.size(), key);
+
+    return header_size + length;
+}
+
+void encode_ws(WsOpcode op, const char* data, size_t size, std::vector<char>& buf)
+{
+    buf.push_back(static_cast<char>(ws_fin | static_cast<uint8_t>(op)));
+
+    if (size < 126) {
+        buf.push_back(static_cast<char>(size));
+    }
+    else if (size <= 0xffff) {
+        buf.push_back(126);
+        buf.push_back(static_cast<char>(size >> 8));
+        buf.push_back(static_cast<char>(size));
+    }
+    else {
+        buf.push_back(127);
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            buf.push_back(static_cast<char>(static_cast<uint64_t>(size) >> shift));
+        }
+    }
+
+    buf.insert(buf.end(), data, data + size);
+}
+
+void unmask(char* data, size_t size, const uint8_t key[4])
+{
+    unmask_impl(reinterpret_cast<uint8_t*>(data), size, key);
+}
+
+
+} // namespace protocol
@@ -0,0 +1,66 @@
+#ifndef __CHECK_H
+#define __CHECK_H
+
+
+#include <iostream>
+#include <string>
+
+
+/*
+ * A minimal test harness: a suite is a function making the checks, the failed ones are counted.
+ * The suites are run by name (see tests/main.cpp), ctest runs each one as a test.
+ */
+namespace check {
+
+
+extern int failures;
+
+
+/*
+ * Reports a failed check, the description tells the case.
+ */
+inline void fail(const char* file, int line, const char* expr, const std::string& description)
+{
+    std::cerr << file << ":" << line << ": check failed: " << expr;
+    if (!description.empty()) {
+        std::cerr << " (" << description << ")";
+    }
+    std::cerr << std::endl;
+    failures++;
+}
+
+
+/*
+ * Returns the bytes of the data as hex for the failure descriptions.
+ */
+inline std::string hex(const std::string& data)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string str;
+    for (unsigned char c: data) {
+        str += digits[c >> 4];
+        str += digits[c & 0xf];
+        str += ' ';
+    }
+    return str;
+}
+
+
+void test_text();
+void test_filter();
+void test_websocket();
+void test_shm();
+
+
+} // namespace check
+
+
+#define CHECK(expr, description) \
+    do { \
+        if (!(expr)) { \
+            check::fail(__FILE__, __LINE__, #expr, description); \
+        } \
+    } while (false)
+
+
+#endif // __CHECK_H
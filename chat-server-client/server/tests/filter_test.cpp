@@ -0,0 +1,104 @@
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+
+#include <filter.h>
+#include <check.h>
+
+
+namespace check {
+
+
+namespace {
+
+std::string lower(std::string str)
+{
+    std::transform(str.begin(), str.end(), str.begin(), [] (char c) {
+        return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+    });
+    return str;
+}
+
+/*
+ * the naive reference: whether any of the patterns occurs in the text
+ */
+bool contains_any(const std::vector<std::string>& patterns, const std::string& text)
+{
+    for (const std::string& pattern: patterns) {
+        if (!pattern.empty() && lower(text).find(lower(pattern)) != std::string::npos) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * checks the PatternSet against the reference: the pattern found should occur in the text
+ */
+void compare(const std::vector<std::string>& patterns, const std::string& text)
+{
+    chat::PatternSet set(patterns);
+    size_t index = set.find(text.data(), text.size());
+
+    std::string description = "text: " + hex(text);
+    if (contains_any(patterns, text)) {
+        CHECK(index != chat::PatternSet::npos, description);
+        if (index != chat::PatternSet::npos) {
+            CHECK(lower(text).find(lower(set.get_pattern(index))) != std::string::npos, description);
+        }
+    }
+    else {
+        CHECK(index == chat::PatternSet::npos, description);
+    }
+}
+
+} // namespace
+
+
+void test_filter()
+{
+    const std::vector<std::string> classic = {"he", "she", "his", "hers"};
+    compare(classic, "ushers");
+    compare(classic, "ahishers");
+    compare(classic, "xyz");
+    compare(classic, "");
+
+    // the ASCII letters are case-insensitive, the other bytes are not
+    compare({"Spam"}, "buy SPAM now");
+    compare({"\xc3\xa9t\xc3\xa9"}, "\xc3\x89T\xc3\x89");
+    compare({"\xc3\xa9t\xc3\xa9"}, "l'\xc3\xa9T\xc3\xa9");
+
+    // the empty patterns are ignored, a pattern may be a prefix or a suffix of another one
+    compare({"", "abc"}, "xyz");
+    compare({"abcd", "bc"}, "abce");
+    compare({"abcd", "cd"}, "abcd");
+    compare({"aaa"}, "aaaa");
+    compare({std::string("a\0b", 3)}, std::string("xa\0b", 4));
+
+    // random patterns and texts over a small alphabet, so the patterns overlap and share prefixes
+    std::mt19937 rng(2024);
+    const char alphabet[] = {'a', 'b', 'c', 'A', 'B', '\0', '\xc3', '\xa9'};
+
+    for (int n = 0; n < 2000; n++) {
+        std::vector<std::string> patterns(1 + rng() % 8);
+        for (std::string& pattern: patterns) {
+            size_t size = rng() % 6;
+            for (size_t i = 0; i < size; i++) {
+                pattern += alphabet[rng() % sizeof(alphabet)];
+            }
+        }
+
+        for (int i = 0; i < 10; i++) {
+            std::string text;
+            size_t size = rng() % 60;
+            for (size_t j = 0; j < size; j++) {
+                text += alphabet[rng() % sizeof(alphabet)];
+            }
+            compare(patterns, text);
+        }
+    }
+}
+
+
+} // namespace check
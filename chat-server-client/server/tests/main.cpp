@@ -0,0 +1,49 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+
+#include <check.h>
+
+
+namespace check {
+
+int failures = 0;
+
+} // namespace check
+
+
+int main(int argc, char* argv[])
+{
+    struct Suite {
+        const char* name;
+        void (*run)();
+    };
+    const Suite suites[] = {
+        {"text", check::test_text},
+        {"filter", check::test_filter},
+        {"websocket", check::test_websocket},
+        {"shm", check::test_shm}
+    };
+
+    // no arguments - all the suites
+    int failed = 0;
+    bool found = false;
+    for (const Suite& suite: suites) {
+        if (argc > 1 && std::strcmp(argv[1], suite.name) != 0) {
+            continue;
+        }
+        found = true;
+
+        int before = check::failures;
+        suite.run();
+        int count = check::failures - before;
+        std::cout << suite.name << ": " << (count == 0 ? "passed" : std::to_string(count) + " checks failed") << std::endl;
+        failed += count;
+    }
+
+    if (!found) {
+        std::cerr << "unknown test suite: " << argv[1] << std::endl;
+        return 2;
+    }
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,76 @@
+#include <string>
+#include <vector>
+#include <memory>
+#include <random>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <socket.h>
+#include <shm.h>
+#include <check.h>
+
+
+namespace check {
+
+
+void test_shm()
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        CHECK(false, "socketpair error");
+        return;
+    }
+    net::Socket server_sock(fds[0]);
+    net::Socket client_sock(fds[1]);
+
+    net::ShmChannel server(net::ShmChannel::ring_min_size);
+    server.send_peer(server_sock);
+    std::unique_ptr<net::ShmChannel> client = net::ShmChannel::receive(client_sock);
+    CHECK(client->get_ring_size() == net::ShmChannel::ring_min_size, "ring size");
+
+    // a stream of many rings in writes and reads of sizes not dividing the ring size, so they wrap
+    // around at every position; some writes are split into buffers (iovec)
+    std::mt19937 rng(2024);
+    std::string sent;
+    std::string received;
+    const size_t total = 4 << 20;
+    std::vector<char> buf(3 * net::ShmChannel::ring_min_size);
+
+    while (true) {
+        if (sent.size() < total) {
+            std::string chunk;
+            size_t size = 1 + rng() % (2 * net::ShmChannel::ring_min_size);
+            for (size_t n = 0; n < size; n++) {
+                chunk += static_cast<char>(rng());
+            }
+
+            ssize_t len;
+            if (rng() % 2) {
+                len = client->send(chunk.data(), chunk.size());
+            }
+            else {
+                size_t half = chunk.size() / 2;
+                iovec iov[2] = {{chunk.data(), half}, {chunk.data() + half, chunk.size() - half}};
+                len = client->send(iov, 2);
+            }
+            CHECK(len >= 0 && static_cast<size_t>(len) <= chunk.size(), "send size");
+            sent.append(chunk, 0, len);
+
+            // the credit is the ring size: the writer can't get ahead of the reader by more
+            CHECK(sent.size() - received.size() <= net::ShmChannel::ring_min_size, "credit exceeded");
+        }
+
+        ssize_t len = server.recv(buf.data(), 1 + rng() % buf.size());
+        CHECK(len >= 0, "recv size");
+        received.append(buf.data(), len);
+        if (len == 0 && sent.size() >= total) {
+            break;
+        }
+    }
+
+    CHECK(received == sent, "received data differs from the sent one");
+    CHECK(server.recv(buf.data(), buf.size()) == 0, "the ring is empty");
+}
+
+
+} // namespace check
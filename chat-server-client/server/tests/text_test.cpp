@@ -0,0 +1,173 @@
+#include <string>
+#include <vector>
+#include <random>
+
+#include <text.h>
+#include <check.h>
+
+
+namespace check {
+
+
+namespace {
+
+struct Case {
+    std::string data;
+    bool valid;
+    bool controls;          // valid cases only
+};
+
+const Case cases[] = {
+    {"", true, false},
+    {"hello\tworld\n", true, false},
+    {"h\xc3\xa9llo", true, false},                     // U+00E9
+    {"\xe2\x82\xac", true, false},                      // U+20AC
+    {"\xef\xbf\xbf", true, false},                      // U+FFFF
+    {"\xf0\x9f\x98\x80", true, false},                  // U+1F600
+    {"\xf4\x8f\xbf\xbf", true, false},                  // U+10FFFF
+    {"\xc2\xa0", true, false},                          // U+00A0, C2 lead of a printable character
+    {"\x01", true, true},
+    {"\x1b[31m", true, true},
+    {"\x7f", true, true},
+    {"\xc2\x80", true, true},                           // U+0080, C1
+    {"\xc2\x9f", true, true},                           // U+009F, C1
+    {"\xc0\x80", false, false},                         // overlong
+    {"\xc1\xbf", false, false},
+    {"\xe0\x80\x80", false, false},
+    {"\xe0\x9f\xbf", false, false},
+    {"\xf0\x80\x80\x80", false, false},
+    {"\xf0\x8f\xbf\xbf", false, false},
+    {"\xed\xa0\x80", false, false},                     // surrogates
+    {"\xed\xbf\xbf", false, false},
+    {"\xf4\x90\x80\x80", false, false},                 // above U+10FFFF
+    {"\xf5\x80\x80\x80", false, false},
+    {"\xff", false, false},
+    {"\x80", false, false},                             // continuations without a lead
+    {"\xbf\xbf", false, false},
+    {"\xe2\x82", false, false},                         // truncated
+    {"\xf0\x9f\x98", false, false},
+    {"\xc3", false, false},
+    {"\xe2\x82\xac\xac", false, false}                  // too long
+};
+
+const char* const isas[] = {"avx2", "ssse3"};
+
+
+bool valid_with(const std::string& isa, const std::string& data)
+{
+    text::set_isa(isa);
+    return text::is_valid_utf8(data.data(), data.size());
+}
+
+bool controls_with(const std::string& isa, const std::string& data)
+{
+    text::set_isa(isa);
+    return text::has_controls(data.data(), data.size());
+}
+
+/*
+ * checks the implementation against the scalar one
+ */
+void compare(const std::string& isa, const std::string& data)
+{
+    bool valid = valid_with("scalar", data);
+    CHECK(valid_with(isa, data) == valid, isa + " is_valid_utf8: " + hex(data));
+
+    if (valid) {
+        CHECK(controls_with(isa, data) == controls_with("scalar", data), isa + " has_controls: " + hex(data));
+    }
+}
+
+/*
+ * appends a random code point, a control or a printable one
+ */
+void put_code_point(std::string& str, std::mt19937& rng)
+{
+    static const uint32_t ranges[][2] = {
+        {0x00, 0x7f}, {0x80, 0x9f}, {0xa0, 0x7ff}, {0x800, 0xd7ff}, {0xe000, 0xffff}, {0x10000, 0x10ffff}
+    };
+    const auto& range = ranges[rng() % 6];
+    uint32_t c = range[0] + rng() % (range[1] - range[0] + 1);
+
+    if (c < 0x80) {
+        str += static_cast<char>(c);
+    }
+    else if (c < 0x800) {
+        str += static_cast<char>(0xc0 | (c >> 6));
+        str += static_cast<char>(0x80 | (c & 0x3f));
+    }
+    else if (c < 0x10000) {
+        str += static_cast<char>(0xe0 | (c >> 12));
+        str += static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+        str += static_cast<char>(0x80 | (c & 0x3f));
+    }
+    else {
+        str += static_cast<char>(0xf0 | (c >> 18));
+        str += static_cast<char>(0x80 | ((c >> 12) & 0x3f));
+        str += static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+        str += static_cast<char>(0x80 | (c & 0x3f));
+    }
+}
+
+} // namespace
+
+
+void test_text()
+{
+    std::string selected = text::get_isa();
+
+    for (const Case& c: cases) {
+        CHECK(valid_with("scalar", c.data) == c.valid, "scalar is_valid_utf8: " + hex(c.data));
+        if (c.valid) {
+            CHECK(controls_with("scalar", c.data) == c.controls, "scalar has_controls: " + hex(c.data));
+        }
+    }
+
+    std::mt19937 rng(2024);
+
+    for (const char* isa: isas) {
+        if (!text::set_isa(isa)) {
+            std::cout << "text: " << isa << " is not supported by the cpu, skipped" << std::endl;
+            continue;
+        }
+
+        // every case at every position of a block and across the block boundaries,
+        // at the end of the data (the zero padded tail) or followed by ascii and full blocks
+        for (const Case& c: cases) {
+            for (size_t prefix = 0; prefix <= 66; prefix++) {
+                for (size_t suffix: {0, 1, 17, 40}) {
+                    compare(isa, std::string(prefix, 'a') + c.data + std::string(suffix, 'b'));
+                }
+            }
+        }
+
+        // C2 in the last lane of a block, the C1 control or the printable character ends in the next one
+        for (size_t block: {16, 32}) {
+            for (const char* second: {"\x85", "\xa9"}) {
+                compare(isa, std::string(block - 1, 'a') + "\xc2" + second);
+                compare(isa, std::string(block - 1, 'a') + "\xc2" + second + std::string(block, 'b'));
+            }
+        }
+
+        // random text, valid and corrupted
+        for (int n = 0; n < 20000; n++) {
+            std::string str;
+            size_t count = rng() % 80;
+            for (size_t i = 0; i < count; i++) {
+                put_code_point(str, rng);
+            }
+            compare(isa, str);
+
+            if (!str.empty()) {
+                str[rng() % str.size()] = static_cast<char>(rng());
+                compare(isa, str);
+                compare(isa, str.substr(0, rng() % str.size()));
+            }
+        }
+    }
+
+    text::set_isa(selected);
+}
+
+
+} // namespace check
@@ -0,0 +1,138 @@
+#include <string>
+#include <vector>
+#include <random>
+#include <cstdint>
+
+#include <protocol.h>
+#include <websocket.h>
+#include <check.h>
+
+
+namespace check {
+
+
+namespace {
+
+const uint8_t ws_fin = 0x80;
+const uint8_t ws_mask = 0x80;
+
+
+/*
+ * encodes a client (masked) frame the way a browser does
+ */
+std::string encode_client(uint8_t first, const std::string& payload, const uint8_t key[4], int length_form = 0)
+{
+    std::string frame(1, static_cast<char>(first));
+    uint64_t size = payload.size();
+
+    // the shortest length form unless another one is asked for
+    if (length_form == 0) {
+        length_form = size < 126 ? 7 : size <= 0xffff ? 16 : 64;
+    }
+    if (length_form == 7) {
+        frame += static_cast<char>(ws_mask | size);
+    }
+    else {
+        frame += static_cast<char>(ws_mask | (length_form == 16 ? 126 : 127));
+        for (int shift = length_form - 8; shift >= 0; shift -= 8) {
+            frame += static_cast<char>(size >> shift);
+        }
+    }
+
+    frame.append(reinterpret_cast<const char*>(key), 4);
+    for (size_t n = 0; n < payload.size(); n++) {
+        frame += static_cast<char>(payload[n] ^ key[n % 4]);
+    }
+    return frame;
+}
+
+bool throws(const std::string& frame, size_t max_size = 1 << 20)
+{
+    protocol::WsFrame decoded;
+    try {
+        protocol::decode_ws(frame.data(), frame.size(), decoded, max_size);
+    }
+    catch (protocol::ProtocolException&) {
+        return true;
+    }
+    return false;
+}
+
+void check_decode(uint8_t first, const std::string& payload, const uint8_t key[4], int length_form = 0)
+{
+    std::string frame = encode_client(first, payload, key, length_form);
+    std::string description = "payload size " + std::to_string(payload.size());
+
+    protocol::WsFrame decoded;
+    CHECK(protocol::decode_ws(frame.data(), frame.size(), decoded, 1 << 20) == frame.size(), description);
+    CHECK(decoded.payload == payload, description);
+    CHECK(static_cast<uint8_t>(decoded.op) == (first & 0x0f), description);
+    CHECK(decoded.fin == ((first & ws_fin) != 0), description);
+
+    // a frame cut anywhere is incomplete
+    for (size_t size = 0; size < frame.size(); size += size < 20 ? 1 : 997) {
+        CHECK(protocol::decode_ws(frame.data(), size, decoded, 1 << 20) == 0, description + ", cut at " + std::to_string(size));
+    }
+
+    // the data following the frame is left for the next one
+    std::string two = frame + frame;
+    CHECK(protocol::decode_ws(two.data(), two.size(), decoded, 1 << 20) == frame.size(), description);
+}
+
+} // namespace
+
+
+void test_websocket()
+{
+    std::mt19937 rng(2024);
+    const uint8_t key[4] = {0x37, 0xfa, 0x21, 0x3d};
+    const uint8_t text = ws_fin | static_cast<uint8_t>(protocol::WsOpcode::TEXT);
+
+    // the length forms and their bounds
+    for (size_t size: {0, 1, 5, 125, 126, 127, 1000, 65535, 65536, 70000}) {
+        std::string payload;
+        for (size_t n = 0; n < size; n++) {
+            payload += static_cast<char>(rng());
+        }
+        check_decode(text, payload, key);
+    }
+    check_decode(static_cast<uint8_t>(protocol::WsOpcode::BINARY), "fragment", key);
+    check_decode(ws_fin | static_cast<uint8_t>(protocol::WsOpcode::PING), "ping", key);
+    check_decode(text, "a longer form than needed", key, 16);
+    check_decode(text, "a longer form than needed", key, 64);
+
+    // malformed frames
+    std::string frame = encode_client(text, "hello", key);
+    CHECK(!throws(frame), "valid frame");
+    CHECK(throws(std::string(1, frame[0]) + static_cast<char>(frame[1] & ~ws_mask) + frame.substr(2)), "not masked");
+    CHECK(throws(encode_client(text | 0x40, "hello", key)), "extension bits");
+    CHECK(throws(encode_client(ws_fin | 0x3, "hello", key)), "unknown opcode");
+    CHECK(throws(encode_client(ws_fin | 0xb, "hello", key)), "unknown opcode");
+    CHECK(throws(encode_client(static_cast<uint8_t>(protocol::WsOpcode::PING), "ping", key)), "fragmented control frame");
+    CHECK(throws(encode_client(ws_fin | static_cast<uint8_t>(protocol::WsOpcode::CLOSE), std::string(126, 'x'), key)),
+          "long control frame");
+    CHECK(throws(frame, 4), "frame too long");
+
+    // unmask against the reference at every alignment and tail size of the vector loops
+    for (size_t offset = 0; offset < 32; offset++) {
+        for (size_t size = 0; size < 200; size++) {
+            std::vector<char> data(offset + size);
+            for (char& c: data) {
+                c = static_cast<char>(rng());
+            }
+            uint8_t random_key[4] = {static_cast<uint8_t>(rng()), static_cast<uint8_t>(rng()),
+                                     static_cast<uint8_t>(rng()), static_cast<uint8_t>(rng())};
+
+            std::vector<char> expected(data);
+            for (size_t n = 0; n < size; n++) {
+                expected[offset + n] ^= random_key[n % 4];
+            }
+
+            protocol::unmask(data.data() + offset, size, random_key);
+            CHECK(data == expected, "offset " + std::to_string(offset) + ", size " + std::to_string(size));
+        }
+    }
+}
+
+
+} // namespace check